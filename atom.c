@@ -1,14 +1,36 @@
 #include "compiler.h"
+#include <pthread.h>
 
 typedef struct CString CString;
 
+static const char *_atom_insert(const char *string, size_t len, unsigned hash);
+
 struct CString {
     char    *str;
     size_t   len;
     CString *prev;
 };
 
-static CString *buckets[1024] = {NULL};
+#define ATOM_LOCKS 64
+
+static CString        *buckets[1024] = {NULL};
+static pthread_mutex_t locks[ATOM_LOCKS];
+static bool            shared        = false;
+
+/*
+ * Called before worker threads start lexing. The table is striped so
+ * threads only serialize when their strings hash to the same group.
+ */
+void atom_share(void)
+{
+    if(shared)
+        return;
+
+    for(int i = 0; i < ATOM_LOCKS; i++)
+        pthread_mutex_init(&locks[i], NULL);
+
+    shared = true;
+}
 
 const char *atom(const char *string)
 {
@@ -24,7 +46,6 @@ const char *atom(const char *string)
 const char *atom_range(const char *string, size_t len)
 {
     const char *end = string;
-    CString    *entry;
     unsigned    hash = 0;
 
     assert(string && len);
@@ -34,6 +55,24 @@ const char *atom_range(const char *string, size_t len)
 
     hash &= 0x3FF;
 
+    if(shared) {
+        const char *str;
+
+        pthread_mutex_lock(&locks[hash % ATOM_LOCKS]);
+        str = _atom_insert(string, len, hash);
+        pthread_mutex_unlock(&locks[hash % ATOM_LOCKS]);
+
+        return str;
+    }
+
+    return _atom_insert(string, len, hash);
+}
+
+static const char *_atom_insert(const char *string, size_t len, unsigned hash)
+{
+    const char *end = string + len;
+    CString    *entry;
+
     for(entry = buckets[hash]; entry; entry = entry->prev) {
         const char *s1, *s2;
 
@@ -52,6 +91,8 @@ const char *atom_range(const char *string, size_t len)
     entry->str    = (char *)zalloc(sizeof(char) * len + 1, ARENA_1);
     memcpy(entry->str, string, len);
 
+    entry->str[len] = '\0';
+
     entry->len    = len;
     entry->prev   = buckets[hash];
     buckets[hash] = entry;
@@ -1,11 +1,19 @@
 #include "compiler.h"
+#include <unistd.h>
 
 byte opTable[ASCII_MAX] = {0};
+int  options             = 0;
+int  thread_count        = 0;
 
 extern void       _init_op_table(void);
 extern CCompiler *_new_compiler(const char *path);
 extern void       _compile_file(const char *path);
 extern void       _parse_file(CCompiler *cmp);
+extern void       _compile_fused(CCompiler *cmp);
+extern void       _compile_unit(CCompiler *cmp);
+extern void       _emit_functions(CCompiler *cmp);
+extern bool       _parse_option(const char *arg);
+extern void       _print_stats(CCompiler *cmp);
 
 void boot(int argc, char **argv)
 {
@@ -16,7 +24,68 @@ void boot(int argc, char **argv)
     _init_op_table();
 
     for(int i = 1; i < argc; i++)
-        _compile_file(argv[i]);
+        if(*argv[i] == '-' && !_parse_option(argv[i]))
+            fprintf(stderr, "unknown option '%s'\n", argv[i]);
+
+    if((options & COMPILER_OPTION_FUSED) && (options & (COMPILER_OPTION_LAZY | COMPILER_OPTION_PARALLEL))) {
+        fprintf(stderr, "'-fused' compiles bodies in place, ignoring '-lazy' and '-j'\n");
+        options &= ~(COMPILER_OPTION_LAZY | COMPILER_OPTION_PARALLEL);
+    }
+
+    for(int i = 1; i < argc; i++)
+        if(*argv[i] != '-')
+            _compile_file(argv[i]);
+}
+
+bool _parse_option(const char *arg)
+{
+    if(!arg)
+        return false;
+
+    if(!strcmp(arg, "-stats")) {
+        options |= COMPILER_OPTION_STATS;
+        return true;
+    }
+
+    if(!strcmp(arg, "-lazy")) {
+        options |= COMPILER_OPTION_LAZY;
+        return true;
+    }
+
+    if(!strcmp(arg, "-fused")) {
+        options |= COMPILER_OPTION_FUSED;
+        return true;
+    }
+
+    if(!strcmp(arg, "-O")) {
+        options |= COMPILER_OPTION_OPTIMIZE;
+        return true;
+    }
+
+    if(!strcmp(arg, "-inline-report")) {
+        options |= COMPILER_OPTION_INLINE_REPORT;
+        return true;
+    }
+
+    if(!strcmp(arg, "-linear-scan")) {
+        options |= COMPILER_OPTION_LINEAR_SCAN;
+        return true;
+    }
+
+    if(!strcmp(arg, "-x86")) {
+        options |= COMPILER_OPTION_X86;
+        return true;
+    }
+
+    if(!strncmp(arg, "-j", 2)) {
+        thread_count = atoi(arg + 2);
+        if(thread_count <= 0)
+            thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        options |= COMPILER_OPTION_PARALLEL;
+        return true;
+    }
+
+    return false;
 }
 
 void _compile_file(const char *path)
@@ -26,6 +95,14 @@ void _compile_file(const char *path)
     if(!(cmp = _new_compiler(path)))
        return;
 
+    if(options & COMPILER_OPTION_FUSED) {
+        _compile_fused(cmp);
+
+        if(options & COMPILER_OPTION_STATS)
+            _print_stats(cmp);
+        return;
+    }
+
     _parse_file(cmp);
 
     if(cmp->flags & COMPILER_FLAG_ERROR)
@@ -36,9 +113,48 @@ void _compile_file(const char *path)
     if(cmp->flags & COMPILER_FLAG_ERROR)
         return;
 
-    start_irgen(cmp);
+    if(options & COMPILER_OPTION_PARALLEL)
+        start_parallel(cmp);
+
+    if(cmp->flags & COMPILER_FLAG_ERROR)
+        return;
+
+    _compile_unit(cmp);
+
+    if(options & COMPILER_OPTION_STATS)
+        _print_stats(cmp);
+}
+
+void _print_stats(CCompiler *cmp)
+{
+    if(!cmp)
+        return;
+
+    fprintf(stderr, "Stats('%s'):\n", cmp->file->path);
+    fprintf(stderr, "\tfolded nodes: %ld\n", cmp->folded_nodes);
+
+    if(options & (COMPILER_OPTION_LAZY | COMPILER_OPTION_PARALLEL))
+        fprintf(stderr, "\tlazy bodies: %ld skipped, %ld parsed\n", cmp->skipped_bodies, cmp->parsed_bodies);
+
+    fprintf(stderr, "\tpeak arena memory: %ld KB ast, %ld KB ir, %ld KB misc\n",
+            zpeak(ARENA_2) / 1024, zpeak(ARENA_3) / 1024, zpeak(ARENA_1) / 1024);
 
-    print_ir(cmp);
+    if(options & COMPILER_OPTION_OPTIMIZE)
+        print_opt_stats(&cmp->opt, stderr);
+
+    if(options & COMPILER_OPTION_X86) {
+        size_t bytes  = 0;
+        size_t relocs = 0;
+
+        for(CCode *code = cmp->code; code; code = code->next) {
+            bytes += code->size;
+
+            for(CReloc *reloc = code->relocs; reloc; reloc = reloc->next)
+                relocs++;
+        }
+
+        fprintf(stderr, "\tmachine code: %ld bytes, %ld relocations, %ld KB arena\n", bytes, relocs, zpeak(ARENA_5) / 1024);
+    }
 }
 
 void _parse_file(CCompiler *cmp)
@@ -54,6 +170,114 @@ void _parse_file(CCompiler *cmp)
     }
 }
 
+/*
+ * Fused mode: every top-level declaration is analysed and lowered right
+ * after it has been parsed, and its IR printed, while its nodes are still
+ * in cache. The AST and IR arenas are then rolled back, so memory stays
+ * bounded by the largest declaration instead of growing with the file.
+ *
+ * Symbols, types and atoms live in ARENA_1 and survive. A NULL item (a
+ * typedef) keeps its nodes: its type may still point at the expression of
+ * an array dimension.
+ */
+void _compile_fused(CCompiler *cmp)
+{
+    CMark ast;
+    CMark ir;
+
+    if(!cmp)
+        return;
+
+    cmp->vreg_count  = 0;
+    cmp->label_count = 0;
+
+    while(lex(cmp)) {
+        ast = zmark(ARENA_2);
+        ir  = zmark(ARENA_3);
+
+        if(!(cmp->nodes = prs_translation_unit(cmp)))
+            continue;
+
+        // after a parse error only keep parsing, to report the remaining ones
+        if(!(cmp->flags & COMPILER_FLAG_ERROR))
+            analyse_unit(cmp, cmp->nodes);
+
+        if(!(cmp->flags & COMPILER_FLAG_ERROR)) {
+            generate_unit(cmp, cmp->nodes);
+            _emit_functions(cmp);
+        }
+
+        cmp->nodes = NULL;
+        cmp->evals = NULL;
+        cmp->fn    = NULL;
+        cmp->block = NULL;
+
+        zrelease(ARENA_3, ir);
+        zrelease(ARENA_2, ast);
+    }
+}
+
+/*
+ * Lowers the analysed unit and prints it a function at a time. Without
+ * '-O' nothing looks across functions, so each top-level declaration is
+ * lowered, allocated and printed in turn and ARENA_3 rolled back after
+ * it: the IR alive is the one of the biggest function, not of the whole
+ * unit. The inliner needs every body, so with '-O' the unit is lowered
+ * first and only what the allocation of each function takes is given
+ * back.
+ */
+void _compile_unit(CCompiler *cmp)
+{
+    CMark ir;
+
+    if(options & COMPILER_OPTION_OPTIMIZE) {
+        start_irgen(cmp);
+        inline_functions(cmp);
+        _emit_functions(cmp);
+        return;
+    }
+
+    cmp->vreg_count  = 0;
+    cmp->label_count = 0;
+
+    for(CNode *tree = cmp->nodes; tree; tree = tree->next_stmt) {
+        ir = zmark(ARENA_3);
+
+        generate_unit(cmp, tree);
+        _emit_functions(cmp);
+
+        zrelease(ARENA_3, ir);
+    }
+}
+
+/*
+ * Allocates and prints the functions lowered so far, rolling ARENA_3
+ * back after each one: the allocation rewrites the function in place, so
+ * nothing it made is needed once it is printed, or encoded to ARENA_5
+ * with '-x86'. Nothing is after an error in the lowering. The list is
+ * emptied.
+ */
+void _emit_functions(CCompiler *cmp)
+{
+    CMark mark;
+
+    for(CFunction *fn = cmp->head; fn && !(cmp->flags & COMPILER_FLAG_ERROR); fn = fn->next) {
+        mark = zmark(ARENA_3);
+
+        allocate_function(cmp, fn);
+
+        if(options & COMPILER_OPTION_X86)
+            print_code(encode_function(cmp, fn));
+        else
+            print_function(fn);
+
+        zrelease(ARENA_3, mark);
+    }
+
+    cmp->head = NULL;
+    cmp->tail = NULL;
+}
+
 CCompiler *_new_compiler(const char *path)
 {
     CCompiler *cmp;
@@ -65,6 +289,9 @@ CCompiler *_new_compiler(const char *path)
 
     memset(cmp, 0, sizeof(CCompiler));
 
+    cmp->diag  = stderr;
+    cmp->stack = new_stack();
+
     cmp->file = new_file(path, true);
 
     if(!cmp->file)
@@ -102,6 +329,10 @@ void _init_op_table(void)
 	opTable[TK_SUB_EQ] = 2;
 	opTable[TK_MUL_EQ] = 2;
 	opTable[TK_DIV_EQ] = 2;
+	opTable[TK_MOD_EQ] = 2;
+	opTable[TK_AND_EQ] = 2;
+	opTable[TK_XOR_EQ] = 2;
+	opTable[TK_OR_EQ]  = 2;
 	opTable['=']       = 2;
 	opTable[',']       = 1;   
 }
@@ -0,0 +1,1486 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * Graph coloring register allocation for optimized builds, the iterated
+ * register coalescing of George and Appel. Linear scan stays the
+ * allocator of the other builds, and of functions too big to color.
+ *
+ * Phis are first replaced by copies: each predecessor copies its operand
+ * to a new register just before its jump, and the block copies that to
+ * the phi's register where the phi was. No copy overwrites what another
+ * one still reads and no edge needs splitting; coalescing takes most of
+ * the copies away again. The interference graph is built from liveness,
+ * then nodes of low degree are simplified, copies whose ends don't
+ * interfere are merged when that can't make the graph harder to color
+ * (Briggs' test, George's for a physical register) and what is left is
+ * frozen or chosen to spill, cheapest by loop weighted uses per edge. A
+ * spilled constant is loaded again before each use; anything else is
+ * stored after each definition and reloaded before each use through
+ * short lived registers, and the function is colored again.
+ *
+ * The physical registers are precolored nodes with the same constraints
+ * as linear scan: a call interferes on the caller saved registers with
+ * what is live across it, a division or MULH on rax and rdx with its
+ * operands and what is live across it, a shift by a register on rcx with
+ * everything around it. The SysV argument and result registers take part
+ * as copies merged when possible: the parameters arrive in theirs at
+ * ENTER and stay there until loaded, when nothing clobbers them first, and
+ * the arguments of a call, what it returns and what the function returns
+ * go through theirs.
+ */
+
+#define COLORING_MAX_VREGS   16384   // bigger functions are left to linear scan
+#define COLORING_MAX_BITS    (1 << 24) // registers times blocks, for the live sets
+#define COLORING_LOOP_WEIGHT 10      // a use inside a loop counts as this many outside, per level
+#define COLORING_LOOP_MAX    8       // levels counted
+
+typedef struct CColoring CColoring;
+typedef struct CCopy     CCopy;
+typedef struct CLists    CLists;
+
+enum {
+    NODE_PRECOLORED,
+    NODE_INITIAL,
+    NODE_SIMPLIFY,
+    NODE_FREEZE,
+    NODE_SPILL,
+    NODE_SPILLED,
+    NODE_COALESCED,
+    NODE_COLORED,
+    NODE_SELECT,
+    NODE_STATES
+};
+
+enum {
+    COPY_WORKLIST,
+    COPY_ACTIVE,
+    COPY_COALESCED,
+    COPY_CONSTRAINED,
+    COPY_FROZEN,
+    COPY_STATES
+};
+
+/*
+ * Elements 0 to count - 1, each on the doubly linked list of its state.
+ */
+struct CLists {
+    size_t *prev;
+    size_t *next;
+    int    *state;
+    size_t  head[NODE_STATES];
+};
+
+/*
+ * A copy between two nodes, a LOAD of one register from another or one
+ * through an ABI register.
+ */
+struct CCopy {
+    size_t dst;
+    size_t src;
+    double weight;
+};
+
+/*
+ * State of one round of coloring. Nodes are the physical registers, then
+ * REG_END_MARK plus the id of each virtual one.
+ */
+struct CColoring {
+    CCompiler  *cmp;
+    CFunction  *fn;
+    size_t      count;
+    size_t      temps;        // ids from here on hold spilled values for an instruction
+    size_t      words;        // of a live set
+    uint64_t   *live_in;      // by block id
+    uint64_t   *live_out;
+    uint64_t   *matrix;       // a bit per pair of nodes that interfere
+    size_t    **adj;
+    size_t     *adj_count;
+    size_t     *adj_cap;
+    size_t    **moves;        // copies of each node
+    size_t     *move_count;
+    size_t     *move_cap;
+    size_t     *degree;
+    size_t     *alias;
+    int        *color;
+    double     *cost;
+    bool       *sse;
+    bool       *seen;
+    CType     **type;
+    COperand   *remat;        // the constant a register is loaded with, if it is only that
+    bool       *varies;       // defined by something else too
+    double     *weights;      // of a use in each block
+    int        *params;       // ABI register of each parameter load of the entry block
+    int         entry_regs[REG_END_MARK];
+    size_t      entry_count;
+    CLists      nodes;
+    CLists      copies;
+    CCopy      *copy;
+    size_t      copy_count;
+    size_t      copy_cap;
+    size_t     *stack;
+    size_t      stack_count;
+    size_t     *stamp;        // for the union of two neighbourhoods
+    size_t      now;
+    size_t      rounds;
+    size_t      copies_made;
+    size_t      coalesced;
+    size_t      spills;
+    size_t      rematerialized;
+    size_t      stores;
+    size_t      reloads;
+};
+
+static const int gpr_order[] = {
+    REG_RAX, REG_RCX, REG_RDX, REG_RSI, REG_RDI, REG_R8,  REG_R9,
+    REG_R10, REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15
+};
+
+static const int sse_order[] = {
+    REG_XMM0,  REG_XMM1,  REG_XMM2,  REG_XMM3,  REG_XMM4,
+    REG_XMM5,  REG_XMM6,  REG_XMM7,  REG_XMM8,  REG_XMM9,
+    REG_XMM10, REG_XMM11, REG_XMM12, REG_XMM13, REG_XMM14
+};
+
+static const int caller_saved[] = {
+    REG_RAX, REG_RCX, REG_RDX, REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10
+};
+
+static const int gpr_args[] = {
+    REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9
+};
+
+#define GPR_COUNT  (sizeof(gpr_order) / sizeof(gpr_order[0]))
+#define SSE_COUNT  (sizeof(sse_order) / sizeof(sse_order[0]))
+#define SSE_ARGS   8
+#define NONE       SIZE_MAX
+
+static void     _drop_branches(CFunction *fn);
+static void     _weigh(CColoring *c);
+static void     _eliminate_phis(CColoring *c);
+static void     _insert_before_jump(CBasicBlock *blk, CInstruction ins);
+static bool     _round(CColoring *c, int *result);
+static void     _find_params(CColoring *c);
+static void     _compute_liveness(CColoring *c);
+static void     _build(CColoring *c);
+static void     _build_block(CColoring *c, CBasicBlock *blk, uint64_t *live, double weight);
+static void     _clobber(CColoring *c, CInstruction *ins, uint64_t *live, size_t def);
+static void     _make_worklist(CColoring *c);
+static void     _simplify(CColoring *c);
+static void     _decrement_degree(CColoring *c, size_t m);
+static void     _enable_moves(CColoring *c, size_t n);
+static void     _coalesce(CColoring *c);
+static void     _add_worklist(CColoring *c, size_t u);
+static bool     _ok(CColoring *c, size_t t, size_t r);
+static bool     _conservative(CColoring *c, size_t u, size_t v);
+static void     _combine(CColoring *c, size_t u, size_t v);
+static void     _freeze(CColoring *c);
+static void     _freeze_moves(CColoring *c, size_t u);
+static void     _select_spill(CColoring *c);
+static void     _assign_colors(CColoring *c);
+static void     _rewrite(CColoring *c, int *result);
+static void     _apply(CColoring *c, int *result);
+static void     _add_edge(CColoring *c, size_t u, size_t v);
+static bool     _interfere(CColoring *c, size_t u, size_t v);
+static void     _add_copy(CColoring *c, size_t dst, size_t src, double weight);
+static void     _push(size_t **list, size_t *count, size_t *cap, size_t x);
+static bool     _move_related(CColoring *c, size_t n);
+static bool     _live_move(CColoring *c, size_t m);
+static size_t   _alias(CColoring *c, size_t n);
+static size_t   _k(CColoring *c, size_t n);
+static bool     _adjacent(CColoring *c, size_t n);
+static void     _init_lists(CLists *lists, size_t count, int state);
+static void     _set_state(CLists *lists, size_t x, int state);
+static size_t   _node(CColoring *c, COperand arg);
+static void     _note(CColoring *c, COperand arg, CInstruction *ins, double weight);
+static int      _abi_class(CType *type);
+static int      _abi_arg(CFunction *fn, COperand arg);
+static int      _result_reg(CInstruction *ins);
+static bool     _is_jump(CInstruction *ins);
+static bool     _is_sse(CInstruction *ins);
+static COperand _slot(CFunction *fn, size_t id, CType *type);
+
+/*
+ * Colors 'fn', false when it is too big for the interference graph and
+ * is left to linear scan untouched.
+ */
+bool color_registers(CCompiler *cmp, CFunction *fn)
+{
+    CColoring c;
+    int      *result;
+
+    if(!cmp || !fn || !fn->sym || !fn->entry)
+        return false;
+
+    if(fn->vreg_count > COLORING_MAX_VREGS || (fn->vreg_count + REG_END_MARK) * fn->block_count > COLORING_MAX_BITS)
+        return false;
+
+    memset(&c, 0, sizeof(CColoring));
+
+    c.cmp = cmp;
+    c.fn  = fn;
+
+    _drop_branches(fn);
+    find_loops(fn);
+
+    _weigh(&c);
+    _eliminate_phis(&c);
+
+    c.temps = fn->vreg_count;
+
+    for(;;) {
+        CMark  mark;
+        size_t count = fn->vreg_count;
+        bool   done;
+
+        c.rounds++;
+
+        result  = (int *)zalloc(sizeof(int) * (count + 1), ARENA_3);
+        c.type   = (CType **)zalloc(sizeof(CType *) * (count + 1), ARENA_3);
+        c.remat  = (COperand *)zalloc(sizeof(COperand) * (count + 1), ARENA_3);
+        c.varies = (bool *)zalloc(sizeof(bool) * (count + 1), ARENA_3);
+
+        memset(c.type, 0, sizeof(CType *) * count);
+        memset(c.remat, 0, sizeof(COperand) * count);
+        memset(c.varies, 0, sizeof(bool) * count);
+
+        // the graph goes once the colors are out
+        mark = zmark(ARENA_3);
+        done = _round(&c, result);
+        zrelease(ARENA_3, mark);
+
+        if(done)
+            break;
+
+        _rewrite(&c, result);
+    }
+
+    _apply(&c, result);
+
+    cmp->opt.spills         += c.spills;
+    cmp->opt.spill_stores   += c.stores;
+    cmp->opt.reloads        += c.reloads;
+    cmp->opt.coalesced      += c.coalesced;
+    cmp->opt.rematerialized += c.rematerialized;
+
+    if(options & COMPILER_OPTION_STATS)
+        fprintf(cmp->diag, "coloring('%s'): %ld rounds, %ld of %ld copies coalesced, %ld spills "
+                "(%ld rematerialized), %ld stores, %ld reloads\n", fn->sym->name, c.rounds, c.coalesced,
+                c.copies_made, c.spills, c.rematerialized, c.stores, c.reloads);
+
+    return true;
+}
+
+/*
+ * A conditional jump to the block it falls through to gives two edges to
+ * the same block, whose phi copies would both go before the jump.
+ */
+static void _drop_branches(CFunction *fn)
+{
+    for(CBasicBlock *blk = fn->entry; blk; blk = blk->next) {
+        CInstruction *last = blk->count ? &blk->ins[blk->count - 1] : NULL;
+
+        if(!last || !is_branch(last->kind) || TARGET_OF(fn, last->arg1) != blk->next)
+            continue;
+
+        remove_edge(fn, blk, blk->next);
+
+        blk->count--;
+        fn->ins_count--;
+    }
+}
+
+static void _weigh(CColoring *c)
+{
+    CFunction *fn = c->fn;
+
+    c->weights = (double *)zalloc(sizeof(double) * fn->block_count, ARENA_3);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        size_t depth = 0;
+
+        for(CLoop *loop = fn->blocks[i]->loop; loop && depth < COLORING_LOOP_MAX; loop = loop->parent)
+            depth++;
+
+        c->weights[i] = 1;
+
+        while(depth--)
+            c->weights[i] *= COLORING_LOOP_WEIGHT;
+    }
+}
+
+/*
+ * Each phi becomes a copy from a new register, which every predecessor
+ * sets from its operand before jumping. The phi is rewritten first: a
+ * block that is its own predecessor may move its instructions when a
+ * copy is inserted.
+ */
+static void _eliminate_phis(CColoring *c)
+{
+    CFunction *fn = c->fn;
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count && blk->ins[j].kind == INS_PHI; j++) {
+            CInstruction phi  = blk->ins[j];
+            COperand     temp = ir_vreg(fn), *args = LIST_OF(fn, phi.arg2);
+
+            blk->ins[j] = new_instruction(INS_LOAD, phi.arg1, temp, 0, phi.type, phi.line);
+
+            for(size_t k = 0; k < blk->pred_count; k++) {
+                if(!args[k])
+                    continue;
+
+                _insert_before_jump(blk->preds[k], new_instruction(INS_LOAD, temp, args[k], 0, phi.type, phi.line));
+                fn->ins_count++;
+            }
+        }
+    }
+}
+
+static void _insert_before_jump(CBasicBlock *blk, CInstruction ins)
+{
+    size_t at = blk->count && _is_jump(&blk->ins[blk->count - 1]) ? blk->count - 1 : blk->count;
+
+    if(blk->count == blk->capacity) {
+        CInstruction *tmp = blk->ins;
+
+        blk->capacity = 2 * blk->capacity + 4;
+        blk->ins      = (CInstruction *)zalloc(sizeof(CInstruction) * blk->capacity, ARENA_3);
+
+        if(blk->count)
+            memcpy(blk->ins, tmp, sizeof(CInstruction) * blk->count);
+    }
+
+    memmove(&blk->ins[at + 1], &blk->ins[at], sizeof(CInstruction) * (blk->count - at));
+
+    blk->ins[at] = ins;
+    blk->count++;
+}
+
+/*
+ * Builds and colors the graph once, leaving in 'result' the register of
+ * each virtual one, none for the spilled. True when nothing spilled.
+ */
+static bool _round(CColoring *c, int *result)
+{
+    size_t vregs = c->fn->vreg_count;
+    bool   done  = true;
+
+    c->count       = REG_END_MARK + vregs;
+    c->copy_count  = 0;
+    c->copy_cap    = 0;
+    c->copy        = NULL;
+    c->stack_count = 0;
+    c->now         = 0;
+
+    _find_params(c);
+    _compute_liveness(c);
+    _build(c);
+    _make_worklist(c);
+
+    for(;;) {
+        if(c->nodes.head[NODE_SIMPLIFY] != NONE)
+            _simplify(c);
+        else if(c->copies.head[COPY_WORKLIST] != NONE)
+            _coalesce(c);
+        else if(c->nodes.head[NODE_FREEZE] != NONE)
+            _freeze(c);
+        else if(c->nodes.head[NODE_SPILL] != NONE)
+            _select_spill(c);
+        else
+            break;
+    }
+
+    _assign_colors(c);
+
+    for(size_t id = 0; id < vregs; id++) {
+        size_t n = REG_END_MARK + id;
+
+        result[id] = REG_NONE;
+
+        if(!c->seen[n])
+            continue;
+
+        if(c->nodes.state[n] == NODE_SPILLED) {
+            c->spills++;
+            done = false;
+            continue;
+        }
+
+        result[id] = c->color[_alias(c, n)];
+
+        if(!result[id])
+            done = false;
+    }
+
+    return done;
+}
+
+/*
+ * The parameters the entry block loads before anything can clobber their
+ * ABI register, and not after a store to them, are taken from it.
+ */
+static void _find_params(CColoring *c)
+{
+    CFunction   *fn    = c->fn;
+    CBasicBlock *entry = fn->entry;
+    int          regs[REG_END_MARK];
+    size_t       gpr = 0, sse = 0, index = 0;
+    CSymbol     *syms[REG_END_MARK];
+
+    c->params      = (int *)zalloc(sizeof(int) * (entry->count + 1), ARENA_3);
+    c->entry_count = 0;
+
+    memset(c->params, 0, sizeof(int) * (entry->count + 1));
+
+    for(CParameter *param = fn->sym->type->params; param; param = param->next) {
+        int class = _abi_class(param->type);
+
+        if(class == 0 && gpr < sizeof(gpr_args) / sizeof(gpr_args[0]))
+            regs[index] = gpr_args[gpr++];
+        else if(class == 1 && sse < SSE_ARGS)
+            regs[index] = sse_order[sse++];
+        else
+            continue;
+
+        syms[index++] = param->sym;
+    }
+
+    for(size_t i = 0; i < entry->count; i++) {
+        CInstruction *ins = &entry->ins[i];
+
+        if(ins->kind == INS_CALL || ins->kind == INS_DIV || ins->kind == INS_MOD || ins->kind == INS_MULH ||
+           ((ins->kind == INS_SHL || ins->kind == INS_SHR) && IS_VREG(ins->arg3)))
+            break;
+
+        for(size_t k = 0; k < index; k++) {
+            if(!syms[k] || OPERAND_KIND(ins->arg2) != OPERAND_SYMBOL || SYMBOL_OF(fn, ins->arg2) != syms[k])
+                continue;
+
+            if(ins->kind == INS_LOAD && IS_VREG(ins->arg1) && _abi_class(ins->type) == (regs[k] >= REG_XMM0)) {
+                c->params[i]                      = regs[k];
+                c->entry_regs[c->entry_count++]   = regs[k];
+            }
+
+            syms[k] = NULL;
+        }
+
+        for(size_t k = 0; k < index; k++) {
+            if(ins->kind == INS_STORE && syms[k] && OPERAND_KIND(ins->arg1) == OPERAND_SYMBOL && SYMBOL_OF(fn, ins->arg1) == syms[k])
+                syms[k] = NULL;
+        }
+    }
+}
+
+/*
+ * Live sets over all nodes, iterated to a fixed point. The ABI registers
+ * of the parameters are defined by ENTER and read by their loads.
+ */
+static void _compute_liveness(CColoring *c)
+{
+    CFunction *fn = c->fn;
+    uint64_t  *gen, *kill;
+    size_t     words, size;
+    bool       changed = true;
+
+    c->words = words = c->count / 64 + 1;
+    size     = sizeof(uint64_t) * words * fn->block_count;
+
+    c->live_in  = (uint64_t *)zalloc(size, ARENA_3);
+    c->live_out = (uint64_t *)zalloc(size, ARENA_3);
+    gen         = (uint64_t *)zalloc(size, ARENA_3);
+    kill        = (uint64_t *)zalloc(size, ARENA_3);
+
+    memset(c->live_in, 0, size);
+    memset(c->live_out, 0, size);
+    memset(gen, 0, size);
+    memset(kill, 0, size);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+        uint64_t    *g   = gen + i * words, *k = kill + i * words;
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand     *op;
+            size_t        n;
+
+            for(size_t u = 0; (op = ins_use(fn, ins, u)); u++) {
+                if((n = _node(c, *op)) != NONE && !(k[n / 64] & (1ull << (n % 64))))
+                    g[n / 64] |= 1ull << (n % 64);
+            }
+
+            if(blk == fn->entry && c->params[j] && !(k[c->params[j] / 64] & (1ull << (c->params[j] % 64))))
+                g[c->params[j] / 64] |= 1ull << (c->params[j] % 64);
+
+            if(blk == fn->entry && ins->kind == INS_ENTER) {
+                for(size_t r = 0; r < c->entry_count; r++)
+                    k[c->entry_regs[r] / 64] |= 1ull << (c->entry_regs[r] % 64);
+            }
+
+            if((n = _node(c, ins_def(ins))) != NONE)
+                k[n / 64] |= 1ull << (n % 64);
+        }
+    }
+
+    while(changed) {
+        changed = false;
+
+        for(size_t i = fn->block_count; i-- > 0;) {
+            CBasicBlock *blk = fn->blocks[i];
+            uint64_t    *in  = c->live_in + i * words, *out = c->live_out + i * words;
+
+            for(size_t j = 0; j < blk->succ_count; j++) {
+                for(size_t w = 0; w < words; w++)
+                    out[w] |= c->live_in[blk->succs[j]->id * words + w];
+            }
+
+            for(size_t w = 0; w < words; w++) {
+                uint64_t value = gen[i * words + w] | (out[w] & ~kill[i * words + w]);
+
+                if(value != in[w]) {
+                    in[w]   = value;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+static void _build(CColoring *c)
+{
+    CFunction *fn    = c->fn;
+    size_t     count = c->count;
+    uint64_t  *live  = (uint64_t *)zalloc(sizeof(uint64_t) * c->words, ARENA_3);
+
+    c->matrix     = (uint64_t *)zalloc(sizeof(uint64_t) * (count * (count - 1) / 2 / 64 + 1), ARENA_3);
+    c->adj        = (size_t **)zalloc(sizeof(size_t *) * count, ARENA_3);
+    c->adj_count  = (size_t *)zalloc(sizeof(size_t) * count, ARENA_3);
+    c->adj_cap    = (size_t *)zalloc(sizeof(size_t) * count, ARENA_3);
+    c->moves      = (size_t **)zalloc(sizeof(size_t *) * count, ARENA_3);
+    c->move_count = (size_t *)zalloc(sizeof(size_t) * count, ARENA_3);
+    c->move_cap   = (size_t *)zalloc(sizeof(size_t) * count, ARENA_3);
+    c->degree     = (size_t *)zalloc(sizeof(size_t) * count, ARENA_3);
+    c->alias      = (size_t *)zalloc(sizeof(size_t) * count, ARENA_3);
+    c->color      = (int *)zalloc(sizeof(int) * count, ARENA_3);
+    c->cost       = (double *)zalloc(sizeof(double) * count, ARENA_3);
+    c->sse        = (bool *)zalloc(sizeof(bool) * count, ARENA_3);
+    c->seen       = (bool *)zalloc(sizeof(bool) * count, ARENA_3);
+    c->stamp      = (size_t *)zalloc(sizeof(size_t) * count, ARENA_3);
+    c->stack      = (size_t *)zalloc(sizeof(size_t) * count, ARENA_3);
+
+    memset(c->matrix, 0, sizeof(uint64_t) * (count * (count - 1) / 2 / 64 + 1));
+    memset(c->adj_count, 0, sizeof(size_t) * count);
+    memset(c->adj_cap, 0, sizeof(size_t) * count);
+    memset(c->move_count, 0, sizeof(size_t) * count);
+    memset(c->move_cap, 0, sizeof(size_t) * count);
+    memset(c->degree, 0, sizeof(size_t) * count);
+    memset(c->color, 0, sizeof(int) * count);
+    memset(c->cost, 0, sizeof(double) * count);
+    memset(c->sse, 0, sizeof(bool) * count);
+    memset(c->seen, 0, sizeof(bool) * count);
+    memset(c->stamp, 0, sizeof(size_t) * count);
+
+    for(size_t n = 0; n < count; n++)
+        c->alias[n] = n;
+
+    for(int r = REG_NONE + 1; r < REG_END_MARK; r++) {
+        c->color[r]  = r;
+        c->sse[r]    = r >= REG_XMM0;
+        c->degree[r] = SIZE_MAX / 2;
+    }
+
+    // the class, type and constant of each register first, edges need the classes
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand     *op;
+
+            for(size_t u = 0; (op = ins_use(fn, ins, u)); u++)
+                _note(c, *op, NULL, c->weights[i]);
+
+            _note(c, ins_def(ins), ins, c->weights[i]);
+        }
+    }
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        memcpy(live, c->live_out + i * c->words, sizeof(uint64_t) * c->words);
+        _build_block(c, fn->blocks[i], live, c->weights[i]);
+    }
+
+    _init_lists(&c->nodes, count, NODE_INITIAL);
+    _init_lists(&c->copies, c->copy_count, COPY_WORKLIST);
+
+    // the copies of the innermost loops are tried first, so that one out of
+    // a loop cannot take the register that would have made them free
+    for(double weight = 1, level = 0; level <= COLORING_LOOP_MAX; weight *= COLORING_LOOP_WEIGHT, level++) {
+        for(size_t m = 0; m < c->copy_count; m++) {
+            if(c->copy[m].weight == weight)
+                _set_state(&c->copies, m, COPY_WORKLIST);
+        }
+    }
+
+    for(int r = REG_NONE + 1; r < REG_END_MARK; r++)
+        _set_state(&c->nodes, r, NODE_PRECOLORED);
+}
+
+/*
+ * Walks 'blk' backwards from what is live at its end: what an
+ * instruction defines interferes with everything live after it, but a
+ * copy's source.
+ */
+static void _build_block(CColoring *c, CBasicBlock *blk, uint64_t *live, double weight)
+{
+    CFunction *fn    = c->fn;
+    bool       entry = blk == fn->entry;
+
+    for(size_t i = blk->count; i-- > 0;) {
+        CInstruction *ins = &blk->ins[i];
+        size_t        def = _node(c, ins_def(ins)), src = NONE, n;
+        COperand     *op;
+        int           reg;
+
+        if(entry && ins->kind == INS_ENTER) {
+            for(size_t r = 0; r < c->entry_count; r++) {
+                size_t abi = c->entry_regs[r];
+
+                live[abi / 64] &= ~(1ull << (abi % 64));
+
+                for(size_t w = 0; w < c->words; w++) {
+                    for(uint64_t bits = live[w]; bits; bits &= bits - 1)
+                        _add_edge(c, abi, w * 64 + __builtin_ctzll(bits));
+                }
+            }
+        }
+
+        if(ins->kind == INS_LOAD && def != NONE && (src = _node(c, ins->arg2)) != NONE && c->sse[src] != c->sse[def])
+            src = NONE;
+
+        if(entry && c->params[i])
+            src = c->params[i];
+
+        if(src != NONE) {
+            live[src / 64] &= ~(1ull << (src % 64));
+            _add_copy(c, def, src, weight);
+        }
+
+        // the copies through the ABI registers, free when both ends get the same
+        if(ins->kind == INS_CALL) {
+            COperand *args = ins->arg3 ? LIST_OF(fn, ins->arg3) : NULL;
+            size_t    gpr  = 0, sse = 0;
+
+            if(def != NONE && (reg = _result_reg(ins)))
+                _add_copy(c, def, reg, weight);
+
+            for(size_t k = 0; args && args[k]; k++) {
+                int class = _abi_arg(fn, args[k]);
+
+                reg = REG_NONE;
+
+                if(class == 0 && gpr < sizeof(gpr_args) / sizeof(gpr_args[0]))
+                    reg = gpr_args[gpr++];
+                else if(class == 1 && sse < SSE_ARGS)
+                    reg = sse_order[sse++];
+
+                if(reg && (n = _node(c, args[k])) != NONE && c->sse[n] == (reg >= REG_XMM0))
+                    _add_copy(c, reg, n, weight);
+            }
+        }
+        else if(ins->kind == INS_RETVAL && (n = _node(c, ins->arg1)) != NONE && (reg = _result_reg(ins)))
+            _add_copy(c, reg, n, weight);
+
+        _clobber(c, ins, live, def);
+
+        if(def != NONE) {
+            for(size_t w = 0; w < c->words; w++) {
+                for(uint64_t bits = live[w]; bits; bits &= bits - 1)
+                    _add_edge(c, def, w * 64 + __builtin_ctzll(bits));
+            }
+
+            live[def / 64] &= ~(1ull << (def % 64));
+        }
+
+        for(size_t u = 0; (op = ins_use(fn, ins, u)); u++) {
+            if((n = _node(c, *op)) != NONE)
+                live[n / 64] |= 1ull << (n % 64);
+        }
+
+        if(entry && c->params[i])
+            live[c->params[i] / 64] |= 1ull << (c->params[i] % 64);
+    }
+}
+
+/*
+ * The physical registers 'ins' takes, against what they would overwrite.
+ */
+static void _clobber(CColoring *c, CInstruction *ins, uint64_t *live, size_t def)
+{
+    int       regs[REG_END_MARK];
+    size_t    count = 0, n;
+    bool      operands = true, result = false;
+    COperand *op;
+
+    switch(ins->kind) {
+        case INS_CALL:
+            for(size_t i = 0; i < sizeof(caller_saved) / sizeof(caller_saved[0]); i++)
+                regs[count++] = caller_saved[i];
+
+            for(size_t i = 0; i < SSE_COUNT; i++)
+                regs[count++] = sse_order[i];
+
+            operands = false;
+            break;
+        case INS_DIV:
+        case INS_MOD:
+        case INS_MULH:
+            if(_is_sse(ins))
+                return;
+
+            regs[count++] = REG_RAX;
+            regs[count++] = REG_RDX;
+            break;
+        case INS_SHL:
+        case INS_SHR:
+            if(!IS_VREG(ins->arg3))
+                return;
+
+            regs[count++] = REG_RCX;
+            result        = true;
+            break;
+        default:
+            return;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        for(size_t w = 0; w < c->words; w++) {
+            for(uint64_t bits = live[w]; bits; bits &= bits - 1) {
+                if((n = w * 64 + __builtin_ctzll(bits)) != def)
+                    _add_edge(c, regs[i], n);
+            }
+        }
+
+        for(size_t u = 0; operands && (op = ins_use(c->fn, ins, u)); u++) {
+            if((n = _node(c, *op)) != NONE)
+                _add_edge(c, regs[i], n);
+        }
+
+        if(result && def != NONE)
+            _add_edge(c, regs[i], def);
+    }
+}
+
+static void _make_worklist(CColoring *c)
+{
+    for(size_t n = REG_END_MARK; n < c->count; n++) {
+        if(!c->seen[n])
+            continue;
+
+        if(c->degree[n] >= _k(c, n))
+            _set_state(&c->nodes, n, NODE_SPILL);
+        else if(_move_related(c, n))
+            _set_state(&c->nodes, n, NODE_FREEZE);
+        else
+            _set_state(&c->nodes, n, NODE_SIMPLIFY);
+    }
+}
+
+static void _simplify(CColoring *c)
+{
+    size_t n = c->nodes.head[NODE_SIMPLIFY];
+
+    _set_state(&c->nodes, n, NODE_SELECT);
+    c->stack[c->stack_count++] = n;
+
+    for(size_t i = 0; i < c->adj_count[n]; i++) {
+        if(_adjacent(c, c->adj[n][i]))
+            _decrement_degree(c, c->adj[n][i]);
+    }
+}
+
+static void _decrement_degree(CColoring *c, size_t m)
+{
+    size_t d;
+
+    if(c->nodes.state[m] == NODE_PRECOLORED)
+        return;
+
+    d = c->degree[m]--;
+
+    if(d != _k(c, m) || c->nodes.state[m] != NODE_SPILL)
+        return;
+
+    _enable_moves(c, m);
+
+    for(size_t i = 0; i < c->adj_count[m]; i++) {
+        if(_adjacent(c, c->adj[m][i]))
+            _enable_moves(c, c->adj[m][i]);
+    }
+
+    _set_state(&c->nodes, m, _move_related(c, m) ? NODE_FREEZE : NODE_SIMPLIFY);
+}
+
+static void _enable_moves(CColoring *c, size_t n)
+{
+    for(size_t i = 0; n >= REG_END_MARK && i < c->move_count[n]; i++) {
+        if(c->copies.state[c->moves[n][i]] == COPY_ACTIVE)
+            _set_state(&c->copies, c->moves[n][i], COPY_WORKLIST);
+    }
+}
+
+static void _coalesce(CColoring *c)
+{
+    size_t m = c->copies.head[COPY_WORKLIST];
+    size_t x = _alias(c, c->copy[m].dst), y = _alias(c, c->copy[m].src), u, v;
+
+    if(c->nodes.state[y] == NODE_PRECOLORED) {
+        u = y;
+        v = x;
+    } else {
+        u = x;
+        v = y;
+    }
+
+    if(u == v) {
+        _set_state(&c->copies, m, COPY_COALESCED);
+        _add_worklist(c, u);
+        return;
+    }
+
+    if(c->nodes.state[v] == NODE_PRECOLORED || _interfere(c, u, v)) {
+        _set_state(&c->copies, m, COPY_CONSTRAINED);
+        _add_worklist(c, u);
+        _add_worklist(c, v);
+        return;
+    }
+
+    if(c->nodes.state[u] == NODE_PRECOLORED) {
+        bool ok = true;
+
+        for(size_t i = 0; ok && i < c->adj_count[v]; i++)
+            ok = !_adjacent(c, c->adj[v][i]) || _ok(c, c->adj[v][i], u);
+
+        if(ok) {
+            _set_state(&c->copies, m, COPY_COALESCED);
+            _combine(c, u, v);
+            _add_worklist(c, u);
+            return;
+        }
+    }
+    else if(_conservative(c, u, v)) {
+        _set_state(&c->copies, m, COPY_COALESCED);
+        _combine(c, u, v);
+        _add_worklist(c, u);
+        return;
+    }
+
+    _set_state(&c->copies, m, COPY_ACTIVE);
+}
+
+static void _add_worklist(CColoring *c, size_t u)
+{
+    if(c->nodes.state[u] == NODE_FREEZE && !_move_related(c, u) && c->degree[u] < _k(c, u))
+        _set_state(&c->nodes, u, NODE_SIMPLIFY);
+}
+
+/*
+ * George's test, for merging a node into the register 'r'.
+ */
+static bool _ok(CColoring *c, size_t t, size_t r)
+{
+    return c->degree[t] < _k(c, t) || c->nodes.state[t] == NODE_PRECOLORED || _interfere(c, t, r);
+}
+
+/*
+ * Briggs' test: fewer than K neighbours of significant degree together.
+ */
+static bool _conservative(CColoring *c, size_t u, size_t v)
+{
+    size_t k = 0, nodes[2] = {u, v};
+
+    c->now++;
+
+    for(int j = 0; j < 2; j++) {
+        size_t n = nodes[j];
+
+        for(size_t i = 0; i < c->adj_count[n]; i++) {
+            size_t t = c->adj[n][i];
+
+            if(!_adjacent(c, t) || c->stamp[t] == c->now)
+                continue;
+
+            c->stamp[t] = c->now;
+
+            if(c->degree[t] >= _k(c, t))
+                k++;
+        }
+    }
+
+    return k < _k(c, u);
+}
+
+static void _combine(CColoring *c, size_t u, size_t v)
+{
+    _set_state(&c->nodes, v, NODE_COALESCED);
+
+    c->alias[v]  = u;
+    c->cost[u]  += c->cost[v];
+
+    for(size_t i = 0; u >= REG_END_MARK && i < c->move_count[v]; i++)
+        _push(&c->moves[u], &c->move_count[u], &c->move_cap[u], c->moves[v][i]);
+
+    _enable_moves(c, v);
+
+    for(size_t i = 0; i < c->adj_count[v]; i++) {
+        size_t t = c->adj[v][i];
+
+        if(!_adjacent(c, t))
+            continue;
+
+        _add_edge(c, t, u);
+        _decrement_degree(c, t);
+    }
+
+    if(c->nodes.state[u] == NODE_FREEZE && c->degree[u] >= _k(c, u))
+        _set_state(&c->nodes, u, NODE_SPILL);
+}
+
+static void _freeze(CColoring *c)
+{
+    size_t u = c->nodes.head[NODE_FREEZE];
+
+    _set_state(&c->nodes, u, NODE_SIMPLIFY);
+    _freeze_moves(c, u);
+}
+
+static void _freeze_moves(CColoring *c, size_t u)
+{
+    for(size_t i = 0; i < c->move_count[u]; i++) {
+        size_t m = c->moves[u][i], v;
+
+        if(!_live_move(c, m))
+            continue;
+
+        v = _alias(c, c->copy[m].src) == _alias(c, u) ? _alias(c, c->copy[m].dst) : _alias(c, c->copy[m].src);
+
+        _set_state(&c->copies, m, COPY_FROZEN);
+
+        if(c->nodes.state[v] == NODE_FREEZE && !_move_related(c, v) && c->degree[v] < _k(c, v))
+            _set_state(&c->nodes, v, NODE_SIMPLIFY);
+    }
+}
+
+/*
+ * The node that costs least to spill for the edges it takes away. A
+ * register holding a spilled value for one instruction never spills, a
+ * constant costs half, being loaded again rather than stored and reloaded.
+ */
+static void _select_spill(CColoring *c)
+{
+    size_t best = NONE;
+    double least = 0;
+    bool   temp  = false;
+
+    for(size_t n = c->nodes.head[NODE_SPILL]; n != NONE; n = c->nodes.next[n]) {
+        double cost = c->cost[n] / c->degree[n];
+        bool   short_lived = n - REG_END_MARK >= c->temps;
+
+        if(c->remat[n - REG_END_MARK])
+            cost /= 2;
+
+        if(best == NONE || (temp && !short_lived) || (temp == short_lived && cost < least)) {
+            best  = n;
+            least = cost;
+            temp  = short_lived;
+        }
+    }
+
+    _set_state(&c->nodes, best, NODE_SIMPLIFY);
+    _freeze_moves(c, best);
+}
+
+/*
+ * Pops the nodes, each taking a register its colored neighbours don't
+ * have: the one of a copy's other end when it can, else the first free in
+ * the order of its class, the caller saved ones first.
+ */
+static void _assign_colors(CColoring *c)
+{
+    while(c->stack_count) {
+        size_t     n = c->stack[--c->stack_count];
+        bool       taken[REG_END_MARK];
+        const int *order = c->sse[n] ? sse_order : gpr_order;
+        size_t     count = c->sse[n] ? SSE_COUNT : GPR_COUNT;
+        int        reg   = REG_NONE;
+
+        memset(taken, 0, sizeof(taken));
+
+        for(size_t i = 0; i < c->adj_count[n]; i++) {
+            size_t w = _alias(c, c->adj[n][i]);
+
+            if(c->nodes.state[w] == NODE_COLORED || c->nodes.state[w] == NODE_PRECOLORED)
+                taken[c->color[w]] = true;
+        }
+
+        for(size_t i = 0; !reg && i < c->move_count[n]; i++) {
+            size_t m = c->moves[n][i], w;
+
+            w = _alias(c, c->copy[m].src) == n ? _alias(c, c->copy[m].dst) : _alias(c, c->copy[m].src);
+
+            if((c->nodes.state[w] == NODE_COLORED || c->nodes.state[w] == NODE_PRECOLORED) &&
+               c->sse[w] == c->sse[n] && !taken[c->color[w]])
+                reg = c->color[w];
+        }
+
+        for(size_t i = 0; !reg && i < count; i++) {
+            if(!taken[order[i]])
+                reg = order[i];
+        }
+
+        if(!reg) {
+            _set_state(&c->nodes, n, NODE_SPILLED);
+            continue;
+        }
+
+        _set_state(&c->nodes, n, NODE_COLORED);
+        c->color[n] = reg;
+    }
+
+    for(size_t n = c->nodes.head[NODE_COALESCED]; n != NONE; n = c->nodes.next[n]) {
+        size_t a = _alias(c, n);
+
+        if(c->nodes.state[a] == NODE_SPILLED)
+            continue;
+
+        c->color[n] = c->color[a];
+    }
+}
+
+/*
+ * Spills what got no register. A spilled argument of a call is passed
+ * from its slot, or as the constant, as linear scan does.
+ */
+static void _rewrite(CColoring *c, int *result)
+{
+    CFunction *fn    = c->fn;
+    size_t     count = fn->vreg_count;
+    COperand  *slots = (COperand *)zalloc(sizeof(COperand) * (count + 1), ARENA_3);
+
+    memset(slots, 0, sizeof(COperand) * count);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock  *blk = fn->blocks[i];
+        CInstruction *ins;
+        COperand      carried = 0;
+        size_t        n = 0, carried_id = NONE;
+
+        ins = (CInstruction *)zalloc(sizeof(CInstruction) * (4 * blk->count + 1), ARENA_3);
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction  cur = blk->ins[j];
+            COperand     *op, def = ins_def(&cur), temp = 0;
+            size_t        spilled = NONE, id;
+
+            // a constant's definition goes, it is loaded where used
+            if(def && !result[OPERAND_INDEX(def)] && c->remat[OPERAND_INDEX(def)])
+                continue;
+
+            for(size_t u = 0; (op = ins_use(fn, &cur, u)); u++) {
+                COperand from;
+
+                if(!IS_VREG(*op) || (id = OPERAND_INDEX(*op)) >= count || result[id])
+                    continue;
+
+                if(!(from = c->remat[id]) && !(from = slots[id]))
+                    from = slots[id] = _slot(fn, id, c->type[id]);
+
+                if(cur.kind == INS_CALL && u) {
+                    *op = from;
+                    continue;
+                }
+
+                // one register for all the operands naming it, and the
+                // previous instruction's register still holds the value
+                if(spilled != id && carried && carried_id == id) {
+                    temp    = carried;
+                    spilled = id;
+                } else if(spilled != id) {
+                    temp    = ir_vreg(fn);
+                    spilled = id;
+
+                    ins[n++] = new_instruction(INS_LOAD, temp, from, 0, c->type[id], cur.line);
+
+                    if(c->remat[id])
+                        c->rematerialized++;
+                    else
+                        c->reloads++;
+                }
+
+                *op = temp;
+            }
+
+            carried    = temp;
+            carried_id = spilled;
+
+            if(def && !result[id = OPERAND_INDEX(def)]) {
+                COperand store = temp && spilled == id ? temp : ir_vreg(fn);
+
+                carried    = store;
+                carried_id = id;
+
+                if(!slots[id])
+                    slots[id] = _slot(fn, id, c->type[id]);
+
+                cur.arg1 = store;
+                ins[n++] = cur;
+                ins[n++] = new_instruction(INS_STORE, slots[id], store, 0, c->type[id], cur.line);
+
+                c->stores++;
+                continue;
+            }
+
+            ins[n++] = cur;
+        }
+
+        fn->ins_count += n;
+        fn->ins_count -= blk->count;
+
+        blk->ins      = ins;
+        blk->count    = n;
+        blk->capacity = 4 * blk->count + 1;
+    }
+}
+
+/*
+ * Writes the registers to the operands, and drops the copies that ended
+ * up between one register and itself.
+ */
+static void _apply(CColoring *c, int *result)
+{
+    CFunction *fn = c->fn;
+
+    for(size_t id = fn->vreg_count; id-- > 0;) {
+        if(result[id])
+            ir_assign(fn, OPERAND(OPERAND_VREG, id), result[id]);
+    }
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+        size_t       n   = 0;
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand      def = ins_def(ins);
+
+            if(ins->kind == INS_LOAD && def && IS_VREG(ins->arg2)) {
+                c->copies_made++;
+
+                if(result[OPERAND_INDEX(ins->arg2)] == result[OPERAND_INDEX(def)]) {
+                    c->coalesced++;
+                    continue;
+                }
+            }
+
+            blk->ins[n++] = *ins;
+        }
+
+        fn->ins_count -= blk->count - n;
+        blk->count     = n;
+    }
+}
+
+static void _add_edge(CColoring *c, size_t u, size_t v)
+{
+    size_t a = u > v ? u : v, b = u > v ? v : u, bit;
+
+    if(u == v || c->sse[u] != c->sse[v])
+        return;
+
+    bit = a * (a - 1) / 2 + b;
+
+    if(c->matrix[bit / 64] & (1ull << (bit % 64)))
+        return;
+
+    c->matrix[bit / 64] |= 1ull << (bit % 64);
+
+    if(u >= REG_END_MARK) {
+        _push(&c->adj[u], &c->adj_count[u], &c->adj_cap[u], v);
+        c->degree[u]++;
+    }
+
+    if(v >= REG_END_MARK) {
+        _push(&c->adj[v], &c->adj_count[v], &c->adj_cap[v], u);
+        c->degree[v]++;
+    }
+}
+
+static bool _interfere(CColoring *c, size_t u, size_t v)
+{
+    size_t a = u > v ? u : v, b = u > v ? v : u, bit;
+
+    if(u == v)
+        return false;
+
+    bit = a * (a - 1) / 2 + b;
+
+    return c->matrix[bit / 64] & (1ull << (bit % 64));
+}
+
+static void _add_copy(CColoring *c, size_t dst, size_t src, double weight)
+{
+    size_t m = c->copy_count;
+
+    if(dst == NONE || src == NONE || dst == src || c->sse[dst] != c->sse[src])
+        return;
+
+    if(c->copy_count == c->copy_cap) {
+        CCopy *tmp = c->copy;
+
+        c->copy_cap = 2 * c->copy_cap + 16;
+        c->copy     = (CCopy *)zalloc(sizeof(CCopy) * c->copy_cap, ARENA_3);
+
+        if(c->copy_count)
+            memcpy(c->copy, tmp, sizeof(CCopy) * c->copy_count);
+    }
+
+    c->copy[c->copy_count++] = (CCopy){dst, src, weight};
+
+    if(dst >= REG_END_MARK)
+        _push(&c->moves[dst], &c->move_count[dst], &c->move_cap[dst], m);
+
+    if(src >= REG_END_MARK)
+        _push(&c->moves[src], &c->move_count[src], &c->move_cap[src], m);
+}
+
+static void _push(size_t **list, size_t *count, size_t *cap, size_t x)
+{
+    if(*count == *cap) {
+        size_t *tmp = *list;
+
+        *cap  = 2 * *cap + 4;
+        *list = (size_t *)zalloc(sizeof(size_t) * *cap, ARENA_3);
+
+        if(*count)
+            memcpy(*list, tmp, sizeof(size_t) * *count);
+    }
+
+    (*list)[(*count)++] = x;
+}
+
+static bool _move_related(CColoring *c, size_t n)
+{
+    for(size_t i = 0; i < c->move_count[n]; i++) {
+        if(_live_move(c, c->moves[n][i]))
+            return true;
+    }
+
+    return false;
+}
+
+static bool _live_move(CColoring *c, size_t m)
+{
+    return c->copies.state[m] == COPY_ACTIVE || c->copies.state[m] == COPY_WORKLIST;
+}
+
+static size_t _alias(CColoring *c, size_t n)
+{
+    while(c->nodes.state[n] == NODE_COALESCED)
+        n = c->alias[n];
+
+    return n;
+}
+
+static size_t _k(CColoring *c, size_t n)
+{
+    return c->sse[n] ? SSE_COUNT : GPR_COUNT;
+}
+
+/*
+ * Whether a neighbour is still in the graph.
+ */
+static bool _adjacent(CColoring *c, size_t n)
+{
+    return c->nodes.state[n] != NODE_SELECT && c->nodes.state[n] != NODE_COALESCED;
+}
+
+static void _init_lists(CLists *lists, size_t count, int state)
+{
+    lists->prev  = (size_t *)zalloc(sizeof(size_t) * (count + 1), ARENA_3);
+    lists->next  = (size_t *)zalloc(sizeof(size_t) * (count + 1), ARENA_3);
+    lists->state = (int *)zalloc(sizeof(int) * (count + 1), ARENA_3);
+
+    for(int s = 0; s < NODE_STATES; s++)
+        lists->head[s] = NONE;
+
+    for(size_t x = count; x-- > 0;) {
+        lists->state[x] = state;
+        lists->prev[x]  = NONE;
+        lists->next[x]  = lists->head[state];
+
+        if(lists->head[state] != NONE)
+            lists->prev[lists->head[state]] = x;
+
+        lists->head[state] = x;
+    }
+}
+
+static void _set_state(CLists *lists, size_t x, int state)
+{
+    if(lists->prev[x] != NONE)
+        lists->next[lists->prev[x]] = lists->next[x];
+    else
+        lists->head[lists->state[x]] = lists->next[x];
+
+    if(lists->next[x] != NONE)
+        lists->prev[lists->next[x]] = lists->prev[x];
+
+    lists->state[x] = state;
+    lists->prev[x]  = NONE;
+    lists->next[x]  = lists->head[state];
+
+    if(lists->head[state] != NONE)
+        lists->prev[lists->head[state]] = x;
+
+    lists->head[state] = x;
+}
+
+static size_t _node(CColoring *c, COperand arg)
+{
+    if(!IS_VREG(arg) || OPERAND_INDEX(arg) >= c->count - REG_END_MARK)
+        return NONE;
+
+    return REG_END_MARK + OPERAND_INDEX(arg);
+}
+
+/*
+ * Records a register seen in the function, with its class, type and
+ * constant from its definitions 'ins'.
+ */
+static void _note(CColoring *c, COperand arg, CInstruction *ins, double weight)
+{
+    size_t n = _node(c, arg), id;
+
+    if(n == NONE)
+        return;
+
+    id          = n - REG_END_MARK;
+    c->seen[n]  = true;
+    c->cost[n] += weight;
+
+    if(!ins)
+        return;
+
+    c->sse[n] = _is_sse(ins);
+
+    if(!c->type[id])
+        c->type[id] = ins->type;
+
+    // a constant only when every definition loads the same one, which is interned
+    if(c->varies[id] || ins->kind != INS_LOAD || ins->type != c->type[id] ||
+       (OPERAND_KIND(ins->arg2) != OPERAND_INT && OPERAND_KIND(ins->arg2) != OPERAND_FLOAT) ||
+       (c->remat[id] && c->remat[id] != ins->arg2)) {
+        c->varies[id] = true;
+        c->remat[id]  = 0;
+        return;
+    }
+
+    c->remat[id] = ins->arg2;
+}
+
+/*
+ * SysV class of a value of 'type': 0 in an integer register, 1 in an SSE
+ * one, -1 in memory.
+ */
+static int _abi_class(CType *type)
+{
+    if(!(type = canonical_type(type)))
+        return 0;
+
+    switch(type->kind) {
+        case FLOAT:
+        case DOUBLE:
+            return 1;
+        case LDOUBLE:
+        case STRUCT:
+        case UNION:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+static int _abi_arg(CFunction *fn, COperand arg)
+{
+    if(!arg)
+        return -1;
+
+    switch(OPERAND_KIND(arg)) {
+        case OPERAND_FLOAT:
+            return 1;
+        case OPERAND_SYMBOL:
+            return _abi_class(SYMBOL_OF(fn, arg)->type);
+        default:
+            return 0;
+    }
+}
+
+/*
+ * The register a call returns in, or a function returns from.
+ */
+static int _result_reg(CInstruction *ins)
+{
+    switch(_abi_class(ins->type)) {
+        case 0:
+            return REG_RAX;
+        case 1:
+            return REG_XMM0;
+        default:
+            return REG_NONE;
+    }
+}
+
+static bool _is_jump(CInstruction *ins)
+{
+    return ins->kind == INS_JMP || ins->kind == INS_JTAB || is_branch(ins->kind);
+}
+
+/*
+ * Whether the result of 'ins' goes to an SSE register. A comparison is
+ * typed with its operands but gives an integer.
+ */
+static bool _is_sse(CInstruction *ins)
+{
+    CType *type;
+
+    switch(ins->kind) {
+        case INS_GE:
+        case INS_LE:
+        case INS_GT:
+        case INS_LT:
+        case INS_EQ:
+        case INS_NE:
+            return false;
+        default:
+            break;
+    }
+
+    if(!(type = canonical_type(ins->type)))
+        return false;
+
+    return type->kind == FLOAT || type->kind == DOUBLE || type->kind == LDOUBLE;
+}
+
+/*
+ * Spill slot of the register 'id', a local of the function.
+ */
+static COperand _slot(CFunction *fn, size_t id, CType *type)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "$spill%ld", id);
+
+    return ir_temp(fn, name, type);
+}
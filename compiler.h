@@ -47,9 +47,23 @@
 #define COMPILER_FLAG_DONT_PUSH_SCOPE (1 << 3)
 #define COMPILER_FLAG_GLOBAL_SCOPE    (1 << 4)
 #define COMPILER_FLAG_LOCAL_SCOPE     (1 << 5)
+#define COMPILER_FLAG_QUIET_FOLD      (1 << 6)
+
+#define COMPILER_OPTION_STATS         (1 << 0)
+#define COMPILER_OPTION_LAZY          (1 << 1)
+#define COMPILER_OPTION_PARALLEL      (1 << 2)
+#define COMPILER_OPTION_FUSED         (1 << 3)
+#define COMPILER_OPTION_OPTIMIZE      (1 << 4)
+#define COMPILER_OPTION_INLINE_REPORT (1 << 5)
+#define COMPILER_OPTION_LINEAR_SCAN   (1 << 6)
+#define COMPILER_OPTION_X86           (1 << 7)
 
 #define SYMBOL_HAS_BEEN_PROTOTYPED    (1 << 0)
 #define SYMBOL_HAS_BEEN_INITIALIZED   (1 << 1)
+#define SYMBOL_IS_STATIC              (1 << 2)
+#define SYMBOL_IS_LOCAL               (1 << 3)
+#define SYMBOL_ADDRESS_TAKEN          (1 << 4)
+#define SYMBOL_IS_INLINE              (1 << 5)
 
 typedef union   UAlign       UAlign;
 typedef struct  CFile        CFile;
@@ -63,8 +77,33 @@ typedef struct  CKeyword     CKeyword;
 typedef struct  CCompiler    CCompiler;
 typedef struct  CNode        CNode;
 typedef struct  CInstruction CInstruction;
-typedef struct  CVirtualReg  CVirtualReg;
-typedef struct  CLabel       CLabel;
+typedef struct  CBasicBlock  CBasicBlock;
+typedef struct  CFunction    CFunction;
+typedef struct  CLoop        CLoop;
+typedef struct  COptStats    COptStats;
+typedef union   CValue       CValue;
+typedef uint32_t             COperand;
+typedef struct  CJob         CJob;
+typedef struct  CEvalCache   CEvalCache;
+typedef struct  CMark        CMark;
+typedef struct  CFrame       CFrame;
+typedef struct  CStack       CStack;
+typedef struct  CCode        CCode;
+typedef struct  CReloc       CReloc;
+
+/*
+ * An IR operand packs its OperandKind in the top bits over an index: the
+ * id of a vreg or label, or a slot in the pools of its function.
+ */
+#define OPERAND_SHIFT        29
+#define OPERAND(kind, index) ((COperand)(kind) << OPERAND_SHIFT | (COperand)(index))
+#define OPERAND_KIND(op)     ((OperandKind)((op) >> OPERAND_SHIFT))
+#define OPERAND_INDEX(op)    ((size_t)((op) & ((1u << OPERAND_SHIFT) - 1)))
+#define IS_VREG(op)          (OPERAND_KIND(op) == OPERAND_VREG)
+#define VALUE_OF(fn, op)     ((fn)->values[OPERAND_INDEX(op)])
+#define SYMBOL_OF(fn, op)    ((fn)->symbols[OPERAND_INDEX(op)])
+#define LIST_OF(fn, op)      ((fn)->lists[OPERAND_INDEX(op)])
+#define TARGET_OF(fn, op)    ((fn)->targets[OPERAND_INDEX(op)])
 
 struct CMisc {
     MiscKind kind;
@@ -75,21 +114,82 @@ struct CMisc {
         float        fval;
         double       dval;
         CType       *type;
-        CVirtualReg *vreg;
-        CLabel      *label;
     };
 };
 
-struct CVirtualReg {
-    size_t usage;
-    size_t id;
-    int    reg;
+struct CMark {
+    void *block;
+    byte *avail;
+};
+
+/*
+ * Work stack of the parser, the analyser and the IR generator, which walk
+ * expressions and statements without recursing. Each user keeps its own
+ * state in a frame, the IR generator its operands in the last ones;
+ * nested walks push above the frames of the outer one.
+ */
+struct CFrame {
+    CNode   *tree;
+    CNode   *cursor;
+    void    *data;
+    void    *extra;
+    void    *aux;
+    int      kind;
+    int      step;
+    COperand value;
+    COperand label;
+    COperand exit;
+    COperand repeat;
+    COperand list;
+};
+
+struct CStack {
+    CFrame *frames;
+    size_t  count;
+    size_t  capacity;
+};
+
+/*
+ * Bits of a constant of the IR: an integer, or a float or double in the
+ * low bytes.
+ */
+union CValue {
+    int64_t val;
+    float   fval;
+    double  dval;
 };
 
-struct CLabel {
-    const char *opt_name;
-    size_t      address;
-    size_t      lbID;
+#define PEEPHOLE_PATTERNS 15
+
+/*
+ * What the optimiser did to a unit, reported by '-stats'.
+ */
+struct COptStats {
+    size_t promoted;
+    size_t removed_loads;
+    size_t removed_stores;
+    size_t phis;
+    size_t folded;
+    size_t folded_branches;
+    size_t unreachable;
+    size_t divisions;
+    size_t redundant;
+    size_t loops;
+    size_t hoisted;
+    size_t reduced;
+    size_t replaced_tests;
+    size_t shifts;
+    size_t inlined;
+    size_t peephole[PEEPHOLE_PATTERNS]; // hits of each pattern
+    size_t dead_blocks;
+    size_t dead_instructions;
+    size_t dead_functions;
+    size_t splits;
+    size_t spills;
+    size_t spill_stores;
+    size_t reloads;
+    size_t coalesced;
+    size_t rematerialized;
 };
 
 struct CCompiler {
@@ -99,22 +199,157 @@ struct CCompiler {
     int            token;
     int            flags;
     CNode         *nodes;
+    CStack        *stack;
     size_t         switch_count;
     size_t         loop_count;
     size_t         label_count;
-    CInstruction  *head;
-    CInstruction  *tail;
+    size_t         vreg_count;
+    size_t         folded_nodes;
+    CEvalCache    *evals;
+    size_t         eval_hits;
+    size_t         skipped_bodies;
+    size_t         parsed_bodies;
+    CNode         *lazy_nodes;
+    CJob          *jobs;
+    size_t         job_count;
+    size_t         job_cursor;
+    FILE          *diag;
+    CFunction     *head;
+    CFunction     *tail;
+    CFunction     *fn;
+    CBasicBlock   *block;
+    CInstruction  *scratch;
+    size_t         scratch_size;
+    CCode         *code;
+    CCode         *code_tail;
+    COptStats      opt;
 };
 
+/*
+ * The operands are inline, 0 when there is none: see OPERAND().
+ */
 struct CInstruction {
     Instruction   kind;
-    size_t        line;
+    COperand      arg1;
+    COperand      arg2;
+    COperand      arg3;
     CType        *type;
-    CMisc        *arg1;
-    CMisc        *arg2;
-    CMisc        *arg3;
-    CInstruction *prev;
-    CInstruction *next;
+    size_t        line;
+};
+
+/*
+ * A basic block keeps its instructions in one array. Only the last one may
+ * transfer control; a block whose last instruction does not falls through
+ * to the next block in layout order. 'succs' has room for two edges, the
+ * fall through first; a block ending in a jump table gets one more for
+ * each distinct target of the table.
+ */
+struct CBasicBlock {
+    size_t        id;
+    COperand      label;
+    CInstruction *ins;
+    size_t        count;
+    size_t        capacity;
+    CBasicBlock **succs;
+    size_t        succ_count;
+    CBasicBlock **preds;
+    size_t        pred_count;
+    CBasicBlock  *idom;
+    CBasicBlock **dom_children;
+    size_t        dom_child_count;
+    size_t        rpo;
+    CLoop        *loop;
+    CBasicBlock  *next;
+};
+
+/*
+ * A natural loop, in the nesting tree built by find_loops(). A block
+ * belongs to its innermost loop, and a loop spans the preorder numbers
+ * 'first' to 'last' of its subtree. 'blocks' are the loop's own blocks in
+ * reverse postorder, the header first. The preheader is the only block
+ * entering the loop, NULL when the loop could not be given one.
+ */
+struct CLoop {
+    CBasicBlock  *header;
+    CBasicBlock  *preheader;
+    CLoop        *parent;
+    CLoop        *child;
+    CLoop        *sibling;
+    size_t        first;
+    size_t        last;
+    CBasicBlock **blocks;
+    size_t        count;
+};
+
+/*
+ * IR of one function, blocks in layout order. Code outside of functions
+ * (global initializers) goes to containers with a NULL 'sym'. 'order'
+ * holds the reachable blocks in reverse postorder once the dominators
+ * have been computed; an unreachable block has no 'idom'.
+ *
+ * Everything its operands index is kept with it in ARENA_3: constants
+ * and symbols, interned through 'interned', lists of operands, the block
+ * each label starts and, once allocated, the register of each vreg.
+ */
+struct CFunction {
+    CSymbol      *sym;
+    CBasicBlock **blocks;
+    size_t        block_count;
+    CBasicBlock **order;
+    size_t        order_count;
+    CLoop        *loops;
+    size_t        loop_count;
+    CBasicBlock  *entry;
+    CBasicBlock  *exit;
+    size_t        vreg_count;
+    size_t        label_count;
+    size_t        ins_count;
+    CValue       *values;
+    size_t        value_count;
+    size_t        value_cap;
+    CSymbol     **symbols;
+    size_t        symbol_count;
+    size_t        symbol_cap;
+    COperand     *interned;     // open addressing, a value or symbol operand per used slot
+    size_t        interned_cap;
+    COperand    **lists;        // each ends with 0
+    size_t        list_count;
+    size_t        list_cap;
+    CBasicBlock **targets;      // by label id
+    size_t        target_cap;
+    byte         *regs;         // the Register of each vreg, 0 until allocated
+    size_t        reg_count;
+    CFunction    *next;
+};
+
+/*
+ * Machine code of a function, or the initial value of a global ('data'),
+ * in ARENA_5. A relocation asks for the address of 'sym' plus 'addend'
+ * minus that of the 32-bit field at 'at', as R_X86_64_PC32 does.
+ */
+struct CReloc {
+    CSymbol      *sym;
+    size_t        at;
+    int64_t       addend;
+    CReloc       *next;
+};
+
+struct CCode {
+    CSymbol      *sym;
+    byte         *bytes;
+    size_t        size;
+    CReloc       *relocs;
+    bool          data;
+    CCode        *next;
+};
+
+struct CJob {
+    CNode        *tree;
+    CFunction    *fn;
+    char         *diag;
+    size_t        diag_size;
+    size_t        errors;
+    size_t        warnings;
 };
 
 struct CEntry {
@@ -142,6 +377,7 @@ struct CSymbol {
     int         scope;
     size_t      usage;
     int         flags;
+    int         slot; // index of a promoted local while its function is optimised
 };
 
 struct CType {
@@ -155,6 +391,11 @@ struct CType {
         CSymbolTable *members;
         CNode        *array_dimension;
     };
+    CType      *pointer;
+    CType      *derived;
+    CType      *link;
+    CType      *canon;
+    int64_t     length;
 };
 
 struct CFile {
@@ -200,8 +441,10 @@ struct CNode {
         }_if;
 
         struct {
-            CSymbol *symbol;
-            CNode   *init;
+            CSymbol    *symbol;
+            CNode      *init;
+            const char *body;
+            size_t      body_line;
         }decl;
 
         struct {
@@ -266,20 +509,23 @@ struct CNode {
 extern CType       *cmp_primitives[END_PRIMITIVES];
 extern CKeyword     keywords[MAX_KEYS];
 extern byte         opTable[ASCII_MAX];
+extern int          options;
+extern int          thread_count;
 
 //zalloc.c
 extern void        *zalloc(size_t nbytes, size_t idx);
 extern void         zfree(void);
+extern void         zmerge(void);
+extern CMark        zmark(size_t idx);
+extern void         zrelease(size_t idx, CMark mark);
+extern size_t       zpeak(size_t idx);
 //misc.c
 extern size_t       get_align(size_t size);
 extern bool         istrcmp(const char *s1, const char *s2);
 extern void         error(CCompiler *cmp, size_t opt_line, const char *msg, ...);
 extern void         warn(CCompiler  *cmp, size_t opt_line, const char *msg, ...);
 extern void         print_type(CType *type);
-extern CType       *make_ptr(CType *base);
 extern CType       *new_type(void);
-extern CType       *new_function(CType *base, CParameter *params, size_t param_count);
-extern CType       *new_array(CType *base, CNode *size_expr);
 extern CParameter  *new_param(void);
 extern void         expect(CCompiler *cmp, int tokenex);
 extern void         accept(CCompiler *cmp, int tokenex);
@@ -287,15 +533,24 @@ extern CSymbol     *new_symbol(void);
 extern CNode       *new_tree(TreeKind kind, size_t line);
 extern CMisc       *new_misc(MiscKind kind);
 extern void         printf_type(CType *type, FILE *out);
-extern CInstruction *new_instruction(Instruction kind, CMisc *arg1, CMisc *arg2, CMisc *arg3, CType *type, size_t line);
-extern void         add_ir(CCompiler *cmp, CInstruction *ins);
-extern CVirtualReg *new_virtual_register(size_t reg_count);
-extern CLabel      *new_label(const char *opt_name, size_t id);
+extern CInstruction new_instruction(Instruction kind, COperand arg1, COperand arg2, COperand arg3, CType *type, size_t line);
+extern CStack      *new_stack(void);
+extern CFrame      *push_frame(CStack *stack, CNode *tree);
+extern CFrame      *top_frame(CStack *stack);
+extern void         pop_frame(CStack *stack);
+//types.c
+extern CType       *make_ptr(CType *base);
+extern CType       *new_function(CType *base, CParameter *params, size_t param_count);
+extern CType       *new_array(CType *base, CNode *size_expr);
+extern CType       *array_of(CType *base, int64_t length);
+extern CType       *canonical_type(CType *type);
+extern void         type_share(void);
 //file.c
 extern CFile        *new_file(const char *path, bool check_ext);
 //atom.c
 extern const char   *atom(const char *string);
 extern const char   *atom_range(const char *string, size_t len);
+extern void          atom_share(void);
 //table.c
 extern CSymbolTable *new_table(void);
 extern void          insert(CSymbolTable *table, const char *key, void *data);
@@ -317,13 +572,83 @@ extern CType        *prs_decl_lvl0(CCompiler *cmp, int *sclass, int *typeq);
 extern CType        *prs_decl_lvl1(CCompiler *cmp, CType *base, const char **name);
 extern CNode        *prs_translation_unit(CCompiler *cmp);
 extern bool          is_storage_class(CCompiler *cmp);
+extern bool          is_function_specifier(CCompiler *cmp);
+extern CNode        *materialize_function(CCompiler *cmp, CNode *tree);
 //expr.c
 extern CNode        *prs_expr(CCompiler *cmp, int power);
+//fold.c
+extern CNode        *fold_tree(CCompiler *cmp, CNode *tree);
+extern bool          fold_in_place(CCompiler *cmp, CNode *tree);
+extern bool          eval_constant(CCompiler *cmp, CNode *tree, int64_t *out);
 //stmt.c
 extern CNode        *prs_stmt(CCompiler *cmp);
 //semantic.c
 extern void          start_semantic_analyser(CCompiler *cmp);
+extern void          analyse_unit(CCompiler *cmp, CNode *tree);
+extern void          analyse_function(CCompiler *cmp, CNode *tree);
 //irgen.c
 extern void          start_irgen(CCompiler *cmp);
+extern void          generate_unit(CCompiler *cmp, CNode *tree);
+extern void          generate_function(CCompiler *cmp, CNode *tree);
+//pool.c
+extern void          start_parallel(CCompiler *cmp);
+//ir.c
+extern CFunction    *begin_ir(CCompiler *cmp, CSymbol *sym);
+extern void          end_ir(CCompiler *cmp);
+extern void          add_ir(CCompiler *cmp, CInstruction ins);
+extern CInstruction *last_ir(CCompiler *cmp);
+extern void          remove_edge(CFunction *fn, CBasicBlock *from, CBasicBlock *to);
+extern COperand     *ins_use(CFunction *fn, CInstruction *ins, size_t n);
+extern COperand      ins_def(CInstruction *ins);
+extern COperand      ir_constant(CFunction *fn, OperandKind kind, int64_t bits);
+extern COperand      ir_symbol(CFunction *fn, CSymbol *sym);
+extern COperand      ir_operand(CFunction *fn, CMisc *misc);
+extern COperand      ir_temp(CFunction *fn, const char *name, CType *type);
+extern COperand      ir_list(CFunction *fn, OperandKind kind, size_t count);
+extern COperand      ir_vreg(CFunction *fn);
+extern COperand      ir_label(CFunction *fn);
+extern void          ir_place(CFunction *fn, COperand label, CBasicBlock *blk);
+extern void          ir_assign(CFunction *fn, COperand vreg, int reg);
+extern bool          ins_clobbers(CInstruction *ins);
+extern bool          is_branch(Instruction kind);
+extern Instruction   branch_compare(Instruction kind);
+extern Instruction   invert_branch(Instruction kind);
 //ir_print.c
-extern void          print_ir(CCompiler *cmp);
+extern void          print_function(CFunction *fn);
+//ssa.c
+extern void          compute_dominators(CFunction *fn);
+extern bool          dominates(CBasicBlock *b1, CBasicBlock *b2);
+extern void          build_ssa(CCompiler *cmp, CFunction *fn);
+//sccp.c
+extern void          propagate_constants(CCompiler *cmp, CFunction *fn);
+//div.c
+extern void          lower_division(CCompiler *cmp, CFunction *fn);
+//gvn.c
+extern void          number_values(CCompiler *cmp, CFunction *fn);
+//loop.c
+extern void          find_loops(CFunction *fn);
+extern bool          loop_contains(CLoop *loop, CBasicBlock *blk);
+//licm.c
+extern void          hoist_invariants(CCompiler *cmp, CFunction *fn);
+//iv.c
+extern void          reduce_strength(CCompiler *cmp, CFunction *fn);
+//peephole.c
+extern void          rewrite_peepholes(CCompiler *cmp, CFunction *fn);
+extern const char   *peephole_pattern(size_t index);
+//dce.c
+extern void          eliminate_dead_code(CCompiler *cmp, CFunction *fn);
+extern size_t        remove_unreachable_blocks(CFunction *fn);
+//inline.c
+extern void          inline_functions(CCompiler *cmp);
+//regalloc.c
+extern void          allocate_function(CCompiler *cmp, CFunction *fn);
+//coloring.c
+extern bool          color_registers(CCompiler *cmp, CFunction *fn);
+//opt.c
+extern void          optimize_function(CCompiler *cmp, CFunction *fn);
+extern void          optimize_ssa(CCompiler *cmp, CFunction *fn);
+extern void          merge_opt_stats(COptStats *into, const COptStats *from);
+extern void          print_opt_stats(const COptStats *stats, FILE *out);
+//x86.c
+extern CCode        *encode_function(CCompiler *cmp, CFunction *fn);
+extern void          print_code(CCode *code);
@@ -0,0 +1,178 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * Dead code elimination over the SSA registers. Blocks the entry can no
+ * longer reach (code after a return, branches constant propagation folded
+ * away) are cut out of the function first, so nothing they read keeps a
+ * definition alive. Then instructions with an effect beyond the register
+ * they define (stores, jumps, returns) are marked live and liveness is
+ * followed backwards through the operands, phis included; whatever is
+ * left unmarked computes a value nobody reads and is dropped. Marking
+ * instead of deleting registers with no uses also removes dead cycles,
+ * like a variable updated in a loop but never read after it.
+ */
+
+typedef struct CSite CSite;
+
+struct CSite {
+    CBasicBlock *block;
+    size_t       index;
+};
+
+typedef struct CDCE {
+    CFunction *fn;
+    CSite     *defs;
+    bool     **live;
+    CSite     *work;
+    size_t     work_count;
+} CDCE;
+
+static size_t _sweep_instructions(CDCE *dce);
+static void   _mark(CDCE *dce, CBasicBlock *blk, size_t index);
+
+void eliminate_dead_code(CCompiler *cmp, CFunction *fn)
+{
+    CDCE   dce;
+    size_t blocks, instructions;
+
+    if(!cmp || !fn || !fn->entry)
+        return;
+
+    blocks = remove_unreachable_blocks(fn);
+
+    memset(&dce, 0, sizeof(CDCE));
+
+    dce.fn       = fn;
+    instructions = _sweep_instructions(&dce);
+
+    cmp->opt.dead_blocks       += blocks;
+    cmp->opt.dead_instructions += instructions;
+
+    if((options & COMPILER_OPTION_STATS) && (blocks || instructions))
+        fprintf(cmp->diag, "dce('%s'): %ld instructions and %ld blocks removed\n",
+                fn->sym->name, instructions, blocks);
+}
+
+/*
+ * Unlinks every block without a dominator, i.e. unreachable from the
+ * entry. A reachable block never falls through into one of them, so the
+ * layout stays valid. The exit block is kept even when the function never
+ * returns, it holds the LEAVE. Also run by the peephole pass, whose
+ * patterns look at the block laid out next.
+ */
+size_t remove_unreachable_blocks(CFunction *fn)
+{
+    CBasicBlock *prev = NULL;
+    size_t       count = 0;
+
+    compute_dominators(fn);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        if(!blk->idom && blk != fn->exit) {
+            while(blk->succ_count)
+                remove_edge(fn, blk, blk->succs[0]);
+
+            fn->ins_count -= blk->count;
+            continue;
+        }
+
+        if(prev)
+            prev->next = blk;
+
+        blk->id             = count;
+        fn->blocks[count++] = blk;
+        prev                = blk;
+    }
+
+    prev->next = NULL;
+
+    if(count == fn->block_count)
+        return 0;
+
+    count           = fn->block_count - count;
+    fn->block_count -= count;
+
+    compute_dominators(fn);
+
+    return count;
+}
+
+static size_t _sweep_instructions(CDCE *dce)
+{
+    CFunction *fn    = dce->fn;
+    size_t     count = 0;
+
+    dce->defs = (CSite *)zalloc(sizeof(CSite) * (fn->vreg_count + 1), ARENA_3);
+    dce->live = (bool **)zalloc(sizeof(bool *) * fn->block_count, ARENA_3);
+    dce->work = (CSite *)zalloc(sizeof(CSite) * (fn->ins_count + 1), ARENA_3);
+
+    memset(dce->defs, 0, sizeof(CSite) * fn->vreg_count);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        dce->live[i] = (bool *)zalloc(sizeof(bool) * (blk->count + 1), ARENA_3);
+
+        memset(dce->live[i], 0, sizeof(bool) * blk->count);
+
+        for(size_t j = 0; j < blk->count; j++) {
+            COperand def = ins_def(&blk->ins[j]);
+
+            if(def && OPERAND_INDEX(def) < fn->vreg_count)
+                dce->defs[OPERAND_INDEX(def)] = (CSite){blk, j};
+        }
+    }
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            if(!ins_def(&blk->ins[j]) || ins_clobbers(&blk->ins[j]))
+                _mark(dce, blk, j);
+        }
+    }
+
+    while(dce->work_count) {
+        CSite     site = dce->work[--dce->work_count];
+        COperand *use;
+
+        for(size_t n = 0; (use = ins_use(fn, &site.block->ins[site.index], n)); n++) {
+            CSite def;
+
+            if(!IS_VREG(*use) || OPERAND_INDEX(*use) >= fn->vreg_count)
+                continue;
+
+            def = dce->defs[OPERAND_INDEX(*use)];
+
+            _mark(dce, def.block, def.index);
+        }
+    }
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk  = fn->blocks[i];
+        size_t       kept = 0;
+
+        for(size_t j = 0; j < blk->count; j++) {
+            if(dce->live[i][j])
+                blk->ins[kept++] = blk->ins[j];
+        }
+
+        count         += blk->count - kept;
+        fn->ins_count -= blk->count - kept;
+        blk->count     = kept;
+    }
+
+    return count;
+}
+
+static void _mark(CDCE *dce, CBasicBlock *blk, size_t index)
+{
+    if(!blk || dce->live[blk->id][index])
+        return;
+
+    dce->live[blk->id][index]    = true;
+    dce->work[dce->work_count++] = (CSite){blk, index};
+}
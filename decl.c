@@ -4,8 +4,10 @@
 static CType *_prs_decl_lvl2(CCompiler *cmp, CType *base);
 static CType *_prs_array(CCompiler *cmp, CType *base);
 static CType *_prs_fun_params(CCompiler *cmp, CType *base);
+static CType *_rebase(CType *type, CType *base);
 
 static CNode *_prs_function(CCompiler *cmp, CSymbol *sym);
+static void   _skip_body(CCompiler *cmp);
 
 CNode *prs_translation_unit(CCompiler *cmp)
 {
@@ -14,7 +16,7 @@ CNode *prs_translation_unit(CCompiler *cmp)
     if(!cmp)
         return NULL;
 
-    if(is_typename(cmp) || is_typequalifier(cmp) || is_storage_class(cmp))
+    if(is_typename(cmp) || is_typequalifier(cmp) || is_storage_class(cmp) || is_function_specifier(cmp))
         return prs_decl(cmp);
 
     tree = prs_expr(cmp, 0);
@@ -42,11 +44,122 @@ static CNode *_prs_function(CCompiler *cmp, CSymbol *sym)
 
     expect(cmp, '{');
 
-    tree->decl.init = prs_stmt(cmp);
+    if(!(options & (COMPILER_OPTION_LAZY | COMPILER_OPTION_PARALLEL)) || cmp->token != '{') {
+        tree->decl.init = prs_stmt(cmp);
+        return tree;
+    }
+
+    tree->decl.body      = cmp->file->src;
+    tree->decl.body_line = cmp->file->line;
+
+    _skip_body(cmp);
+
+    cmp->skipped_bodies++;
 
     return tree;
 }
 
+/*
+ * Parses the body of a function recorded by the lazy mode. The lexer is
+ * rewound to the recorded '{' and restored afterwards, so this can be called
+ * at any point after the translation unit has been parsed.
+ */
+CNode *materialize_function(CCompiler *cmp, CNode *tree)
+{
+    const char *src;
+    size_t      line;
+    int         token;
+    int         flags;
+    CMisc       misc;
+
+    if(!cmp || !tree || tree->kind != FNDECL)
+        return NULL;
+
+    if(tree->decl.init || !tree->decl.body)
+        return tree->decl.init;
+
+    src   = cmp->file->src;
+    line  = cmp->file->line;
+    token = cmp->token;
+    flags = cmp->flags;
+    misc  = cmp->misc;
+
+    cmp->file->src  = (char *)tree->decl.body;
+    cmp->file->line = tree->decl.body_line;
+    cmp->token      = '{';
+    cmp->flags     &= ~COMPILER_FLAG_DONT_LEX;
+
+    tree->decl.init = prs_stmt(cmp);
+
+    cmp->file->src  = (char *)src;
+    cmp->file->line = line;
+    cmp->token      = token;
+    cmp->flags      = flags | (cmp->flags & COMPILER_FLAG_ERROR);
+    cmp->misc       = misc;
+
+    cmp->parsed_bodies++;
+
+    return tree->decl.init;
+}
+
+/*
+ * Skips a function body by brace matching, without building tokens.
+ * Comments, string and character literals are stepped over so braces
+ * inside them are not counted. Leaves the current token at the closing '}'
+ * exactly like prs_stmt() would.
+ */
+static void _skip_body(CCompiler *cmp)
+{
+    const char *src   = cmp->file->src;
+    size_t      depth = 1;
+
+    while(*src && depth) {
+        switch(*src++) {
+            case '{':
+                depth++;
+                break;
+            case '}':
+                depth--;
+                break;
+            case '\n':
+                cmp->file->line++;
+                break;
+            case '/':
+                if(*src == '/') {
+                    while(*src && *src != '\n')
+                        src++;
+                    break;
+                }
+                if(*src != '*')
+                    break;
+                for(src++; *src && (src[0] != '*' || src[1] != '/'); src++)
+                    if(*src == '\n')
+                        cmp->file->line++;
+                if(*src)
+                    src += 2;
+                break;
+            case '"':
+            case '\'':
+                for(char quote = src[-1]; *src && *src != quote && *src != '\n'; src++)
+                    if(*src == '\\' && src[1])
+                        src++;
+                if(*src && *src != '\n')
+                    src++;
+                break;
+        }
+    }
+
+    cmp->file->src = (char *)src;
+
+    if(depth) {
+        error(cmp, 0, "'}' expected\n");
+        cmp->token = TK_EOF;
+        return;
+    }
+
+    cmp->token = '}';
+}
+
 CNode *prs_decl(CCompiler *cmp)
 {
     CType      *base   = NULL;
@@ -83,6 +196,15 @@ CNode *prs_decl(CCompiler *cmp)
         sym->name = name;
         sym->type = final;
 
+        if(sclass == KW_STATIC)
+            sym->flags |= SYMBOL_IS_STATIC;
+
+        if(typeq & SPECIFIER_INLINE) {
+            if(final->kind != FUNCTION)
+                error(cmp, 0, "'inline' can only be applied to a function\n");
+            sym->flags |= SYMBOL_IS_INLINE;
+        }
+
         if(final->kind == FUNCTION)
             return _prs_function(cmp, sym);
 
@@ -123,7 +245,7 @@ static CType *_prs_fun_params(CCompiler *cmp, CType *base)
         CType *type = prs_decl_lvl0(cmp, &sclass, &typeq);
         type        = prs_decl_lvl1(cmp, type, &name);
 
-        if(sclass)
+        if(sclass || (typeq & SPECIFIER_INLINE))
             error(cmp, 0, "Cannot specify a storage class here\n");
 
         if(type->kind == VOID) {
@@ -208,7 +330,7 @@ CType *prs_decl_lvl1(CCompiler *cmp, CType *base, const char **name)
     }
 
     if(cmp->token == '(') {
-        CType *prefix, *suffix, *ptr, *empty_type;
+        CType *prefix, *suffix, *empty_type;
 
         empty_type       = new_type();
         empty_type->kind = EMPTY;
@@ -224,17 +346,7 @@ CType *prs_decl_lvl1(CCompiler *cmp, CType *base, const char **name)
 
         suffix = _prs_decl_lvl2(cmp, final);
 
-        for(ptr = prefix; ptr; ptr = ptr->base) {
-            if(ptr->base && ptr->base->kind == EMPTY) {
-                ptr->base = suffix;
-                break;
-            }
-        }
-
-        if(!ptr && suffix)
-            return suffix;
-
-        return prefix;
+        return _rebase(prefix, suffix);
     }
 
     if(cmp->token == TK_ID || !(cmp->flags & COMPILER_FLAG_DONT_NEED_ID)) {
@@ -250,6 +362,31 @@ CType *prs_decl_lvl1(CCompiler *cmp, CType *base, const char **name)
     return _prs_decl_lvl2(cmp, final);
 }
 
+/*
+ * Rebuilds the declarator 'type', parsed around an EMPTY placeholder, on top
+ * of 'base'. Types are interned, so they are rebuilt instead of patched.
+ */
+static CType *_rebase(CType *type, CType *base)
+{
+    if(!type)
+        return base;
+
+    switch(type->kind) {
+        case EMPTY:
+            return base;
+        case PTR:
+            return make_ptr(_rebase(type->base, base));
+        case ARRAY:
+            if(type->array_dimension)
+                return new_array(_rebase(type->base, base), type->array_dimension);
+            return array_of(_rebase(type->base, base), type->length);
+        case FUNCTION:
+            return new_function(_rebase(type->base, base), type->params, type->param_count);
+        default:
+            return type;
+    }
+}
+
 CType *prs_decl_lvl0(CCompiler *cmp, int *sclass, int *typeq)
 {
     const char *usertype = NULL;
@@ -260,7 +397,7 @@ CType *prs_decl_lvl0(CCompiler *cmp, int *sclass, int *typeq)
         return NULL;
 
 
-    while(is_typename(cmp) || is_typequalifier(cmp) || is_storage_class(cmp)) {
+    while(is_typename(cmp) || is_typequalifier(cmp) || is_storage_class(cmp) || is_function_specifier(cmp)) {
         switch(cmp->token) {
             case KW_AUTO:
             case KW_STATIC:
@@ -270,6 +407,9 @@ CType *prs_decl_lvl0(CCompiler *cmp, int *sclass, int *typeq)
                     error(cmp, 0, "Storage class already specified\n");
                 *sclass = cmp->token;
                  break;
+            case KW_INLINE:
+                *typeq |= SPECIFIER_INLINE;
+                break;
             case KW_UNSIGNED:
                 sum += MASK_UNSIGNED;
                 break;
@@ -404,3 +544,11 @@ bool is_storage_class(CCompiler *cmp)
 
     return cmp->token == KW_AUTO || cmp->token == KW_STATIC || cmp->token == KW_TYPEDEF || cmp->token == KW_EXTERN;
 }
+
+bool is_function_specifier(CCompiler *cmp)
+{
+    if(!cmp)
+        return false;
+
+    return cmp->token == KW_INLINE;
+}
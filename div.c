@@ -0,0 +1,412 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * Division and remainder by integer constants. A power of two is a shift,
+ * rounded towards zero for a signed dividend by adding 2^k - 1 to a
+ * negative one first, and its remainder is a mask. Any other divisor is a
+ * multiply by a magic number keeping the high half of the product
+ * (MULH), a shift and a fixup (Hacker's Delight, chapter 10): for a
+ * signed type the quotient is rounded up when negative, for an unsigned
+ * one a magic number that does not fit the width is handled by adding the
+ * dividend back. A remainder is the dividend less the quotient times the
+ * divisor.
+ *
+ * Only 32- and 64-bit types are lowered, and divisors of 0, 1 and -1 are
+ * left alone.
+ */
+
+typedef struct CMagic {
+    uint64_t mul;
+    int      shift;
+    bool     add;
+} CMagic;
+
+typedef struct CDivision {
+    CCompiler    *cmp;
+    CFunction    *fn;
+    COperand     *constant;
+    CInstruction *out;
+    size_t        out_count;
+    size_t        lowered;
+} CDivision;
+
+static bool          _lower(CDivision *div, CInstruction *ins);
+static void          _lower_pow2(CDivision *div, CInstruction *ins, int64_t d, int k, int bits, bool sign);
+static void          _lower_signed(CDivision *div, CInstruction *ins, int64_t d, int bits);
+static void          _lower_unsigned(CDivision *div, CInstruction *ins, uint64_t d, int bits);
+static void          _remainder(CDivision *div, CInstruction *ins, COperand quotient, int64_t d);
+static void          _finish(CDivision *div, CInstruction *ins);
+static COperand      _emit(CDivision *div, CInstruction *ins, Instruction kind, COperand m1, COperand m2);
+static CMagic        _magic_signed(int64_t d, int bits);
+static CMagic        _magic_unsigned(uint64_t d, int bits);
+static COperand      _new_constant(CFunction *fn, CType *type, int64_t val);
+
+static bool          _is_integer(CType *type);
+static bool          _is_unsigned(CType *type);
+static int64_t       _truncate(CType *type, int64_t val);
+
+void lower_division(CCompiler *cmp, CFunction *fn)
+{
+    CDivision div;
+    size_t    capacity = 0;
+
+    if(!cmp || !fn || !fn->entry)
+        return;
+
+    memset(&div, 0, sizeof(CDivision));
+
+    div.cmp      = cmp;
+    div.fn       = fn;
+    div.constant = (COperand *)zalloc(sizeof(COperand) * (fn->vreg_count + 1), ARENA_3);
+
+    memset(div.constant, 0, sizeof(COperand) * fn->vreg_count);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk  = fn->blocks[i];
+        size_t       size = blk->count;
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand      def = ins_def(ins);
+
+            // a division becomes at most 7 instructions
+            if(ins->kind == INS_DIV || ins->kind == INS_MOD)
+                size += 6;
+
+            if(def && OPERAND_INDEX(def) < fn->vreg_count && ins->kind == INS_LOAD &&
+               OPERAND_KIND(ins->arg2) == OPERAND_INT)
+                div.constant[OPERAND_INDEX(def)] = ins->arg2;
+        }
+
+        capacity = size > capacity ? size : capacity;
+    }
+
+    div.out = (CInstruction *)zalloc(sizeof(CInstruction) * (capacity + 1), ARENA_3);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk   = fn->blocks[i];
+        size_t       count = div.lowered;
+
+        div.out_count = 0;
+
+        for(size_t j = 0; j < blk->count; j++) {
+            if(!_lower(&div, &blk->ins[j]))
+                div.out[div.out_count++] = blk->ins[j];
+        }
+
+        if(div.lowered == count)
+            continue;
+
+        blk->ins      = (CInstruction *)zalloc(sizeof(CInstruction) * div.out_count, ARENA_3);
+        blk->capacity = div.out_count;
+        fn->ins_count += div.out_count - blk->count;
+        blk->count     = div.out_count;
+
+        memcpy(blk->ins, div.out, sizeof(CInstruction) * div.out_count);
+    }
+
+    cmp->opt.divisions += div.lowered;
+
+    if((options & COMPILER_OPTION_STATS) && div.lowered)
+        fprintf(cmp->diag, "div('%s'): %ld divisions by constants lowered\n", fn->sym->name, div.lowered);
+}
+
+/*
+ * Appends the sequence replacing 'ins' to the block being rebuilt, false
+ * if it is kept as it is.
+ */
+static bool _lower(CDivision *div, CInstruction *ins)
+{
+    COperand divisor = ins->arg3;
+    int      bits, k = 0;
+    bool     sign;
+    int64_t  d;
+    uint64_t ad;
+
+    if((ins->kind != INS_DIV && ins->kind != INS_MOD) || !_is_integer(ins->type) ||
+       (ins->type->size != 4 && ins->type->size != 8) || !IS_VREG(ins->arg2))
+        return false;
+
+    if(IS_VREG(divisor) && OPERAND_INDEX(divisor) < div->fn->vreg_count)
+        divisor = div->constant[OPERAND_INDEX(divisor)];
+
+    if(OPERAND_KIND(divisor) != OPERAND_INT)
+        return false;
+
+    bits = (int)ins->type->size * 8;
+    sign = !_is_unsigned(ins->type);
+    d    = _truncate(ins->type, VALUE_OF(div->fn, divisor).val);
+    ad   = sign && d < 0 ? 0 - (uint64_t)d : (uint64_t)d;
+
+    if(!d || d == 1 || (sign && d == -1))
+        return false;
+
+    if(!(ad & (ad - 1))) {
+        while(((uint64_t)1 << k) != ad)
+            k++;
+
+        _lower_pow2(div, ins, d, k, bits, sign);
+    } else if(sign)
+        _lower_signed(div, ins, d, bits);
+    else
+        _lower_unsigned(div, ins, (uint64_t)d, bits);
+
+    div->lowered++;
+
+    return true;
+}
+
+/*
+ * n / 2^k is (n + (n < 0 ? 2^k - 1 : 0)) >> k for a signed n, and the
+ * remainder n - ((n + bias) & -2^k), the same for -2^k.
+ */
+static void _lower_pow2(CDivision *div, CInstruction *ins, int64_t d, int k, int bits, bool sign)
+{
+    CType   *type = ins->type;
+    COperand n    = ins->arg2, t;
+    int64_t  mask = (int64_t)(((uint64_t)1 << k) - 1);
+
+    if(!sign) {
+        if(ins->kind == INS_DIV)
+            _emit(div, ins, INS_SHR, n, _new_constant(div->fn, type, k));
+        else
+            _emit(div, ins, INS_AND, n, _new_constant(div->fn, type, mask));
+
+        _finish(div, ins);
+        return;
+    }
+
+    t = _emit(div, ins, INS_SHR, n, _new_constant(div->fn, type, bits - 1));
+    t = _emit(div, ins, INS_AND, t, _new_constant(div->fn, type, mask));
+    t = _emit(div, ins, INS_ADD, n, t);
+
+    if(ins->kind == INS_MOD) {
+        t = _emit(div, ins, INS_AND, t, _new_constant(div->fn, type, ~mask));
+        _emit(div, ins, INS_SUB, n, t);
+    } else {
+        t = _emit(div, ins, INS_SHR, t, _new_constant(div->fn, type, k));
+
+        if(d < 0)
+            _emit(div, ins, INS_SUB, _new_constant(div->fn, type, 0), t);
+    }
+
+    _finish(div, ins);
+}
+
+/*
+ * q = mulh(n, M), corrected by n when M and d differ in sign, shifted,
+ * plus one when negative.
+ */
+static void _lower_signed(CDivision *div, CInstruction *ins, int64_t d, int bits)
+{
+    CType   *type  = ins->type;
+    COperand n     = ins->arg2, t;
+    CMagic   magic = _magic_signed(d, bits);
+    int64_t  mul   = _truncate(type, (int64_t)magic.mul);
+
+    t = _emit(div, ins, INS_MULH, n, _new_constant(div->fn, type, mul));
+
+    if(d > 0 && mul < 0)
+        t = _emit(div, ins, INS_ADD, t, n);
+    else if(d < 0 && mul > 0)
+        t = _emit(div, ins, INS_SUB, t, n);
+
+    if(magic.shift)
+        t = _emit(div, ins, INS_SHR, t, _new_constant(div->fn, type, magic.shift));
+
+    t = _emit(div, ins, INS_SUB, t, _emit(div, ins, INS_SHR, t, _new_constant(div->fn, type, bits - 1)));
+
+    _remainder(div, ins, t, d);
+}
+
+/*
+ * q = mulh(n, M) >> s, or when M needs one bit more than the width,
+ * (((n - t) >> 1) + t) >> (s - 1) with t = mulh(n, M). A divisor with the
+ * top bit set goes into n at most once.
+ */
+static void _lower_unsigned(CDivision *div, CInstruction *ins, uint64_t d, int bits)
+{
+    CType   *type = ins->type;
+    COperand n    = ins->arg2, t, q;
+    CMagic   magic;
+
+    if(d >> (bits - 1)) {
+        q = _emit(div, ins, INS_GE, n, _new_constant(div->fn, type, (int64_t)d));
+        _remainder(div, ins, q, (int64_t)d);
+        return;
+    }
+
+    magic = _magic_unsigned(d, bits);
+    t     = _emit(div, ins, INS_MULH, n, _new_constant(div->fn, type, (int64_t)magic.mul));
+
+    if(magic.add) {
+        q = _emit(div, ins, INS_SUB, n, t);
+        q = _emit(div, ins, INS_SHR, q, _new_constant(div->fn, type, 1));
+        q = _emit(div, ins, INS_ADD, q, t);
+
+        if(magic.shift > 1)
+            q = _emit(div, ins, INS_SHR, q, _new_constant(div->fn, type, magic.shift - 1));
+    } else {
+        q = magic.shift ? _emit(div, ins, INS_SHR, t, _new_constant(div->fn, type, magic.shift)) : t;
+    }
+
+    _remainder(div, ins, q, (int64_t)d);
+}
+
+/*
+ * 'quotient' was emitted last, a remainder is n - q * d.
+ */
+static void _remainder(CDivision *div, CInstruction *ins, COperand quotient, int64_t d)
+{
+    if(ins->kind == INS_MOD)
+        _emit(div, ins, INS_SUB, ins->arg2, _emit(div, ins, INS_MUL, quotient, _new_constant(div->fn, ins->type, d)));
+
+    _finish(div, ins);
+}
+
+/*
+ * The last instruction emitted defines the register of 'ins' instead.
+ */
+static void _finish(CDivision *div, CInstruction *ins)
+{
+    div->out[div->out_count - 1].arg1 = ins->arg1;
+}
+
+static COperand _emit(CDivision *div, CInstruction *ins, Instruction kind, COperand m1, COperand m2)
+{
+    COperand dest = ir_vreg(div->fn);
+
+    div->out[div->out_count++] = new_instruction(kind, dest, m1, m2, ins->type, ins->line);
+
+    return dest;
+}
+
+/*
+ * Smallest M, s with n / d == mulh(n, M) >> s (+ n, + 1 if negative) over
+ * the signed 'bits'-bit range, 2 <= |d|. All arithmetic is unsigned
+ * modulo 2^bits.
+ */
+static CMagic _magic_signed(int64_t d, int bits)
+{
+    uint64_t mask = bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+    uint64_t top  = (uint64_t)1 << (bits - 1);
+    uint64_t ad   = (d < 0 ? 0 - (uint64_t)d : (uint64_t)d) & mask;
+    uint64_t t    = top + (((uint64_t)d & mask) >> (bits - 1));
+    uint64_t anc  = t - 1 - t % ad;
+    uint64_t q1   = top / anc, r1 = top - q1 * anc;
+    uint64_t q2   = top / ad, r2 = top - q2 * ad;
+    uint64_t delta;
+    int      p    = bits - 1;
+    CMagic   magic;
+
+    do {
+        p++;
+
+        q1 = (q1 * 2) & mask;
+        r1 = (r1 * 2) & mask;
+
+        if(r1 >= anc) {
+            q1 = (q1 + 1) & mask;
+            r1 = (r1 - anc) & mask;
+        }
+
+        q2 = (q2 * 2) & mask;
+        r2 = (r2 * 2) & mask;
+
+        if(r2 >= ad) {
+            q2 = (q2 + 1) & mask;
+            r2 = (r2 - ad) & mask;
+        }
+
+        delta = (ad - r2) & mask;
+    } while(q1 < delta || (q1 == delta && !r1));
+
+    magic.mul   = (q2 + 1) & mask;
+    magic.shift = p - bits;
+    magic.add   = false;
+
+    if(d < 0)
+        magic.mul = (0 - magic.mul) & mask;
+
+    return magic;
+}
+
+/*
+ * Smallest M, s with n / d == mulh(n, M) >> s over the unsigned
+ * 'bits'-bit range, 'add' set when M is 2^bits more than 'mul'.
+ */
+static CMagic _magic_unsigned(uint64_t d, int bits)
+{
+    uint64_t mask = bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+    uint64_t top  = (uint64_t)1 << (bits - 1);
+    uint64_t nc   = (mask - ((0 - d) & mask) % d) & mask;
+    uint64_t q1   = top / nc, r1 = top - q1 * nc;
+    uint64_t q2   = (top - 1) / d, r2 = (top - 1) - q2 * d;
+    uint64_t delta;
+    int      p    = bits - 1;
+    CMagic   magic;
+
+    magic.add = false;
+
+    do {
+        p++;
+
+        if(r1 >= ((nc - r1) & mask)) {
+            q1 = (q1 * 2 + 1) & mask;
+            r1 = (r1 * 2 - nc) & mask;
+        } else {
+            q1 = (q1 * 2) & mask;
+            r1 = (r1 * 2) & mask;
+        }
+
+        if(((r2 + 1) & mask) >= ((d - r2) & mask)) {
+            magic.add |= q2 >= top - 1;
+            q2         = (q2 * 2 + 1) & mask;
+            r2         = (r2 * 2 + 1 - d) & mask;
+        } else {
+            magic.add |= q2 >= top;
+            q2         = (q2 * 2) & mask;
+            r2         = (r2 * 2 + 1) & mask;
+        }
+
+        delta = (d - 1 - r2) & mask;
+    } while(p < bits * 2 && (q1 < delta || (q1 == delta && !r1)));
+
+    magic.mul   = (q2 + 1) & mask;
+    magic.shift = p - bits;
+
+    return magic;
+}
+
+static COperand _new_constant(CFunction *fn, CType *type, int64_t val)
+{
+    return ir_constant(fn, OPERAND_INT, _truncate(type, val));
+}
+
+static bool _is_integer(CType *type)
+{
+    return type && type->kind >= CHAR && type->kind <= ULONG;
+}
+
+static bool _is_unsigned(CType *type)
+{
+    if(!type)
+        return false;
+
+    return type->kind == UCHAR || type->kind == USHORT || type->kind == UINT || type->kind == ULONG;
+}
+
+static int64_t _truncate(CType *type, int64_t val)
+{
+    switch(type->size) {
+        case 1:
+            return _is_unsigned(type) ? (int64_t)(uint8_t)val  : (int64_t)(int8_t)val;
+        case 2:
+            return _is_unsigned(type) ? (int64_t)(uint16_t)val : (int64_t)(int16_t)val;
+        case 4:
+            return _is_unsigned(type) ? (int64_t)(uint32_t)val : (int64_t)(int32_t)val;
+        default:
+            return val;
+    }
+}
@@ -1,268 +1,367 @@
 #include "compiler.h"
 #include "misc.h"
 
-static CNode *_prs_prefix(CCompiler *cmp);
-static CNode *_prs_postfix(CCompiler *cmp, CNode *base);
-
-static CNode *_prs_fn_call(CCompiler *cmp, CNode *base);
-static CNode *_prs_array_access(CCompiler *cmp, CNode *base);
-static CNode *_prs_member_access(CCompiler *cmp, CNode *base);
-static CNode *_prs_member_ptr_access(CCompiler *cmp, CNode *base);
-static CNode *_prs_sizeof(CCompiler *cmp);
-static CNode *_prs_unary(CCompiler *cmp, TreeKind kind);
+/*
+ * Expressions are parsed without recursion: every construct waiting for a
+ * sub-expression (the right operand of a binary operator, the base of a
+ * unary one, a parenthesised expression, an argument, a subscript...)
+ * pushes a frame on cmp->stack and the loop in prs_expr() goes on with the
+ * operand. Once an operand is complete it is handed to the frame on top,
+ * so nesting depth is only bounded by memory.
+ */
+
+typedef enum {
+    PARSE_OPERAND,   // a prefix expression starts at the current token
+    PARSE_POSTFIX,   // 'tree' is complete, apply postfix operators to it
+    PARSE_REDUCE     // 'tree' is complete, give it to the frame on top
+} ParseState;
+
+typedef enum {
+    FRAME_BINARY,    // tree: left operand, data: binary node waiting for its rhs, step: power
+    FRAME_UNARY,     // tree: unary node waiting for its base
+    FRAME_PAREN,
+    FRAME_CALL,      // tree: call, data: where the next argument goes
+    FRAME_INDEX,     // tree: subscript node
+    FRAME_SIZEOF     // tree: sizeof node, step: operand was parenthesised
+} FrameKind;
+
+static ParseState _prs_prefix(CCompiler *cmp, CNode **tree);
+static ParseState _prs_postfix(CCompiler *cmp, CNode **tree);
+static ParseState _reduce(CCompiler *cmp, CNode **tree);
+static void       _push_expr(CCompiler *cmp, int power);
+
+static ParseState _prs_fn_call(CCompiler *cmp, CNode **tree);
+static ParseState _prs_array_access(CCompiler *cmp);
+static CNode     *_prs_member_access(CCompiler *cmp, CNode *base);
+static CNode     *_prs_member_ptr_access(CCompiler *cmp, CNode *base);
+static ParseState _prs_sizeof(CCompiler *cmp, CNode **tree);
+static ParseState _prs_unary(CCompiler *cmp, TreeKind kind);
 
 CNode *prs_expr(CCompiler *cmp, int power)
 {
-    CNode *lhs = NULL;
+    CNode     *tree  = NULL;
+    ParseState state = PARSE_OPERAND;
+    size_t     base;
 
     if(!cmp)
         return NULL;
 
-    lhs = _prs_prefix(cmp);
+    base = cmp->stack->count;
 
-    while(*cmp->file->src && cmp->token < KEYWORD && power < opTable[cmp->token]) {
-        int op     = cmp->token;
-        CNode *rhs = NULL;
-        CNode *bin = NULL;
+    _push_expr(cmp, power);
 
-        bin = new_tree(BINARYEXPR, cmp->file->line);
+    while(cmp->stack->count > base) {
+        switch(state) {
+            case PARSE_OPERAND:
+                state = _prs_prefix(cmp, &tree);
+                break;
+            case PARSE_POSTFIX:
+                state = _prs_postfix(cmp, &tree);
+                break;
+            case PARSE_REDUCE:
+                state = _reduce(cmp, &tree);
+                break;
+        }
+    }
 
-        lex(cmp);
+    return tree;
+}
 
-        if(op == '=' || op >= TK_ADD_EQ && op <= TK_OR_EQ) {
-            bin->kind = ASSIGN;
-            rhs       = prs_expr(cmp, opTable[op] - 1);
-        }
-        else
-            rhs = prs_expr(cmp, opTable[op]);
+static void _push_expr(CCompiler *cmp, int power)
+{
+    CFrame *frame;
+
+    frame       = push_frame(cmp->stack, NULL);
+    frame->kind = FRAME_BINARY;
+    frame->step = power;
+}
+
+/*
+ * Hands the complete operand 'tree' to the frame on top of the stack and
+ * tells what has to be parsed next.
+ */
+static ParseState _reduce(CCompiler *cmp, CNode **tree)
+{
+    CFrame *frame = top_frame(cmp->stack);
+    CNode  *node  = frame->tree;
+    CNode  *bin;
+    int     op;
+
+    switch(frame->kind) {
+        case FRAME_BINARY:
+            if((bin = frame->data)) {
+                bin->bin.rhs = *tree;
+                *tree        = fold_tree(cmp, bin);
+            }
+
+            if(!*cmp->file->src || cmp->token >= KEYWORD || frame->step >= opTable[cmp->token]) {
+                pop_frame(cmp->stack);
+                return PARSE_REDUCE;
+            }
+
+            op           = cmp->token;
+            bin          = new_tree(BINARYEXPR, cmp->file->line);
+            bin->bin.lhs = *tree;
+            bin->bin.op  = op;
+            frame->data  = bin;
+
+            lex(cmp);
+
+            if(op == '=' || (op >= TK_ADD_EQ && op <= TK_OR_EQ) || op == TK_MOD_EQ) {
+                bin->kind = ASSIGN;
+                _push_expr(cmp, opTable[op] - 1);
+            }
+            else
+                _push_expr(cmp, opTable[op]);
+            return PARSE_OPERAND;
+        case FRAME_UNARY:
+            node->unary.base = *tree;
+            pop_frame(cmp->stack);
+
+            if(node->kind == PREFIX || node->kind == ADDROF) {
+                if(*tree && ((*tree)->kind == POSTFIX || (*tree)->kind == PREFIX))
+                    error(cmp, 0, "Invalid expression\n");
+                *tree = node;
+            }
+            else
+                *tree = fold_tree(cmp, node);
+            return PARSE_POSTFIX;
+        case FRAME_PAREN:
+            pop_frame(cmp->stack);
+            accept(cmp, ')');
+            return PARSE_POSTFIX;
+        case FRAME_CALL:
+            *(CNode **)frame->data = *tree;
 
-        bin->bin.lhs = lhs;
-        bin->bin.rhs = rhs;
-        bin->bin.op  = op;
+            if(*tree)
+                frame->data = &(*tree)->next_stmt;
 
-        lhs          = bin;
+            if(cmp->token == ',' && *cmp->file->src && lex(cmp) != ')') {
+                node->fncall.count++;
+                _push_expr(cmp, opTable[',']);
+                return PARSE_OPERAND;
+            }
+
+            pop_frame(cmp->stack);
+            *tree = node;
+            lex(cmp);
+            return PARSE_POSTFIX;
+        case FRAME_INDEX:
+            node->unary.base = *tree;
+            pop_frame(cmp->stack);
+            expect(cmp, ']');
+            *tree = node;
+            lex(cmp);
+            return PARSE_POSTFIX;
+        case FRAME_SIZEOF:
+            node->_sizeof.expr = *tree;
+            if(frame->step)
+                accept(cmp, ')');
+            pop_frame(cmp->stack);
+            *tree = node;
+            return PARSE_POSTFIX;
     }
 
-    return lhs;
+    return PARSE_REDUCE;
 }
 
-static CNode *_prs_prefix(CCompiler *cmp)
+static ParseState _prs_prefix(CCompiler *cmp, CNode **tree)
 {
-    CNode   *tree = NULL;
+    CFrame  *frame;
     uint64_t u    = 0;
 
-    if(!cmp)
-        return NULL;
-
     switch(cmp->token) {
         case TK_INT:
-            tree       = new_tree(LITERAL, cmp->file->line);
-            tree->misc = new_misc(MISC_CONSTANT_INT);
-
-            tree->misc->val = cmp->misc.val;
-            u               = cmp->misc.val;
-
-            if(tree->misc->val >= INT_MIN && tree->misc->val <= INT_MAX)
-                tree->type = cmp_primitives[INT];
-            else if(u <= UINT_MAX && tree->misc->val >= 0)
-                tree->type = cmp_primitives[UINT];
-            else if(tree->misc->val >= LLONG_MIN && tree->misc->val <= LLONG_MAX)
-                tree->type = cmp_primitives[LONG];
-            else if(u <= ULLONG_MAX && tree->misc->val >= 0)
-                tree->type = cmp_primitives[ULONG];
+            *tree         = new_tree(LITERAL, cmp->file->line);
+            (*tree)->misc = new_misc(MISC_CONSTANT_INT);
+
+            (*tree)->misc->val = cmp->misc.val;
+            u                  = cmp->misc.val;
+
+            if((*tree)->misc->val >= INT_MIN && (*tree)->misc->val <= INT_MAX)
+                (*tree)->type = cmp_primitives[INT];
+            else if(u <= UINT_MAX && (*tree)->misc->val >= 0)
+                (*tree)->type = cmp_primitives[UINT];
+            else if((*tree)->misc->val >= LLONG_MIN && (*tree)->misc->val <= LLONG_MAX)
+                (*tree)->type = cmp_primitives[LONG];
+            else if(u <= ULLONG_MAX && (*tree)->misc->val >= 0)
+                (*tree)->type = cmp_primitives[ULONG];
             lex(cmp);
-            break;
+            return PARSE_POSTFIX;
         case TK_ID:
-            tree            = new_tree(IDENTIFIER, cmp->file->line);
-            tree->misc      = new_misc(MISC_ID);
-            tree->misc->str = cmp->misc.str;
+            *tree              = new_tree(IDENTIFIER, cmp->file->line);
+            (*tree)->misc      = new_misc(MISC_ID);
+            (*tree)->misc->str = cmp->misc.str;
             lex(cmp);
-            break;
+            return PARSE_POSTFIX;
         case TK_PP:
         case TK_MM:
-            tree = new_tree(PREFIX, cmp->file->line);
-            tree->unary.op = cmp->token;
+            frame                 = push_frame(cmp->stack, new_tree(PREFIX, cmp->file->line));
+            frame->kind           = FRAME_UNARY;
+            frame->tree->unary.op = cmp->token;
             lex(cmp);
-            tree->unary.base = _prs_prefix(cmp);
-            if(tree->unary.base && tree->unary.base->kind == POSTFIX || tree->unary.base->kind == PREFIX)
-                error(cmp, 0, "Invalid expression\n");
-            break;
+            return PARSE_OPERAND;
         case '&':
-            tree = new_tree(ADDROF, cmp->file->line);
-            lex(cmp);
-            tree->unary.base = _prs_prefix(cmp);
-            if(tree->unary.base && tree->unary.base->kind == POSTFIX || tree->unary.base->kind == PREFIX)
-                error(cmp, 0, "Invalid expression\n");
-            break;
+            return _prs_unary(cmp, ADDROF);
         case '*':
-            tree = _prs_unary(cmp, DEREFERENCE);
-            break;
+            return _prs_unary(cmp, DEREFERENCE);
         case '-':
-            tree = _prs_unary(cmp, MINUS);
-            break;
+            return _prs_unary(cmp, MINUS);
         case '+':
-            tree = _prs_unary(cmp, MINUS);
-            break;
+            return _prs_unary(cmp, PLUS);
         case '(':
             lex(cmp);
-            tree = prs_expr(cmp, 0);
-            accept(cmp, ')');
-            break;
+            push_frame(cmp->stack, NULL)->kind = FRAME_PAREN;
+            _push_expr(cmp, 0);
+            return PARSE_OPERAND;
         case KW_SIZEOF:
-            tree = _prs_sizeof(cmp);
-            break;
+            return _prs_sizeof(cmp, tree);
         case TK_FLOAT:
-            tree             = new_tree(LITERAL, cmp->file->line);
-            tree->misc       = new_misc(MISC_CONSTANT_FLOAT);
-            tree->type       = cmp_primitives[FLOAT];
-            tree->misc->fval = cmp->misc.fval;
+            *tree               = new_tree(LITERAL, cmp->file->line);
+            (*tree)->misc       = new_misc(MISC_CONSTANT_FLOAT);
+            (*tree)->type       = cmp_primitives[FLOAT];
+            (*tree)->misc->fval = cmp->misc.fval;
             lex(cmp);
-            break;
+            return PARSE_POSTFIX;
         case TK_DOUBLE:
-            tree             = new_tree(LITERAL, cmp->file->line);
-            tree->misc       = new_misc(MISC_CONSTANT_FLOAT);
-            tree->type       = cmp_primitives[DOUBLE];
-            tree->misc->dval = cmp->misc.dval;
+            *tree               = new_tree(LITERAL, cmp->file->line);
+            (*tree)->misc       = new_misc(MISC_CONSTANT_FLOAT);
+            (*tree)->type       = cmp_primitives[DOUBLE];
+            (*tree)->misc->dval = cmp->misc.dval;
             lex(cmp);
-            break;
+            return PARSE_POSTFIX;
         case '!':
-            tree = _prs_unary(cmp, NOT);
-            break;
+            return _prs_unary(cmp, NOT);
         case '~':
-            tree = _prs_unary(cmp, NEGATION);
-            break;
+            return _prs_unary(cmp, NEGATION);
         default:
             error(cmp, 0, "Expression expected\n");
             lex(cmp);
-            break;
+            *tree = NULL;
+            return PARSE_POSTFIX;
     }
-
-    return _prs_postfix(cmp, tree);
 }
 
-static CNode *_prs_sizeof(CCompiler *cmp)
+static ParseState _prs_sizeof(CCompiler *cmp, CNode **tree)
 {
-    CNode      *tree   = NULL;
+    CFrame     *frame;
     const char *name   = NULL;
     int         sclass = 0;
     int         typeq  = 0;
+    bool        paren  = false;
 
-    if(!cmp)
-        return NULL;
-
-    tree = new_tree(SIZEOF, cmp->file->line);
+    *tree = new_tree(SIZEOF, cmp->file->line);
 
     lex(cmp);
 
-    if(cmp->token != '(') {
-        tree->_sizeof.expr = prs_expr(cmp, 0);
-        return tree;
-    }
+    if(cmp->token == '(') {
+        paren = true;
+        accept(cmp, '(');
 
-    accept(cmp, '(');
+        if(is_typename(cmp) || is_typequalifier(cmp)) {
+            cmp->flags |= COMPILER_FLAG_DONT_NEED_ID;
+            (*tree)->_sizeof.type = prs_decl_lvl0(cmp, &sclass, &typeq);
+            (*tree)->_sizeof.type = prs_decl_lvl1(cmp, (*tree)->_sizeof.type, &name);
+            cmp->flags &= ~COMPILER_FLAG_DONT_NEED_ID;
 
-    if(!is_typename(cmp) && !is_typequalifier(cmp)) {
-        tree->_sizeof.expr = prs_expr(cmp, 0);
-        accept(cmp, ')');
-        return tree;
-    }
-    cmp->flags |= COMPILER_FLAG_DONT_NEED_ID;
-    tree->_sizeof.type = prs_decl_lvl0(cmp, &sclass, &typeq);
-    tree->_sizeof.type = prs_decl_lvl1(cmp, tree->_sizeof.type, &name);
-    cmp->flags &= ~COMPILER_FLAG_DONT_NEED_ID;
+            accept(cmp, ')');
+
+            if(name)
+                error(cmp, 0, "Cannot have a name here\n");
 
-    accept(cmp, ')');
+            if(sclass)
+                error(cmp, 0, "Cannot specify a storage class here\n");
 
-    if(name)
-        error(cmp, 0, "Cannot have a name here\n");
+            return PARSE_POSTFIX;
+        }
+    }
 
-    if(sclass)
-        error(cmp, 0, "Cannot specify a storage class here\n");
+    frame       = push_frame(cmp->stack, *tree);
+    frame->kind = FRAME_SIZEOF;
+    frame->step = paren;
 
-    return tree;
+    // 'sizeof x + 1' is '(sizeof x) + 1', only a parenthesised operand is a full expression
+    if(paren)
+        _push_expr(cmp, 0);
+
+    return PARSE_OPERAND;
 }
 
-static CNode *_prs_postfix(CCompiler *cmp, CNode *base)
+static ParseState _prs_postfix(CCompiler *cmp, CNode **tree)
 {
-    CNode *left;
     CNode *tmp;
 
-    if(!cmp || !base)
-        return NULL;
-
-    left = base;
+    if(!*tree)
+        return PARSE_REDUCE;
 
     while(*cmp->file->src) {
         switch(cmp->token) {
             case TK_PP:
             case TK_MM:
-                if(left->kind == POSTFIX || left->kind == PREFIX)
+                if((*tree)->kind == POSTFIX || (*tree)->kind == PREFIX)
                     error(cmp, 0, "Invalid expression\n");
                 tmp = new_tree(POSTFIX, cmp->file->line);
-                tmp->unary.base = left;
+                tmp->unary.base = *tree;
                 tmp->unary.op   = cmp->token;
-                left            = tmp;
+                *tree           = tmp;
                 break;
             case '(':
-                left = _prs_fn_call(cmp, left);
-                break;
+                return _prs_fn_call(cmp, tree);
             case '[':
-                left = _prs_array_access(cmp, left);
-                break;
+                return _prs_array_access(cmp);
             case '.':
-                left = _prs_member_access(cmp, left);
+                *tree = _prs_member_access(cmp, *tree);
                 break;
             case TK_ARROW:
-                left = _prs_member_ptr_access(cmp, left);
+                *tree = _prs_member_ptr_access(cmp, *tree);
                 break;
             default:
-                return left;
+                return PARSE_REDUCE;
         }
         lex(cmp);
     }
+
+    return PARSE_REDUCE;
 }
 
-static CNode *_prs_fn_call(CCompiler *cmp, CNode *base)
+static ParseState _prs_fn_call(CCompiler *cmp, CNode **tree)
 {
-    CNode *tree;
-    CNode **ptr;
-    
-    if(!cmp || !base)
-        return NULL;
+    CFrame *frame;
+    CNode  *call;
 
-    tree = new_tree(FNCALL, cmp->file->line);
+    call = new_tree(FNCALL, cmp->file->line);
 
-    tree->fncall.base = base;
-    ptr = &tree->fncall.args;
+    call->fncall.base = *tree;
+    *tree             = call;
 
-    while(*cmp->file->src && lex(cmp) != ')') {
-        tree->fncall.count++;
-        *ptr = prs_expr(cmp, 0);
-        if(*ptr)
-            ptr = &(*ptr)->next_stmt;
-        if(cmp->token != ',')
-            break;
+    if(!*cmp->file->src || lex(cmp) == ')') {
+        lex(cmp);
+        return PARSE_POSTFIX;
     }
 
-    return tree;
+    call->fncall.count++;
+
+    frame       = push_frame(cmp->stack, call);
+    frame->kind = FRAME_CALL;
+    frame->data = &call->fncall.args;
+
+    _push_expr(cmp, opTable[',']);
+
+    return PARSE_OPERAND;
 }
 
-static CNode *_prs_array_access(CCompiler *cmp, CNode *base)
+static ParseState _prs_array_access(CCompiler *cmp)
 {
-    CNode *tree;
+    CFrame *frame;
 
-    if(!cmp || !base)
-        return NULL;
-
-    tree = new_tree(ARRAY_ACCESS, cmp->file->line);
+    frame       = push_frame(cmp->stack, new_tree(ARRAY_ACCESS, cmp->file->line));
+    frame->kind = FRAME_INDEX;
 
     lex(cmp);
 
-    tree->unary.base = prs_expr(cmp, 0);
+    _push_expr(cmp, 0);
 
-    expect(cmp, ']');
-
-    return tree;
+    return PARSE_OPERAND;
 }
 
 static CNode *_prs_member_access(CCompiler *cmp, CNode *base)
@@ -309,13 +408,14 @@ static CNode *_prs_member_ptr_access(CCompiler *cmp, CNode *base)
     return tree;
 }
 
-static CNode *_prs_unary(CCompiler *cmp, TreeKind kind)
+static ParseState _prs_unary(CCompiler *cmp, TreeKind kind)
 {
-    CNode *tree;
+    CFrame *frame;
+
+    frame       = push_frame(cmp->stack, new_tree(kind, cmp->file->line));
+    frame->kind = FRAME_UNARY;
 
-    tree = new_tree(kind, cmp->file->line);
     lex(cmp);
-    tree->unary.base = _prs_prefix(cmp);
 
-    return tree;
+    return PARSE_OPERAND;
 }
@@ -0,0 +1,739 @@
+#include "compiler.h"
+#include "misc.h"
+
+static CNode *_fold_bin(CCompiler *cmp, CNode *tree);
+static CNode *_fold_unary(CCompiler *cmp, CNode *tree);
+static bool   _fold_int(CCompiler *cmp, int op, CType *type, int64_t a, int64_t b, int64_t *out, size_t line);
+static bool   _fold_shift(CCompiler *cmp, int op, CType *type, int64_t a, int64_t b, int64_t *out, size_t line);
+static bool   _fold_float(int op, CType *type, double a, double b, double *out);
+static bool   _fold_compare(int op, CNode *lhs, CNode *rhs, int64_t *out);
+static int64_t _compare_int(int op, CType *type, int64_t a, int64_t b);
+
+static bool    _is_literal(CNode *tree);
+static bool    _is_float(CType *type);
+static bool    _is_unsigned(CType *type);
+static bool    _is_true(CNode *tree);
+static CType  *_arith_type(CType *t1, CType *t2);
+static double  _to_double(CNode *tree);
+static int64_t _to_int(CNode *tree, CType *to);
+static int64_t _truncate(CType *type, int64_t val);
+static void    _set_literal(CNode *tree, CType *type, int64_t ival, double fval);
+
+static bool    _known(CCompiler *cmp, CNode *tree, bool hit, bool *ok, int64_t *out);
+static CNode  *_eval_step(CCompiler *cmp, CFrame *frame);
+static bool    _short_circuits(CNode *tree, int64_t a);
+static bool    _eval_unary(CCompiler *cmp, CNode *tree, int64_t a, int64_t *out);
+static bool    _eval_bin(CCompiler *cmp, CNode *tree, int64_t a, int64_t b, int64_t *out);
+static bool    _is_integer(CType *type);
+
+typedef struct CEval CEval;
+
+struct CEval {
+    CNode  *node;
+    int64_t val;
+    bool    ok;
+};
+
+struct CEvalCache {
+    CEval  *entries;
+    size_t  capacity;
+    size_t  count;
+};
+
+static CEval  *_lookup(CCompiler *cmp, CNode *tree);
+
+/*
+ * Folds a BINARYEXPR or unary node whose operands are literals into a single
+ * LITERAL node. The returned node replaces 'tree'; if nothing can be folded
+ * 'tree' itself is returned untouched.
+ */
+CNode *fold_tree(CCompiler *cmp, CNode *tree)
+{
+    if(!cmp || !tree)
+        return tree;
+
+    switch(tree->kind) {
+        case BINARYEXPR:
+            return _fold_bin(cmp, tree);
+        case MINUS:
+        case PLUS:
+        case NOT:
+        case NEGATION:
+            return _fold_unary(cmp, tree);
+        default:
+            return tree;
+    }
+}
+
+/*
+ * Same as fold_tree() but rewrites 'tree' itself, for callers that cannot
+ * replace the node in its parent (e.g. the semantic analyser). Nothing is
+ * reported: the parser already warned about what it could not fold.
+ */
+bool fold_in_place(CCompiler *cmp, CNode *tree)
+{
+    CNode *folded;
+    CNode *next, *next_stmt;
+
+    if(!cmp || !tree)
+        return false;
+
+    cmp->flags |= COMPILER_FLAG_QUIET_FOLD;
+
+    folded = fold_tree(cmp, tree);
+
+    cmp->flags &= ~COMPILER_FLAG_QUIET_FOLD;
+
+    if(folded == tree)
+        return false;
+
+    next      = tree->next;
+    next_stmt = tree->next_stmt;
+
+    *tree = *folded;
+
+    tree->next      = next;
+    tree->next_stmt = next_stmt;
+
+    return true;
+}
+
+/*
+ * Evaluates an integer constant expression (array dimensions, case labels).
+ * 'tree' must have been analysed. Results, including failures, are cached
+ * per node so the same expression is never walked twice.
+ *
+ * Like the parser, the walk uses cmp->stack instead of recursing: a frame
+ * is pushed for each node whose value is not known yet. The frame takes
+ * the values of its operands from the cache once they are evaluated.
+ */
+bool eval_constant(CCompiler *cmp, CNode *tree, int64_t *out)
+{
+    size_t base;
+    bool   ok = false;
+
+    if(!cmp || !tree || !out)
+        return false;
+
+    *out = 0;
+
+    if(_known(cmp, tree, true, &ok, out))
+        return ok;
+
+    base = cmp->stack->count;
+
+    push_frame(cmp->stack, tree);
+
+    while(cmp->stack->count > base) {
+        CNode *next = _eval_step(cmp, top_frame(cmp->stack));
+
+        if(next)
+            push_frame(cmp->stack, next);
+        else
+            pop_frame(cmp->stack);
+    }
+
+    _known(cmp, tree, false, &ok, out);
+
+    return ok;
+}
+
+/*
+ * The value of a literal, or of a node already evaluated. False when it
+ * still has to be. 'hit' counts the cache hit.
+ */
+static bool _known(CCompiler *cmp, CNode *tree, bool hit, bool *ok, int64_t *out)
+{
+    CEval *entry;
+
+    if(tree->kind == LITERAL) { // not cached
+        *ok = _is_integer(tree->type) && tree->misc->kind == MISC_CONSTANT_INT;
+
+        if(*ok)
+            *out = tree->misc->val;
+        return true;
+    }
+
+    entry = _lookup(cmp, tree);
+
+    if(entry->node != tree)
+        return false;
+
+    cmp->eval_hits += hit;
+
+    *ok  = entry->ok;
+    *out = entry->val;
+
+    return true;
+}
+
+/*
+ * Evaluates the node of 'frame' once the values of its operands are
+ * known, and caches the result. Returns NULL when done, or the first
+ * operand that still has to be evaluated. 'step' counts the operands
+ * already looked up.
+ */
+static CNode *_eval_step(CCompiler *cmp, CFrame *frame)
+{
+    CNode  *tree        = frame->tree;
+    CNode  *operands[2] = {NULL, NULL};
+    int64_t vals[2]     = {0, 0};
+    int64_t val         = 0;
+    size_t  count       = 0;
+    bool    ok          = _is_integer(tree->type);
+    CEval  *entry;
+
+    switch(tree->kind) {
+        case PLUS:
+        case MINUS:
+        case NEGATION:
+        case NOT:
+            operands[count++] = tree->unary.base;
+            break;
+        case BINARYEXPR:
+            operands[count++] = tree->bin.lhs;
+            operands[count++] = tree->bin.rhs;
+            break;
+        default:
+            ok = false;
+            break;
+    }
+
+    for(size_t i = 0; i < count; i++)
+        ok = ok && operands[i] && _is_integer(operands[i]->type);
+
+    for(size_t i = 0; ok && i < count; i++) {
+        // only the evaluated operand of && and || has to be constant
+        if(i && _short_circuits(tree, vals[0]))
+            break;
+
+        if(!_known(cmp, operands[i], i >= (size_t)frame->step, &ok, &vals[i])) {
+            frame->step = (int)i + 1;
+            return operands[i];
+        }
+
+        frame->step = (int)i + 1;
+    }
+
+    if(ok)
+        ok = tree->kind == BINARYEXPR ? _eval_bin(cmp, tree, vals[0], vals[1], &val) : _eval_unary(cmp, tree, vals[0], &val);
+
+    entry = _lookup(cmp, tree);
+
+    entry->node = tree;
+    entry->val  = ok ? val : 0;
+    entry->ok   = ok;
+
+    cmp->evals->count++;
+
+    return NULL;
+}
+
+static bool _short_circuits(CNode *tree, int64_t a)
+{
+    return tree->kind == BINARYEXPR && ((tree->bin.op == TK_ANDAND && !a) || (tree->bin.op == TK_OROR && a));
+}
+
+static bool _eval_unary(CCompiler *cmp, CNode *tree, int64_t a, int64_t *out)
+{
+    switch(tree->kind) {
+        case PLUS:
+            *out = a;
+            return true;
+        case MINUS:
+            return _fold_int(cmp, '-', _arith_type(tree->type, tree->type), 0, a, out, tree->line);
+        case NEGATION:
+            *out = _truncate(_arith_type(tree->type, tree->type), ~a);
+            return true;
+        case NOT:
+            *out = !a;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool _eval_bin(CCompiler *cmp, CNode *tree, int64_t a, int64_t b, int64_t *out)
+{
+    CNode *lhs = tree->bin.lhs;
+    CNode *rhs = tree->bin.rhs;
+    CType *type;
+
+    if(_short_circuits(tree, a)) {
+        *out = tree->bin.op == TK_OROR;
+        return true;
+    }
+
+    type = _arith_type(lhs->type, rhs->type);
+
+    switch(tree->bin.op) {
+        case '+':
+        case '-':
+        case '*':
+        case '/':
+        case '%':
+        case '&':
+        case '|':
+        case '^':
+            return _fold_int(cmp, tree->bin.op, type, _truncate(type, a), _truncate(type, b), out, tree->line);
+        case TK_SHL:
+        case TK_SHR:
+            type = _arith_type(lhs->type, lhs->type);
+            return _fold_shift(cmp, tree->bin.op, type, _truncate(type, a), b, out, tree->line);
+        case '<':
+        case '>':
+        case TK_LE:
+        case TK_GE:
+        case TK_EQ_EQ:
+        case TK_NOT_EQ:
+            *out = _compare_int(tree->bin.op, type, _truncate(type, a), _truncate(type, b));
+            return true;
+        case TK_ANDAND:
+        case TK_OROR:
+            *out = b != 0;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static CEval *_lookup(CCompiler *cmp, CNode *tree)
+{
+    CEvalCache *cache = cmp->evals;
+    size_t      idx;
+
+    // keyed on AST nodes, so it lives in the AST arena and is dropped with them
+    if(!cache) {
+        cache           = (CEvalCache *)zalloc(sizeof(CEvalCache), ARENA_2);
+        cache->capacity = 64;
+        cache->count    = 0;
+        cache->entries  = (CEval *)zalloc(sizeof(CEval) * cache->capacity, ARENA_2);
+        memset(cache->entries, 0, sizeof(CEval) * cache->capacity);
+        cmp->evals      = cache;
+    }
+
+    if((cache->count + 1) * 2 > cache->capacity) {
+        CEval  *old      = cache->entries;
+        size_t  capacity = cache->capacity;
+
+        cache->capacity *= 2;
+        cache->entries   = (CEval *)zalloc(sizeof(CEval) * cache->capacity, ARENA_2);
+        memset(cache->entries, 0, sizeof(CEval) * cache->capacity);
+
+        for(size_t i = 0; i < capacity; i++) {
+            if(!old[i].node)
+                continue;
+            idx = ((uintptr_t)old[i].node >> 4) & (cache->capacity - 1);
+            while(cache->entries[idx].node)
+                idx = (idx + 1) & (cache->capacity - 1);
+            cache->entries[idx] = old[i];
+        }
+    }
+
+    idx = ((uintptr_t)tree >> 4) & (cache->capacity - 1);
+
+    while(cache->entries[idx].node && cache->entries[idx].node != tree)
+        idx = (idx + 1) & (cache->capacity - 1);
+
+    return &cache->entries[idx];
+}
+
+static CNode *_fold_bin(CCompiler *cmp, CNode *tree)
+{
+    CNode  *lhs = tree->bin.lhs;
+    CNode  *rhs = tree->bin.rhs;
+    CType  *type;
+    int64_t ival = 0;
+    double  fval = 0;
+
+    if(!_is_literal(lhs) || !_is_literal(rhs))
+        return tree;
+
+    type = _arith_type(lhs->type, rhs->type);
+
+    switch(tree->bin.op) {
+        case '+':
+        case '-':
+        case '*':
+        case '/':
+            if(_is_float(type)) {
+                if(!_fold_float(tree->bin.op, type, _to_double(lhs), _to_double(rhs), &fval))
+                    return tree;
+                break;
+            }
+        // fall through
+        case '%':
+        case '&':
+        case '|':
+        case '^':
+            if(_is_float(type))
+                return tree; // reported by the semantic analyser
+            if(!_fold_int(cmp, tree->bin.op, type, _to_int(lhs, type), _to_int(rhs, type), &ival, tree->line))
+                return tree;
+            break;
+        case TK_SHL:
+        case TK_SHR:
+            if(_is_float(lhs->type) || _is_float(rhs->type))
+                return tree;
+            type = _arith_type(lhs->type, lhs->type);
+            if(!_fold_shift(cmp, tree->bin.op, type, _to_int(lhs, type), _to_int(rhs, rhs->type), &ival, tree->line))
+                return tree;
+            break;
+        case '<':
+        case '>':
+        case TK_LE:
+        case TK_GE:
+        case TK_EQ_EQ:
+        case TK_NOT_EQ:
+            type = cmp_primitives[INT];
+            _fold_compare(tree->bin.op, lhs, rhs, &ival);
+            break;
+        case TK_ANDAND:
+            type = cmp_primitives[INT];
+            ival = _is_true(lhs) && _is_true(rhs);
+            break;
+        case TK_OROR:
+            type = cmp_primitives[INT];
+            ival = _is_true(lhs) || _is_true(rhs);
+            break;
+        default:
+            return tree;
+    }
+
+    _set_literal(lhs, type, ival, fval);
+
+    lhs->line = tree->line;
+
+    cmp->folded_nodes += 2;
+
+    return lhs;
+}
+
+static CNode *_fold_unary(CCompiler *cmp, CNode *tree)
+{
+    CNode  *base = tree->unary.base;
+    CType  *type;
+    int64_t ival = 0;
+    double  fval = 0;
+
+    if(!_is_literal(base))
+        return tree;
+
+    type = _arith_type(base->type, base->type);
+
+    switch(tree->kind) {
+        case PLUS:
+            if(_is_float(type))
+                fval = _to_double(base);
+            else
+                ival = _to_int(base, type);
+            break;
+        case MINUS:
+            if(_is_float(type)) {
+                fval = -_to_double(base);
+                break;
+            }
+            if(_is_unsigned(type))
+                return tree; // reported by the semantic analyser
+            if(!_fold_int(cmp, '-', type, 0, _to_int(base, type), &ival, tree->line))
+                return tree;
+            break;
+        case NEGATION:
+            if(_is_float(type))
+                return tree;
+            ival = _truncate(type, ~_to_int(base, type));
+            break;
+        case NOT:
+            type = cmp_primitives[INT];
+            ival = !_is_true(base);
+            break;
+        default:
+            return tree;
+    }
+
+    _set_literal(base, type, ival, fval);
+
+    base->line = tree->line;
+
+    cmp->folded_nodes++;
+
+    return base;
+}
+
+static bool _fold_int(CCompiler *cmp, int op, CType *type, int64_t a, int64_t b, int64_t *out, size_t line)
+{
+    int64_t r = 0;
+    bool    overflow = false;
+
+    if((op == '/' || op == '%') && !b) {
+        if(!(cmp->flags & COMPILER_FLAG_QUIET_FOLD))
+            warn(cmp, line, "Division by zero\n");
+        return false;
+    }
+
+    if(_is_unsigned(type)) {
+        uint64_t ua = (uint64_t)a, ub = (uint64_t)b;
+
+        switch(op) {
+            case '+': r = (int64_t)(ua + ub); break;
+            case '-': r = (int64_t)(ua - ub); break;
+            case '*': r = (int64_t)(ua * ub); break;
+            case '/': r = (int64_t)(ua / ub); break;
+            case '%': r = (int64_t)(ua % ub); break;
+            case '&': r = (int64_t)(ua & ub); break;
+            case '|': r = (int64_t)(ua | ub); break;
+            case '^': r = (int64_t)(ua ^ ub); break;
+        }
+
+        *out = _truncate(type, r);
+        return true;
+    }
+
+    switch(op) {
+        case '+':
+            r        = (int64_t)((uint64_t)a + (uint64_t)b);
+            overflow = ((a ^ r) & (b ^ r)) < 0;
+            break;
+        case '-':
+            r        = (int64_t)((uint64_t)a - (uint64_t)b);
+            overflow = ((a ^ b) & (a ^ r)) < 0;
+            break;
+        case '*':
+            r        = (int64_t)((uint64_t)a * (uint64_t)b);
+            overflow = a && (r / a != b || (a == -1 && b == LLONG_MIN));
+            break;
+        case '/':
+        case '%':
+            if(a == LLONG_MIN && b == -1) {
+                overflow = true;
+                break;
+            }
+            r = op == '/' ? a / b : a % b;
+            break;
+        case '&': r = a & b; break;
+        case '|': r = a | b; break;
+        case '^': r = a ^ b; break;
+    }
+
+    if(!overflow && type->size < sizeof(int64_t))
+        overflow = r != _truncate(type, r);
+
+    if(overflow) {
+        if(!(cmp->flags & COMPILER_FLAG_QUIET_FOLD))
+            warn(cmp, line, "Integer overflow in constant expression\n");
+        return false;
+    }
+
+    *out = r;
+
+    return true;
+}
+
+static bool _fold_shift(CCompiler *cmp, int op, CType *type, int64_t a, int64_t b, int64_t *out, size_t line)
+{
+    size_t   bits = type->size * CHAR_BIT;
+    uint64_t r;
+
+    if(b < 0 || (uint64_t)b >= bits) {
+        if(!(cmp->flags & COMPILER_FLAG_QUIET_FOLD))
+            warn(cmp, line, "Shift count out of range\n");
+        return false;
+    }
+
+    if(op == TK_SHR) {
+        if(_is_unsigned(type))
+            *out = _truncate(type, (int64_t)((uint64_t)_truncate(type, a) >> b));
+        else
+            *out = a >> b;
+        return true;
+    }
+
+    r = (uint64_t)a << b;
+
+    if(!_is_unsigned(type) && (a < 0 || (int64_t)(r >> b) != a || _truncate(type, r) != (int64_t)r || (int64_t)r < 0)) {
+        if(!(cmp->flags & COMPILER_FLAG_QUIET_FOLD))
+            warn(cmp, line, "Integer overflow in constant expression\n");
+        return false;
+    }
+
+    *out = _truncate(type, (int64_t)r);
+
+    return true;
+}
+
+static bool _fold_float(int op, CType *type, double a, double b, double *out)
+{
+    if(op == '/' && b == 0)
+        return false;
+
+    if(type->kind == FLOAT) {
+        float fa = (float)a, fb = (float)b;
+
+        switch(op) {
+            case '+': *out = fa + fb; return true;
+            case '-': *out = fa - fb; return true;
+            case '*': *out = fa * fb; return true;
+            case '/': *out = fa / fb; return true;
+        }
+        return false;
+    }
+
+    switch(op) {
+        case '+': *out = a + b; return true;
+        case '-': *out = a - b; return true;
+        case '*': *out = a * b; return true;
+        case '/': *out = a / b; return true;
+    }
+
+    return false;
+}
+
+static bool _fold_compare(int op, CNode *lhs, CNode *rhs, int64_t *out)
+{
+    CType *type = _arith_type(lhs->type, rhs->type);
+
+    if(_is_float(type)) {
+        double a = _to_double(lhs), b = _to_double(rhs);
+
+        switch(op) {
+            case '<':       *out = a <  b; return true;
+            case '>':       *out = a >  b; return true;
+            case TK_LE:     *out = a <= b; return true;
+            case TK_GE:     *out = a >= b; return true;
+            case TK_EQ_EQ:  *out = a == b; return true;
+            case TK_NOT_EQ: *out = a != b; return true;
+        }
+        return false;
+    }
+
+    *out = _compare_int(op, type, _to_int(lhs, type), _to_int(rhs, type));
+
+    return true;
+}
+
+static int64_t _compare_int(int op, CType *type, int64_t a, int64_t b)
+{
+    int cmp;
+
+    if(_is_unsigned(type))
+        cmp = ((uint64_t)a > (uint64_t)b) - ((uint64_t)a < (uint64_t)b);
+    else
+        cmp = (a > b) - (a < b);
+
+    switch(op) {
+        case '<':       return cmp <  0;
+        case '>':       return cmp >  0;
+        case TK_LE:     return cmp <= 0;
+        case TK_GE:     return cmp >= 0;
+        case TK_EQ_EQ:  return cmp == 0;
+        case TK_NOT_EQ: return cmp != 0;
+    }
+
+    return 0;
+}
+
+static bool _is_literal(CNode *tree)
+{
+    if(!tree || tree->kind != LITERAL || !tree->type || !tree->misc)
+        return false;
+
+    return tree->type->kind > VOID && tree->type->kind < LDOUBLE;
+}
+
+static bool _is_float(CType *type)
+{
+    return type && (type->kind == FLOAT || type->kind == DOUBLE || type->kind == LDOUBLE);
+}
+
+static bool _is_integer(CType *type)
+{
+    return type && type->kind >= CHAR && type->kind <= ULONG;
+}
+
+static bool _is_unsigned(CType *type)
+{
+    if(!type)
+        return false;
+
+    return type->kind == UCHAR || type->kind == USHORT || type->kind == UINT || type->kind == ULONG;
+}
+
+static bool _is_true(CNode *tree)
+{
+    if(_is_float(tree->type))
+        return _to_double(tree) != 0;
+
+    return tree->misc->val != 0;
+}
+
+/*
+ * Usual arithmetic conversions: integer promotion first, then the operand with
+ * the higher rank wins. TypeKind is ordered so that the higher kind is also the
+ * right common type (e.g. 'long' + 'unsigned int' yields 'long').
+ */
+static CType *_arith_type(CType *t1, CType *t2)
+{
+    TypeKind k1 = t1->kind < INT ? INT : t1->kind;
+    TypeKind k2 = t2->kind < INT ? INT : t2->kind;
+
+    return cmp_primitives[k1 > k2 ? k1 : k2];
+}
+
+static double _to_double(CNode *tree)
+{
+    switch(tree->type->kind) {
+        case FLOAT:
+            return tree->misc->fval;
+        case DOUBLE:
+            return tree->misc->dval;
+        case UCHAR:
+        case USHORT:
+        case UINT:
+        case ULONG:
+            return (double)(uint64_t)tree->misc->val;
+        default:
+            return (double)tree->misc->val;
+    }
+}
+
+static int64_t _to_int(CNode *tree, CType *to)
+{
+    if(_is_float(tree->type))
+        return (int64_t)_to_double(tree);
+
+    return _truncate(to, tree->misc->val);
+}
+
+static int64_t _truncate(CType *type, int64_t val)
+{
+    switch(type->size) {
+        case 1:
+            return _is_unsigned(type) ? (int64_t)(uint8_t)val  : (int64_t)(int8_t)val;
+        case 2:
+            return _is_unsigned(type) ? (int64_t)(uint16_t)val : (int64_t)(int16_t)val;
+        case 4:
+            return _is_unsigned(type) ? (int64_t)(uint32_t)val : (int64_t)(int32_t)val;
+        default:
+            return val;
+    }
+}
+
+static void _set_literal(CNode *tree, CType *type, int64_t ival, double fval)
+{
+    tree->type = type;
+
+    switch(type->kind) {
+        case FLOAT:
+            tree->misc->kind = MISC_CONSTANT_FLOAT;
+            tree->misc->fval = (float)fval;
+            return;
+        case DOUBLE:
+            tree->misc->kind = MISC_CONSTANT_FLOAT;
+            tree->misc->dval = fval;
+            return;
+        default:
+            tree->misc->kind = MISC_CONSTANT_INT;
+            tree->misc->val  = ival;
+            return;
+    }
+}
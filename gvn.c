@@ -0,0 +1,375 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * Value numbering over the SSA registers, scoped by the dominator tree:
+ * a computation is keyed on its instruction, its type and the value
+ * numbers of its operands, and if the same key is already available in a
+ * dominating block the register it defines is replaced by the earlier
+ * one. A register's value number is the register it was replaced with,
+ * or itself. Operands of commutative instructions are put in a fixed
+ * order, and GT/GE are keyed as LT/LE with their operands swapped.
+ *
+ * Loads of a symbol are keyed on the memory version as well. A block
+ * whose only predecessor is its immediate dominator continues that
+ * block's version, every other block starts a new one since a store may
+ * be on some path into it. A store kills the loads of its symbol only,
+ * anything else that may write memory starts a new version.
+ *
+ * Entries live on a stack chained into the hash buckets, so leaving a
+ * dominator subtree just pops what it pushed. Constants and symbols are
+ * interned, so an operand is its own key.
+ */
+
+typedef struct CKey        CKey;
+typedef struct CValueEntry CValueEntry;
+typedef struct CScope      CScope;
+
+struct CKey {
+    Instruction kind;
+    CType      *type;
+    COperand    op1;
+    COperand    op2;
+    size_t      memory;
+};
+
+struct CValueEntry {
+    CKey     key;
+    CType   *type;
+    COperand value; // 0 once a store killed the key
+    size_t   bucket;
+    size_t   next;
+};
+
+struct CScope {
+    CBasicBlock *block;
+    size_t       child;
+    size_t       height;
+    size_t       memory;
+};
+
+typedef struct CGVN {
+    CCompiler *cmp;
+    CFunction *fn;
+    COperand  *repl;
+    size_t     repl_count;
+    size_t    *buckets;
+    size_t     bucket_mask;
+    CValueEntry    *entries;
+    size_t     entry_count;
+    size_t     memory;
+    size_t     memory_count;
+} CGVN;
+
+#define NO_ENTRY ((size_t)-1)
+
+static void        _number_block(CGVN *gvn, CBasicBlock *blk);
+static bool        _number_phi(CGVN *gvn, CInstruction *ins);
+static CKey        _key_of(CGVN *gvn, CInstruction *ins);
+static size_t      _hash(const CKey *key);
+static bool        _same_key(const CKey *k1, const CKey *k2);
+static CValueEntry *_find(CGVN *gvn, const CKey *key, size_t bucket);
+static void        _push(CGVN *gvn, const CKey *key, size_t bucket, CType *type, COperand value);
+static COperand    _resolve(CGVN *gvn, COperand arg);
+static size_t      _rewrite(CGVN *gvn);
+
+void number_values(CCompiler *cmp, CFunction *fn)
+{
+    CGVN    gvn;
+    CScope *stack;
+    size_t  top = 0, size, removed;
+
+    if(!cmp || !fn || !fn->entry || !fn->order_count)
+        return;
+
+    memset(&gvn, 0, sizeof(CGVN));
+
+    for(size = 16; size < fn->ins_count * 2; size *= 2)
+        ;
+
+    gvn.cmp         = cmp;
+    gvn.fn          = fn;
+    gvn.repl_count  = fn->vreg_count;
+    gvn.repl        = (COperand *)zalloc(sizeof(COperand) * (fn->vreg_count + 1), ARENA_3);
+    gvn.buckets     = (size_t *)zalloc(sizeof(size_t) * size, ARENA_3);
+    gvn.bucket_mask = size - 1;
+    gvn.entries     = (CValueEntry *)zalloc(sizeof(CValueEntry) * (fn->ins_count + 1), ARENA_3);
+    stack           = (CScope *)zalloc(sizeof(CScope) * fn->order_count, ARENA_3);
+
+    memset(gvn.repl, 0, sizeof(COperand) * fn->vreg_count);
+
+    for(size_t i = 0; i < size; i++)
+        gvn.buckets[i] = NO_ENTRY;
+
+    gvn.memory = gvn.memory_count++;
+
+    _number_block(&gvn, fn->entry);
+
+    stack[top].block    = fn->entry;
+    stack[top].child    = 0;
+    stack[top].height   = 0;
+    stack[top++].memory = gvn.memory;
+
+    while(top) {
+        CScope *scope = &stack[top - 1];
+
+        if(scope->child < scope->block->dom_child_count) {
+            CBasicBlock *child  = scope->block->dom_children[scope->child++];
+            size_t       height = gvn.entry_count;
+
+            // only the end of the dominator is known to be what flows in
+            if(child->pred_count == 1 && child->preds[0] == scope->block)
+                gvn.memory = scope->memory;
+            else
+                gvn.memory = gvn.memory_count++;
+
+            _number_block(&gvn, child);
+
+            stack[top].block    = child;
+            stack[top].child    = 0;
+            stack[top].height   = height;
+            stack[top++].memory = gvn.memory;
+            continue;
+        }
+
+        while(gvn.entry_count > scope->height) {
+            CValueEntry *entry = &gvn.entries[--gvn.entry_count];
+
+            gvn.buckets[entry->bucket] = entry->next;
+        }
+
+        top--;
+    }
+
+    removed = _rewrite(&gvn);
+
+    cmp->opt.redundant += removed;
+
+    if((options & COMPILER_OPTION_STATS) && removed)
+        fprintf(cmp->diag, "gvn('%s'): %ld redundant instructions removed\n", fn->sym->name, removed);
+}
+
+static void _number_block(CGVN *gvn, CBasicBlock *blk)
+{
+    for(size_t i = 0; i < blk->count; i++) {
+        CInstruction *ins = &blk->ins[i];
+        COperand      def;
+        CValueEntry  *entry;
+        CKey          key;
+        size_t        bucket;
+
+        if(ins->kind == INS_PHI) {
+            if(_number_phi(gvn, ins))
+                ins->kind = INS_END_MARK;
+            continue;
+        }
+
+        ins->arg2 = _resolve(gvn, ins->arg2);
+        ins->arg3 = _resolve(gvn, ins->arg3);
+
+        if(ins->kind == INS_RETVAL || ins->kind == INS_STORE)
+            ins->arg1 = _resolve(gvn, ins->arg1);
+
+        if(ins->kind == INS_STORE && OPERAND_KIND(ins->arg1) == OPERAND_SYMBOL) {
+            CInstruction load = {INS_LOAD, 0, ins->arg1, 0, NULL, 0};
+
+            key    = _key_of(gvn, &load);
+            bucket = _hash(&key) & gvn->bucket_mask;
+
+            _push(gvn, &key, bucket, NULL, 0);
+            continue;
+        }
+
+        if(ins_clobbers(ins)) {
+            gvn->memory = gvn->memory_count++;
+            continue;
+        }
+
+        if(!(def = ins_def(ins)) || OPERAND_INDEX(def) >= gvn->repl_count)
+            continue;
+
+        key    = _key_of(gvn, ins);
+        bucket = _hash(&key) & gvn->bucket_mask;
+        entry  = _find(gvn, &key, bucket);
+
+        if(entry && entry->value && entry->type == ins->type) {
+            gvn->repl[OPERAND_INDEX(def)] = entry->value;
+            ins->kind                     = INS_END_MARK;
+            continue;
+        }
+
+        _push(gvn, &key, bucket, ins->type, def);
+    }
+}
+
+/*
+ * A phi whose operands all have the same value number, or are the phi
+ * itself around a loop, is that value.
+ */
+static bool _number_phi(CGVN *gvn, CInstruction *ins)
+{
+    COperand same = 0;
+
+    if(OPERAND_INDEX(ins->arg1) >= gvn->repl_count)
+        return false;
+
+    for(COperand *op = LIST_OF(gvn->fn, ins->arg2); *op; op++) {
+        COperand value = _resolve(gvn, *op);
+
+        if(value == ins->arg1 || value == same)
+            continue;
+
+        if(same || !IS_VREG(value))
+            return false;
+
+        same = value;
+    }
+
+    if(!same)
+        return false;
+
+    gvn->repl[OPERAND_INDEX(ins->arg1)] = same;
+
+    return true;
+}
+
+/*
+ * Loads of a symbol are keyed without their type, so that a store kills
+ * them whatever type they were read with; the type is checked on a hit.
+ */
+static CKey _key_of(CGVN *gvn, CInstruction *ins)
+{
+    CKey     key;
+    COperand tmp;
+
+    memset(&key, 0, sizeof(CKey));
+
+    key.kind = ins->kind;
+    key.type = ins->type;
+    key.op1  = _resolve(gvn, ins->arg2);
+    key.op2  = _resolve(gvn, ins->arg3);
+
+    switch(key.kind) {
+        case INS_LOAD:
+            if(OPERAND_KIND(ins->arg2) == OPERAND_SYMBOL) {
+                key.type   = NULL;
+                key.memory = gvn->memory;
+            }
+            return key;
+        case INS_GT:
+        case INS_GE:
+            key.kind = key.kind == INS_GT ? INS_LT : INS_LE;
+            break;
+        case INS_ADD:
+        case INS_MUL:
+        case INS_AND:
+        case INS_MULH:
+        case INS_EQ:
+        case INS_NE:
+        case INS_OR:
+        case INS_XOR:
+            if(key.op1 <= key.op2)
+                return key;
+            break;
+        default:
+            return key;
+    }
+
+    tmp     = key.op1;
+    key.op1 = key.op2;
+    key.op2 = tmp;
+
+    return key;
+}
+
+static size_t _hash(const CKey *key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t parts[4];
+
+    parts[0] = (uint64_t)key->kind;
+    parts[1] = (uint64_t)(uintptr_t)key->type;
+    parts[2] = (uint64_t)key->op1 << 32 ^ (uint64_t)key->op2;
+    parts[3] = (uint64_t)key->memory;
+
+    for(size_t i = 0; i < 4; i++) {
+        hash ^= parts[i];
+        hash *= 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+
+    return (size_t)hash;
+}
+
+static bool _same_key(const CKey *k1, const CKey *k2)
+{
+    return k1->kind == k2->kind && k1->type == k2->type && k1->memory == k2->memory &&
+           k1->op1 == k2->op1 && k1->op2 == k2->op2;
+}
+
+static CValueEntry *_find(CGVN *gvn, const CKey *key, size_t bucket)
+{
+    for(size_t i = gvn->buckets[bucket]; i != NO_ENTRY; i = gvn->entries[i].next) {
+        if(_same_key(&gvn->entries[i].key, key))
+            return &gvn->entries[i];
+    }
+
+    return NULL;
+}
+
+static void _push(CGVN *gvn, const CKey *key, size_t bucket, CType *type, COperand value)
+{
+    CValueEntry *entry = &gvn->entries[gvn->entry_count];
+
+    entry->key    = *key;
+    entry->type   = type;
+    entry->value  = value;
+    entry->bucket = bucket;
+    entry->next   = gvn->buckets[bucket];
+
+    gvn->buckets[bucket] = gvn->entry_count++;
+}
+
+static COperand _resolve(CGVN *gvn, COperand arg)
+{
+    while(IS_VREG(arg) && OPERAND_INDEX(arg) < gvn->repl_count && gvn->repl[OPERAND_INDEX(arg)])
+        arg = gvn->repl[OPERAND_INDEX(arg)];
+
+    return arg;
+}
+
+/*
+ * Points the uses that were not seen in dominator order, phi operands
+ * coming around a loop, at their value numbers and drops the
+ * instructions that were replaced.
+ */
+static size_t _rewrite(CGVN *gvn)
+{
+    CFunction *fn    = gvn->fn;
+    size_t     count = 0;
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk  = fn->blocks[i];
+        size_t       kept = 0;
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand     *use;
+
+            if(ins->kind == INS_END_MARK) {
+                count++;
+                continue;
+            }
+
+            for(size_t n = 0; (use = ins_use(fn, ins, n)); n++)
+                *use = _resolve(gvn, *use);
+
+            blk->ins[kept++] = *ins;
+        }
+
+        fn->ins_count -= blk->count - kept;
+        blk->count     = kept;
+    }
+
+    return count;
+}
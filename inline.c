@@ -0,0 +1,888 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * Inlining over the IR of the whole unit ('-O'), once every function has
+ * been generated and optimised. Functions are visited callees first, so a
+ * body is copied with what was already inlined into it. A direct call is
+ * replaced by a copy of the callee's blocks, laid out between the part of
+ * the caller's block before the call and a new block with the rest: the
+ * callee's registers and labels are renumbered after the caller's, the
+ * loads of its parameters become the argument values and its returns go
+ * to the new block, where a phi merges the returned values. Calls copied
+ * along are not inlined again, so recursion stops after one level.
+ *
+ * Functions marked 'inline' and static functions called once are always
+ * inlined, any other one when its body is not much bigger than what the
+ * call costs, constant arguments counting as a bonus since they may fold
+ * it. Everything inlined is charged to a growth budget for the unit, but
+ * for the only call of a static function: its body is dropped afterwards.
+ * Callers that changed go through the SSA passes again.
+ *
+ * The fused mode never gets here: it releases the IR of a function as
+ * soon as it has been printed.
+ */
+
+#define INLINE_SIZE_LIMIT     12  // instructions a callee may have on top of its bonus
+#define INLINE_CALL_COST       4  // what the call itself is worth, plus one per argument
+#define INLINE_CONSTANT_BONUS  4  // per constant argument
+#define INLINE_GROWTH_PERCENT 50  // of the unit's size, for the growth budget
+#define INLINE_GROWTH_MIN     64
+
+typedef struct CCallee  CCallee;
+typedef struct CRegInfo CRegInfo;
+
+struct CCallee {
+    CFunction *fn;
+    size_t     calls;   // direct calls left in the unit
+    bool       escapes; // also used otherwise than by a direct call
+    size_t    *callees;
+    size_t     callee_count;
+    bool       visited;
+};
+
+struct CRegInfo {
+    CType   *type;
+    COperand repl;     // the value returned to it, when the call was inlined
+    bool     constant;
+};
+
+/*
+ * State of one inline_functions() call. 'regs' and 'clone' map the
+ * registers and blocks of the callee being copied, by id.
+ */
+typedef struct CInliner {
+    CCompiler    *cmp;
+    CCallee      *funcs;
+    CCallee     **sorted;
+    size_t        count;
+    size_t        budget;
+    CFunction    *fn;
+    CRegInfo     *info;
+    size_t        info_capacity;
+    COperand     *regs;
+    CBasicBlock **clone;
+    COperand     *values;
+} CInliner;
+
+static void         _collect_calls(CInliner *inl);
+static size_t      *_order(CInliner *inl);
+static void         _inline_into(CInliner *inl, CCallee *caller);
+static CCallee     *_should_inline(CInliner *inl, CCallee *caller, CInstruction *call);
+static const char  *_check(CFunction *fn, CFunction *callee, CInstruction *call);
+static CBasicBlock *_inline_call(CInliner *inl, CBasicBlock *blk, size_t index, CCallee *callee);
+static CBasicBlock *_split(CInliner *inl, CBasicBlock *blk, size_t index);
+static void         _copy_block(CInliner *inl, CFunction *callee, CBasicBlock *from, CInstruction *call);
+static void         _return(CInliner *inl, CFunction *callee, CBasicBlock *cont, CInstruction *call);
+static void         _finish(CInliner *inl);
+static void         _check_phis(CFunction *fn);
+static void         _remove_dead(CInliner *inl);
+static CCallee     *_find(CInliner *inl, CFunction *fn, COperand arg);
+static int          _compare(const void *a, const void *b);
+static COperand     _map(CInliner *inl, CFunction *callee, COperand arg);
+static COperand     _resolve(CInliner *inl, COperand arg);
+static void         _note(CInliner *inl, CInstruction *ins);
+static void         _reserve(CInliner *inl, size_t count);
+static void         _prepend(CBasicBlock *blk, CInstruction ins);
+static int          _param_index(CFunction *fn, CSymbol *sym);
+static size_t       _size(CFunction *fn);
+static CBasicBlock *_new_block(CFunction *fn);
+static COperand     _new_label(CFunction *fn, CBasicBlock *blk);
+static COperand     _zero_of(CFunction *fn, CType *type);
+
+void inline_functions(CCompiler *cmp)
+{
+    CInliner inl;
+    size_t  *order;
+    size_t   total = 0, inlined;
+
+    if(!cmp || !(options & COMPILER_OPTION_OPTIMIZE))
+        return;
+
+    memset(&inl, 0, sizeof(CInliner));
+
+    inl.cmp = cmp;
+
+    for(CFunction *fn = cmp->head; fn; fn = fn->next)
+        inl.count += fn->sym && fn->entry;
+
+    if(!inl.count)
+        return;
+
+    inl.funcs  = (CCallee *)zalloc(sizeof(CCallee) * inl.count, ARENA_3);
+    inl.sorted = (CCallee **)zalloc(sizeof(CCallee *) * inl.count, ARENA_3);
+
+    memset(inl.funcs, 0, sizeof(CCallee) * inl.count);
+
+    inl.count = 0;
+
+    for(CFunction *fn = cmp->head; fn; fn = fn->next) {
+        if(!fn->sym || !fn->entry)
+            continue;
+
+        inl.funcs[inl.count].fn = fn;
+        inl.sorted[inl.count]   = &inl.funcs[inl.count];
+        inl.count++;
+
+        total += _size(fn);
+    }
+
+    // names are atoms, functions are looked up by the address of theirs
+    qsort(inl.sorted, inl.count, sizeof(CCallee *), _compare);
+
+    _collect_calls(&inl);
+
+    inl.budget = total * INLINE_GROWTH_PERCENT / 100 + INLINE_GROWTH_MIN;
+    order      = _order(&inl);
+    inlined    = cmp->opt.inlined;
+
+    for(size_t i = 0; i < inl.count; i++)
+        _inline_into(&inl, &inl.funcs[order[i]]);
+
+    if(cmp->opt.inlined != inlined)
+        _remove_dead(&inl);
+}
+
+/*
+ * Counts the direct calls to every function and lists each function's
+ * callees, in the order they are called.
+ */
+static void _collect_calls(CInliner *inl)
+{
+    for(size_t i = 0; i < inl->count; i++) {
+        CCallee   *caller = &inl->funcs[i];
+        CFunction *fn     = caller->fn;
+
+        for(int pass = 0; pass < 2; pass++) {
+            for(size_t j = 0; j < fn->block_count; j++) {
+                CBasicBlock *blk = fn->blocks[j];
+
+                for(size_t k = 0; k < blk->count; k++) {
+                    CCallee *callee;
+
+                    if(blk->ins[k].kind != INS_CALL || !(callee = _find(inl, fn, blk->ins[k].arg2)))
+                        continue;
+
+                    if(pass)
+                        caller->callees[caller->callee_count++] = callee - inl->funcs;
+                    else {
+                        caller->callee_count++;
+                        callee->calls++;
+                    }
+                }
+            }
+
+            if(pass || !caller->callee_count)
+                break;
+
+            caller->callees      = (size_t *)zalloc(sizeof(size_t) * caller->callee_count, ARENA_3);
+            caller->callee_count = 0;
+        }
+    }
+
+    for(size_t i = 0; i < inl->count; i++)
+        inl->funcs[i].escapes = inl->funcs[i].fn->sym->usage > inl->funcs[i].calls;
+}
+
+/*
+ * Postorder of the call graph, walked depth first without recursion from
+ * every function in source order. Callees come before their callers but
+ * around a cycle.
+ */
+static size_t *_order(CInliner *inl)
+{
+    size_t *order, *stack, *next;
+    size_t  count = 0, top = 0;
+
+    order = (size_t *)zalloc(sizeof(size_t) * inl->count, ARENA_3);
+    stack = (size_t *)zalloc(sizeof(size_t) * inl->count, ARENA_3);
+    next  = (size_t *)zalloc(sizeof(size_t) * inl->count, ARENA_3);
+
+    for(size_t i = 0; i < inl->count; i++) {
+        if(inl->funcs[i].visited)
+            continue;
+
+        inl->funcs[i].visited = true;
+        stack[top]            = i;
+        next[top++]           = 0;
+
+        while(top) {
+            CCallee *fun = &inl->funcs[stack[top - 1]];
+
+            if(next[top - 1] < fun->callee_count) {
+                size_t callee = fun->callees[next[top - 1]++];
+
+                if(!inl->funcs[callee].visited) {
+                    inl->funcs[callee].visited = true;
+                    stack[top]                 = callee;
+                    next[top++]                = 0;
+                }
+                continue;
+            }
+
+            order[count++] = stack[--top];
+        }
+    }
+
+    return order;
+}
+
+/*
+ * Inlines the calls 'caller' makes, going on after each copy with what
+ * followed the call.
+ */
+static void _inline_into(CInliner *inl, CCallee *caller)
+{
+    CFunction   *fn    = caller->fn;
+    CBasicBlock *blk   = fn->entry;
+    size_t       index = 0, inlined = 0;
+
+    inl->fn = fn;
+
+    _reserve(inl, fn->vreg_count);
+
+    memset(inl->info, 0, sizeof(CRegInfo) * inl->info_capacity);
+
+    for(size_t i = 0; i < fn->block_count; i++)
+        for(size_t j = 0; j < fn->blocks[i]->count; j++)
+            _note(inl, &fn->blocks[i]->ins[j]);
+
+    while(blk) {
+        CInstruction *ins;
+        CCallee      *callee;
+
+        if(index == blk->count) {
+            blk   = blk->next;
+            index = 0;
+            continue;
+        }
+
+        ins = &blk->ins[index++];
+
+        if(ins->kind != INS_CALL || !(callee = _should_inline(inl, caller, ins)))
+            continue;
+
+        blk   = _inline_call(inl, blk, index - 1, callee);
+        index = 0;
+        inlined++;
+    }
+
+    if(!inlined)
+        return;
+
+    _finish(inl);
+
+    inl->cmp->opt.inlined += inlined;
+
+    if(options & COMPILER_OPTION_STATS)
+        fprintf(inl->cmp->diag, "inline('%s'): %ld calls inlined\n", fn->sym->name, inlined);
+
+    optimize_ssa(inl->cmp, fn);
+}
+
+/*
+ * Takes the decision for one call and reports it with -inline-report.
+ * Returns the callee to inline, NULL to keep the call.
+ */
+static CCallee *_should_inline(CInliner *inl, CCallee *caller, CInstruction *call)
+{
+    CCallee    *callee = _find(inl, inl->fn, call->arg2);
+    CFunction  *fn;
+    const char *reason;
+    size_t      size = 0, benefit, charge;
+    bool        inline_it = false;
+
+    if(OPERAND_KIND(call->arg2) != OPERAND_SYMBOL)
+        return NULL; // through a pointer
+
+    if(!callee)
+        reason = "no body";
+    else if(callee == caller)
+        reason = "recursive";
+    else if(!(reason = _check(inl->fn, (fn = callee->fn), call))) {
+        size    = _size(fn);
+        benefit = INLINE_CALL_COST;
+
+        for(COperand *op = LIST_OF(inl->fn, call->arg3); *op; op++) {
+            COperand arg = _resolve(inl, *op);
+
+            benefit++;
+
+            if(OPERAND_KIND(arg) == OPERAND_INT || OPERAND_KIND(arg) == OPERAND_FLOAT ||
+               (IS_VREG(arg) && inl->info[OPERAND_INDEX(arg)].constant))
+                benefit += INLINE_CONSTANT_BONUS;
+        }
+
+        charge    = size > benefit ? size - benefit : 0;
+        inline_it = true;
+
+        if((fn->sym->flags & SYMBOL_IS_STATIC) && callee->calls == 1 && !callee->escapes) {
+            reason = "single call site";
+            charge = 0;
+        }
+        else if(fn->sym->flags & SYMBOL_IS_INLINE)
+            reason = "marked inline";
+        else if(size <= INLINE_SIZE_LIMIT + benefit)
+            reason = "small";
+        else {
+            reason    = "too big";
+            inline_it = false;
+        }
+
+        if(inline_it && charge > inl->budget) {
+            reason    = "growth budget exhausted";
+            inline_it = false;
+        }
+
+        if(inline_it)
+            inl->budget -= charge;
+    }
+
+    if(options & COMPILER_OPTION_INLINE_REPORT)
+        fprintf(inl->cmp->diag, "inline('%s'): '%s' %s (%s, %ld instructions)\n", caller->fn->sym->name,
+                SYMBOL_OF(inl->fn, call->arg2)->name, inline_it ? "inlined" : "not inlined", reason, size);
+
+    return inline_it ? callee : NULL;
+}
+
+/*
+ * Why 'callee' can't be copied into the place of 'call', NULL if it can.
+ * Its locals must all have been promoted to registers: the only accesses
+ * to memory of its frame left are the loads of parameters at the entry.
+ */
+static const char *_check(CFunction *fn, CFunction *callee, CInstruction *call)
+{
+    size_t args = 0;
+
+    for(COperand *op = LIST_OF(fn, call->arg3); *op; op++)
+        args++;
+
+    if(args != callee->sym->type->param_count)
+        return "argument count";
+
+    if(callee->entry->pred_count)
+        return "entry is a loop header";
+
+    if(!callee->exit || callee->exit->next || !callee->exit->pred_count)
+        return "never returns";
+
+    for(size_t i = 0; i < callee->block_count; i++) {
+        CBasicBlock *blk = callee->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins     = &blk->ins[j];
+            COperand      args[3] = {ins->arg1, ins->arg2, ins->arg3};
+
+            // the symbol of a phi only names the local it merges
+            if(ins->kind == INS_PHI)
+                continue;
+
+            for(int k = 0; k < 3; k++) {
+                CSymbol *sym;
+
+                if(OPERAND_KIND(args[k]) != OPERAND_SYMBOL || !(sym = SYMBOL_OF(callee, args[k])))
+                    continue;
+
+                if(!(sym->flags & SYMBOL_IS_LOCAL) || (sym->flags & SYMBOL_IS_STATIC))
+                    continue;
+
+                if(blk != callee->entry || ins->kind != INS_LOAD || k != 1 || _param_index(callee, sym) < 0)
+                    return "locals kept in memory";
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static CBasicBlock *_inline_call(CInliner *inl, CBasicBlock *blk, size_t index, CCallee *callee)
+{
+    CFunction   *fn   = inl->fn;
+    CFunction   *cf   = callee->fn;
+    CInstruction call = blk->ins[index];
+    CBasicBlock *cont, *prev = blk;
+
+    _reserve(inl, fn->vreg_count + cf->vreg_count);
+
+    inl->regs   = (COperand *)zalloc(sizeof(COperand) * (cf->vreg_count + 1), ARENA_3);
+    inl->clone  = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * cf->block_count, ARENA_3);
+    inl->values = (COperand *)zalloc(sizeof(COperand) * cf->block_count, ARENA_3);
+
+    memset(inl->regs, 0, sizeof(COperand) * cf->vreg_count);
+    memset(inl->values, 0, sizeof(COperand) * cf->block_count);
+
+    cont = _split(inl, blk, index);
+
+    // every copy exists before the jumps and edges between them are mapped
+    for(size_t i = 0; i < cf->block_count; i++) {
+        CBasicBlock *from = cf->blocks[i];
+        CBasicBlock *to;
+
+        if(from == cf->exit) {
+            inl->clone[i] = cont;
+            continue;
+        }
+
+        to = _new_block(fn);
+
+        if(from->label)
+            _new_label(fn, to);
+
+        to->next   = prev->next;
+        prev->next = to;
+        prev       = to;
+
+        inl->clone[i] = to;
+    }
+
+    for(size_t i = 0; i < cf->block_count; i++) {
+        if(cf->blocks[i] != cf->exit)
+            _copy_block(inl, cf, cf->blocks[i], &call);
+    }
+
+    blk->succs[0]   = inl->clone[cf->entry->id];
+    blk->succ_count = 1;
+
+    blk->succs[0]->preds[blk->succs[0]->pred_count++] = blk;
+
+    _return(inl, cf, cont, &call);
+
+    callee->calls--;
+
+    return cont;
+}
+
+/*
+ * Moves what follows the call at 'index' to a new block laid out after
+ * 'blk', which takes over the successors of 'blk'.
+ */
+static CBasicBlock *_split(CInliner *inl, CBasicBlock *blk, size_t index)
+{
+    CFunction   *fn   = inl->fn;
+    CBasicBlock *cont = _new_block(fn);
+
+    cont->count    = blk->count - index - 1;
+    cont->capacity = cont->count;
+
+    if(cont->count) {
+        cont->ins = (CInstruction *)zalloc(sizeof(CInstruction) * cont->count, ARENA_3);
+        memcpy(cont->ins, &blk->ins[index + 1], sizeof(CInstruction) * cont->count);
+    }
+
+    if(blk->succ_count > 2)
+        cont->succs = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * blk->succ_count, ARENA_3);
+
+    for(size_t i = 0; i < blk->succ_count; i++) {
+        CBasicBlock *succ = blk->succs[i];
+
+        for(size_t j = 0; j < succ->pred_count; j++) {
+            if(succ->preds[j] == blk)
+                succ->preds[j] = cont;
+        }
+
+        cont->succs[i] = succ;
+    }
+
+    cont->succ_count = blk->succ_count;
+    cont->next       = blk->next;
+    blk->next        = cont;
+    blk->count       = index;
+    blk->succ_count  = 0;
+
+    fn->ins_count--;
+
+    return cont;
+}
+
+/*
+ * Copies 'from' to its clone. The entry drops ENTER and maps the
+ * registers its parameters are loaded in to the arguments, or loads the
+ * argument with the type of the parameter when they differ. A return
+ * jumps to the block after the call, or falls into it from the last block.
+ */
+static void _copy_block(CInliner *inl, CFunction *callee, CBasicBlock *from, CInstruction *call)
+{
+    CFunction   *fn = inl->fn;
+    CBasicBlock *to = inl->clone[from->id];
+
+    to->ins      = (CInstruction *)zalloc(sizeof(CInstruction) * (from->count + 1), ARENA_3);
+    to->capacity = from->count + 1;
+
+    for(size_t i = 0; i < from->count; i++) {
+        CInstruction ins = from->ins[i];
+        int          param;
+
+        if(ins.kind == INS_ENTER)
+            continue;
+
+        if(from == callee->entry && ins.kind == INS_LOAD && OPERAND_KIND(ins.arg2) == OPERAND_SYMBOL &&
+           (param = _param_index(callee, SYMBOL_OF(callee, ins.arg2))) >= 0) {
+            COperand arg = _resolve(inl, LIST_OF(fn, call->arg3)[param]);
+
+            if(IS_VREG(arg) && inl->info[OPERAND_INDEX(arg)].type &&
+               inl->info[OPERAND_INDEX(arg)].type->kind == ins.type->kind) {
+                inl->regs[OPERAND_INDEX(ins.arg1)] = arg;
+                continue;
+            }
+
+            ins.arg2 = arg;
+        }
+        else if(ins.kind == INS_RET || ins.kind == INS_RETVAL) {
+            inl->values[from->id] = _map(inl, callee, ins.arg1);
+
+            if(from->next == callee->exit)
+                continue;
+
+            ins.kind = INS_JMP;
+            ins.arg1 = inl->clone[callee->exit->id]->label;
+
+            if(!ins.arg1)
+                ins.arg1 = _new_label(fn, inl->clone[callee->exit->id]);
+
+            to->ins[to->count++] = ins;
+            continue;
+        }
+        else
+            ins.arg2 = _map(inl, callee, ins.arg2);
+
+        ins.arg1 = _map(inl, callee, ins.arg1);
+        ins.arg3 = _map(inl, callee, ins.arg3);
+
+        _note(inl, &ins);
+
+        // a call copied along is one more call site of its callee
+        if(ins.kind == INS_CALL) {
+            CCallee *target = _find(inl, fn, ins.arg2);
+
+            if(target)
+                target->calls++;
+        }
+
+        to->ins[to->count++] = ins;
+    }
+
+    fn->ins_count += to->count;
+
+    if(from->succ_count > 2)
+        to->succs = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * from->succ_count, ARENA_3);
+
+    for(size_t i = 0; i < from->succ_count; i++)
+        to->succs[i] = inl->clone[from->succs[i]->id];
+
+    to->succ_count = from->succ_count;
+
+    // one more for the entry, which gets the caller's block
+    to->preds      = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * (from->pred_count + 1), ARENA_3);
+    to->pred_count = from->pred_count;
+
+    for(size_t i = 0; i < from->pred_count; i++)
+        to->preds[i] = inl->clone[from->preds[i]->id];
+}
+
+/*
+ * Gives the block after the call its predecessors from the copy and the
+ * call's result: the value returned when there is one return, else a phi
+ * of the returned values. A return without value or falling off the end
+ * of the callee gives zero.
+ */
+static void _return(CInliner *inl, CFunction *callee, CBasicBlock *cont, CInstruction *call)
+{
+    CFunction *fn    = inl->fn;
+    COperand   def   = ins_def(call);
+    COperand   list;
+    COperand  *args;
+    size_t     count = 0;
+
+    for(size_t i = 0; i < callee->block_count; i++) {
+        CBasicBlock *blk = inl->clone[i];
+
+        for(size_t j = 0; blk != cont && j < blk->succ_count; j++)
+            count += blk->succs[j] == cont;
+    }
+
+    cont->preds      = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * (count + 1), ARENA_3);
+    cont->pred_count = 0;
+    list             = ir_list(fn, OPERAND_PHI, count);
+    args             = LIST_OF(fn, list);
+
+    for(size_t i = 0; i < callee->block_count; i++) {
+        CBasicBlock *blk = inl->clone[i];
+
+        for(size_t j = 0; blk != cont && j < blk->succ_count; j++) {
+            if(blk->succs[j] != cont)
+                continue;
+
+            args[cont->pred_count]          = inl->values[i] ? inl->values[i] : _zero_of(fn, call->type);
+            cont->preds[cont->pred_count++] = blk;
+        }
+    }
+
+    if(!def)
+        return;
+
+    if(count == 1 && IS_VREG(args[0]) && inl->info[OPERAND_INDEX(args[0])].type &&
+       inl->info[OPERAND_INDEX(args[0])].type->kind == call->type->kind) {
+        inl->info[OPERAND_INDEX(def)].repl = args[0];
+        return;
+    }
+
+    if(count == 1) {
+        _prepend(cont, new_instruction(INS_LOAD, def, args[0], 0, call->type, call->line));
+        return;
+    }
+
+    _prepend(cont, new_instruction(INS_PHI, def, list, 0, call->type, call->line));
+}
+
+/*
+ * Puts the results of inlined calls in place of their registers and lays
+ * the blocks out again.
+ */
+static void _finish(CInliner *inl)
+{
+    CFunction *fn    = inl->fn;
+    size_t     count = 0;
+
+    fn->blocks = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * fn->block_count, ARENA_3);
+
+    for(CBasicBlock *blk = fn->entry; blk; blk = blk->next) {
+        for(size_t i = 0; i < blk->count; i++) {
+            COperand *use;
+
+            for(size_t n = 0; (use = ins_use(fn, &blk->ins[i], n)); n++)
+                *use = _resolve(inl, *use);
+        }
+
+        blk->id             = count;
+        fn->blocks[count++] = blk;
+    }
+
+    _check_phis(fn);
+
+    compute_dominators(fn);
+}
+
+/*
+ * Every phi has one operand per predecessor, in their order, what the SSA
+ * passes run again on the caller index by predecessor. Debug builds only.
+ */
+static void _check_phis(CFunction *fn)
+{
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count && blk->ins[j].kind == INS_PHI; j++) {
+            size_t count = 0;
+
+            for(COperand *op = LIST_OF(fn, blk->ins[j].arg2); *op; op++)
+                count++;
+
+            assert(count == blk->pred_count);
+        }
+    }
+}
+
+/*
+ * Drops the static functions whose calls were all inlined.
+ */
+static void _remove_dead(CInliner *inl)
+{
+    CCompiler  *cmp  = inl->cmp;
+    CFunction **link = &cmp->head;
+    CFunction  *last = NULL;
+    size_t      next = 0;
+
+    for(CFunction *fn = cmp->head; fn; fn = fn->next) {
+        CCallee *fun = next < inl->count && inl->funcs[next].fn == fn ? &inl->funcs[next++] : NULL;
+
+        if(fun && (fn->sym->flags & SYMBOL_IS_STATIC) && !fun->calls && !fun->escapes) {
+            cmp->opt.dead_functions++;
+            continue;
+        }
+
+        *link = fn;
+        link  = &fn->next;
+        last  = fn;
+    }
+
+    *link     = NULL;
+    cmp->tail = last;
+}
+
+static CCallee *_find(CInliner *inl, CFunction *fn, COperand arg)
+{
+    size_t   lo = 0, hi = inl->count;
+    CSymbol *sym;
+
+    if(OPERAND_KIND(arg) != OPERAND_SYMBOL || !(sym = SYMBOL_OF(fn, arg)))
+        return NULL;
+
+    while(lo < hi) {
+        size_t      mid  = lo + (hi - lo) / 2;
+        const char *name = inl->sorted[mid]->fn->sym->name;
+
+        if(name == sym->name)
+            return inl->sorted[mid];
+
+        if((uintptr_t)name < (uintptr_t)sym->name)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+static int _compare(const void *a, const void *b)
+{
+    uintptr_t n1 = (uintptr_t)(*(CCallee *const *)a)->fn->sym->name;
+    uintptr_t n2 = (uintptr_t)(*(CCallee *const *)b)->fn->sym->name;
+
+    return n1 < n2 ? -1 : n1 > n2;
+}
+
+/*
+ * Operand of the callee as it reads in the copy. Constants and symbols
+ * are interned again in the caller's pools, operand lists are copied.
+ */
+static COperand _map(CInliner *inl, CFunction *callee, COperand arg)
+{
+    CBasicBlock *to;
+    COperand     copy;
+    COperand    *ops;
+    size_t       count = 0;
+
+    switch(OPERAND_KIND(arg)) {
+        case OPERAND_VREG:
+            if(!inl->regs[OPERAND_INDEX(arg)])
+                inl->regs[OPERAND_INDEX(arg)] = ir_vreg(inl->fn);
+            return inl->regs[OPERAND_INDEX(arg)];
+        case OPERAND_INT:
+        case OPERAND_FLOAT:
+            return ir_constant(inl->fn, OPERAND_KIND(arg), VALUE_OF(callee, arg).val);
+        case OPERAND_SYMBOL:
+            return ir_symbol(inl->fn, SYMBOL_OF(callee, arg));
+        case OPERAND_LABEL:
+            to = inl->clone[TARGET_OF(callee, arg)->id];
+            return to->label ? to->label : _new_label(inl->fn, to);
+        case OPERAND_PHI:
+        case OPERAND_ARGS:
+            ops = LIST_OF(callee, arg);
+
+            while(ops[count])
+                count++;
+
+            copy = ir_list(inl->fn, OPERAND_KIND(arg), count);
+
+            for(size_t i = 0; i < count; i++)
+                LIST_OF(inl->fn, copy)[i] = _map(inl, callee, ops[i]);
+            return copy;
+        default:
+            return arg;
+    }
+}
+
+static COperand _resolve(CInliner *inl, COperand arg)
+{
+    while(IS_VREG(arg) && OPERAND_INDEX(arg) < inl->info_capacity && inl->info[OPERAND_INDEX(arg)].repl)
+        arg = inl->info[OPERAND_INDEX(arg)].repl;
+
+    return arg;
+}
+
+/*
+ * Records the type of the register 'ins' defines and whether it is a
+ * constant.
+ */
+static void _note(CInliner *inl, CInstruction *ins)
+{
+    COperand def = ins_def(ins);
+
+    if(!def || OPERAND_INDEX(def) >= inl->info_capacity)
+        return;
+
+    inl->info[OPERAND_INDEX(def)].type     = ins->type;
+    inl->info[OPERAND_INDEX(def)].constant = ins->kind == INS_LOAD &&
+                                             (OPERAND_KIND(ins->arg2) == OPERAND_INT || OPERAND_KIND(ins->arg2) == OPERAND_FLOAT);
+}
+
+static void _reserve(CInliner *inl, size_t count)
+{
+    CRegInfo *tmp = inl->info;
+    size_t    old = inl->info_capacity;
+
+    if(count < old)
+        return;
+
+    inl->info_capacity = count * 2 + 64;
+    inl->info          = (CRegInfo *)zalloc(sizeof(CRegInfo) * inl->info_capacity, ARENA_3);
+
+    memset(inl->info, 0, sizeof(CRegInfo) * inl->info_capacity);
+
+    if(tmp)
+        memcpy(inl->info, tmp, sizeof(CRegInfo) * old);
+}
+
+static void _prepend(CBasicBlock *blk, CInstruction ins)
+{
+    CInstruction *tmp = blk->ins;
+
+    blk->ins = (CInstruction *)zalloc(sizeof(CInstruction) * (blk->count + 1), ARENA_3);
+
+    if(tmp)
+        memcpy(blk->ins + 1, tmp, sizeof(CInstruction) * blk->count);
+
+    blk->ins[0]   = ins;
+    blk->capacity = ++blk->count;
+}
+
+static int _param_index(CFunction *fn, CSymbol *sym)
+{
+    int index = 0;
+
+    for(CParameter *param = fn->sym->type->params; param; param = param->next, index++) {
+        if(param->sym == sym)
+            return index;
+    }
+
+    return -1;
+}
+
+/*
+ * Instructions of a body, without ENTER and LEAVE.
+ */
+static size_t _size(CFunction *fn)
+{
+    return fn->ins_count > 2 ? fn->ins_count - 2 : 0;
+}
+
+static CBasicBlock *_new_block(CFunction *fn)
+{
+    CBasicBlock *blk;
+
+    blk = (CBasicBlock *)zalloc(sizeof(CBasicBlock), ARENA_3);
+
+    memset(blk, 0, sizeof(CBasicBlock));
+
+    blk->id    = fn->block_count++;
+    blk->succs = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * 2, ARENA_3);
+
+    return blk;
+}
+
+static COperand _new_label(CFunction *fn, CBasicBlock *blk)
+{
+    blk->label = ir_label(fn);
+
+    ir_place(fn, blk->label, blk);
+
+    return blk->label;
+}
+
+static COperand _zero_of(CFunction *fn, CType *type)
+{
+    if(type && (type->kind == FLOAT || type->kind == DOUBLE || type->kind == LDOUBLE))
+        return ir_constant(fn, OPERAND_FLOAT, 0);
+
+    return ir_constant(fn, OPERAND_INT, 0);
+}
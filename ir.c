@@ -0,0 +1,696 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * The IR of a unit is a list of functions, each one a list of basic blocks
+ * holding their instructions in one array (ARENA_3). Blocks are cut
+ * while the generator appends: a label starts a new block and is kept as
+ * the block's label instead of an instruction, a jump or return ends one.
+ * Edges are only resolved by end_ir(), once every label is placed.
+ *
+ * The open block is filled in cmp->scratch and copied to an array of the
+ * exact size when it is closed: arena memory can't be given back, so
+ * growing every block by doubling would leave its old copies behind.
+ *
+ * Operands are 32 bits inline in the instructions. Constants, symbols and
+ * lists of operands live in pools of their function, the constants and
+ * symbols interned so that equal ones are the same operand.
+ */
+
+#define SCRATCH_INITIAL_SIZE 64
+#define POOL_INITIAL_SIZE    16
+#define HASH_MULTIPLIER      0x9E3779B97F4A7C15ull // 2^64 / golden ratio
+
+static CBasicBlock *_new_block(CCompiler *cmp, COperand label);
+static void         _seal_block(CBasicBlock *blk);
+static bool         _ends_block(Instruction kind);
+static void         _add_edge(CBasicBlock *from, CBasicBlock *to);
+static bool         _has_edge(CBasicBlock *from, CBasicBlock *to);
+static COperand    *_interned(CFunction *fn, uint64_t key, OperandKind kind);
+static uint64_t     _key(CFunction *fn, COperand op);
+static void        *_grow(void *array, size_t count, size_t *cap, size_t size);
+
+CFunction *begin_ir(CCompiler *cmp, CSymbol *sym)
+{
+    CFunction *fn;
+
+    if(!cmp)
+        return NULL;
+
+    end_ir(cmp);
+
+    fn = (CFunction *)zalloc(sizeof(CFunction), ARENA_3);
+
+    memset(fn, 0, sizeof(CFunction));
+
+    fn->sym = sym;
+
+    if(!cmp->head)
+        cmp->head = fn;
+    else
+        cmp->tail->next = fn;
+
+    cmp->tail  = fn;
+    cmp->fn    = fn;
+    cmp->block = NULL;
+
+    return fn;
+}
+
+/*
+ * Closes the function being generated: lays its blocks out in an array and
+ * builds the successor and predecessor edges. A jump table has an edge to
+ * each block it may jump to, however many entries go there.
+ */
+void end_ir(CCompiler *cmp)
+{
+    CFunction   *fn;
+    CBasicBlock *blk;
+    size_t       i;
+
+    if(!cmp || !cmp->fn)
+        return;
+
+    _seal_block(cmp->block);
+
+    fn         = cmp->fn;
+    cmp->fn    = NULL;
+    cmp->block = NULL;
+
+    fn->vreg_count  = cmp->vreg_count;
+    fn->label_count = cmp->label_count;
+
+    if(!fn->block_count)
+        return;
+
+    fn->blocks = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * fn->block_count, ARENA_3);
+
+    for(i = 0, blk = fn->entry; blk; blk = blk->next)
+        fn->blocks[i++] = blk;
+
+    for(blk = fn->entry; blk; blk = blk->next) {
+        CInstruction *last = blk->count ? &blk->ins[blk->count - 1] : NULL;
+
+        switch(last ? last->kind : INS_END_MARK) {
+            case INS_JMP:
+                _add_edge(blk, TARGET_OF(fn, last->arg1));
+                break;
+            case INS_JMPZ:
+            case INS_JLT:
+            case INS_JLE:
+            case INS_JGT:
+            case INS_JGE:
+            case INS_JEQ:
+            case INS_JNE:
+                _add_edge(blk, blk->next);
+                _add_edge(blk, TARGET_OF(fn, last->arg1));
+                break;
+            case INS_JTAB:
+                // the fall through and one per entry, at most
+                for(i = 1; LIST_OF(fn, last->arg1)[i - 1]; i++)
+                    ;
+
+                blk->succs = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * i, ARENA_3);
+
+                _add_edge(blk, blk->next);
+
+                for(COperand *op = LIST_OF(fn, last->arg1); *op; op++) {
+                    if(!_has_edge(blk, TARGET_OF(fn, *op)))
+                        _add_edge(blk, TARGET_OF(fn, *op));
+                }
+                break;
+            case INS_RET:
+            case INS_RETVAL:
+                _add_edge(blk, fn->exit);
+                break;
+            case INS_LEAVE:
+                break;
+            default:
+                _add_edge(blk, blk->next);
+                break;
+        }
+    }
+
+    for(i = 0; i < fn->block_count; i++) {
+        blk = fn->blocks[i];
+
+        if(blk->pred_count)
+            blk->preds = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * blk->pred_count, ARENA_3);
+
+        blk->pred_count = 0;
+    }
+
+    for(i = 0; i < fn->block_count; i++) {
+        blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->succ_count; j++)
+            blk->succs[j]->preds[blk->succs[j]->pred_count++] = blk;
+    }
+}
+
+/*
+ * Appends 'ins' to the current block. Code emitted outside of a function
+ * (global initializers) opens a container with no symbol.
+ */
+void add_ir(CCompiler *cmp, CInstruction ins)
+{
+    CBasicBlock *blk;
+
+    if(!cmp)
+        return;
+
+    if(!cmp->fn)
+        begin_ir(cmp, NULL);
+
+    blk = cmp->block;
+
+    switch(ins.kind) {
+        case INS_LABEL:
+            if(blk && !blk->count && !blk->label) {
+                blk->label = ins.arg1;
+                ir_place(cmp->fn, ins.arg1, blk);
+            } else
+                _new_block(cmp, ins.arg1);
+            return;
+        case INS_LEAVE:
+            if(!blk || blk->count)
+                blk = _new_block(cmp, 0);
+            cmp->fn->exit = blk;
+            break;
+        default:
+            if(!blk || (blk->count && _ends_block(blk->ins[blk->count - 1].kind)))
+                blk = _new_block(cmp, 0);
+            break;
+    }
+
+    if(blk->count == cmp->scratch_size) {
+        CInstruction *tmp = cmp->scratch;
+
+        cmp->scratch_size = cmp->scratch_size ? cmp->scratch_size * 2 : SCRATCH_INITIAL_SIZE;
+        cmp->scratch      = (CInstruction *)zalloc(sizeof(CInstruction) * cmp->scratch_size, ARENA_1);
+
+        if(tmp)
+            memcpy(cmp->scratch, tmp, sizeof(CInstruction) * blk->count);
+    }
+
+    blk->ins      = cmp->scratch;
+    blk->capacity = cmp->scratch_size;
+
+    blk->ins[blk->count++] = ins;
+
+    cmp->fn->ins_count++;
+}
+
+/*
+ * Drops one 'from' -> 'to' edge, together with the phi operands of 'to'
+ * coming through it: they are kept in predecessor order.
+ */
+void remove_edge(CFunction *fn, CBasicBlock *from, CBasicBlock *to)
+{
+    size_t i, j;
+
+    if(!from || !to)
+        return;
+
+    for(i = 0; i < from->succ_count && from->succs[i] != to; i++)
+        ;
+
+    if(i == from->succ_count)
+        return;
+
+    for(; i + 1 < from->succ_count; i++)
+        from->succs[i] = from->succs[i + 1];
+
+    from->succ_count--;
+
+    for(j = 0; j < to->pred_count && to->preds[j] != from; j++)
+        ;
+
+    if(j == to->pred_count)
+        return;
+
+    for(size_t k = j; k + 1 < to->pred_count; k++)
+        to->preds[k] = to->preds[k + 1];
+
+    to->pred_count--;
+
+    for(size_t k = 0; k < to->count && to->ins[k].kind == INS_PHI; k++)
+        for(COperand *op = &LIST_OF(fn, to->ins[k].arg2)[j]; *op; op++)
+            *op = op[1];
+}
+
+/*
+ * Address of the n-th operand 'ins' reads, NULL past the last one. The
+ * slot itself may be empty or hold a symbol, a label or a constant.
+ */
+COperand *ins_use(CFunction *fn, CInstruction *ins, size_t n)
+{
+    COperand *list;
+
+    if(!ins)
+        return NULL;
+
+    if(ins->kind == INS_PHI) {
+        list = LIST_OF(fn, ins->arg2);
+        return list[n] ? &list[n] : NULL;
+    }
+
+    // a call reads its callee, then its arguments
+    if(ins->kind == INS_CALL) {
+        if(!n)
+            return &ins->arg2;
+        list = LIST_OF(fn, ins->arg3);
+        return list[n - 1] ? &list[n - 1] : NULL;
+    }
+
+    // the first operand of a store is where, of a return what
+    if(ins->kind == INS_RETVAL || ins->kind == INS_STORE) {
+        if(!n)
+            return &ins->arg1;
+        n--;
+    }
+
+    switch(n) {
+        case 0:
+            return &ins->arg2;
+        case 1:
+            return &ins->arg3;
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * Register 'ins' defines, 0 if it only has side effects.
+ */
+COperand ins_def(CInstruction *ins)
+{
+    if(!ins || !IS_VREG(ins->arg1))
+        return 0;
+
+    switch(ins->kind) {
+        case INS_PHI:
+        case INS_LOAD:
+        case INS_ADD:
+        case INS_SUB:
+        case INS_MUL:
+        case INS_DIV:
+        case INS_SHL:
+        case INS_SHR:
+        case INS_GE:
+        case INS_LE:
+        case INS_GT:
+        case INS_LT:
+        case INS_AND:
+        case INS_MOD:
+        case INS_MULH:
+        case INS_CALL:
+        case INS_EQ:
+        case INS_NE:
+        case INS_OR:
+        case INS_XOR:
+            return ins->arg1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Whether 'ins' may write memory other than through a STORE to a symbol.
+ * A call may, whether or not it returns a value.
+ */
+bool ins_clobbers(CInstruction *ins)
+{
+    if(!ins)
+        return false;
+
+    if(ins->kind == INS_CALL)
+        return true;
+
+    if(ins_def(ins))
+        return false;
+
+    switch(ins->kind) {
+        case INS_END_MARK:
+        case INS_ENTER:
+        case INS_LEAVE:
+        case INS_JMP:
+        case INS_JMPZ:
+        case INS_JLT:
+        case INS_JLE:
+        case INS_JGT:
+        case INS_JGE:
+        case INS_JEQ:
+        case INS_JNE:
+        case INS_JTAB:
+        case INS_RET:
+        case INS_RETVAL:
+        case INS_STORE:
+            return false;
+        default:
+            return true;
+    }
+}
+
+/*
+ * Whether 'kind' is a conditional jump: JMPZ, taken when its operand is
+ * zero, or a compare and branch, taken when its operands are in the
+ * relation it names. Either falls through to the next block otherwise.
+ */
+bool is_branch(Instruction kind)
+{
+    switch(kind) {
+        case INS_JMPZ:
+        case INS_JLT:
+        case INS_JLE:
+        case INS_JGT:
+        case INS_JGE:
+        case INS_JEQ:
+        case INS_JNE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * The comparison a compare and branch jumps on, INS_END_MARK for anything
+ * else.
+ */
+Instruction branch_compare(Instruction kind)
+{
+    switch(kind) {
+        case INS_JLT: return INS_LT;
+        case INS_JLE: return INS_LE;
+        case INS_JGT: return INS_GT;
+        case INS_JGE: return INS_GE;
+        case INS_JEQ: return INS_EQ;
+        case INS_JNE: return INS_NE;
+        default:      return INS_END_MARK;
+    }
+}
+
+/*
+ * The compare and branch taken exactly when 'kind' is not. Between floats
+ * that only holds for JEQ and JNE: with a NaN, JLT and JGE both fall
+ * through.
+ */
+Instruction invert_branch(Instruction kind)
+{
+    switch(kind) {
+        case INS_JLT: return INS_JGE;
+        case INS_JLE: return INS_JGT;
+        case INS_JGT: return INS_JLE;
+        case INS_JGE: return INS_JLT;
+        case INS_JEQ: return INS_JNE;
+        case INS_JNE: return INS_JEQ;
+        default:      return INS_END_MARK;
+    }
+}
+
+/*
+ * Last instruction emitted, NULL if the current block is still empty.
+ */
+CInstruction *last_ir(CCompiler *cmp)
+{
+    if(!cmp || !cmp->block || !cmp->block->count)
+        return NULL;
+
+    return &cmp->block->ins[cmp->block->count - 1];
+}
+
+/*
+ * The constant with 'bits', read as an integer or a float: both kinds
+ * share the slot of the same bits.
+ */
+COperand ir_constant(CFunction *fn, OperandKind kind, int64_t bits)
+{
+    COperand *slot = _interned(fn, (uint64_t)bits, OPERAND_INT);
+
+    if(!*slot) {
+        fn->values = (CValue *)_grow(fn->values, fn->value_count, &fn->value_cap, sizeof(CValue));
+
+        fn->values[fn->value_count].val = bits;
+
+        *slot = OPERAND(OPERAND_INT, fn->value_count++);
+    }
+
+    return OPERAND(kind, OPERAND_INDEX(*slot));
+}
+
+COperand ir_symbol(CFunction *fn, CSymbol *sym)
+{
+    COperand *slot = _interned(fn, (uint64_t)(uintptr_t)sym, OPERAND_SYMBOL);
+
+    if(!*slot) {
+        fn->symbols = (CSymbol **)_grow(fn->symbols, fn->symbol_count, &fn->symbol_cap, sizeof(CSymbol *));
+
+        fn->symbols[fn->symbol_count] = sym;
+
+        *slot = OPERAND(OPERAND_SYMBOL, fn->symbol_count++);
+    }
+
+    return *slot;
+}
+
+/*
+ * Operand of a literal or a variable of the tree.
+ */
+COperand ir_operand(CFunction *fn, CMisc *misc)
+{
+    if(!misc)
+        return 0;
+
+    switch(misc->kind) {
+        case MISC_CONSTANT_INT:
+            return ir_constant(fn, OPERAND_INT, misc->val);
+        case MISC_CONSTANT_FLOAT:
+            return ir_constant(fn, OPERAND_FLOAT, misc->val);
+        case MISC_SYMBOL:
+            return ir_symbol(fn, misc->sym);
+        default:
+            return 0;
+    }
+}
+
+/*
+ * A local of the function that is not in the source, with the rest of
+ * its IR in ARENA_3.
+ */
+COperand ir_temp(CFunction *fn, const char *name, CType *type)
+{
+    CSymbol *sym;
+    char    *copy;
+
+    sym  = (CSymbol *)zalloc(sizeof(CSymbol), ARENA_3);
+    copy = (char *)zalloc(strlen(name) + 1, ARENA_3);
+
+    memset(sym, 0, sizeof(CSymbol));
+    strcpy(copy, name);
+
+    sym->name  = copy;
+    sym->type  = type;
+    sym->flags = SYMBOL_IS_LOCAL;
+
+    return ir_symbol(fn, sym);
+}
+
+/*
+ * A list of 'count' operands, all 0 and then the 0 ending it, of a phi,
+ * the arguments of a call or the entries of a jump table.
+ */
+COperand ir_list(CFunction *fn, OperandKind kind, size_t count)
+{
+    COperand *list;
+
+    list = (COperand *)zalloc(sizeof(COperand) * (count + 1), ARENA_3);
+
+    memset(list, 0, sizeof(COperand) * (count + 1));
+
+    fn->lists = (COperand **)_grow(fn->lists, fn->list_count, &fn->list_cap, sizeof(COperand *));
+
+    fn->lists[fn->list_count] = list;
+
+    return OPERAND(kind, fn->list_count++);
+}
+
+COperand ir_vreg(CFunction *fn)
+{
+    return OPERAND(OPERAND_VREG, fn->vreg_count++);
+}
+
+COperand ir_label(CFunction *fn)
+{
+    COperand label = OPERAND(OPERAND_LABEL, fn->label_count++);
+
+    ir_place(fn, label, NULL);
+
+    return label;
+}
+
+/*
+ * Gives 'vreg' the Register 'reg'.
+ */
+void ir_assign(CFunction *fn, COperand vreg, int reg)
+{
+    size_t id = OPERAND_INDEX(vreg);
+
+    while(id >= fn->reg_count)
+        fn->regs = (byte *)_grow(fn->regs, fn->reg_count, &fn->reg_count, sizeof(byte));
+
+    fn->regs[id] = (byte)reg;
+}
+
+/*
+ * Makes 'blk' the block 'label' starts.
+ */
+void ir_place(CFunction *fn, COperand label, CBasicBlock *blk)
+{
+    size_t id = OPERAND_INDEX(label);
+
+    while(id >= fn->target_cap)
+        fn->targets = (CBasicBlock **)_grow(fn->targets, fn->target_cap, &fn->target_cap, sizeof(CBasicBlock *));
+
+    fn->targets[id] = blk;
+}
+
+static CBasicBlock *_new_block(CCompiler *cmp, COperand label)
+{
+    CBasicBlock *blk;
+
+    blk = (CBasicBlock *)zalloc(sizeof(CBasicBlock), ARENA_3);
+
+    memset(blk, 0, sizeof(CBasicBlock));
+
+    _seal_block(cmp->block);
+
+    blk->id    = cmp->fn->block_count++;
+    blk->label = label;
+    blk->succs = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * 2, ARENA_3);
+
+    if(label)
+        ir_place(cmp->fn, label, blk);
+
+    if(!cmp->fn->entry)
+        cmp->fn->entry = blk;
+    else
+        cmp->block->next = blk;
+
+    cmp->block = blk;
+
+    return blk;
+}
+
+static void _seal_block(CBasicBlock *blk)
+{
+    CInstruction *tmp;
+
+    if(!blk || !blk->count)
+        return;
+
+    tmp = blk->ins;
+
+    blk->capacity = blk->count;
+    blk->ins      = (CInstruction *)zalloc(sizeof(CInstruction) * blk->count, ARENA_3);
+
+    memcpy(blk->ins, tmp, sizeof(CInstruction) * blk->count);
+}
+
+static bool _ends_block(Instruction kind)
+{
+    if(is_branch(kind))
+        return true;
+
+    switch(kind) {
+        case INS_JMP:
+        case INS_JTAB:
+        case INS_RET:
+        case INS_RETVAL:
+        case INS_LEAVE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void _add_edge(CBasicBlock *from, CBasicBlock *to)
+{
+    if(!from || !to)
+        return;
+
+    from->succs[from->succ_count++] = to;
+    to->pred_count++;
+}
+
+static bool _has_edge(CBasicBlock *from, CBasicBlock *to)
+{
+    for(size_t i = 0; i < from->succ_count; i++) {
+        if(from->succs[i] == to)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Slot of 'interned' holding the constant with bits 'key', or the symbol
+ * at address 'key', or the empty one it goes to.
+ */
+static COperand *_interned(CFunction *fn, uint64_t key, OperandKind kind)
+{
+    size_t mask, i;
+
+    if(2 * (fn->value_count + fn->symbol_count + 1) > fn->interned_cap) {
+        COperand *old = fn->interned;
+        size_t    cap = fn->interned_cap;
+
+        fn->interned_cap = cap ? 2 * cap : POOL_INITIAL_SIZE;
+        fn->interned     = (COperand *)zalloc(sizeof(COperand) * fn->interned_cap, ARENA_3);
+
+        memset(fn->interned, 0, sizeof(COperand) * fn->interned_cap);
+
+        for(i = 0; i < cap; i++) {
+            if(old[i])
+                *_interned(fn, _key(fn, old[i]), OPERAND_KIND(old[i])) = old[i];
+        }
+    }
+
+    mask = fn->interned_cap - 1;
+
+    for(i = (key * HASH_MULTIPLIER) >> 32 & mask; fn->interned[i]; i = (i + 1) & mask) {
+        if(OPERAND_KIND(fn->interned[i]) == kind && _key(fn, fn->interned[i]) == key)
+            break;
+    }
+
+    return &fn->interned[i];
+}
+
+static uint64_t _key(CFunction *fn, COperand op)
+{
+    if(OPERAND_KIND(op) == OPERAND_SYMBOL)
+        return (uint64_t)(uintptr_t)fn->symbols[OPERAND_INDEX(op)];
+
+    return (uint64_t)fn->values[OPERAND_INDEX(op)].val;
+}
+
+/*
+ * 'array' with room for one more than its 'count' elements, the new ones
+ * zeroed.
+ */
+static void *_grow(void *array, size_t count, size_t *cap, size_t size)
+{
+    byte *tmp;
+
+    if(count < *cap)
+        return array;
+
+    *cap = *cap ? 2 * *cap : POOL_INITIAL_SIZE;
+    tmp  = (byte *)zalloc(size * *cap, ARENA_3);
+
+    if(count)
+        memcpy(tmp, array, size * count);
+
+    memset(tmp + size * count, 0, size * (*cap - count));
+
+    return tmp;
+}
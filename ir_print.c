@@ -5,47 +5,61 @@ static const char *ins_name[INS_END_MARK] = {
     "LOAD", "STORE",      "JMPZ",       "ADD",   "SUB",
     "MUL",  "DIV",        "ENTER",      "LEAVE", "SHL",
     "SHR",  "GE",         "LE",         "GT",    "LT",
-    "JMP",  NULL/*label*/,"RETVAL",     "RET",   "AND"
+    "JMP",  NULL/*label*/,"RETVAL",     "RET",   "AND",
+    "PHI",  "MOD",        "MULH",       "CALL",  "JLT",
+    "JLE",  "JGT",        "JGE",        "EQ",    "NE",
+    "OR",   "XOR",        "JEQ",        "JNE",   "JTAB"
 };
 
-static void _print_ins(CInstruction *ins);
-static void _print_arg(CMisc *arg);
+static const char *reg_name[REG_END_MARK] = {
+    NULL,    "rax",   "rcx",   "rdx",   "rbx",   "rsp",   "rbp",   "rsi",
+    "rdi",   "r8",    "r9",    "r10",   "r11",   "r12",   "r13",   "r14",
+    "r15",   "xmm0",  "xmm1",  "xmm2",  "xmm3",  "xmm4",  "xmm5",  "xmm6",
+    "xmm7",  "xmm8",  "xmm9",  "xmm10", "xmm11", "xmm12", "xmm13", "xmm14",
+    "xmm15"
+};
+
+static void _print_ins(CFunction *fn, CInstruction *ins);
+static void _print_arg(CFunction *fn, COperand arg);
 
-void print_ir(CCompiler *cmp)
+void print_function(CFunction *fn)
 {
-    if(!cmp)
+    if(!fn)
         return;
 
-    for(CInstruction **ins = &cmp->head; *ins; ins = &(*ins)->next) {
-        if((*ins)->kind == INS_LABEL) {
-            printf("L%ld:", (*ins)->arg1->label->lbID);
-            continue;
-        }
-        _print_ins(*ins);
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        if(blk->label)
+            printf("L%ld:", OPERAND_INDEX(blk->label));
+
+        for(size_t j = 0; j < blk->count; j++)
+            _print_ins(fn, &blk->ins[j]);
     }
 }
 
-static void _print_ins(CInstruction *ins)
+static void _print_ins(CFunction *fn, CInstruction *ins)
 {
     if(!ins)
         return;
 
     if(ins->kind == INS_ENTER)
-        printf("function '%s'\n", ins->arg1->sym->name);
+        printf("function '%s'\n", fn->sym->name);
 
      printf("\t%s", ins_name[ins->kind]);
         
-    _print_arg(ins->arg1);
+    _print_arg(fn, ins->arg1);
 
-    if(ins->arg2)
+    // a call whose result is unused has no destination
+    if(ins->arg2 && (ins->arg1 || ins->kind != INS_CALL))
         printf(",");
 
-    _print_arg(ins->arg2);
+    _print_arg(fn, ins->arg2);
     
     if(ins->arg3)
         printf(",");
 
-    _print_arg(ins->arg3);
+    _print_arg(fn, ins->arg3);
 
     if(ins->type) {
         printf("\t[");
@@ -56,26 +70,47 @@ static void _print_ins(CInstruction *ins)
     printf("\n");
 }
 
-static void _print_arg(CMisc *arg)
+static void _print_arg(CFunction *fn, COperand arg)
 {
-    if(!arg)
-        return;
+    size_t index = OPERAND_INDEX(arg);
 
-    switch(arg->kind) {
-        case MISC_CONSTANT_FLOAT:
-            printf(" %.4lf", arg->dval);
+    switch(OPERAND_KIND(arg)) {
+        case OPERAND_NONE:
+            return;
+        case OPERAND_FLOAT:
+            printf(" %.4lf", fn->values[index].dval);
+            return;
+        case OPERAND_INT:
+            printf(" %ld", fn->values[index].val);
+            return;
+        case OPERAND_SYMBOL:
+            printf(" %s", fn->symbols[index]->name);
             return;
-        case MISC_CONSTANT_INT:
-            printf(" %ld", arg->val);
+        case OPERAND_VREG:
+            printf(" R%ld", index);
+            if(index < fn->reg_count && fn->regs[index])
+                printf(":%s", reg_name[fn->regs[index]]);
             return;
-        case MISC_SYMBOL:
-            printf(" %s", arg->sym->name);
+        case OPERAND_LABEL:
+            printf(" L%ld", index);
             return;
-        case MISC_VREG:
-            printf(" R%ld", arg->vreg->id);
+        case OPERAND_PHI:
+            printf(" [");
+            for(COperand *op = fn->lists[index]; *op; op++) {
+                if(op != fn->lists[index])
+                    printf(",");
+                _print_arg(fn, *op);
+            }
+            printf(" ]");
             return;
-        case MISC_LABEL:
-            printf(" L%ld", arg->label->lbID);
+        case OPERAND_ARGS:
+            printf(" (");
+            for(COperand *op = fn->lists[index]; *op; op++) {
+                if(op != fn->lists[index])
+                    printf(",");
+                _print_arg(fn, *op);
+            }
+            printf(" )");
             return;
     }
 }
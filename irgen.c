@@ -1,265 +1,947 @@
 #include "compiler.h"
 #include "misc.h"
 
-static CMisc* _generate_from_tree(CCompiler *cmp, CNode *tree);
-static void   _generate_fun(CCompiler *cmp, CNode *tree);
-static void   _generate_load(CCompiler *cmp, CNode *tree);
-static void   _generate_vdecl(CCompiler *cmp, CNode *tree);
-static void   _generate_id(CCompiler *cmp, CNode *tree);
-static void   _generate_bin(CCompiler *cmp, CNode *tree);
-static void   _generate_assign(CCompiler *cmp, CNode *tree);
-static void   _generate_if(CCompiler *cmp, CNode *tree);
-static void   _generate_while(CCompiler *cmp, CNode *tree);
-static void   _generate_do_while(CCompiler *cmp, CNode *tree);
-static void   _generate_return(CCompiler *cmp, CNode *tree);
-static void   _generate_for(CCompiler *cmp, CNode *tree);
-
-static CMisc *_new_label(size_t *id);
+#define SWITCH_TABLE_MIN      4     // cases a jump table must hold
+#define SWITCH_TABLE_DENSITY  40    // percent of its entries that must be cases
+#define SWITCH_TABLE_MAX      4096  // entries
+#define SWITCH_LINEAR_MAX     3     // clusters tested in a row instead of searched
+
+/*
+ * A case of a switch. 'key' orders the values as unsigned numbers, the
+ * signed ones with their sign bit flipped, so distances between them are
+ * the same for both.
+ */
+typedef struct CCase {
+    uint64_t key;
+    int64_t  val;
+    COperand label;
+} CCase;
+
+/*
+ * Sorted cases 'first' to 'last', a jump table when there are more than one.
+ */
+typedef struct CCluster {
+    size_t first;
+    size_t last;
+} CCluster;
+
+/*
+ * Clusters 'first' up to, not including, 'last' left to search, from 'label'
+ * when the code before does not fall into them.
+ */
+typedef struct CSearch {
+    size_t   first;
+    size_t   last;
+    COperand label;
+} CSearch;
+
+static COperand   _generate_from_tree(CCompiler *cmp, CNode *tree);
+static bool       _generate_step(CCompiler *cmp, CFrame *frame);
+static bool       _visit(CCompiler *cmp, CNode *tree);
+static COperand   _value_of(CCompiler *cmp, CNode *tree);
+static void       _generate_fun(CCompiler *cmp, CNode *tree);
+static void       _splice_job(CCompiler *cmp, CNode *tree);
+static void       _generate_load(CCompiler *cmp, CNode *tree);
+static bool       _generate_vdecl(CCompiler *cmp, CFrame *frame);
+static bool       _generate_blk(CCompiler *cmp, CFrame *frame);
+static bool       _generate_bin(CCompiler *cmp, CFrame *frame);
+static bool       _generate_assign(CCompiler *cmp, CFrame *frame);
+static bool       _generate_if(CCompiler *cmp, CFrame *frame);
+static bool       _generate_while(CCompiler *cmp, CFrame *frame);
+static bool       _generate_do_while(CCompiler *cmp, CFrame *frame);
+static bool       _generate_return(CCompiler *cmp, CFrame *frame);
+static bool       _generate_for(CCompiler *cmp, CFrame *frame);
+static bool       _generate_switch(CCompiler *cmp, CFrame *frame);
+static bool       _generate_case(CCompiler *cmp, CFrame *frame);
+static void       _generate_jump(CCompiler *cmp, CNode *tree);
+static COperand  *_lower_switch(CCompiler *cmp, CNode *tree, COperand end);
+static size_t     _cluster(CCase *cases, size_t count, CCluster *clusters);
+static void       _emit_cluster(CCompiler *cmp, CNode *tree, COperand value, CCase *cases, CCluster *cluster, COperand other);
+static int        _compare_cases(const void *c1, const void *c2);
+static bool       _is_unsigned(CType *type);
+static bool       _generate_call(CCompiler *cmp, CFrame *frame);
+static bool       _generate_logical(CCompiler *cmp, CFrame *frame);
+static bool       _generate_branch(CCompiler *cmp, CFrame *frame);
+static bool       _generate_short_circuit(CCompiler *cmp, CFrame *frame);
+static bool       _visit_branch(CCompiler *cmp, CNode *cond, COperand label, int kind);
+static bool       _is_direct_call(CNode *tree);
+static bool       _is_fusable(CNode *cond, bool invert);
+
+static CFunction *_fn(CCompiler *cmp);
+static COperand   _new_label(size_t *id);
+static COperand   _new_vreg(CCompiler *cmp);
+static COperand   _new_constant(CCompiler *cmp, int64_t val);
 
 static Instruction _get_op(int op);
+static Instruction _get_branch(int op);
+
+/*
+ * Frames are pushed for tree nodes, except for the branches on a
+ * condition: 'tree' is the condition, 'label' the label to jump to. The
+ * frame of a loop or switch keeps the label a break jumps to in 'exit',
+ * a loop the one a continue jumps to in 'repeat'.
+ */
+enum {
+    FRAME_NODE,
+    FRAME_BRANCH_FALSE,
+    FRAME_BRANCH_TRUE
+};
 
 void start_irgen(CCompiler *cmp)
 {
     if(!cmp)
         return;
 
-    cmp->misc.val    = 0; // virtual reg count
+    cmp->vreg_count  = 0;
     cmp->label_count = 0;
 
     for(CNode **ptr = &cmp->nodes; *ptr; ptr = &(*ptr)->next_stmt)
         _generate_from_tree(cmp, *ptr);
+
+    end_ir(cmp);
 }
 
-static CMisc *_generate_from_tree(CCompiler *cmp, CNode *tree)
+/*
+ * Lowers a single top-level declaration, for the drivers that print and
+ * release the IR of each declaration before lowering the next one.
+ */
+void generate_unit(CCompiler *cmp, CNode *tree)
 {
     if(!cmp || !tree)
-        return NULL;
+        return;
+
+    _generate_from_tree(cmp, tree);
+
+    end_ir(cmp);
+}
+
+/*
+ * Like the analyser, the generator walks the tree with cmp->stack: the
+ * _generate_* functions are called once per step, return true after
+ * pushing a child and false when the node is done. The value of an
+ * expression is the register the last instruction it emitted defines, for
+ * an assignment the value it stored.
+ */
+static COperand _generate_from_tree(CCompiler *cmp, CNode *tree)
+{
+    size_t base;
+
+    if(!cmp || !tree)
+        return 0;
+
+    base = cmp->stack->count;
+
+    _visit(cmp, tree);
+
+    while(cmp->stack->count > base)
+        if(!_generate_step(cmp, top_frame(cmp->stack)))
+            pop_frame(cmp->stack);
+
+    return _value_of(cmp, tree);
+}
+
+static bool _visit(CCompiler *cmp, CNode *tree)
+{
+    if(tree)
+        push_frame(cmp->stack, tree);
+
+    return true;
+}
+
+static COperand _value_of(CCompiler *cmp, CNode *tree)
+{
+    if(!tree)
+        return 0;
+
+    switch(tree->kind) {
+        case BINARYEXPR:
+            // a comma expression has the value of its right operand
+            if(tree->bin.op == ',')
+                return _value_of(cmp, tree->bin.rhs);
+            return last_ir(cmp)->arg1;
+        case LITERAL:
+        case IDENTIFIER:
+        case FNCALL:
+            return last_ir(cmp)->arg1;
+        case ASSIGN:
+            return last_ir(cmp)->arg2;
+        default:
+            return 0;
+    }
+}
+
+static bool _generate_step(CCompiler *cmp, CFrame *frame)
+{
+    CNode *tree = frame->tree;
+
+    if(frame->kind != FRAME_NODE)
+        return _generate_branch(cmp, frame);
 
     switch(tree->kind) {
         case FNDECL:
             _generate_fun(cmp, tree);
-            break;
+            return false;
         case LITERAL:
         case IDENTIFIER:
             _generate_load(cmp, tree);
-            return cmp->tail->arg1;
+            return false;
         case VARDECL:
-            _generate_vdecl(cmp, tree);
-            break;
+            return _generate_vdecl(cmp, frame);
         case BLOCK:
-            for(CNode **ptr = &tree->blk.head; *ptr; ptr = &(*ptr)->next_stmt)
-                _generate_from_tree(cmp, *ptr);
-            break;
+            return _generate_blk(cmp, frame);
         case BINARYEXPR:
-            _generate_bin(cmp, tree);
-            return cmp->tail->arg1;
+            return _generate_bin(cmp, frame);
         case ASSIGN:
-            _generate_assign(cmp, tree);
-            return cmp->tail->arg1;
+            return _generate_assign(cmp, frame);
         case IF:
-            _generate_if(cmp, tree);
-            break;
+            return _generate_if(cmp, frame);
         case WHILE:
-            _generate_while(cmp, tree);
-            break;
+            return _generate_while(cmp, frame);
         case DO_WHILE:
-            _generate_do_while(cmp, tree);
-            break;
+            return _generate_do_while(cmp, frame);
         case RETURN:
-            _generate_return(cmp, tree);
-            break;
+            return _generate_return(cmp, frame);
         case FOR:
-            _generate_for(cmp, tree);
-            break;
+            return _generate_for(cmp, frame);
+        case SWITCH:
+            return _generate_switch(cmp, frame);
+        case CASE:
+        case DEFAULT:
+            return _generate_case(cmp, frame);
+        case BREAK:
+        case CONTINUE:
+            _generate_jump(cmp, tree);
+            return false;
+        case FNCALL:
+            return _generate_call(cmp, frame);
+        default:
+            return false;
     }
+}
+
+static bool _generate_blk(CCompiler *cmp, CFrame *frame)
+{
+    frame->cursor = frame->step++ ? frame->cursor->next_stmt : frame->tree->blk.head;
 
-    return NULL;
+    return frame->cursor ? _visit(cmp, frame->cursor) : false;
 }
 
-static void _generate_do_while(CCompiler *cmp, CNode *tree)
+static bool _generate_do_while(CCompiler *cmp, CFrame *frame)
 {
-    CMisc *lb, *lb2;
+    CNode *tree = frame->tree;
+
+    switch(frame->step++) {
+        case 0:
+            frame->label = _new_label(&cmp->label_count);
+
+            add_ir(cmp, new_instruction(INS_LABEL, frame->label, 0, 0, tree->type, tree->line));
+            return _visit(cmp, tree->_while.then);
+        case 1:
+            if(frame->repeat)
+                add_ir(cmp, new_instruction(INS_LABEL, frame->repeat, 0, 0, tree->type, tree->line));
+            return _visit_branch(cmp, tree->_while.cond, frame->label, FRAME_BRANCH_TRUE);
+    }
 
-    if(!cmp || !tree)
-        return;
+    if(frame->exit)
+        add_ir(cmp, new_instruction(INS_LABEL, frame->exit, 0, 0, tree->type, tree->line));
 
-    lb  = _new_label(&cmp->label_count);
-    lb2 = _new_label(&cmp->label_count);
+    return false;
+}
+
+static bool _generate_while(CCompiler *cmp, CFrame *frame)
+{
+    CNode *tree = frame->tree;
+    COperand lb, lb2;
+
+    switch(frame->step++) {
+        case 0:
+            lb   = _new_label(&cmp->label_count);
+            lb2  = _new_label(&cmp->label_count);
+
+            frame->label  = lb;
+            frame->exit = lb2;
+            frame->repeat   = lb;
+
+            add_ir(cmp, new_instruction(INS_LABEL, lb, 0, 0, tree->type, tree->line));
+
+            return _visit_branch(cmp, tree->_while.cond, lb2, FRAME_BRANCH_FALSE);
+        case 1:
+            return _visit(cmp, tree->_while.then);
+    }
 
-    add_ir(cmp, new_instruction(INS_LABEL, lb, NULL, NULL, tree->type, tree->line));
-    _generate_from_tree(cmp, tree->_while.then);
-    _generate_from_tree(cmp, tree->_while.cond);
-    add_ir(cmp, new_instruction(INS_JMPZ,  lb2,  NULL, NULL, tree->type, tree->line));
-    add_ir(cmp, new_instruction(INS_JMP,   lb,   NULL, NULL, tree->type, tree->line));
-    add_ir(cmp, new_instruction(INS_LABEL, lb2,  NULL, NULL, tree->type, tree->line));
+    add_ir(cmp, new_instruction(INS_JMP,   frame->label,  0, 0, tree->type, tree->line));
+    add_ir(cmp, new_instruction(INS_LABEL, frame->exit, 0, 0, tree->type, tree->line));
+
+    return false;
 }
 
-static void _generate_while(CCompiler *cmp, CNode *tree)
+static bool _generate_if(CCompiler *cmp, CFrame *frame)
 {
-    CMisc *lb, *lb2;
+    CNode *tree = frame->tree;
 
-    if(!cmp || !tree)
-        return;
+    switch(frame->step++) {
+        case 0:
+            frame->label = _new_label(&cmp->label_count);
 
-    lb   = _new_label(&cmp->label_count);
-    lb2  = _new_label(&cmp->label_count);
+            return _visit_branch(cmp, tree->_if.cond, frame->label, FRAME_BRANCH_FALSE);
+        case 1:
+            return _visit(cmp, tree->_if.then);
+        case 2:
+            if(!tree->_if._else) {
+                add_ir(cmp, new_instruction(INS_LABEL, frame->label, 0, 0, tree->type, tree->line));
+                return false;
+            }
 
-    add_ir(cmp, new_instruction(INS_LABEL, lb, NULL, NULL, tree->type, tree->line));
+            frame->exit = _new_label(&cmp->label_count);
 
-    _generate_from_tree(cmp, tree->_while.cond);
+            add_ir(cmp, new_instruction(INS_JMP,  frame->exit, 0, 0, tree->type, tree->line));
+            add_ir(cmp, new_instruction(INS_LABEL, frame->label, 0, 0, tree->type, tree->line));
 
-    add_ir(cmp, new_instruction(INS_JMPZ, lb2, NULL, NULL, tree->type, tree->line));
+            return _visit(cmp, tree->_if._else);
+    }
 
-    _generate_from_tree(cmp, tree->_while.then);
+    add_ir(cmp, new_instruction(INS_LABEL, frame->exit, 0, 0, tree->type, tree->line));
 
-    add_ir(cmp, new_instruction(INS_JMP,   lb,  NULL, NULL, tree->type, tree->line));
-    add_ir(cmp, new_instruction(INS_LABEL, lb2, NULL, NULL, tree->type, tree->line));
+    return false;
 }
 
-static void _generate_if(CCompiler *cmp, CNode *tree)
+static bool _generate_for(CCompiler *cmp, CFrame *frame)
 {
-    CMisc  *arg;
-    CMisc  *lb, *lb2;
+    CNode *tree = frame->tree;
+
+    switch(frame->step++) {
+        case 0:
+            frame->label  = _new_label(&cmp->label_count);
+            frame->exit = _new_label(&cmp->label_count);
+
+            return _visit(cmp, tree->_for.init);
+        case 1:
+            add_ir(cmp, new_instruction(INS_LABEL, frame->label, 0, 0, tree->type, tree->line));
+
+            // for(;;) has no condition to test
+            return _visit_branch(cmp, tree->_for.cond, frame->exit, FRAME_BRANCH_FALSE);
+        case 2:
+            return _visit(cmp, tree->_for.then);
+        case 3:
+            if(frame->repeat)
+                add_ir(cmp, new_instruction(INS_LABEL, frame->repeat, 0, 0, tree->type, tree->line));
+            return _visit(cmp, tree->_for.step);
+    }
 
-    if(!cmp || !tree)
-        return;
+    add_ir(cmp, new_instruction(INS_JMP,   frame->label,  0, 0, tree->type, tree->line));
+    add_ir(cmp, new_instruction(INS_LABEL, frame->exit, 0, 0, tree->type, tree->line));
 
-    lb        = _new_label(&cmp->label_count);
-    
-    _generate_from_tree(cmp, tree->_if.cond);
-    add_ir(cmp, new_instruction(INS_JMPZ, lb, NULL, NULL, tree->type, tree->line));
+    return false;
+}
+
+/*
+ * The cases follow the dispatch in source order, each placed at its label
+ * so one falls through into the next.
+ */
+static bool _generate_switch(CCompiler *cmp, CFrame *frame)
+{
+    CNode  *tree = frame->tree;
+    COperand *labels;
+
+    switch(frame->step++) {
+        case 0:
+            return _visit(cmp, tree->_switch.cond);
+        case 1:
+            frame->exit  = _new_label(&cmp->label_count);
+            frame->data   = _lower_switch(cmp, tree, frame->exit);
+            frame->cursor = tree->_switch.cases;
+            break;
+        default:
+            frame->cursor = frame->cursor->next_stmt;
+            break;
+    }
+
+    if(frame->cursor) {
+        labels = frame->data;
+
+        add_ir(cmp, new_instruction(INS_LABEL, labels[frame->step - 2], 0, 0, 0, tree->line));
+
+        return _visit(cmp, frame->cursor);
+    }
+
+    add_ir(cmp, new_instruction(INS_LABEL, frame->exit, 0, 0, 0, tree->line));
+
+    return false;
+}
+
+static bool _generate_case(CCompiler *cmp, CFrame *frame)
+{
+    frame->cursor = frame->step++ ? frame->cursor->next_stmt : frame->tree->_case.head;
+
+    return frame->cursor ? _visit(cmp, frame->cursor) : false;
+}
+
+/*
+ * A break leaves the innermost loop or switch, a continue goes on with the
+ * innermost loop. Their labels are made when first jumped to: a loop only
+ * places the ones it needs, so it is not cut in more blocks than before.
+ */
+static void _generate_jump(CCompiler *cmp, CNode *tree)
+{
+    for(size_t i = cmp->stack->count; i-- > 0;) {
+        CFrame *frame = &cmp->stack->frames[i];
+        COperand *label;
 
-    _generate_from_tree(cmp, tree->_if.then);
+        if(frame->kind != FRAME_NODE)
+            continue;
 
-    if(!tree->_if._else) {
-        add_ir(cmp, new_instruction(INS_LABEL, lb, NULL, NULL, tree->type, tree->line));
+        switch(frame->tree->kind) {
+            case SWITCH:
+                if(tree->kind == CONTINUE)
+                    continue;
+                label = &frame->exit;
+                break;
+            case WHILE:
+            case DO_WHILE:
+            case FOR:
+                label = tree->kind == BREAK ? &frame->exit : &frame->repeat;
+                break;
+            default:
+                continue;
+        }
+
+        if(!*label)
+            *label = _new_label(&cmp->label_count);
+
+        add_ir(cmp, new_instruction(INS_JMP, *label, 0, 0, tree->type, tree->line));
         return;
     }
+}
 
-    lb2 = _new_label(&cmp->label_count);
+/*
+ * Emits the dispatch of a switch on the value of its condition and returns
+ * the labels of its cases, in source order. The sorted cases are cut into
+ * clusters, runs dense enough becoming a jump table and the others single
+ * cases. A few clusters are tested one after the other; more are searched
+ * with a balanced tree of compares against the first case of the middle
+ * cluster, down to runs that short. Values matching no case go to the
+ * default, or past the switch.
+ */
+static COperand *_lower_switch(CCompiler *cmp, CNode *tree, COperand end)
+{
+    COperand  *labels, value, other = end;
+    CCase     *cases;
+    CCluster  *clusters;
+    CSearch   *work;
+    size_t     work_count = 0, count = 0, case_count = 0, cluster_count, tables = 0, compares = 0;
+
+    for(CNode *c = tree->_switch.cases; c; c = c->next_stmt)
+        count++;
+
+    value  = _value_of(cmp, tree->_switch.cond);
+    labels = (COperand *)zalloc(sizeof(COperand) * (count + 1), ARENA_3);
+    cases  = (CCase *)zalloc(sizeof(CCase) * (count + 1), ARENA_3);
+
+    count = 0;
+
+    for(CNode *c = tree->_switch.cases; c; c = c->next_stmt) {
+        labels[count] = _new_label(&cmp->label_count);
+
+        if(c->kind == DEFAULT)
+            other = labels[count];
+        else {
+            cases[case_count].val   = c->_case.cond->misc->val;
+            cases[case_count].key   = (uint64_t)cases[case_count].val ^ (_is_unsigned(tree->type) ? 0 : 1ull << 63);
+            cases[case_count].label = labels[count];
+            case_count++;
+        }
+
+        count++;
+    }
 
-    add_ir(cmp, new_instruction(INS_JMP,  lb2, NULL, NULL, tree->type, tree->line));
-    add_ir(cmp, new_instruction(INS_LABEL, lb, NULL, NULL, tree->type, tree->line));
+    qsort(cases, case_count, sizeof(CCase), _compare_cases);
 
-    _generate_from_tree(cmp, tree->_if._else);
-    
-    add_ir(cmp, new_instruction(INS_LABEL, lb2, NULL, NULL, tree->type, tree->line));
+    clusters      = (CCluster *)zalloc(sizeof(CCluster) * (case_count + 1), ARENA_3);
+    cluster_count = _cluster(cases, case_count, clusters);
+
+    // the half placed next, falling through from the compare, on top
+    work = (CSearch *)zalloc(sizeof(CSearch) * (cluster_count + 2), ARENA_3);
+
+    work[work_count++] = (CSearch){0, cluster_count, 0};
+
+    while(work_count) {
+        CSearch  search = work[--work_count];
+        COperand label;
+        size_t   mid;
+
+        if(search.label)
+            add_ir(cmp, new_instruction(INS_LABEL, search.label, 0, 0, 0, tree->line));
+
+        if(search.last - search.first <= SWITCH_LINEAR_MAX) {
+            for(size_t i = search.first; i < search.last; i++) {
+                _emit_cluster(cmp, tree, value, cases, &clusters[i], other);
+
+                tables   += clusters[i].first != clusters[i].last;
+                compares += clusters[i].first == clusters[i].last;
+            }
+
+            add_ir(cmp, new_instruction(INS_JMP, other, 0, 0, 0, tree->line));
+            continue;
+        }
+
+        mid   = search.first + (search.last - search.first) / 2;
+        label = _new_label(&cmp->label_count);
+
+        add_ir(cmp, new_instruction(INS_JLT, label, value, _new_constant(cmp, cases[clusters[mid].first].val),
+                                    tree->type, tree->line));
+
+        compares++;
+
+        work[work_count++] = (CSearch){search.first, mid, label};
+        work[work_count++] = (CSearch){mid, search.last, 0};
+    }
+
+    if(options & COMPILER_OPTION_STATS)
+        fprintf(cmp->diag, "switch('%s'): %ld cases, %ld jump tables, %ld compares\n", cmp->fn->sym->name,
+                case_count, tables, compares);
+
+    return labels;
 }
 
-static void _generate_for(CCompiler *cmp, CNode *tree)
+/*
+ * Cuts the sorted cases into clusters, greedily from the lowest: each one
+ * takes the longest run starting there that makes a jump table, or just
+ * its first case. Returns the number of clusters.
+ */
+static size_t _cluster(CCase *cases, size_t count, CCluster *clusters)
 {
-    CMisc *lb, *lb2;
+    size_t n = 0;
 
-    if(!cmp || !tree)
+    for(size_t i = 0; i < count; n++) {
+        size_t j = i;
+
+        for(size_t k = count; k-- > i + SWITCH_TABLE_MIN - 1;) {
+            uint64_t range = cases[k].key - cases[i].key;
+
+            if(range < SWITCH_TABLE_MAX && (k - i + 1) * 100 >= (range + 1) * SWITCH_TABLE_DENSITY) {
+                j = k;
+                break;
+            }
+        }
+
+        clusters[n].first = i;
+        clusters[n].last  = j;
+
+        i = j + 1;
+    }
+
+    return n;
+}
+
+/*
+ * Jumps to the case 'cluster' holds 'value', falls through otherwise. A
+ * jump table is indexed by the distance from its first case, the values
+ * it spans that are no case going to 'other'.
+ */
+static void _emit_cluster(CCompiler *cmp, CNode *tree, COperand value, CCase *cases, CCluster *cluster, COperand other)
+{
+    COperand  table, index = value, *entries;
+    uint64_t  size;
+
+    if(cluster->first == cluster->last) {
+        add_ir(cmp, new_instruction(INS_JEQ, cases[cluster->first].label, value,
+                                    _new_constant(cmp, cases[cluster->first].val), tree->type, tree->line));
         return;
+    }
+
+    size    = cases[cluster->last].key - cases[cluster->first].key + 1;
+    table   = ir_list(_fn(cmp), OPERAND_ARGS, size);
+    entries = LIST_OF(cmp->fn, table);
+
+    for(uint64_t i = 0; i < size; i++)
+        entries[i] = other;
+
+    for(size_t i = cluster->first; i <= cluster->last; i++)
+        entries[cases[i].key - cases[cluster->first].key] = cases[i].label;
+
+    if(cases[cluster->first].val) {
+        index = _new_vreg(cmp);
+        add_ir(cmp, new_instruction(INS_SUB, index, value, _new_constant(cmp, cases[cluster->first].val), tree->type,
+                                    tree->line));
+    }
+
+    add_ir(cmp, new_instruction(INS_JTAB, table, index, 0, tree->type, tree->line));
+}
 
-    lb  = _new_label(&cmp->label_count);
-    lb2 = _new_label(&cmp->label_count);
+static int _compare_cases(const void *c1, const void *c2)
+{
+    const CCase *cs1 = (const CCase *)c1;
+    const CCase *cs2 = (const CCase *)c2;
+
+    return cs1->key < cs2->key ? -1 : cs1->key > cs2->key;
+}
 
-    _generate_from_tree(cmp, tree->_for.init);
+static bool _is_unsigned(CType *type)
+{
+    if(!type)
+        return false;
 
-    add_ir(cmp, new_instruction(INS_LABEL, lb, NULL, NULL, tree->type, tree->line));
+    return type->kind == UCHAR || type->kind == USHORT || type->kind == UINT || type->kind == ULONG;
+}
 
-    _generate_from_tree(cmp, tree->_for.cond);
+static bool _generate_return(CCompiler *cmp, CFrame *frame)
+{
+    CNode *tree = frame->tree;
 
-    add_ir(cmp, new_instruction(INS_JMPZ, lb2, NULL, NULL, tree->type, tree->line));
+    if(!tree->ret.expr) {
+        add_ir(cmp, new_instruction(INS_RET, 0, 0, 0, tree->type, tree->line));
+        return false;
+    }
 
-    _generate_from_tree(cmp, tree->_for.then);
+    if(!frame->step++)
+        return _visit(cmp, tree->ret.expr);
 
-    _generate_from_tree(cmp, tree->_for.step);
+    add_ir(cmp, new_instruction(INS_RETVAL, _value_of(cmp, tree->ret.expr), 0, 0, tree->type, tree->line));
 
-    add_ir(cmp, new_instruction(INS_JMP,   lb,  NULL, NULL, tree->type, tree->line));
-    add_ir(cmp, new_instruction(INS_LABEL, lb2, NULL, NULL, tree->type, tree->line));
+    return false;
 }
 
-static void _generate_return(CCompiler *cmp, CNode *tree)
+static void _generate_fun(CCompiler *cmp, CNode *tree)
 {
     if(!cmp || !tree)
         return;
 
-    if(!tree->ret.expr) {
-        add_ir(cmp, new_instruction(INS_RET, NULL, NULL, NULL, tree->type, tree->line));
+    if(!tree->decl.init && tree->decl.body)
+        return; // lazy body never referenced, nothing to emit
+
+    // fused mode emits a function before the rest of the unit had a chance to call it
+    if((options & COMPILER_OPTION_OPTIMIZE) && !(options & COMPILER_OPTION_FUSED) &&
+       (tree->decl.symbol->flags & SYMBOL_IS_STATIC) && !tree->decl.symbol->usage) {
+        cmp->opt.dead_functions++;
         return;
     }
 
-    add_ir(cmp, new_instruction(INS_RETVAL, _generate_from_tree(cmp, tree->ret.expr), NULL, NULL, tree->type, tree->line));
+    if(cmp->jobs) {
+        _splice_job(cmp, tree);
+        return;
+    }
+
+    generate_function(cmp, tree);
 }
 
-static void _generate_fun(CCompiler *cmp, CNode *tree)
+void generate_function(CCompiler *cmp, CNode *tree)
 {
-    CMisc *arg;
+    CFunction *fn;
+    COperand   arg;
     
     if(!cmp || !tree)
         return;
 
-    arg      = new_misc(MISC_CONSTANT_INT);
-    arg->val = 0;
-    arg->sym = tree->decl.symbol;
+    cmp->vreg_count  = 0;
+    cmp->label_count = 0;
 
-    cmp->misc.val = 0;
+    fn  = begin_ir(cmp, tree->decl.symbol);
+    arg = ir_constant(fn, OPERAND_INT, 0);
 
-    add_ir(cmp, new_instruction(INS_ENTER, arg, NULL, NULL, tree->type, tree->line));
+    add_ir(cmp, new_instruction(INS_ENTER, arg, 0, 0, tree->type, tree->line));
     _generate_from_tree(cmp, tree->decl.init);
-    add_ir(cmp, new_instruction(INS_LEAVE, arg, NULL, NULL, tree->type, tree->line));
+    add_ir(cmp, new_instruction(INS_LEAVE, arg, 0, 0, tree->type, tree->line));
+
+    end_ir(cmp);
+
+    optimize_function(cmp, fn);
 }
 
-static void _generate_load(CCompiler *cmp, CNode *tree)
+/*
+ * Appends the IR a worker produced for 'tree'. Jobs are sorted in source
+ * order, the same order FNDECL nodes are visited here.
+ */
+static void _splice_job(CCompiler *cmp, CNode *tree)
 {
-    CMisc *arg1;
+    CJob *job;
 
-    if(!cmp || !tree)
-        return;
+    assert(cmp->job_cursor < cmp->job_count);
 
-    arg1 = new_misc(MISC_VREG);
+    job = &cmp->jobs[cmp->job_cursor++];
 
-    arg1->vreg = new_virtual_register(cmp->misc.val);
+    assert(job->tree == tree);
+
+    if(!job->fn)
+        return;
 
-    cmp->misc.val++;
+    end_ir(cmp);
 
-    add_ir(cmp, new_instruction(INS_LOAD, arg1, tree->misc, NULL, tree->type, tree->line));
+    if(!cmp->head)
+        cmp->head = job->fn;
+    else
+        cmp->tail->next = job->fn;
+
+    cmp->tail = job->fn;
 }
 
-static void _generate_vdecl(CCompiler *cmp, CNode *tree)
+static void _generate_load(CCompiler *cmp, CNode *tree)
 {
-    CMisc *arg1;
-
     if(!cmp || !tree)
         return;
 
-    for(CNode **ptr = &tree; *ptr; ptr = &(*ptr)->next) {
-        if(!(*ptr)->decl.init)
+    add_ir(cmp, new_instruction(INS_LOAD, _new_vreg(cmp), ir_operand(_fn(cmp), tree->misc), 0, tree->type, tree->line));
+}
+
+static bool _generate_vdecl(CCompiler *cmp, CFrame *frame)
+{
+    CNode   *decl = frame->cursor;
+    COperand arg1;
+
+    // the initializer of 'decl' has just been lowered
+    if(decl) {
+        arg1 = ir_symbol(_fn(cmp), decl->decl.symbol);
+
+        add_ir(cmp, new_instruction(INS_STORE, arg1, _value_of(cmp, decl->decl.init), 0, decl->type, decl->line));
+
+        decl = decl->next;
+    }
+    else if(!frame->step++)
+        decl = frame->tree;
+
+    for(; decl; decl = decl->next) {
+        if(!decl->decl.init)
             continue;
-        arg1 = new_misc(MISC_SYMBOL);
-        arg1->sym = (*ptr)->decl.symbol;
 
-        add_ir(cmp, new_instruction(INS_STORE, arg1, _generate_from_tree(cmp, (*ptr)->decl.init), NULL, (*ptr)->type, (*ptr)->line));
+        frame->cursor = decl;
+
+        return _visit(cmp, decl->decl.init);
     }
+
+    return false;
 }
 
-static void _generate_bin(CCompiler *cmp, CNode *tree)
+static bool _generate_bin(CCompiler *cmp, CFrame *frame)
 {
-    CMisc *arg;
+    CNode *tree = frame->tree;
 
-    if(!cmp || !tree)
-        return;
+    if(tree->bin.op == TK_ANDAND || tree->bin.op == TK_OROR)
+        return _generate_logical(cmp, frame);
+
+    switch(frame->step++) {
+        case 0:
+            return _visit(cmp, tree->bin.lhs);
+        case 1:
+            frame->value = _value_of(cmp, tree->bin.lhs);
+            return _visit(cmp, tree->bin.rhs);
+    }
+
+    if(tree->bin.op != ',')
+        add_ir(cmp, new_instruction(_get_op(tree->bin.op), _new_vreg(cmp), frame->value, _value_of(cmp, tree->bin.rhs), tree->type, tree->line));
+
+    return false;
+}
+
+/*
+ * The value of && and || outside of a condition: the short-circuit
+ * branches store 1 or 0 into a temporary local, which becomes a phi at
+ * the join once the function is in SSA form.
+ */
+static bool _generate_logical(CCompiler *cmp, CFrame *frame)
+{
+    CNode *tree = frame->tree;
+    COperand done, var, one, zero;
+
+    if(!frame->step++) {
+        frame->label = _new_label(&cmp->label_count);
+
+        return _visit_branch(cmp, tree, frame->label, FRAME_BRANCH_FALSE);
+    }
 
-    add_ir(cmp, new_instruction(_get_op(tree->bin.op), _generate_from_tree(cmp, tree->bin.lhs), _generate_from_tree(cmp, tree->bin.rhs), NULL, tree->type, tree->line));
+    done = _new_label(&cmp->label_count);
+    var  = ir_temp(_fn(cmp), tree->bin.op == TK_ANDAND ? "$and" : "$or", tree->type);
+    one  = _new_vreg(cmp);
+    zero = _new_vreg(cmp);
+
+    add_ir(cmp, new_instruction(INS_LOAD,  one,  _new_constant(cmp, 1), 0, tree->type, tree->line));
+    add_ir(cmp, new_instruction(INS_STORE, var,  one, 0, tree->type, tree->line));
+    add_ir(cmp, new_instruction(INS_JMP,   done, 0, 0, 0, tree->line));
+    add_ir(cmp, new_instruction(INS_LABEL, frame->label, 0, 0, 0, tree->line));
+    add_ir(cmp, new_instruction(INS_LOAD,  zero, _new_constant(cmp, 0), 0, tree->type, tree->line));
+    add_ir(cmp, new_instruction(INS_STORE, var,  zero, 0, tree->type, tree->line));
+    add_ir(cmp, new_instruction(INS_LABEL, done, 0, 0, 0, tree->line));
+    add_ir(cmp, new_instruction(INS_LOAD,  _new_vreg(cmp), var, 0, tree->type, tree->line));
+
+    return false;
 }
 
+/*
+ * CALL defines the result (none for a void function) and reads the callee
+ * and the list of argument values. A direct call names the function's
+ * symbol, anything else computes the callee first.
+ */
+static bool _generate_call(CCompiler *cmp, CFrame *frame)
+{
+    CNode *tree = frame->tree;
+    CNode *base = tree->fncall.base;
+    COperand def  = 0;
+
+    switch(frame->step++) {
+        case 0:
+            frame->list = ir_list(_fn(cmp), OPERAND_ARGS, tree->fncall.count);
+
+            return _visit(cmp, _is_direct_call(tree) ? NULL : base);
+        case 1:
+            frame->value  = _is_direct_call(tree) ? ir_operand(cmp->fn, base->misc) : _value_of(cmp, base);
+            frame->cursor = tree->fncall.args;
+
+            return _visit(cmp, frame->cursor);
+    }
+
+    // the argument in 'cursor' has just been lowered, into no value when it isn't supported
+    if(frame->cursor) {
+        if(!(LIST_OF(cmp->fn, frame->list)[frame->step - 3] = _value_of(cmp, frame->cursor)))
+            error(cmp, frame->cursor->line, "Unsupported expression as argument of function call\n");
+
+        if((frame->cursor = frame->cursor->next_stmt))
+            return _visit(cmp, frame->cursor);
+    }
+
+    if(tree->type && tree->type->kind != VOID)
+        def = _new_vreg(cmp);
+
+    add_ir(cmp, new_instruction(INS_CALL, def, frame->value, frame->list, tree->type, tree->line));
+
+    return false;
+}
+
+/*
+ * Jumps to the label in 'data' when the condition is false, or when it is
+ * true for FRAME_BRANCH_TRUE. A relation is fused into one compare and
+ * branch, inverted to jump on false so that the true case falls through,
+ * except for an ordering between floats, which a NaN makes false both
+ * ways. && and || jump on each operand in turn. Any other condition is
+ * computed into a register, tested with JMPZ to jump on false and
+ * compared to zero to jump on true.
+ */
+static bool _generate_branch(CCompiler *cmp, CFrame *frame)
+{
+    CNode      *tree  = frame->tree;
+    bool        taken = frame->kind == FRAME_BRANCH_TRUE;
+    Instruction kind;
+
+    if(tree->kind == BINARYEXPR && (tree->bin.op == TK_ANDAND || tree->bin.op == TK_OROR))
+        return _generate_short_circuit(cmp, frame);
+
+    if(_is_fusable(tree, !taken)) {
+        switch(frame->step++) {
+            case 0:
+                return _visit(cmp, tree->bin.lhs);
+            case 1:
+                frame->value = _value_of(cmp, tree->bin.lhs);
+                return _visit(cmp, tree->bin.rhs);
+        }
+
+        kind = _get_branch(tree->bin.op);
+
+        add_ir(cmp, new_instruction(taken ? kind : invert_branch(kind), frame->label, frame->value,
+                                    _value_of(cmp, tree->bin.rhs), tree->type, tree->line));
+        return false;
+    }
+
+    if(!frame->step++)
+        return _visit(cmp, tree);
+
+    if(taken)
+        add_ir(cmp, new_instruction(INS_JNE, frame->label, _value_of(cmp, tree), _new_constant(cmp, 0), tree->type, tree->line));
+    else
+        add_ir(cmp, new_instruction(INS_JMPZ, frame->label, _value_of(cmp, tree), 0, 0, tree->line));
+
+    return false;
+}
+
+/*
+ * When jumping on the result an operator settles early, on false for &&
+ * and on true for ||, both operands jump to the label. Otherwise the
+ * left operand jumps the other way, past the right one, which alone
+ * decides whether to jump to the label.
+ */
+static bool _generate_short_circuit(CCompiler *cmp, CFrame *frame)
+{
+    CNode *tree  = frame->tree;
+    bool   taken = frame->kind == FRAME_BRANCH_TRUE;
+    bool   early = taken == (tree->bin.op == TK_OROR);
+
+    switch(frame->step++) {
+        case 0:
+            if(early)
+                return _visit_branch(cmp, tree->bin.lhs, frame->label, frame->kind);
+
+            frame->exit = _new_label(&cmp->label_count);
+
+            return _visit_branch(cmp, tree->bin.lhs, frame->exit, taken ? FRAME_BRANCH_FALSE : FRAME_BRANCH_TRUE);
+        case 1:
+            return _visit_branch(cmp, tree->bin.rhs, frame->label, frame->kind);
+    }
+
+    if(!early)
+        add_ir(cmp, new_instruction(INS_LABEL, frame->exit, 0, 0, 0, tree->line));
+
+    return false;
+}
+
+static bool _visit_branch(CCompiler *cmp, CNode *cond, COperand label, int kind)
+{
+    CFrame *frame;
+
+    if(!cond)
+        return true;
+
+    frame       = push_frame(cmp->stack, cond);
+    frame->kind = kind;
+    frame->label = label;
+
+    return true;
+}
+
+static bool _is_direct_call(CNode *tree)
+{
+    CNode *base = tree->fncall.base;
+
+    return base->kind == IDENTIFIER && base->type && base->type->kind == FUNCTION;
+}
+
+static bool _is_fusable(CNode *cond, bool invert)
+{
+    TypeKind kind;
+
+    if(cond->kind != BINARYEXPR || !cond->type || _get_branch(cond->bin.op) == INS_END_MARK)
+        return false;
+
+    kind = cond->type->kind;
+
+    if(kind >= FLOAT && kind <= LDOUBLE)
+        return !invert || cond->bin.op == TK_EQ_EQ || cond->bin.op == TK_NOT_EQ;
+
+    return (kind >= CHAR && kind <= ULONG) || kind == PTR;
+}
+
+/*
+ * Instruction of a binary operator, or of the operator of a compound
+ * assignment. && , || and ',' have none, they are lowered on their own.
+ */
 static Instruction _get_op(int op)
 {
     switch(op) {
         case '+':
+        case TK_ADD_EQ:
             return INS_ADD;
         case '-':
+        case TK_SUB_EQ:
             return INS_SUB;
         case '*':
+        case TK_MUL_EQ:
             return INS_MUL;
         case '/':
+        case TK_DIV_EQ:
             return INS_DIV;
+        case '%':
+        case TK_MOD_EQ:
+            return INS_MOD;
         case TK_SHL:
+        case TK_SHL_EQ:
             return INS_SHL;
         case TK_SHR:
+        case TK_SHR_EQ:
             return INS_SHR;
         case TK_GE:
             return INS_GE;
@@ -269,40 +951,101 @@ static Instruction _get_op(int op)
             return INS_LE;
         case '<':
             return INS_LT;
+        case TK_EQ_EQ:
+            return INS_EQ;
+        case TK_NOT_EQ:
+            return INS_NE;
         case '&':
+        case TK_AND_EQ:
             return INS_AND;
+        case '|':
+        case TK_OR_EQ:
+            return INS_OR;
+        case '^':
+        case TK_XOR_EQ:
+            return INS_XOR;
     }
 
-    return INS_ADD;
+    return INS_END_MARK;
 }
 
-static void _generate_assign(CCompiler *cmp, CNode *tree)
+static bool _generate_assign(CCompiler *cmp, CFrame *frame)
 {
-    CMisc *arg1, *arg2;
+    CNode *tree = frame->tree;
+    COperand value;
+
+    switch(frame->step++) {
+        case 0:
+            return _visit(cmp, tree->bin.lhs->kind != IDENTIFIER ? tree->bin.lhs : NULL);
+        case 1:
+            if(tree->bin.lhs->kind != IDENTIFIER)
+                frame->value = _value_of(cmp, tree->bin.lhs);
+            else
+                frame->value = ir_operand(_fn(cmp), tree->bin.lhs->misc);
+            return _visit(cmp, tree->bin.rhs);
+    }
 
-    if(!cmp || !tree)
-        return;
+    value = _value_of(cmp, tree->bin.rhs);
 
-    if(tree->bin.lhs->kind != IDENTIFIER)
-        arg1 = _generate_from_tree(cmp, tree->bin.lhs);
-    else
-        arg1 = tree->bin.lhs->misc;
-    arg2 = _generate_from_tree(cmp, tree->bin.rhs);
+    // a compound assignment to a variable reads it after the right operand
+    if(tree->bin.op != '=' && tree->bin.lhs->kind == IDENTIFIER) {
+        COperand cur = _new_vreg(cmp);
+        COperand def = _new_vreg(cmp);
 
-    add_ir(cmp, new_instruction(INS_STORE, arg1, arg2, NULL, tree->type, tree->line));
+        add_ir(cmp, new_instruction(INS_LOAD, cur, frame->value, 0, tree->type, tree->line));
+        add_ir(cmp, new_instruction(_get_op(tree->bin.op), def, cur, value, tree->type, tree->line));
+
+        value = def;
+    }
+
+    add_ir(cmp, new_instruction(INS_STORE, frame->value, value, 0, tree->type, tree->line));
+
+    return false;
 }
 
-static CMisc *_new_label(size_t *id)
+/*
+ * Function the IR goes to, a container for code outside of functions
+ * when none is open yet.
+ */
+static CFunction *_fn(CCompiler *cmp)
 {
-    CMisc *misc;
+    if(!cmp->fn)
+        begin_ir(cmp, NULL);
 
-    if(!id)
-        return NULL;
+    return cmp->fn;
+}
 
-    misc = new_misc(MISC_LABEL);
+static COperand _new_label(size_t *id)
+{
+    return OPERAND(OPERAND_LABEL, (*id)++);
+}
 
-    misc->label = new_label(NULL, (*id)++);
+static COperand _new_vreg(CCompiler *cmp)
+{
+    return OPERAND(OPERAND_VREG, cmp->vreg_count++);
+}
 
-    return misc;
+static COperand _new_constant(CCompiler *cmp, int64_t val)
+{
+    return ir_constant(_fn(cmp), OPERAND_INT, val);
 }
 
+static Instruction _get_branch(int op)
+{
+    switch(op) {
+        case TK_GE:
+            return INS_JGE;
+        case '>':
+            return INS_JGT;
+        case TK_LE:
+            return INS_JLE;
+        case '<':
+            return INS_JLT;
+        case TK_EQ_EQ:
+            return INS_JEQ;
+        case TK_NOT_EQ:
+            return INS_JNE;
+    }
+
+    return INS_END_MARK;
+}
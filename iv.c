@@ -0,0 +1,648 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * Induction variables and strength reduction. A basic induction variable
+ * is a phi of a loop header taking its initial value from the preheader
+ * and itself plus a loop-invariant step around the only back edge. A
+ * multiply of one by an invariant, or a shift by a constant, is then
+ * linear in the loop too: it becomes a new header phi starting at
+ * init * k and stepping by step * k next to the basic variable's own
+ * increment, the products being folded or computed in the preheader.
+ *
+ * When a basic variable is then only read by its increment and by tests
+ * against constants, the tests are made on the reduced variable instead
+ * (linear-function test replacement), leaving the basic variable dead for
+ * dead code elimination to drop. That is only done when the header exits
+ * the loop on such a test, which bounds the values the variable takes, and
+ * for a signed type and a positive constant factor with all of that range
+ * scaled without overflow, so the order of the values is kept.
+ *
+ * Finally any multiply by a power of two becomes a shift.
+ */
+
+typedef struct CInduction CInduction;
+
+struct CInduction {
+    COperand reg;
+    CType   *type;
+    COperand init;
+    COperand step;
+    COperand next;
+    COperand scaled; // a reduced multiple, for test replacement
+    int64_t  factor;
+};
+
+typedef struct CIV {
+    CCompiler    *cmp;
+    CFunction    *fn;
+    size_t        vreg_count;
+    CBasicBlock **def_block;
+    COperand     *constant;
+    size_t       *uses;
+    COperand     *repl;
+    CInduction   *ivs;
+    size_t        iv_count;
+    size_t        reduced;
+    size_t        tests;
+    size_t        shifts;
+} CIV;
+
+static void          _scan(CIV *iv);
+static void          _reduce_loop(CIV *iv, CLoop *loop);
+static void          _find_inductions(CIV *iv, CLoop *loop, size_t from_pre);
+static void          _reduce(CIV *iv, CLoop *loop, size_t from_pre, CInstruction *ins);
+static void          _replace_tests(CIV *iv, CLoop *loop, CInduction *ind);
+static bool          _is_bounded(CIV *iv, CLoop *loop, CInduction *ind, int64_t step);
+static bool          _scale(CInduction *ind, int64_t val, int64_t *result);
+static void          _shift_multiplies(CIV *iv);
+static void          _rewrite(CIV *iv);
+static CInduction   *_induction_of(CIV *iv, COperand arg);
+static CInstruction *_def_of(CIV *iv, COperand arg);
+static COperand      _constant_of(CIV *iv, COperand arg);
+static bool          _is_invariant(CIV *iv, CLoop *loop, COperand arg);
+static COperand      _product(CIV *iv, CBasicBlock *pre, COperand m1, COperand m2, CType *type, size_t line);
+static COperand      _new_constant(CIV *iv, int64_t val);
+static void          _insert(CIV *iv, CBasicBlock *blk, size_t index, CInstruction ins);
+static void          _count_uses(CIV *iv, CInstruction *ins, int delta);
+
+static bool          _is_integer(CType *type);
+static bool          _is_unsigned(CType *type);
+static int64_t       _truncate(CType *type, int64_t val);
+
+void reduce_strength(CCompiler *cmp, CFunction *fn)
+{
+    CIV iv;
+
+    if(!cmp || !fn || !fn->entry)
+        return;
+
+    memset(&iv, 0, sizeof(CIV));
+
+    iv.cmp        = cmp;
+    iv.fn         = fn;
+    iv.vreg_count = fn->vreg_count;
+
+    find_loops(fn);
+    _scan(&iv);
+
+    for(size_t i = 0; i < fn->loop_count; i++)
+        _reduce_loop(&iv, &fn->loops[i]);
+
+    _shift_multiplies(&iv);
+    _rewrite(&iv);
+
+    cmp->opt.reduced        += iv.reduced;
+    cmp->opt.replaced_tests += iv.tests;
+    cmp->opt.shifts         += iv.shifts;
+
+    if((options & COMPILER_OPTION_STATS) && (iv.reduced || iv.tests || iv.shifts))
+        fprintf(cmp->diag, "iv('%s'): %ld multiplies reduced, %ld tests replaced, %ld multiplies made shifts\n",
+                fn->sym->name, iv.reduced, iv.tests, iv.shifts);
+}
+
+/*
+ * Where each register is defined, which ones are constants and how many
+ * times each is read by a result in use. Registers created by the pass
+ * are past the end of these and are never looked up.
+ */
+static void _scan(CIV *iv)
+{
+    CFunction *fn    = iv->fn;
+    size_t     count = iv->vreg_count;
+
+    iv->def_block = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * (count + 1), ARENA_3);
+    iv->constant  = (COperand *)zalloc(sizeof(COperand) * (count + 1), ARENA_3);
+    iv->uses      = (size_t *)zalloc(sizeof(size_t) * (count + 1), ARENA_3);
+    iv->repl      = (COperand *)zalloc(sizeof(COperand) * (count + 1), ARENA_3);
+
+    memset(iv->def_block, 0, sizeof(CBasicBlock *) * count);
+    memset(iv->constant, 0, sizeof(COperand) * count);
+    memset(iv->uses, 0, sizeof(size_t) * count);
+    memset(iv->repl, 0, sizeof(COperand) * count);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand      def = ins_def(ins);
+
+            _count_uses(iv, ins, 1);
+
+            if(!def || OPERAND_INDEX(def) >= count)
+                continue;
+
+            iv->def_block[OPERAND_INDEX(def)] = blk;
+
+            if(ins->kind == INS_LOAD && OPERAND_KIND(ins->arg2) == OPERAND_INT)
+                iv->constant[OPERAND_INDEX(def)] = ins->arg2;
+        }
+    }
+
+    // what an unused result reads is left for dead code elimination
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            COperand def = ins_def(&blk->ins[j]);
+
+            if(def && OPERAND_INDEX(def) < count && !iv->uses[OPERAND_INDEX(def)] && !ins_clobbers(&blk->ins[j]))
+                _count_uses(iv, &blk->ins[j], -1);
+        }
+    }
+}
+
+/*
+ * Only loops with a preheader and a single back edge are handled, their
+ * header has exactly two predecessors then.
+ */
+static void _reduce_loop(CIV *iv, CLoop *loop)
+{
+    CBasicBlock *header = loop->header;
+    size_t       from_pre;
+
+    if(!loop->preheader || header->pred_count != 2)
+        return;
+
+    from_pre = header->preds[0] == loop->preheader ? 0 : 1;
+
+    _find_inductions(iv, loop, from_pre);
+
+    if(!iv->iv_count)
+        return;
+
+    // only phis and ADDs are inserted, so an instruction seen twice after
+    // one went in front of it has already been removed
+    for(size_t i = 0; i < loop->count; i++) {
+        CBasicBlock *blk = loop->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+
+            if((ins->kind == INS_MUL || ins->kind == INS_SHL) && _is_integer(ins->type))
+                _reduce(iv, loop, from_pre, ins);
+        }
+    }
+
+    for(size_t i = 0; i < iv->iv_count; i++)
+        _replace_tests(iv, loop, &iv->ivs[i]);
+}
+
+static void _find_inductions(CIV *iv, CLoop *loop, size_t from_pre)
+{
+    CBasicBlock *header = loop->header;
+    size_t       phis   = 0;
+
+    while(phis < header->count && header->ins[phis].kind == INS_PHI)
+        phis++;
+
+    iv->iv_count = 0;
+    iv->ivs      = (CInduction *)zalloc(sizeof(CInduction) * (phis + 1), ARENA_3);
+
+    for(size_t i = 0; i < phis; i++) {
+        CInstruction *phi  = &header->ins[i];
+        COperand      next = LIST_OF(iv->fn, phi->arg2)[1 - from_pre];
+        CInstruction *add  = _def_of(iv, next);
+        CInduction   *ind;
+        COperand      step;
+
+        if(!add || !loop_contains(loop, iv->def_block[OPERAND_INDEX(next)]) ||
+           (add->kind != INS_ADD && add->kind != INS_SUB))
+            continue;
+
+        if(add->arg2 == phi->arg1)
+            step = add->arg3;
+        else if(add->kind == INS_ADD && add->arg3 == phi->arg1)
+            step = add->arg2;
+        else
+            continue;
+
+        if(!_is_invariant(iv, loop, step))
+            continue;
+
+        if(add->kind == INS_SUB) {
+            if(!(step = _constant_of(iv, step)))
+                continue;
+
+            step = _new_constant(iv, _truncate(phi->type, (int64_t)(0 - (uint64_t)VALUE_OF(iv->fn, step).val)));
+        }
+
+        ind = &iv->ivs[iv->iv_count++];
+
+        ind->reg    = phi->arg1;
+        ind->type   = phi->type;
+        ind->init   = LIST_OF(iv->fn, phi->arg2)[from_pre];
+        ind->step   = step;
+        ind->next   = next;
+        ind->scaled = 0;
+        ind->factor = 0;
+    }
+}
+
+/*
+ * 'ins' is MUL d, i, k or SHL d, i, c with i a basic induction variable:
+ * d is replaced by a new variable stepping by step * k.
+ */
+static void _reduce(CIV *iv, CLoop *loop, size_t from_pre, CInstruction *ins)
+{
+    CBasicBlock  *header = loop->header, *blk;
+    CInduction   *ind;
+    CInstruction  phi;
+    COperand      factor, init, step, reg, next, val, *args;
+    CType        *type = ins->type;
+    size_t        line = ins->line, at;
+
+    if((ind = _induction_of(iv, ins->arg2)))
+        factor = ins->arg3;
+    else if(ins->kind == INS_MUL && (ind = _induction_of(iv, ins->arg3)))
+        factor = ins->arg2;
+    else
+        return;
+
+    if(ins->kind == INS_SHL) {
+        if(!(val = _constant_of(iv, factor)) || VALUE_OF(iv->fn, val).val < 0 ||
+           VALUE_OF(iv->fn, val).val >= (int64_t)type->size * 8)
+            return;
+
+        factor = _new_constant(iv, _truncate(type, (int64_t)((uint64_t)1 << VALUE_OF(iv->fn, val).val)));
+    }
+
+    if(!_is_invariant(iv, loop, factor) || OPERAND_INDEX(ins->arg1) >= iv->vreg_count || !iv->uses[OPERAND_INDEX(ins->arg1)])
+        return;
+
+    // the multiply goes away, what it read loses a use
+    _count_uses(iv, ins, -1);
+
+    reg                                = ir_vreg(iv->fn);
+    iv->repl[OPERAND_INDEX(ins->arg1)] = reg;
+    ins->kind                          = INS_END_MARK;
+
+    next = ir_vreg(iv->fn);
+    init = _product(iv, loop->preheader, ind->init, factor, type, line);
+    step = _product(iv, loop->preheader, ind->step, factor, type, line);
+    phi  = new_instruction(INS_PHI, reg, ir_list(iv->fn, OPERAND_PHI, 2), 0, type, line);
+    args = LIST_OF(iv->fn, phi.arg2);
+
+    args[from_pre]     = init;
+    args[1 - from_pre] = next;
+
+    for(at = 0; at < header->count && header->ins[at].kind == INS_PHI; at++)
+        ;
+
+    _insert(iv, header, at, phi);
+
+    blk = iv->def_block[OPERAND_INDEX(ind->next)];
+
+    for(at = 0; at < blk->count && ins_def(&blk->ins[at]) != ind->next; at++)
+        ;
+
+    _insert(iv, blk, at + 1, new_instruction(INS_ADD, next, reg, step, type, line));
+
+    if(!ind->scaled && type->kind == ind->type->kind && (val = _constant_of(iv, factor)) && VALUE_OF(iv->fn, val).val > 0) {
+        ind->scaled = reg;
+        ind->factor = VALUE_OF(iv->fn, val).val;
+    }
+
+    iv->reduced++;
+}
+
+/*
+ * Tests of the basic variable against constants are made on its scaled
+ * copy, when they and its increment are all that still read it.
+ */
+static void _replace_tests(CIV *iv, CLoop *loop, CInduction *ind)
+{
+    CFunction *fn = iv->fn;
+    COperand   init, step;
+    size_t     tests = 0;
+    int64_t    low;
+
+    if(!ind->scaled || !_is_integer(ind->type) || _is_unsigned(ind->type) ||
+       OPERAND_INDEX(ind->reg) >= iv->vreg_count || OPERAND_INDEX(ind->next) >= iv->vreg_count ||
+       iv->uses[OPERAND_INDEX(ind->next)] != 1)
+        return;
+
+    if(!(init = _constant_of(iv, ind->init)) || !(step = _constant_of(iv, ind->step)) || !VALUE_OF(fn, step).val ||
+       !_scale(ind, VALUE_OF(fn, init).val, &low) || !_is_bounded(iv, loop, ind, VALUE_OF(fn, step).val))
+        return;
+
+    for(int pass = 0; pass < 2; pass++) {
+        for(size_t i = 0; i < loop->count; i++) {
+            CBasicBlock *blk = loop->blocks[i];
+
+            for(size_t j = 0; j < blk->count; j++) {
+                CInstruction *ins = &blk->ins[j];
+                COperand      limit;
+                int64_t       scaled;
+
+                // a compare and branch has no result to be read
+                if(branch_compare(ins->kind) == INS_END_MARK &&
+                   ((ins->kind != INS_LT && ins->kind != INS_LE && ins->kind != INS_GT && ins->kind != INS_GE) ||
+                    OPERAND_INDEX(ins->arg1) >= iv->vreg_count || !iv->uses[OPERAND_INDEX(ins->arg1)]))
+                    continue;
+
+                if(ins->arg2 == ind->reg)
+                    limit = _constant_of(iv, ins->arg3);
+                else if(ins->arg3 == ind->reg)
+                    limit = _constant_of(iv, ins->arg2);
+                else
+                    continue;
+
+                if(!limit || ins->type->kind != ind->type->kind || !_scale(ind, VALUE_OF(fn, limit).val, &scaled))
+                    return;
+
+                if(!pass) {
+                    tests++;
+                    continue;
+                }
+
+                limit = _new_constant(iv, scaled);
+
+                _count_uses(iv, ins, -1);
+
+                if(ins->arg2 == ind->reg) {
+                    ins->arg2 = ind->scaled;
+                    ins->arg3 = limit;
+                } else {
+                    ins->arg2 = limit;
+                    ins->arg3 = ind->scaled;
+                }
+
+                iv->tests++;
+            }
+        }
+
+        if(!pass && iv->uses[OPERAND_INDEX(ind->reg)] != tests + 1)
+            return;
+    }
+}
+
+/*
+ * Whether the header leaves the loop as soon as the variable passes a
+ * constant in the direction it steps, so it stays between its initial
+ * value and that constant plus one step, which must scale too. The test
+ * is a JMPZ on a comparison in the header, or a compare and branch whose
+ * inverse is the relation that keeps the loop going.
+ */
+static bool _is_bounded(CIV *iv, CLoop *loop, CInduction *ind, int64_t step)
+{
+    CBasicBlock  *header = loop->header;
+    CInstruction *jump, *test;
+    COperand      limit;
+    Instruction   kind;
+    int64_t       end, scaled;
+
+    if(!header->count || !is_branch((jump = &header->ins[header->count - 1])->kind) ||
+       loop_contains(loop, TARGET_OF(iv->fn, jump->arg1)))
+        return false;
+
+    if(jump->kind != INS_JMPZ) {
+        test = jump;
+        kind = branch_compare(invert_branch(jump->kind));
+    } else if((test = _def_of(iv, jump->arg2)) && iv->def_block[OPERAND_INDEX(jump->arg2)] == header) {
+        kind = test->kind;
+    } else
+        return false;
+
+    if(test->arg2 == ind->reg) {
+        limit = _constant_of(iv, test->arg3);
+    } else if(test->arg3 == ind->reg) {
+        limit = _constant_of(iv, test->arg2);
+
+        switch(kind) {
+            case INS_LT: kind = INS_GT; break;
+            case INS_LE: kind = INS_GE; break;
+            case INS_GT: kind = INS_LT; break;
+            case INS_GE: kind = INS_LE; break;
+            default:     break;
+        }
+    } else
+        return false;
+
+    if(!limit || test->type->kind != ind->type->kind)
+        return false;
+
+    if(!((kind == INS_LT || kind == INS_LE) && step > 0) && !((kind == INS_GT || kind == INS_GE) && step < 0))
+        return false;
+
+    return !__builtin_add_overflow(VALUE_OF(iv->fn, limit).val, step, &end) && _scale(ind, end, &scaled);
+}
+
+static bool _scale(CInduction *ind, int64_t val, int64_t *result)
+{
+    return !__builtin_mul_overflow(val, ind->factor, result) && _truncate(ind->type, *result) == *result;
+}
+
+static void _shift_multiplies(CIV *iv)
+{
+    CFunction *fn = iv->fn;
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand      val, other;
+            int64_t       shift = 0;
+
+            if(ins->kind != INS_MUL || !_is_integer(ins->type))
+                continue;
+
+            if((val = _constant_of(iv, ins->arg3)))
+                other = ins->arg2;
+            else if((val = _constant_of(iv, ins->arg2)))
+                other = ins->arg3;
+            else
+                continue;
+
+            if(VALUE_OF(fn, val).val <= 1 || (VALUE_OF(fn, val).val & (VALUE_OF(fn, val).val - 1)))
+                continue;
+
+            while(((int64_t)1 << shift) != VALUE_OF(fn, val).val)
+                shift++;
+
+            ins->kind = INS_SHL;
+            ins->arg2 = other;
+            ins->arg3 = _new_constant(iv, shift);
+
+            iv->shifts++;
+        }
+    }
+}
+
+/*
+ * Points the uses of the reduced multiplies at their new variables and
+ * drops the multiplies.
+ */
+static void _rewrite(CIV *iv)
+{
+    CFunction *fn = iv->fn;
+
+    if(!iv->reduced)
+        return;
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk  = fn->blocks[i];
+        size_t       kept = 0;
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand     *use;
+
+            if(ins->kind == INS_END_MARK)
+                continue;
+
+            for(size_t n = 0; (use = ins_use(fn, ins, n)); n++) {
+                COperand arg = *use;
+
+                if(IS_VREG(arg) && OPERAND_INDEX(arg) < iv->vreg_count && iv->repl[OPERAND_INDEX(arg)])
+                    *use = iv->repl[OPERAND_INDEX(arg)];
+            }
+
+            blk->ins[kept++] = *ins;
+        }
+
+        fn->ins_count -= blk->count - kept;
+        blk->count     = kept;
+    }
+}
+
+static CInduction *_induction_of(CIV *iv, COperand arg)
+{
+    for(size_t i = 0; i < iv->iv_count; i++) {
+        if(iv->ivs[i].reg == arg)
+            return &iv->ivs[i];
+    }
+
+    return NULL;
+}
+
+static CInstruction *_def_of(CIV *iv, COperand arg)
+{
+    CBasicBlock *blk;
+
+    if(!IS_VREG(arg) || OPERAND_INDEX(arg) >= iv->vreg_count || !(blk = iv->def_block[OPERAND_INDEX(arg)]))
+        return NULL;
+
+    for(size_t i = 0; i < blk->count; i++) {
+        if(ins_def(&blk->ins[i]) == arg)
+            return &blk->ins[i];
+    }
+
+    return NULL;
+}
+
+static COperand _constant_of(CIV *iv, COperand arg)
+{
+    if(IS_VREG(arg) && OPERAND_INDEX(arg) < iv->vreg_count)
+        arg = iv->constant[OPERAND_INDEX(arg)];
+
+    return OPERAND_KIND(arg) == OPERAND_INT ? arg : 0;
+}
+
+static bool _is_invariant(CIV *iv, CLoop *loop, COperand arg)
+{
+    if(OPERAND_KIND(arg) == OPERAND_INT)
+        return true;
+
+    if(!IS_VREG(arg) || OPERAND_INDEX(arg) >= iv->vreg_count)
+        return false;
+
+    return !loop_contains(loop, iv->def_block[OPERAND_INDEX(arg)]);
+}
+
+/*
+ * m1 * m2, folded when both are constants and computed at the end of the
+ * preheader otherwise.
+ */
+static COperand _product(CIV *iv, CBasicBlock *pre, COperand m1, COperand m2, CType *type, size_t line)
+{
+    COperand c1 = _constant_of(iv, m1), c2 = _constant_of(iv, m2), dest;
+    int64_t  v1 = c1 ? VALUE_OF(iv->fn, c1).val : 0, v2 = c2 ? VALUE_OF(iv->fn, c2).val : 0;
+    size_t   at = pre->count;
+
+    if(c1 && c2)
+        return _new_constant(iv, _truncate(type, (int64_t)((uint64_t)v1 * (uint64_t)v2)));
+
+    if((c1 && !v1) || (c2 && !v2))
+        return _new_constant(iv, 0);
+
+    if(c1 && v1 == 1)
+        return m2;
+
+    if(c2 && v2 == 1)
+        return m1;
+
+    if(at && pre->ins[at - 1].kind == INS_JMP)
+        at--;
+
+    dest = ir_vreg(iv->fn);
+
+    _insert(iv, pre, at, new_instruction(INS_MUL, dest, m1, m2, type, line));
+
+    return dest;
+}
+
+static COperand _new_constant(CIV *iv, int64_t val)
+{
+    return ir_constant(iv->fn, OPERAND_INT, val);
+}
+
+static void _insert(CIV *iv, CBasicBlock *blk, size_t index, CInstruction ins)
+{
+    if(blk->count == blk->capacity) {
+        CInstruction *tmp = blk->ins;
+
+        blk->capacity = blk->capacity ? blk->capacity * 2 : 4;
+        blk->ins      = (CInstruction *)zalloc(sizeof(CInstruction) * blk->capacity, ARENA_3);
+
+        if(tmp)
+            memcpy(blk->ins, tmp, sizeof(CInstruction) * blk->count);
+    }
+
+    memmove(blk->ins + index + 1, blk->ins + index, sizeof(CInstruction) * (blk->count - index));
+
+    blk->ins[index] = ins;
+    blk->count++;
+    iv->fn->ins_count++;
+
+    _count_uses(iv, &blk->ins[index], 1);
+}
+
+static void _count_uses(CIV *iv, CInstruction *ins, int delta)
+{
+    COperand *use;
+
+    for(size_t n = 0; (use = ins_use(iv->fn, ins, n)); n++) {
+        if(IS_VREG(*use) && OPERAND_INDEX(*use) < iv->vreg_count)
+            iv->uses[OPERAND_INDEX(*use)] += delta;
+    }
+}
+
+static bool _is_integer(CType *type)
+{
+    return type && type->kind >= CHAR && type->kind <= ULONG;
+}
+
+static bool _is_unsigned(CType *type)
+{
+    if(!type)
+        return false;
+
+    return type->kind == UCHAR || type->kind == USHORT || type->kind == UINT || type->kind == ULONG;
+}
+
+static int64_t _truncate(CType *type, int64_t val)
+{
+    switch(type->size) {
+        case 1:
+            return _is_unsigned(type) ? (int64_t)(uint8_t)val  : (int64_t)(int8_t)val;
+        case 2:
+            return _is_unsigned(type) ? (int64_t)(uint16_t)val : (int64_t)(int16_t)val;
+        case 4:
+            return _is_unsigned(type) ? (int64_t)(uint32_t)val : (int64_t)(int32_t)val;
+        default:
+            return val;
+    }
+}
@@ -176,6 +176,7 @@ int lex(CCompiler *cmp)
             case ',':
             case '?':
             case ':':
+            case '~':
                 return cmp->token = *(cmp->file->src - 1);
             case '.':
                 if(*cmp->file->src == '.' && cmp->file->src[1] == '.') { cmp->file->src += 2; return cmp->token = TK_ELIPSIS; }
@@ -210,6 +211,9 @@ int lex(CCompiler *cmp)
             case '^':
                 if(*cmp->file->src == '=') { cmp->file->src++; return cmp->token = TK_XOR_EQ; }
                 return cmp->token = '^';
+            case '%':
+                if(*cmp->file->src == '=') { cmp->file->src++; return cmp->token = TK_MOD_EQ; }
+                return cmp->token = '%';
             case '/':
                 if(*cmp->file->src == '/') {
                     while(*cmp->file->src && map[*cmp->file->src] ^ NEWLINE)
@@ -0,0 +1,266 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * Loop-invariant code motion over the loops find_loops() builds. Loops
+ * are visited innermost first, each over its own blocks only: what is
+ * still in an inner loop after it was visited depends on it and can't
+ * leave the outer one either. A computation whose operands are all
+ * defined outside the loop moves to the end of the preheader, which is a
+ * block of the loop around, so it may move again from there. A load of a
+ * symbol moves too when nothing in the loop stores to it. Divisions are
+ * only hoisted by a non-zero constant: the loop may not have executed
+ * them at all.
+ */
+
+typedef struct CStore CStore;
+
+/*
+ * A STORE to 'sym' in the loop numbered 'loop', or with no symbol, an
+ * instruction that may write any memory.
+ */
+struct CStore {
+    CSymbol *sym;
+    size_t   loop;
+};
+
+typedef struct CLICM {
+    CCompiler    *cmp;
+    CFunction    *fn;
+    CBasicBlock **def_block;
+    COperand     *constant;
+    CInstruction *hoisted;
+    CStore       *stores;
+    size_t        store_count;
+} CLICM;
+
+static void   _collect_stores(CLICM *licm);
+static int    _compare_stores(const void *s1, const void *s2);
+static size_t _hoist(CLICM *licm, CLoop *loop);
+static bool   _is_invariant(CLICM *licm, CInstruction *ins, CLoop *loop);
+static bool   _is_stored(CLICM *licm, CSymbol *sym, CLoop *loop);
+
+void hoist_invariants(CCompiler *cmp, CFunction *fn)
+{
+    CLICM  licm;
+    size_t hoisted = 0, loops = 0;
+
+    if(!cmp || !fn || !fn->entry)
+        return;
+
+    find_loops(fn);
+
+    if(!fn->loop_count)
+        return;
+
+    memset(&licm, 0, sizeof(CLICM));
+
+    licm.cmp       = cmp;
+    licm.fn        = fn;
+    licm.def_block = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * (fn->vreg_count + 1), ARENA_3);
+    licm.constant  = (COperand *)zalloc(sizeof(COperand) * (fn->vreg_count + 1), ARENA_3);
+    licm.hoisted   = (CInstruction *)zalloc(sizeof(CInstruction) * (fn->ins_count + 1), ARENA_3);
+
+    memset(licm.def_block, 0, sizeof(CBasicBlock *) * fn->vreg_count);
+    memset(licm.constant, 0, sizeof(COperand) * fn->vreg_count);
+
+    _collect_stores(&licm);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            COperand def = ins_def(&blk->ins[j]);
+
+            if(!def || OPERAND_INDEX(def) >= fn->vreg_count)
+                continue;
+
+            licm.def_block[OPERAND_INDEX(def)] = blk;
+
+            if(blk->ins[j].kind == INS_LOAD && OPERAND_KIND(blk->ins[j].arg2) == OPERAND_INT)
+                licm.constant[OPERAND_INDEX(def)] = blk->ins[j].arg2;
+        }
+    }
+
+    for(size_t i = 0; i < fn->loop_count; i++) {
+        size_t count = _hoist(&licm, &fn->loops[i]);
+
+        hoisted += count;
+        loops   += count != 0;
+    }
+
+    cmp->opt.hoisted += hoisted;
+    cmp->opt.loops   += fn->loop_count;
+
+    if((options & COMPILER_OPTION_STATS) && hoisted)
+        fprintf(cmp->diag, "licm('%s'): %ld instructions hoisted out of %ld loops\n", fn->sym->name, hoisted, loops);
+}
+
+/*
+ * Lists what writes memory inside loops, sorted by symbol and then by
+ * loop, so a loop's stores to a symbol are one range of the list.
+ */
+static void _collect_stores(CLICM *licm)
+{
+    for(int pass = 0; pass < 2; pass++) {
+        for(size_t i = 0; i < licm->fn->loop_count; i++) {
+            CLoop *loop = &licm->fn->loops[i];
+
+            for(size_t j = 0; j < loop->count; j++) {
+                CBasicBlock *blk = loop->blocks[j];
+
+                for(size_t k = 0; k < blk->count; k++) {
+                    CInstruction *ins = &blk->ins[k];
+                    CSymbol      *sym = NULL;
+
+                    if(ins->kind == INS_STORE && OPERAND_KIND(ins->arg1) == OPERAND_SYMBOL)
+                        sym = SYMBOL_OF(licm->fn, ins->arg1);
+                    else if(!ins_clobbers(ins))
+                        continue;
+
+                    if(pass)
+                        licm->stores[licm->store_count++] = (CStore){sym, loop->first};
+                    else
+                        licm->store_count++;
+                }
+            }
+        }
+
+        if(pass)
+            break;
+
+        licm->stores      = (CStore *)zalloc(sizeof(CStore) * (licm->store_count + 1), ARENA_3);
+        licm->store_count = 0;
+    }
+
+    qsort(licm->stores, licm->store_count, sizeof(CStore), _compare_stores);
+}
+
+static int _compare_stores(const void *s1, const void *s2)
+{
+    const CStore *st1 = (const CStore *)s1;
+    const CStore *st2 = (const CStore *)s2;
+
+    if(st1->sym != st2->sym)
+        return (uintptr_t)st1->sym < (uintptr_t)st2->sym ? -1 : 1;
+
+    return st1->loop < st2->loop ? -1 : st1->loop > st2->loop;
+}
+
+/*
+ * Moves the invariant computations of 'loop' to its preheader, before the
+ * jump ending it.
+ */
+static size_t _hoist(CLICM *licm, CLoop *loop)
+{
+    CBasicBlock  *pre = loop->preheader;
+    CInstruction *tmp;
+    size_t        count = 0, keep;
+
+    if(!pre)
+        return 0;
+
+    for(size_t i = 0; i < loop->count; i++) {
+        CBasicBlock *blk = loop->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+
+            if(!_is_invariant(licm, ins, loop))
+                continue;
+
+            licm->def_block[OPERAND_INDEX(ins->arg1)] = pre;
+            licm->hoisted[count++]                    = *ins;
+            ins->kind                                 = INS_END_MARK;
+        }
+    }
+
+    if(!count)
+        return 0;
+
+    for(size_t i = 0; i < loop->count; i++) {
+        CBasicBlock *blk  = loop->blocks[i];
+        size_t       kept = 0;
+
+        for(size_t j = 0; j < blk->count; j++) {
+            if(blk->ins[j].kind != INS_END_MARK)
+                blk->ins[kept++] = blk->ins[j];
+        }
+
+        blk->count = kept;
+    }
+
+    tmp  = pre->ins;
+    keep = pre->count && pre->ins[pre->count - 1].kind == INS_JMP ? pre->count - 1 : pre->count;
+
+    pre->ins      = (CInstruction *)zalloc(sizeof(CInstruction) * (pre->count + count), ARENA_3);
+    pre->capacity = pre->count + count;
+
+    if(tmp)
+        memcpy(pre->ins, tmp, sizeof(CInstruction) * keep);
+
+    memcpy(pre->ins + keep, licm->hoisted, sizeof(CInstruction) * count);
+
+    if(keep < pre->count)
+        pre->ins[keep + count] = tmp[keep];
+
+    pre->count += count;
+
+    return count;
+}
+
+static bool _is_invariant(CLICM *licm, CInstruction *ins, CLoop *loop)
+{
+    CFunction *fn  = licm->fn;
+    COperand  *use;
+    COperand   def = ins_def(ins);
+    COperand   divisor;
+
+    if(!def || ins->kind == INS_PHI || ins_clobbers(ins) || OPERAND_INDEX(def) >= fn->vreg_count)
+        return false;
+
+    if(ins->kind == INS_LOAD && OPERAND_KIND(ins->arg2) == OPERAND_SYMBOL &&
+       (_is_stored(licm, NULL, loop) || _is_stored(licm, SYMBOL_OF(fn, ins->arg2), loop)))
+        return false;
+
+    if(ins->kind == INS_DIV || ins->kind == INS_MOD) {
+        divisor = ins->arg3;
+
+        if(IS_VREG(divisor) && OPERAND_INDEX(divisor) < fn->vreg_count)
+            divisor = licm->constant[OPERAND_INDEX(divisor)];
+
+        if(OPERAND_KIND(divisor) != OPERAND_INT || !VALUE_OF(fn, divisor).val)
+            return false;
+    }
+
+    for(size_t n = 0; (use = ins_use(fn, ins, n)); n++) {
+        if(!IS_VREG(*use) || OPERAND_INDEX(*use) >= fn->vreg_count)
+            continue;
+
+        if(loop_contains(loop, licm->def_block[OPERAND_INDEX(*use)]))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Whether something in 'loop' or a loop inside it stores to 'sym'; with
+ * no symbol, whether something may write any memory.
+ */
+static bool _is_stored(CLICM *licm, CSymbol *sym, CLoop *loop)
+{
+    size_t lo = 0, hi = licm->store_count;
+
+    while(lo < hi) {
+        size_t  mid   = lo + (hi - lo) / 2;
+        CStore *store = &licm->stores[mid];
+
+        if((uintptr_t)store->sym < (uintptr_t)sym || (store->sym == sym && store->loop < loop->first))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < licm->store_count && licm->stores[lo].sym == sym && licm->stores[lo].loop <= loop->last;
+}
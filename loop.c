@@ -0,0 +1,431 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * Natural loops of the IR CFG: an edge into a block that dominates its
+ * source is a back edge, and the loop of that header is every block
+ * reaching one of its back edges without going through the header.
+ *
+ * Every header is first given a preheader, a block ending in a jump to
+ * the header that all edges from outside the loop go through. The block
+ * falling into the header is used as is when it is the only one. The
+ * header's phis lose their operands from outside the loop, which move to
+ * phis of the preheader when there were several.
+ *
+ * Loops are kept as a nesting tree with each block belonging to its
+ * innermost loop, so deep nests stay linear: a loop contains a block
+ * when the block's loop is numbered within its subtree.
+ */
+
+static bool         _is_header(CBasicBlock *blk);
+static void         _insert_preheaders(CFunction *fn);
+static CBasicBlock *_insert_preheader(CFunction *fn, CBasicBlock *header, CBasicBlock *prev);
+static void         _retarget(CFunction *fn, CBasicBlock *from, CBasicBlock *header, CBasicBlock *pre);
+static void         _build_tree(CFunction *fn);
+static CLoop       *_find_root(CLoop **root, CLoop *loops, CLoop *loop);
+static void         _number_loops(CFunction *fn);
+static void         _collect_blocks(CFunction *fn);
+static COperand     _new_label(CFunction *fn, CBasicBlock *blk);
+
+/*
+ * Inserts the missing preheaders and builds fn->loops, innermost loops
+ * first. The dominators are up to date afterwards.
+ */
+void find_loops(CFunction *fn)
+{
+    if(!fn || !fn->entry)
+        return;
+
+    fn->loops      = NULL;
+    fn->loop_count = 0;
+
+    _insert_preheaders(fn);
+    _build_tree(fn);
+
+    if(!fn->loop_count)
+        return;
+
+    _number_loops(fn);
+    _collect_blocks(fn);
+}
+
+bool loop_contains(CLoop *loop, CBasicBlock *blk)
+{
+    if(!loop || !blk || !blk->loop)
+        return false;
+
+    return blk->loop->first >= loop->first && blk->loop->first <= loop->last;
+}
+
+static bool _is_header(CBasicBlock *blk)
+{
+    for(size_t i = 0; i < blk->pred_count; i++) {
+        if(dominates(blk, blk->preds[i]))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Lays the blocks out again and recomputes the dominators once the
+ * preheaders are in. A preheader only changes the dominators of its
+ * header, so the headers and their back edges are found with the old ones
+ * while inserting.
+ */
+static void _insert_preheaders(CFunction *fn)
+{
+    CBasicBlock *prev  = NULL;
+    size_t       count = fn->block_count;
+
+    compute_dominators(fn);
+
+    for(size_t i = 0; i < count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        if(blk != fn->entry && blk->idom && _is_header(blk))
+            _insert_preheader(fn, blk, prev);
+
+        prev = blk;
+    }
+
+    if(fn->block_count == count)
+        return;
+
+    fn->blocks = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * fn->block_count, ARENA_3);
+
+    count = 0;
+
+    for(CBasicBlock *blk = fn->entry; blk; blk = blk->next) {
+        blk->id             = count;
+        fn->blocks[count++] = blk;
+    }
+
+    compute_dominators(fn);
+}
+
+/*
+ * 'prev' is the block laid out before 'header', which the preheader goes
+ * after. Loops entered by a back edge falling through are left alone.
+ */
+static CBasicBlock *_insert_preheader(CFunction *fn, CBasicBlock *header, CBasicBlock *prev)
+{
+    CBasicBlock  *pre, **preds;
+    CInstruction *last;
+    size_t        outside = 0, inside = 0;
+
+    for(size_t i = 0; i < header->pred_count; i++) {
+        if(!dominates(header, header->preds[i]))
+            outside++;
+    }
+
+    if(!outside)
+        return NULL;
+
+    if(prev) {
+        last = prev->count ? &prev->ins[prev->count - 1] : NULL;
+
+        if(dominates(header, prev) && (!last || (last->kind != INS_JMP && last->kind != INS_RET &&
+                                                 last->kind != INS_RETVAL && last->kind != INS_LEAVE)))
+            return NULL;
+    }
+
+    // a single block only going to the header already is one
+    for(size_t i = 0; i < header->pred_count && outside == 1; i++) {
+        if(!dominates(header, header->preds[i]) && header->preds[i]->succ_count == 1)
+            return header->preds[i];
+    }
+
+    pre = (CBasicBlock *)zalloc(sizeof(CBasicBlock), ARENA_3);
+
+    memset(pre, 0, sizeof(CBasicBlock));
+
+    pre->id         = fn->block_count++;
+    pre->preds      = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * outside, ARENA_3);
+    pre->succs      = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * 2, ARENA_3);
+    pre->succs[0]   = header;
+    pre->succ_count = 1;
+
+    if(prev) {
+        pre->next  = prev->next;
+        prev->next = pre;
+    }
+
+    preds = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * (header->pred_count - outside + 1), ARENA_3);
+
+    for(size_t i = 0; i < header->pred_count; i++) {
+        CBasicBlock *from = header->preds[i];
+
+        if(!dominates(header, from)) {
+            pre->preds[pre->pred_count++] = from;
+            _retarget(fn, from, header, pre);
+        } else
+            preds[++inside] = from;
+    }
+
+    preds[0] = pre;
+
+    // the operands from outside merge in the preheader now
+    for(size_t i = 0; i < header->count && header->ins[i].kind == INS_PHI; i++) {
+        CInstruction *phi   = &header->ins[i];
+        COperand      list  = ir_list(fn, OPERAND_PHI, inside + 1);
+        COperand     *args  = LIST_OF(fn, list);
+        COperand     *ops   = LIST_OF(fn, phi->arg2);
+        COperand      same  = 0;
+        bool          merge = false;
+
+        inside = 0;
+
+        for(size_t j = 0; j < header->pred_count; j++) {
+            if(dominates(header, header->preds[j]))
+                args[++inside] = ops[j];
+            else if(!same)
+                same = ops[j];
+            else
+                merge |= same != ops[j];
+        }
+
+        if(merge) {
+            CInstruction  ins   = new_instruction(INS_PHI, ir_vreg(fn), ir_list(fn, OPERAND_PHI, outside), phi->arg3, phi->type, phi->line);
+            COperand     *outer = LIST_OF(fn, ins.arg2);
+            CInstruction *tmp   = pre->ins;
+            size_t        n     = 0;
+
+            for(size_t j = 0; j < header->pred_count; j++) {
+                if(!dominates(header, header->preds[j]))
+                    outer[n++] = ops[j];
+            }
+
+            same = ins.arg1;
+
+            pre->ins = (CInstruction *)zalloc(sizeof(CInstruction) * (pre->count + 1), ARENA_3);
+
+            if(tmp)
+                memcpy(pre->ins, tmp, sizeof(CInstruction) * pre->count);
+
+            pre->ins[pre->count++] = ins;
+            pre->capacity          = pre->count;
+            fn->ins_count++;
+        }
+
+        args[0]   = same;
+        phi->arg2 = list;
+    }
+
+    header->preds      = preds;
+    header->pred_count = inside + 1;
+
+    return pre;
+}
+
+/*
+ * Makes the edges 'from' -> 'header' go to 'pre' instead, which is laid
+ * out right before 'header' so falling through still reaches it. Every
+ * entry of a jump table going to 'header' is moved.
+ */
+static void _retarget(CFunction *fn, CBasicBlock *from, CBasicBlock *header, CBasicBlock *pre)
+{
+    CInstruction *last = from->count ? &from->ins[from->count - 1] : NULL;
+
+    for(size_t i = 0; i < from->succ_count; i++) {
+        if(from->succs[i] == header)
+            from->succs[i] = pre;
+    }
+
+    if(last && last->kind == INS_JTAB) {
+        for(COperand *op = LIST_OF(fn, last->arg1); *op; op++) {
+            if(TARGET_OF(fn, *op) != header)
+                continue;
+
+            if(!pre->label)
+                _new_label(fn, pre);
+
+            *op = pre->label;
+        }
+        return;
+    }
+
+    if(!last || (last->kind != INS_JMP && !is_branch(last->kind)) || TARGET_OF(fn, last->arg1) != header)
+        return;
+
+    if(!pre->label)
+        _new_label(fn, pre);
+
+    last->arg1 = pre->label;
+}
+
+/*
+ * Headers are taken in reverse order of the reverse postorder so inner
+ * loops are complete before the loops around them. Walking back from the
+ * latches, a block already in a loop stands for the outermost loop found
+ * around it so far, which becomes a child of the new one and is stepped
+ * over to the edges entering it.
+ */
+static void _build_tree(CFunction *fn)
+{
+    CBasicBlock **work;
+    CLoop       **root;
+    size_t        capacity = 0, edges = 0;
+
+    for(size_t i = 0; i < fn->block_count; i++)
+        fn->blocks[i]->loop = NULL;
+
+    for(size_t i = 0; i < fn->order_count; i++) {
+        capacity += fn->order[i] != fn->entry && _is_header(fn->order[i]);
+        edges    += fn->order[i]->pred_count;
+    }
+
+    if(!capacity)
+        return;
+
+    fn->loops = (CLoop *)zalloc(sizeof(CLoop) * capacity, ARENA_3);
+    root      = (CLoop **)zalloc(sizeof(CLoop *) * capacity, ARENA_3);
+    work      = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * (edges + 1), ARENA_3);
+
+    for(size_t i = fn->order_count; i-- > 1;) {
+        CBasicBlock *header = fn->order[i];
+        CLoop       *loop;
+        size_t       top = 0, entries = 0;
+
+        if(!_is_header(header))
+            continue;
+
+        loop = &fn->loops[fn->loop_count];
+
+        memset(loop, 0, sizeof(CLoop));
+
+        loop->header           = header;
+        root[fn->loop_count++] = loop;
+        header->loop           = loop;
+
+        for(size_t j = 0; j < header->pred_count; j++) {
+            CBasicBlock *from = header->preds[j];
+
+            if(dominates(header, from))
+                work[top++] = from;
+            else if(!entries++ && from->succ_count == 1)
+                loop->preheader = from;
+        }
+
+        if(entries != 1)
+            loop->preheader = NULL;
+
+        while(top) {
+            CBasicBlock *blk = work[--top];
+            CLoop       *sub;
+
+            if(!blk->loop) {
+                blk->loop = loop;
+
+                for(size_t j = 0; j < blk->pred_count; j++) {
+                    if(blk->preds[j]->idom)
+                        work[top++] = blk->preds[j];
+                }
+                continue;
+            }
+
+            if((sub = _find_root(root, fn->loops, blk->loop)) == loop)
+                continue;
+
+            root[sub - fn->loops] = loop;
+            sub->parent           = loop;
+            sub->sibling          = loop->child;
+            loop->child           = sub;
+
+            blk = sub->header;
+
+            for(size_t j = 0; j < blk->pred_count; j++) {
+                if(!dominates(blk, blk->preds[j]))
+                    work[top++] = blk->preds[j];
+            }
+        }
+    }
+}
+
+/*
+ * Outermost loop found so far around 'loop', compressing the path to it.
+ */
+static CLoop *_find_root(CLoop **root, CLoop *loops, CLoop *loop)
+{
+    CLoop *top = loop;
+
+    while(root[top - loops] != top)
+        top = root[top - loops];
+
+    while(root[loop - loops] != top) {
+        CLoop *next = root[loop - loops];
+
+        root[loop - loops] = top;
+        loop               = next;
+    }
+
+    return top;
+}
+
+/*
+ * Numbers the nesting tree in preorder, a subtree spans first..last.
+ * 'next' is the child of each loop on the stack to visit next.
+ */
+static void _number_loops(CFunction *fn)
+{
+    CLoop **stack = (CLoop **)zalloc(sizeof(CLoop *) * fn->loop_count, ARENA_3);
+    CLoop **next  = (CLoop **)zalloc(sizeof(CLoop *) * fn->loop_count, ARENA_3);
+    size_t  count = 0;
+
+    for(size_t i = 0; i < fn->loop_count; i++) {
+        size_t top = 0;
+
+        if(fn->loops[i].parent)
+            continue;
+
+        fn->loops[i].first = count++;
+        stack[top]         = &fn->loops[i];
+        next[top++]        = fn->loops[i].child;
+
+        while(top) {
+            CLoop *child = next[top - 1];
+
+            if(!child) {
+                stack[--top]->last = count - 1;
+                continue;
+            }
+
+            next[top - 1] = child->sibling;
+            child->first  = count++;
+            stack[top]    = child;
+            next[top++]   = child->child;
+        }
+    }
+}
+
+/*
+ * Hands every block to its innermost loop, in reverse postorder.
+ */
+static void _collect_blocks(CFunction *fn)
+{
+    for(size_t i = 0; i < fn->order_count; i++) {
+        if(fn->order[i]->loop)
+            fn->order[i]->loop->count++;
+    }
+
+    for(size_t i = 0; i < fn->loop_count; i++) {
+        fn->loops[i].blocks = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * fn->loops[i].count, ARENA_3);
+        fn->loops[i].count  = 0;
+    }
+
+    for(size_t i = 0; i < fn->order_count; i++) {
+        CLoop *loop = fn->order[i]->loop;
+
+        if(loop)
+            loop->blocks[loop->count++] = fn->order[i];
+    }
+}
+
+static COperand _new_label(CFunction *fn, CBasicBlock *blk)
+{
+    blk->label = ir_label(fn);
+
+    ir_place(fn, blk->label, blk);
+
+    return blk->label;
+}
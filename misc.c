@@ -29,26 +29,15 @@ void error(CCompiler *cmp, size_t opt_line, const char *msg, ...)
 
     va_start(ap, msg);
 
-    fprintf(stderr, "Error('%s', %d): ", cmp->file->path, line);
+    fprintf(cmp->diag, "Error('%s', %d): ", cmp->file->path, line);
 
-    vfprintf(stderr, msg, ap);
+    vfprintf(cmp->diag, msg, ap);
 
     cmp->file->errors++;
 
     cmp->flags |= COMPILER_FLAG_ERROR;
 }
 
-CType *make_ptr(CType *base)
-{
-    CType *ptr = new_type();
-
-    ptr->kind = PTR;
-    ptr->base = base;
-    ptr->size = sizeof(void *);
-    
-    return ptr;
-}
-
 CType *new_type(void)
 {
     CType *type;
@@ -102,9 +91,9 @@ void warn(CCompiler *cmp, size_t opt_line, const char *msg, ...)
 
     va_start(ap, msg);
 
-    fprintf(stderr, "Warning('%s', %d): ", cmp->file->path, line);
+    fprintf(cmp->diag, "Warning('%s', %d): ", cmp->file->path, line);
 
-    vfprintf(stderr, msg, ap);
+    vfprintf(cmp->diag, msg, ap);
 
     cmp->file->warnings++;
 }
@@ -143,19 +132,6 @@ void accept(CCompiler *cmp, int tokenex)
     error(cmp, 0, "'%c' expected\n", (char)tokenex);   
 }
 
-CType *new_function(CType *base, CParameter *params, size_t param_count)
-{
-    CType *fun;
-
-    fun               = new_type();
-    fun->kind         = FUNCTION;
-    fun->base         = base;
-    fun->params       = params;
-    fun->param_count  = param_count;
-
-    return fun;
-}
-
 CParameter  *new_param(void)
 {
     CParameter *param;
@@ -201,25 +177,68 @@ CMisc *new_misc(MiscKind kind)
     misc = (CMisc *)zalloc(sizeof(CMisc), ARENA_1);
 
     misc->kind = kind;
+    misc->sym  = NULL;
     misc->val  = 0;
 
     return misc;
 }
 
-CType *new_array(CType *base, CNode *size_expr)
+CStack *new_stack(void)
+{
+    CStack *stack;
+
+    stack = (CStack *)zalloc(sizeof(CStack), ARENA_1);
+
+    stack->capacity = 64;
+    stack->count    = 0;
+    stack->frames   = (CFrame *)zalloc(sizeof(CFrame) * stack->capacity, ARENA_1);
+
+    return stack;
+}
+
+/*
+ * Returns a zeroed frame on top of 'stack'. Growing moves the frames, so
+ * pointers to frames taken before a push must not be used after it.
+ */
+CFrame *push_frame(CStack *stack, CNode *tree)
 {
-    CType *array;
+    CFrame *frame;
+
+    if(!stack)
+        return NULL;
+
+    if(stack->count == stack->capacity) {
+        CFrame *frames = (CFrame *)zalloc(sizeof(CFrame) * stack->capacity * 2, ARENA_1);
+
+        memcpy(frames, stack->frames, sizeof(CFrame) * stack->count);
+
+        stack->frames    = frames;
+        stack->capacity *= 2;
+    }
+
+    frame = &stack->frames[stack->count++];
+
+    memset(frame, 0, sizeof(CFrame));
+
+    frame->tree = tree;
+
+    return frame;
+}
 
-    if(!base)
+CFrame *top_frame(CStack *stack)
+{
+    if(!stack || !stack->count)
         return NULL;
 
-    array = new_type();
+    return &stack->frames[stack->count - 1];
+}
 
-    array->kind            = ARRAY;
-    array->base            = base;
-    array->array_dimension = size_expr;
+void pop_frame(CStack *stack)
+{
+    if(!stack || !stack->count)
+        return;
 
-    return array;
+    stack->count--;
 }
 
 void printf_type(CType *type, FILE *out)
@@ -244,63 +263,16 @@ void printf_type(CType *type, FILE *out)
     }
 }
 
-CInstruction *new_instruction(Instruction kind, CMisc *arg1, CMisc *arg2, CMisc *arg3, CType *type, size_t line)
+CInstruction new_instruction(Instruction kind, COperand arg1, COperand arg2, COperand arg3, CType *type, size_t line)
 {
-    CInstruction *ins;
+    CInstruction ins;
 
-    ins = (CInstruction *)zalloc(sizeof(CInstruction), ARENA_3);
-
-    ins->kind = kind;
-    ins->arg1 = arg1;
-    ins->arg2 = arg2;
-    ins->arg3 = arg3;
-    ins->type = type;
-    ins->line = line;
-    ins->prev = NULL;
-    ins->next = NULL;
+    ins.kind = kind;
+    ins.arg1 = arg1;
+    ins.arg2 = arg2;
+    ins.arg3 = arg3;
+    ins.type = type;
+    ins.line = line;
 
     return ins;
 }
-
-void add_ir(CCompiler *cmp, CInstruction *ins)
-{
-    if(!cmp || !ins)
-        return;
-
-    if(!cmp->head) {
-        cmp->head = ins;
-        cmp->tail = ins;
-        return;
-    }
-
-    ins->prev = cmp->tail;
-
-    cmp->tail->next = ins;
-    cmp->tail       = cmp->tail->next;
-}
-
-CVirtualReg *new_virtual_register(size_t reg_count)
-{
-    CVirtualReg *vreg;
-
-    vreg = (CVirtualReg *)zalloc(sizeof(CVirtualReg), ARENA_1);
-
-    vreg->usage = 0;
-    vreg->reg   = 0;
-    vreg->id    = reg_count;
-
-    return vreg;
-}
-
-CLabel *new_label(const char *opt_name, size_t id)
-{
-    CLabel *lb;
-
-    lb = (CLabel *)zalloc(sizeof(CLabel), ARENA_1);
-
-    lb->opt_name = opt_name;
-    lb->address  = 0;
-    lb->lbID     = id;
-
-    return lb;
-}
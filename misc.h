@@ -83,6 +83,8 @@
 #define MASK_UNION    (1 << 25)
 #define MASK_ENUM     (1 << 27)
 
+#define SPECIFIER_INLINE (1 << 0)
+
 typedef uint8_t  byte;
 typedef uint16_t word;
 typedef uint32_t dword;
@@ -91,6 +93,8 @@ typedef enum TreeKind    TreeKind;
 typedef enum TypeKind    TypeKind;
 typedef enum MiscKind    MiscKind;
 typedef enum Instruction Instruction;
+typedef enum Register    Register;
+typedef enum OperandKind OperandKind;
 
 enum TypeKind {
     VOID,
@@ -119,9 +123,18 @@ enum MiscKind {
     MISC_CONSTANT_INT,
     MISC_CONSTANT_FLOAT,
     MISC_ID,
-    MISC_SYMBOL,
-    MISC_LABEL,
-    MISC_VREG
+    MISC_SYMBOL
+};
+
+enum OperandKind {
+    OPERAND_NONE,
+    OPERAND_VREG,
+    OPERAND_INT,
+    OPERAND_FLOAT,
+    OPERAND_SYMBOL,
+    OPERAND_LABEL,
+    OPERAND_PHI,
+    OPERAND_ARGS
 };
 
 enum TreeKind {
@@ -182,5 +195,61 @@ enum Instruction {
     INS_RETVAL,
     INS_RET,
     INS_AND,
+    INS_PHI,
+    INS_MOD,
+    INS_MULH,
+    INS_CALL,
+    INS_JLT,
+    INS_JLE,
+    INS_JGT,
+    INS_JGE,
+    INS_EQ,
+    INS_NE,
+    INS_OR,
+    INS_XOR,
+    INS_JEQ,
+    INS_JNE,
+    INS_JTAB,
     INS_END_MARK
 };
+
+/*
+ * x86-64 registers in encoding order, REG_RAX + n for register n, then
+ * the SSE ones the same way.
+ */
+enum Register {
+    REG_NONE,
+    REG_RAX,
+    REG_RCX,
+    REG_RDX,
+    REG_RBX,
+    REG_RSP,
+    REG_RBP,
+    REG_RSI,
+    REG_RDI,
+    REG_R8,
+    REG_R9,
+    REG_R10,
+    REG_R11,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15,
+    REG_XMM0,
+    REG_XMM1,
+    REG_XMM2,
+    REG_XMM3,
+    REG_XMM4,
+    REG_XMM5,
+    REG_XMM6,
+    REG_XMM7,
+    REG_XMM8,
+    REG_XMM9,
+    REG_XMM10,
+    REG_XMM11,
+    REG_XMM12,
+    REG_XMM13,
+    REG_XMM14,
+    REG_XMM15,
+    REG_END_MARK
+};
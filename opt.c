@@ -0,0 +1,98 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * Runs the optimisation passes over a function right after its IR has
+ * been generated, on the thread that generated it ('-O'). Containers of
+ * global initializers are left alone.
+ */
+void optimize_function(CCompiler *cmp, CFunction *fn)
+{
+    if(!cmp || !fn || !fn->sym || !(options & COMPILER_OPTION_OPTIMIZE))
+        return;
+
+    build_ssa(cmp, fn);
+    optimize_ssa(cmp, fn);
+}
+
+/*
+ * The passes working on SSA form, run again by the inliner over the
+ * callers it changed.
+ */
+void optimize_ssa(CCompiler *cmp, CFunction *fn)
+{
+    if(!cmp || !fn || !fn->sym || !(options & COMPILER_OPTION_OPTIMIZE))
+        return;
+
+    propagate_constants(cmp, fn);
+    lower_division(cmp, fn);
+    number_values(cmp, fn);
+    hoist_invariants(cmp, fn);
+    reduce_strength(cmp, fn);
+    rewrite_peepholes(cmp, fn);
+    eliminate_dead_code(cmp, fn);
+}
+
+void merge_opt_stats(COptStats *into, const COptStats *from)
+{
+    if(!into || !from)
+        return;
+
+    into->promoted          += from->promoted;
+    into->removed_loads     += from->removed_loads;
+    into->removed_stores    += from->removed_stores;
+    into->phis              += from->phis;
+    into->folded            += from->folded;
+    into->folded_branches   += from->folded_branches;
+    into->unreachable       += from->unreachable;
+    into->divisions         += from->divisions;
+    into->redundant         += from->redundant;
+    into->loops             += from->loops;
+    into->hoisted           += from->hoisted;
+    into->reduced           += from->reduced;
+    into->replaced_tests    += from->replaced_tests;
+    into->shifts            += from->shifts;
+    into->inlined           += from->inlined;
+
+    for(size_t i = 0; i < PEEPHOLE_PATTERNS; i++)
+        into->peephole[i] += from->peephole[i];
+
+    into->dead_blocks       += from->dead_blocks;
+    into->dead_instructions += from->dead_instructions;
+    into->dead_functions    += from->dead_functions;
+    into->splits            += from->splits;
+    into->spills            += from->spills;
+    into->spill_stores      += from->spill_stores;
+    into->reloads           += from->reloads;
+    into->coalesced         += from->coalesced;
+    into->rematerialized    += from->rematerialized;
+}
+
+void print_opt_stats(const COptStats *stats, FILE *out)
+{
+    if(!stats || !out)
+        return;
+
+    fprintf(out, "\tmem2reg: %ld locals promoted, %ld loads and %ld stores removed, %ld phis\n",
+            stats->promoted, stats->removed_loads, stats->removed_stores, stats->phis);
+    fprintf(out, "\tsccp: %ld instructions and %ld branches folded, %ld blocks unreachable\n",
+            stats->folded, stats->folded_branches, stats->unreachable);
+    fprintf(out, "\tdiv: %ld divisions by constants lowered\n", stats->divisions);
+    fprintf(out, "\tgvn: %ld redundant instructions removed\n", stats->redundant);
+    fprintf(out, "\tlicm: %ld instructions hoisted, %ld loops\n", stats->hoisted, stats->loops);
+    fprintf(out, "\tiv: %ld multiplies reduced, %ld tests replaced, %ld multiplies made shifts\n",
+            stats->reduced, stats->replaced_tests, stats->shifts);
+    fprintf(out, "\tinline: %ld calls inlined\n", stats->inlined);
+    fprintf(out, "\tpeephole:");
+
+    for(size_t i = 0; i < PEEPHOLE_PATTERNS; i++)
+        fprintf(out, "%s %ld '%s'", i ? "," : "", stats->peephole[i], peephole_pattern(i));
+
+    fprintf(out, "\n");
+    fprintf(out, "\tdce: %ld instructions, %ld blocks and %ld static functions removed\n",
+            stats->dead_instructions, stats->dead_blocks, stats->dead_functions);
+    fprintf(out, "\tregalloc: %ld intervals split, %ld values spilled, %ld stores and %ld reloads\n",
+            stats->splits, stats->spills, stats->spill_stores, stats->reloads);
+    fprintf(out, "\tcoloring: %ld copies coalesced, %ld constants rematerialized\n",
+            stats->coalesced, stats->rematerialized);
+}
@@ -0,0 +1,560 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * Peephole rewriting over a sliding window of instructions in layout
+ * order. The patterns are declared in one table: the instruction kinds
+ * of the window, whether it may run from the end of a block into the
+ * start of the next one, and the function checking the rest and doing
+ * the rewrite. The window starts at every instruction in turn, and after
+ * a rewrite the scan steps back one instruction, so that whatever the
+ * rewrite exposes to the instruction before it is caught as well. Every
+ * rewrite removes an instruction or turns one into a constant, so this
+ * reaches a fixpoint in one pass, linear in the size of the function.
+ *
+ * Registers that become another one are replaced through a table like
+ * value numbering does, resolved at every match and, for the uses seen
+ * before their definition, once more at the end.
+ */
+
+#define PEEP_WINDOW 2
+#define ANY_BRANCH  INS_END_MARK // in a window, any conditional jump
+
+typedef struct CPeephole CPeephole;
+typedef struct CPattern  CPattern;
+
+struct CPeephole {
+    CCompiler      *cmp;
+    CFunction      *fn;
+    size_t          vreg_count;
+    CInstruction  **defs;
+    size_t         *uses;
+    COperand       *repl;
+    bool           *removed;
+    CInstruction   *win[PEEP_WINDOW];    // the window being matched
+    CBasicBlock    *blocks[PEEP_WINDOW]; // the block of each of its instructions
+    const CPattern *pat;                 // the pattern tried on it
+    size_t          hits[PEEPHOLE_PATTERNS];
+};
+
+struct CPattern {
+    const char  *name;
+    size_t       size;
+    Instruction  kinds[PEEP_WINDOW];
+    bool         crosses; // the window may go on into the next block
+    bool       (*rewrite)(CPeephole *peep);
+    int64_t      constant;
+};
+
+static bool _jump_to_next(CPeephole *peep);
+static bool _branch_over_jump(CPeephole *peep);
+static bool _store_load(CPeephole *peep);
+static bool _store_store(CPeephole *peep);
+static bool _identity(CPeephole *peep);
+static bool _annihilator(CPeephole *peep);
+static bool _self_difference(CPeephole *peep);
+
+static const CPattern _patterns[PEEPHOLE_PATTERNS] = {
+    {"jump to next block", 1, {INS_JMP},              true,  _jump_to_next,      0},
+    {"branch over jump",   2, {ANY_BRANCH, INS_JMP},  true,  _branch_over_jump,  0},
+    {"store then load",    2, {INS_STORE, INS_LOAD},  false, _store_load,        0},
+    {"store then store",   2, {INS_STORE, INS_STORE}, false, _store_store,       0},
+    {"x + 0",              1, {INS_ADD},              false, _identity,          0},
+    {"x - 0",              1, {INS_SUB},              false, _identity,          0},
+    {"x * 1",              1, {INS_MUL},              false, _identity,          1},
+    {"x / 1",              1, {INS_DIV},              false, _identity,          1},
+    {"x << 0",             1, {INS_SHL},              false, _identity,          0},
+    {"x >> 0",             1, {INS_SHR},              false, _identity,          0},
+    {"x | 0",              1, {INS_OR},               false, _identity,          0},
+    {"x ^ 0",              1, {INS_XOR},              false, _identity,          0},
+    {"x * 0",              1, {INS_MUL},              false, _annihilator,       0},
+    {"x & 0",              1, {INS_AND},              false, _annihilator,       0},
+    {"x - x",              1, {INS_SUB},              false, _self_difference,   0},
+};
+
+static void     _scan(CPeephole *peep);
+static bool     _match(CPeephole *peep, CBasicBlock *blk, size_t index);
+static size_t   _next_live(CBasicBlock *blk, size_t index);
+static bool     _invert(CPeephole *peep, CInstruction *jump);
+static void     _replace(CPeephole *peep, COperand def, COperand value);
+static void     _replace_pred(CBasicBlock *blk, CBasicBlock *from, CBasicBlock *to);
+static void     _rewrite(CPeephole *peep);
+static COperand _resolve(CPeephole *peep, COperand arg);
+static COperand _constant_of(CPeephole *peep, COperand arg);
+static CType   *_type_of(CPeephole *peep, COperand arg);
+static bool     _commutes(Instruction kind);
+static bool     _is_integer(CType *type);
+static bool     _is_scalar(CType *type);
+
+void rewrite_peepholes(CCompiler *cmp, CFunction *fn)
+{
+    CPeephole peep;
+    size_t    total = 0;
+
+    if(!cmp || !fn || !fn->entry)
+        return;
+
+    // the window runs on into the block laid out next, which must be live
+    cmp->opt.dead_blocks += remove_unreachable_blocks(fn);
+
+    memset(&peep, 0, sizeof(CPeephole));
+
+    peep.cmp        = cmp;
+    peep.fn         = fn;
+    peep.vreg_count = fn->vreg_count;
+    peep.defs       = (CInstruction **)zalloc(sizeof(CInstruction *) * (fn->vreg_count + 1), ARENA_3);
+    peep.uses       = (size_t *)zalloc(sizeof(size_t) * (fn->vreg_count + 1), ARENA_3);
+    peep.repl       = (COperand *)zalloc(sizeof(COperand) * (fn->vreg_count + 1), ARENA_3);
+    peep.removed    = (bool *)zalloc(sizeof(bool) * (fn->block_count + 1), ARENA_3);
+
+    memset(peep.defs, 0, sizeof(CInstruction *) * fn->vreg_count);
+    memset(peep.uses, 0, sizeof(size_t) * fn->vreg_count);
+    memset(peep.repl, 0, sizeof(COperand) * fn->vreg_count);
+    memset(peep.removed, 0, sizeof(bool) * fn->block_count);
+
+    _scan(&peep);
+
+    for(CBasicBlock *blk = fn->entry; blk; blk = blk->next) {
+        size_t i = 0;
+
+        while(i < blk->count) {
+            if(blk->ins[i].kind == INS_END_MARK || !_match(&peep, blk, i)) {
+                i++;
+                continue;
+            }
+
+            // step back to the live instruction before the rewrite, if any
+            for(size_t j = i; j-- > 0;) {
+                if(blk->ins[j].kind != INS_END_MARK) {
+                    i = j;
+                    break;
+                }
+            }
+        }
+    }
+
+    _rewrite(&peep);
+
+    for(size_t i = 0; i < PEEPHOLE_PATTERNS; i++) {
+        cmp->opt.peephole[i] += peep.hits[i];
+        total                += peep.hits[i];
+    }
+
+    if((options & COMPILER_OPTION_STATS) && total) {
+        const char *sep = "";
+
+        fprintf(cmp->diag, "peephole('%s'):", fn->sym->name);
+
+        for(size_t i = 0; i < PEEPHOLE_PATTERNS; i++) {
+            if(!peep.hits[i])
+                continue;
+
+            fprintf(cmp->diag, "%s %ld '%s'", sep, peep.hits[i], _patterns[i].name);
+            sep = ",";
+        }
+
+        fprintf(cmp->diag, "\n");
+    }
+}
+
+const char *peephole_pattern(size_t index)
+{
+    return index < PEEPHOLE_PATTERNS ? _patterns[index].name : NULL;
+}
+
+static void _scan(CPeephole *peep)
+{
+    CFunction *fn = peep->fn;
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand      def = ins_def(ins);
+            COperand     *use;
+
+            if(def && OPERAND_INDEX(def) < peep->vreg_count)
+                peep->defs[OPERAND_INDEX(def)] = ins;
+
+            for(size_t n = 0; (use = ins_use(fn, ins, n)); n++) {
+                if(IS_VREG(*use) && OPERAND_INDEX(*use) < peep->vreg_count)
+                    peep->uses[OPERAND_INDEX(*use)]++;
+            }
+        }
+    }
+}
+
+/*
+ * Tries the patterns on the window starting at 'index' of 'blk' in table
+ * order, returning whether one of them rewrote it.
+ */
+static bool _match(CPeephole *peep, CBasicBlock *blk, size_t index)
+{
+    CInstruction **win    = peep->win;
+    CBasicBlock  **blocks = peep->blocks;
+    size_t         size   = 1, next;
+
+    win[0]    = &blk->ins[index];
+    blocks[0] = blk;
+
+    if((next = _next_live(blk, index + 1)) < blk->count) {
+        win[1]    = &blk->ins[next];
+        blocks[1] = blk;
+        size++;
+    } else if(blk->next && (next = _next_live(blk->next, 0)) < blk->next->count) {
+        win[1]    = &blk->next->ins[next];
+        blocks[1] = blk->next;
+        size++;
+    }
+
+    for(size_t i = 0; i < PEEPHOLE_PATTERNS; i++) {
+        const CPattern *pat = &_patterns[i];
+        size_t          k;
+
+        if(pat->size > size)
+            continue;
+
+        for(k = 0; k < pat->size; k++) {
+            if((pat->kinds[k] == ANY_BRANCH ? !is_branch(win[k]->kind) : win[k]->kind != pat->kinds[k]) ||
+               (blocks[k] != blk && !pat->crosses))
+                break;
+        }
+
+        peep->pat = pat;
+
+        if(k < pat->size || !pat->rewrite(peep))
+            continue;
+
+        peep->hits[i]++;
+
+        return true;
+    }
+
+    return false;
+}
+
+static size_t _next_live(CBasicBlock *blk, size_t index)
+{
+    while(index < blk->count && blk->ins[index].kind == INS_END_MARK)
+        index++;
+
+    return index;
+}
+
+/*
+ * A jump to the block laid out right after its own becomes the fall
+ * through, which is the same edge.
+ */
+static bool _jump_to_next(CPeephole *peep)
+{
+    if(TARGET_OF(peep->fn, peep->win[0]->arg1) != peep->blocks[0]->next)
+        return false;
+
+    peep->win[0]->kind = INS_END_MARK;
+
+    return true;
+}
+
+/*
+ * A conditional branch over a block that only jumps elsewhere, to the
+ * block right after that one:
+ *
+ *      JMPZ L1, R1         JMPZ L2, R1'
+ *      JMP L2          =>
+ *  L1: ...             L1: ...
+ *
+ * branches on the inverted test instead and the jumping block goes.
+ */
+static bool _branch_over_jump(CPeephole *peep)
+{
+    CInstruction **win  = peep->win;
+    CBasicBlock   *from = peep->blocks[0], *over = peep->blocks[1];
+    CBasicBlock *fall, *target;
+
+    if(over != from->next || over->pred_count != 1 || over->preds[0] != from || over == peep->fn->exit)
+        return false;
+
+    if(!from->pred_count && from != peep->fn->entry)
+        return false;
+
+    fall   = TARGET_OF(peep->fn, win[0]->arg1);
+    target = TARGET_OF(peep->fn, win[1]->arg1);
+
+    if(fall != over->next || target == fall || target == over || !_invert(peep, win[0]))
+        return false;
+
+    win[0]->arg1 = win[1]->arg1;
+    win[1]->kind = INS_END_MARK;
+
+    from->succs[0]   = fall;
+    from->succs[1]   = target;
+    from->succ_count = 2;
+    from->next       = fall;
+
+    _replace_pred(target, over, from);
+
+    over->succ_count = 0;
+    over->pred_count = 0;
+
+    peep->removed[over->id] = true;
+
+    return true;
+}
+
+/*
+ * Makes a conditional jump go the other way. A compare and branch is
+ * inverted itself; for JMPZ the test must be an integer comparison the
+ * jump is the only reader of, so it can be inverted in place.
+ */
+static bool _invert(CPeephole *peep, CInstruction *jump)
+{
+    COperand      cond;
+    CInstruction *test;
+
+    if(jump->kind != INS_JMPZ) {
+        if(!_is_integer(jump->type) && (!jump->type || jump->type->kind != PTR))
+            return false;
+
+        jump->kind = invert_branch(jump->kind);
+        return true;
+    }
+
+    if(!IS_VREG(cond = _resolve(peep, jump->arg2)) || OPERAND_INDEX(cond) >= peep->vreg_count ||
+       peep->uses[OPERAND_INDEX(cond)] != 1 || !(test = peep->defs[OPERAND_INDEX(cond)]) || !_is_integer(test->type))
+        return false;
+
+    switch(test->kind) {
+        case INS_LT: test->kind = INS_GE; break;
+        case INS_GE: test->kind = INS_LT; break;
+        case INS_GT: test->kind = INS_LE; break;
+        case INS_LE: test->kind = INS_GT; break;
+        case INS_EQ: test->kind = INS_NE; break;
+        case INS_NE: test->kind = INS_EQ; break;
+        default:
+            return false;
+    }
+
+    jump->arg2 = cond;
+
+    return true;
+}
+
+/*
+ * A load of the symbol just stored reads the value stored, when nothing
+ * is converted on the way.
+ */
+static bool _store_load(CPeephole *peep)
+{
+    CInstruction *store = peep->win[0], *load = peep->win[1];
+    COperand      value;
+    CType        *type;
+
+    if(OPERAND_KIND(store->arg1) != OPERAND_SYMBOL || store->arg1 != load->arg2)
+        return false;
+
+    if(!IS_VREG(value = _resolve(peep, store->arg2)) || !(type = _type_of(peep, value)))
+        return false;
+
+    if(!_is_scalar(load->type) || !store->type || store->type->kind != load->type->kind || type->kind != load->type->kind)
+        return false;
+
+    _replace(peep, load->arg1, value);
+
+    load->kind = INS_END_MARK;
+
+    return true;
+}
+
+/*
+ * A store overwritten by the next instruction is dead.
+ */
+static bool _store_store(CPeephole *peep)
+{
+    CInstruction **win = peep->win;
+
+    if(OPERAND_KIND(win[0]->arg1) != OPERAND_SYMBOL || win[0]->arg1 != win[1]->arg1)
+        return false;
+
+    win[0]->kind = INS_END_MARK;
+
+    return true;
+}
+
+/*
+ * An integer operation with its identity element, on either side for
+ * the commutative ones, is the other operand when that has the type of
+ * the result.
+ */
+static bool _identity(CPeephole *peep)
+{
+    CInstruction *ins = peep->win[0];
+    COperand      lhs = _resolve(peep, ins->arg2), rhs = _resolve(peep, ins->arg3), konst, value = 0;
+    CType        *type;
+
+    if(!_is_integer(ins->type) || !ins->arg1)
+        return false;
+
+    if((konst = _constant_of(peep, rhs)) && VALUE_OF(peep->fn, konst).val == peep->pat->constant)
+        value = lhs;
+    else if(_commutes(ins->kind) && (konst = _constant_of(peep, lhs)) && VALUE_OF(peep->fn, konst).val == peep->pat->constant)
+        value = rhs;
+
+    if(!IS_VREG(value) || !(type = _type_of(peep, value)) || type->kind != ins->type->kind)
+        return false;
+
+    _replace(peep, ins->arg1, value);
+
+    ins->kind = INS_END_MARK;
+
+    return true;
+}
+
+/*
+ * An integer operation with its absorbing element is that constant.
+ */
+static bool _annihilator(CPeephole *peep)
+{
+    CInstruction *ins = peep->win[0];
+    COperand      konst;
+
+    if(!_is_integer(ins->type) || !ins->arg1)
+        return false;
+
+    if(!(konst = _constant_of(peep, _resolve(peep, ins->arg3))) || VALUE_OF(peep->fn, konst).val != peep->pat->constant) {
+        if(!(konst = _constant_of(peep, _resolve(peep, ins->arg2))) || VALUE_OF(peep->fn, konst).val != peep->pat->constant)
+            return false;
+    }
+
+    ins->kind = INS_LOAD;
+    ins->arg2 = konst;
+    ins->arg3 = 0;
+
+    return true;
+}
+
+static bool _self_difference(CPeephole *peep)
+{
+    CInstruction *ins = peep->win[0];
+    COperand      lhs = _resolve(peep, ins->arg2);
+
+    if(!_is_integer(ins->type) || !ins->arg1 || !IS_VREG(lhs) || lhs != _resolve(peep, ins->arg3))
+        return false;
+
+    ins->kind = INS_LOAD;
+    ins->arg2 = ir_constant(peep->fn, OPERAND_INT, 0);
+    ins->arg3 = 0;
+
+    return true;
+}
+
+static void _replace(CPeephole *peep, COperand def, COperand value)
+{
+    if(OPERAND_INDEX(def) >= peep->vreg_count)
+        return;
+
+    peep->repl[OPERAND_INDEX(def)] = value;
+
+    if(IS_VREG(value) && OPERAND_INDEX(value) < peep->vreg_count)
+        peep->uses[OPERAND_INDEX(value)] += peep->uses[OPERAND_INDEX(def)];
+}
+
+/*
+ * Swaps a predecessor in place, keeping the phi operands in order.
+ */
+static void _replace_pred(CBasicBlock *blk, CBasicBlock *from, CBasicBlock *to)
+{
+    for(size_t i = 0; i < blk->pred_count; i++) {
+        if(blk->preds[i] == from) {
+            blk->preds[i] = to;
+            return;
+        }
+    }
+}
+
+/*
+ * Resolves the replaced registers, drops the rewritten instructions and
+ * the blocks that were jumped over, and renumbers what is left.
+ */
+static void _rewrite(CPeephole *peep)
+{
+    CFunction *fn          = peep->fn;
+    size_t     kept_blocks = 0;
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk  = fn->blocks[i];
+        size_t       kept = 0;
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand     *use;
+
+            if(ins->kind == INS_END_MARK)
+                continue;
+
+            for(size_t n = 0; (use = ins_use(fn, ins, n)); n++)
+                *use = _resolve(peep, *use);
+
+            blk->ins[kept++] = *ins;
+        }
+
+        fn->ins_count -= blk->count - kept;
+        blk->count     = kept;
+
+        if(peep->removed[i])
+            continue;
+
+        blk->id                   = kept_blocks;
+        fn->blocks[kept_blocks++] = blk;
+    }
+
+    if(kept_blocks != fn->block_count) {
+        fn->block_count = kept_blocks;
+        compute_dominators(fn);
+    }
+}
+
+static COperand _resolve(CPeephole *peep, COperand arg)
+{
+    while(IS_VREG(arg) && OPERAND_INDEX(arg) < peep->vreg_count && peep->repl[OPERAND_INDEX(arg)])
+        arg = peep->repl[OPERAND_INDEX(arg)];
+
+    return arg;
+}
+
+static COperand _constant_of(CPeephole *peep, COperand arg)
+{
+    CInstruction *def;
+
+    if(IS_VREG(arg) && OPERAND_INDEX(arg) < peep->vreg_count && (def = peep->defs[OPERAND_INDEX(arg)]) &&
+       def->kind == INS_LOAD)
+        arg = def->arg2;
+
+    return OPERAND_KIND(arg) == OPERAND_INT ? arg : 0;
+}
+
+static CType *_type_of(CPeephole *peep, COperand arg)
+{
+    CInstruction *def;
+
+    if(!IS_VREG(arg) || OPERAND_INDEX(arg) >= peep->vreg_count || !(def = peep->defs[OPERAND_INDEX(arg)]) ||
+       def->kind == INS_END_MARK)
+        return NULL;
+
+    return def->type;
+}
+
+static bool _commutes(Instruction kind)
+{
+    return kind == INS_ADD || kind == INS_MUL || kind == INS_OR || kind == INS_XOR;
+}
+
+static bool _is_integer(CType *type)
+{
+    return type && type->kind >= CHAR && type->kind <= ULONG;
+}
+
+static bool _is_scalar(CType *type)
+{
+    return type && ((type->kind >= CHAR && type->kind <= LDOUBLE) || type->kind == PTR);
+}
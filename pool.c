@@ -0,0 +1,285 @@
+#include "compiler.h"
+#include "misc.h"
+#include <pthread.h>
+
+/*
+ * Function bodies are parsed, analysed and lowered to IR by a pool of
+ * workers. The main thread has already parsed every top-level declaration
+ * (bodies were skipped by brace matching) and analysed it in order, so the
+ * global scope is complete and read-only while workers run.
+ *
+ * Each worker owns a deque of job indexes: it pops from the bottom of its
+ * own deque and, once empty, steals from the top of the others. Workers
+ * allocate from their own thread-local arenas and keep their diagnostics in
+ * a memory stream; results are merged in source order afterwards, so the
+ * output does not depend on scheduling.
+ */
+
+#define NO_JOB ((size_t)-1)
+
+typedef struct CDeque  CDeque;
+typedef struct CWorker CWorker;
+typedef struct CPool   CPool;
+
+struct CDeque {
+    pthread_mutex_t lock;
+    size_t         *items;
+    size_t          top;
+    size_t          bottom;
+};
+
+struct CWorker {
+    pthread_t  thread;
+    CPool     *pool;
+    CCompiler *cmp;
+    CDeque     deque;
+};
+
+struct CPool {
+    CCompiler *cmp;
+    CJob      *jobs;
+    CWorker   *workers;
+    size_t     count;
+};
+
+static size_t _collect_jobs(CCompiler *cmp, CJob *jobs, size_t first);
+static void   _run_round(CPool *pool, size_t first, size_t last);
+static void  *_worker_main(void *arg);
+static void   _run_job(CWorker *self, CJob *job);
+static size_t _pop(CDeque *deque);
+static size_t _steal(CPool *pool, CWorker *self);
+static int    _job_order(const void *j1, const void *j2);
+
+void start_parallel(CCompiler *cmp)
+{
+    CPool  pool;
+    size_t pending = 0;
+    size_t done    = 0;
+    size_t ready   = 0;
+
+    if(!cmp)
+        return;
+
+    for(CNode *tree = cmp->lazy_nodes; tree; tree = tree->next)
+        pending++;
+
+    if(!pending)
+        return;
+
+    pool.cmp     = cmp;
+    pool.count   = thread_count > 0 ? (size_t)thread_count : 1;
+    pool.jobs    = (CJob *)zalloc(sizeof(CJob) * pending, ARENA_1);
+    pool.workers = (CWorker *)zalloc(sizeof(CWorker) * pool.count, ARENA_1);
+
+    atom_share();
+    type_share();
+
+    for(size_t i = 0; i < pool.count; i++) {
+        pool.workers[i].pool        = &pool;
+        pool.workers[i].cmp         = NULL;
+        pool.workers[i].deque.items = (size_t *)zalloc(sizeof(size_t) * pending, ARENA_1);
+        pthread_mutex_init(&pool.workers[i].deque.lock, NULL);
+    }
+
+    // bodies analysed in one round can make unused static functions live
+    while((ready = _collect_jobs(cmp, pool.jobs, done)) != done) {
+        _run_round(&pool, done, ready);
+        done = ready;
+    }
+
+    qsort(pool.jobs, done, sizeof(CJob), _job_order);
+
+    for(size_t i = 0; i < done; i++) {
+        CJob *job = &pool.jobs[i];
+
+        if(job->diag) {
+            fwrite(job->diag, 1, job->diag_size, cmp->diag);
+            free(job->diag);
+            job->diag = NULL;
+        }
+
+        cmp->file->errors   += job->errors;
+        cmp->file->warnings += job->warnings;
+
+        if(job->errors)
+            cmp->flags |= COMPILER_FLAG_ERROR;
+    }
+
+    for(size_t i = 0; i < pool.count; i++) {
+        CCompiler *wc = pool.workers[i].cmp;
+
+        pthread_mutex_destroy(&pool.workers[i].deque.lock);
+
+        if(!wc)
+            continue;
+
+        cmp->folded_nodes  += wc->folded_nodes;
+        cmp->parsed_bodies += wc->parsed_bodies;
+
+        merge_opt_stats(&cmp->opt, &wc->opt);
+    }
+
+    cmp->jobs       = pool.jobs;
+    cmp->job_count  = done;
+    cmp->job_cursor = 0;
+}
+
+/*
+ * Moves every body that must be compiled from cmp->lazy_nodes into 'jobs'.
+ * Static functions nobody referenced yet stay behind for a later round.
+ */
+static size_t _collect_jobs(CCompiler *cmp, CJob *jobs, size_t first)
+{
+    size_t last = first;
+
+    for(CNode **ptr = &cmp->lazy_nodes; *ptr;) {
+        CNode   *tree = *ptr;
+        CSymbol *sym  = tree->decl.symbol;
+
+        if((sym->flags & SYMBOL_IS_STATIC) && !sym->usage) {
+            ptr = &tree->next;
+            continue;
+        }
+
+        *ptr       = tree->next;
+        tree->next = NULL;
+
+        memset(&jobs[last], 0, sizeof(CJob));
+
+        jobs[last++].tree = tree;
+    }
+
+    return last;
+}
+
+static void _run_round(CPool *pool, size_t first, size_t last)
+{
+    size_t count = last - first;
+
+    for(size_t i = 0; i < pool->count; i++) {
+        CDeque *deque = &pool->workers[i].deque;
+        size_t  from  = first + count * i / pool->count;
+        size_t  to    = first + count * (i + 1) / pool->count;
+
+        deque->top    = 0;
+        deque->bottom = 0;
+
+        while(from < to)
+            deque->items[deque->bottom++] = from++;
+    }
+
+    for(size_t i = 1; i < pool->count; i++)
+        if(pthread_create(&pool->workers[i].thread, NULL, _worker_main, &pool->workers[i]))
+            pool->workers[i].thread = pthread_self(); // couldn't spawn, others will steal its jobs
+
+    _worker_main(&pool->workers[0]);
+
+    for(size_t i = 1; i < pool->count; i++)
+        if(!pthread_equal(pool->workers[i].thread, pthread_self()))
+            pthread_join(pool->workers[i].thread, NULL);
+}
+
+static void *_worker_main(void *arg)
+{
+    CWorker *self = (CWorker *)arg;
+    CPool   *pool = self->pool;
+    size_t   idx;
+
+    if(!self->cmp) {
+        self->cmp       = (CCompiler *)zalloc(sizeof(CCompiler), ARENA_1);
+        *self->cmp      = *pool->cmp;
+        self->cmp->file = (CFile *)zalloc(sizeof(CFile), ARENA_1);
+        *self->cmp->file = *pool->cmp->file;
+
+        self->cmp->folded_nodes  = 0;
+        self->cmp->parsed_bodies = 0;
+        self->cmp->lazy_nodes    = NULL;
+        self->cmp->evals         = NULL;
+        self->cmp->stack         = new_stack();
+        self->cmp->scratch       = NULL;
+        self->cmp->scratch_size  = 0;
+
+        memset(&self->cmp->opt, 0, sizeof(COptStats));
+    }
+
+    while((idx = _pop(&self->deque)) != NO_JOB || (idx = _steal(pool, self)) != NO_JOB)
+        _run_job(self, &pool->jobs[idx]);
+
+    if(self != &pool->workers[0])
+        zmerge();
+
+    return NULL;
+}
+
+static void _run_job(CWorker *self, CJob *job)
+{
+    CCompiler *cmp = self->cmp;
+
+    cmp->flags          &= ~COMPILER_FLAG_ERROR;
+    cmp->file->errors    = 0;
+    cmp->file->warnings  = 0;
+    cmp->head            = NULL;
+    cmp->tail            = NULL;
+    cmp->fn              = NULL;
+    cmp->block           = NULL;
+    cmp->diag            = open_memstream(&job->diag, &job->diag_size);
+
+    if(!cmp->diag)
+        cmp->diag = stderr;
+
+    analyse_function(cmp, job->tree);
+
+    if(!(cmp->flags & COMPILER_FLAG_ERROR))
+        generate_function(cmp, job->tree);
+
+    if(cmp->diag != stderr)
+        fclose(cmp->diag);
+
+    job->fn       = cmp->head;
+    job->errors   = cmp->file->errors;
+    job->warnings = cmp->file->warnings;
+}
+
+static size_t _pop(CDeque *deque)
+{
+    size_t idx = NO_JOB;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if(deque->bottom > deque->top)
+        idx = deque->items[--deque->bottom];
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return idx;
+}
+
+static size_t _steal(CPool *pool, CWorker *self)
+{
+    size_t me = self - pool->workers;
+
+    for(size_t i = 1; i < pool->count; i++) {
+        CDeque *victim = &pool->workers[(me + i) % pool->count].deque;
+        size_t  idx    = NO_JOB;
+
+        pthread_mutex_lock(&victim->lock);
+
+        if(victim->bottom > victim->top)
+            idx = victim->items[victim->top++];
+
+        pthread_mutex_unlock(&victim->lock);
+
+        if(idx != NO_JOB)
+            return idx;
+    }
+
+    return NO_JOB;
+}
+
+static int _job_order(const void *j1, const void *j2)
+{
+    const char *b1 = ((const CJob *)j1)->tree->decl.body;
+    const char *b2 = ((const CJob *)j2)->tree->decl.body;
+
+    return (b1 > b2) - (b1 < b2);
+}
@@ -0,0 +1,1730 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * Linear scan register allocation over the final IR of each function,
+ * after Wimmer and Franz: every virtual register gets a live interval,
+ * the intervals are visited by start position and each one is given a
+ * register of its class, x86-64 integer or SSE, for as long as it is
+ * free. When none is, the interval is split: the part that can't be
+ * given a register waits in the value's spill slot, a local of the
+ * function, until just before its next use.
+ *
+ * Blocks are numbered in layout order with a slot for their label and one
+ * per instruction. Slot s covers positions 4s to 4s + 3: an instruction
+ * reads its operands at 4s, the registers it clobbers are taken at
+ * 4s + 1 and its result is written at 4s + 2. 4s + 3 is the gap after it,
+ * where a move may go. Intervals are lists of half-open ranges of
+ * positions, with holes where the value is dead.
+ *
+ * Registers are single definition, so a spilled value is stored once,
+ * right after it is computed, and its slot stays valid: going from a
+ * register to the slot needs no move, only coming back does. A phi is
+ * resolved on each incoming edge, together with the values changing
+ * location between the end of the predecessor and the start of the
+ * successor. Those moves go at the end of the predecessor when it has one
+ * successor, at the start of the successor when it has one predecessor,
+ * else in a block split into the edge. The moves of one point are a
+ * parallel copy, ordered so no source is overwritten before it is read.
+ *
+ * The constraints of the instructions are fixed intervals: a call
+ * clobbers the caller saved registers, a division and MULH take rax and
+ * rdx, a shift by a register takes rcx. r11 and xmm15 are left out for
+ * the moves and the code generator, which also gets rsp and rbp.
+ */
+
+#define REGALLOC_LOOP_WEIGHT 10 // a use inside a loop counts as this many outside, per level
+#define REGALLOC_LOOP_MAX    8  // levels counted
+
+typedef struct CRange    CRange;
+typedef struct CUse      CUse;
+typedef struct CInterval CInterval;
+typedef struct CMove     CMove;
+typedef struct CLive     CLive;
+typedef struct CAlloc    CAlloc;
+
+struct CRange {
+    size_t  from;
+    size_t  to;
+    CRange *next;
+};
+
+struct CUse {
+    size_t    pos;
+    COperand *slot;   // the operand to rewrite
+    double    weight; // REGALLOC_LOOP_WEIGHT to the loop depth
+    bool      reg;    // whether it must be in a register, call arguments need not
+    CUse     *next;
+};
+
+/*
+ * One piece of a value's lifetime. The first piece is the value itself,
+ * the others follow it through 'split' in position order. A piece either
+ * lives in 'reg' or in the value's spill slot. Fixed intervals only have
+ * ranges and their register.
+ */
+struct CInterval {
+    COperand   value;
+    CType     *type;
+    CRange    *ranges;
+    CRange    *cursor;   // first range not behind the scan
+    CUse      *uses;
+    size_t     start;
+    size_t     end;
+    CInterval *parent;
+    CInterval *split;
+    CInterval *hint;     // a value to share a register with, where it is at 'hint_pos'
+    size_t     hint_pos;
+    size_t     resume;   // where its next range starts, while inactive
+    COperand   misc;     // what the operands of the piece become
+    COperand   slot;
+    double     weight;
+    bool       weighed;
+    bool       sse;
+    bool       fixed;
+    int        reg;
+    CInterval *next;
+};
+
+struct CMove {
+    size_t       key;  // twice the position, see _add_move()
+    size_t       seq;
+    COperand     dst;
+    COperand     src;
+    CType       *type;
+    bool         sse;
+    CMove       *next;
+};
+
+/*
+ * State of one function's allocation. Positions index 'slots' divided by
+ * four; 'values' are the intervals by register id.
+ */
+struct CLive {
+    size_t  id;
+    CLive  *next;
+};
+
+struct CAlloc {
+    CCompiler    *cmp;
+    CFunction    *fn;
+    size_t        block_count;
+    size_t       *from;      // first position of each block, by id
+    size_t       *to;
+    CBasicBlock **slots;     // block of each slot
+    size_t        slot_count;
+    double       *weights;   // of a use in each block
+    CLive       **live_in;   // registers, by block id
+    CLive       **live_out;
+    size_t       *index;     // of each register among the globals, SIZE_MAX for a temporary
+    size_t       *globals;   // register of each index
+    size_t        global_count;
+    CInterval   **values;
+    size_t        value_count;
+    CInterval    *fixed[REG_END_MARK];
+    CInterval    *unhandled;
+    CInterval    *active;
+    CInterval    *inactive;
+    CMove       **moves;     // by block id, new blocks included
+    CMove        *edge;      // of the edge being resolved
+    size_t        move_count;
+    COperand      scratch[2];
+    size_t        splits;
+    size_t        spills;
+    size_t        stores;
+    size_t        reloads;
+};
+
+static const int gpr_order[] = {
+    REG_RAX, REG_RCX, REG_RDX, REG_RSI, REG_RDI, REG_R8,  REG_R9,
+    REG_R10, REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15
+};
+
+static const int sse_order[] = {
+    REG_XMM0,  REG_XMM1,  REG_XMM2,  REG_XMM3,  REG_XMM4,
+    REG_XMM5,  REG_XMM6,  REG_XMM7,  REG_XMM8,  REG_XMM9,
+    REG_XMM10, REG_XMM11, REG_XMM12, REG_XMM13, REG_XMM14
+};
+
+static const int caller_saved[] = {
+    REG_RAX, REG_RCX, REG_RDX, REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10
+};
+
+static void         _drop_branches(CFunction *fn);
+static void         _number(CAlloc *ra);
+static void         _compute_liveness(CAlloc *ra);
+static void         _build_intervals(CAlloc *ra);
+static void         _build_block(CAlloc *ra, CBasicBlock *blk);
+static void         _note(CAlloc *ra, size_t *home, COperand arg, size_t blk);
+static void         _push_live(CLive **list, size_t id);
+static bool         _live_at(CInterval *it, size_t pos);
+static void         _add_fixed(CAlloc *ra, CInstruction *ins, size_t pos);
+static void         _scan(CAlloc *ra);
+static bool         _try_free(CAlloc *ra, CInterval *cur);
+static void         _allocate_blocked(CAlloc *ra, CInterval *cur);
+static void         _deactivate(CAlloc *ra, CInterval *it);
+static void         _spill_from(CAlloc *ra, CInterval *it, size_t pos);
+static void         _resolve(CAlloc *ra);
+static void         _resolve_edge(CAlloc *ra, CBasicBlock *from, CBasicBlock *to);
+static CBasicBlock *_split_edge(CAlloc *ra, CBasicBlock *from, CBasicBlock *to);
+static void         _rewrite(CAlloc *ra);
+static void         _insert_moves(CAlloc *ra);
+static size_t       _sequence(CAlloc *ra, CMove **group, size_t count, CInstruction *out);
+static size_t       _emit(CAlloc *ra, CMove *move, CInstruction *out, bool busy);
+static void         _add_move(CAlloc *ra, CBasicBlock *blk, size_t key, COperand dst, COperand src, CInterval *value);
+static CInterval   *_value(CAlloc *ra, size_t id);
+static CInterval   *_new_interval(void);
+static CInterval   *_split(CAlloc *ra, CInterval *it, size_t pos);
+static void         _add_range(CInterval *it, size_t from, size_t to);
+static void         _add_use(CAlloc *ra, CInterval *it, size_t pos, COperand *slot, bool reg);
+static bool         _covers(CInterval *it, size_t pos);
+static bool         _contains(CInterval *it, size_t pos);
+static size_t       _intersect(CInterval *a, CInterval *b);
+static size_t       _next_use(CInterval *it, size_t pos);
+static size_t       _legal_before(CAlloc *ra, size_t pos);
+static double       _weight(CInterval *it);
+static int          _hint(CInterval *it);
+static CInterval   *_piece_at(CInterval *it, size_t pos);
+static COperand     _location(CAlloc *ra, CInterval *it);
+static COperand     _slot(CAlloc *ra, CInterval *it);
+static void         _insert(CInterval **list, CInterval *it);
+static bool         _same(CFunction *fn, COperand a, COperand b);
+static bool         _is_sse(CInstruction *ins);
+static bool         _is_vreg(CAlloc *ra, COperand arg);
+static size_t       _pred_index(CBasicBlock *blk, CBasicBlock *pred);
+static COperand     _new_vreg(CFunction *fn, int reg);
+static COperand     _new_label(CFunction *fn, CBasicBlock *blk);
+
+/*
+ * Containers of global initializers are left alone. Optimized builds
+ * color the graph instead, for functions small enough. What is allocated
+ * for it may be released once 'fn' has been printed.
+ */
+void allocate_function(CCompiler *cmp, CFunction *fn)
+{
+    CAlloc ra;
+
+    if(!cmp || !fn || !fn->sym || !fn->entry)
+        return;
+
+    if((options & COMPILER_OPTION_OPTIMIZE) && !(options & COMPILER_OPTION_LINEAR_SCAN) && color_registers(cmp, fn))
+        return;
+
+    memset(&ra, 0, sizeof(CAlloc));
+
+    ra.cmp = cmp;
+    ra.fn  = fn;
+
+    _drop_branches(fn);
+    find_loops(fn);
+
+    _number(&ra);
+    _compute_liveness(&ra);
+    _build_intervals(&ra);
+    _scan(&ra);
+    _resolve(&ra);
+    _rewrite(&ra);
+    _insert_moves(&ra);
+
+    cmp->opt.splits       += ra.splits;
+    cmp->opt.spills       += ra.spills;
+    cmp->opt.spill_stores += ra.stores;
+    cmp->opt.reloads      += ra.reloads;
+
+    if(options & COMPILER_OPTION_STATS)
+        fprintf(cmp->diag, "regalloc('%s'): %ld intervals, %ld splits, %ld spills, %ld stores, %ld reloads\n",
+                fn->sym->name, ra.value_count, ra.splits, ra.spills, ra.stores, ra.reloads);
+}
+
+/*
+ * A conditional jump to the block it falls through to gives two edges to
+ * the same block, which would need different moves at one place.
+ */
+static void _drop_branches(CFunction *fn)
+{
+    for(CBasicBlock *blk = fn->entry; blk; blk = blk->next) {
+        CInstruction *last = blk->count ? &blk->ins[blk->count - 1] : NULL;
+
+        if(!last || !is_branch(last->kind) || TARGET_OF(fn, last->arg1) != blk->next)
+            continue;
+
+        remove_edge(fn, blk, blk->next);
+
+        blk->count--;
+        fn->ins_count--;
+    }
+}
+
+static void _number(CAlloc *ra)
+{
+    CFunction *fn = ra->fn;
+    size_t     slot = 0;
+
+    ra->block_count = fn->block_count;
+    ra->from        = (size_t *)zalloc(sizeof(size_t) * fn->block_count, ARENA_3);
+    ra->to          = (size_t *)zalloc(sizeof(size_t) * fn->block_count, ARENA_3);
+    ra->weights     = (double *)zalloc(sizeof(double) * fn->block_count, ARENA_3);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk   = fn->blocks[i];
+        size_t       depth = 0;
+
+        for(CLoop *loop = blk->loop; loop && depth < REGALLOC_LOOP_MAX; loop = loop->parent)
+            depth++;
+
+        ra->weights[i] = 1;
+
+        while(depth--)
+            ra->weights[i] *= REGALLOC_LOOP_WEIGHT;
+
+        ra->from[i] = 4 * slot;
+        slot       += 1 + blk->count;
+        ra->to[i]   = 4 * slot;
+    }
+
+    ra->slot_count = slot;
+    ra->slots      = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * slot, ARENA_3);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        for(size_t s = ra->from[i] / 4; s < ra->to[i] / 4; s++)
+            ra->slots[s] = fn->blocks[i];
+    }
+}
+
+/*
+ * Live sets of the blocks, found one register at a time by walking back
+ * from each of its uses to its definition, so the work is only what is
+ * live. Only registers used in more than one block are looked at: a
+ * temporary of one block is found live by walking the block, and there
+ * are far more of those. A phi reads its operand at the end of the
+ * predecessor it comes from, and defines its register at the start of
+ * its own block.
+ */
+static void _compute_liveness(CAlloc *ra)
+{
+    CFunction *fn = ra->fn;
+    CLive    **uses;
+    size_t    *home, *defs, *in_mark, *out_mark, *stack;
+
+    ra->value_count = fn->vreg_count;
+    ra->values      = (CInterval **)zalloc(sizeof(CInterval *) * (fn->vreg_count + 1), ARENA_3);
+    ra->index       = (size_t *)zalloc(sizeof(size_t) * (fn->vreg_count + 1), ARENA_3);
+    ra->globals     = (size_t *)zalloc(sizeof(size_t) * (fn->vreg_count + 1), ARENA_3);
+    home            = (size_t *)zalloc(sizeof(size_t) * (fn->vreg_count + 1), ARENA_3);
+
+    memset(ra->values, 0, sizeof(CInterval *) * fn->vreg_count);
+
+    for(size_t i = 0; i < fn->vreg_count; i++) {
+        ra->index[i] = SIZE_MAX;
+        home[i]      = SIZE_MAX;
+    }
+
+    // the registers seen in more than one block, or in a phi
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand     *op;
+
+            for(size_t n = 0; (op = ins_use(fn, ins, n)); n++)
+                _note(ra, home, *op, ins->kind == INS_PHI ? SIZE_MAX : i);
+
+            _note(ra, home, ins_def(ins), ins->kind == INS_PHI ? SIZE_MAX : i);
+        }
+    }
+
+    ra->live_in  = (CLive **)zalloc(sizeof(CLive *) * fn->block_count, ARENA_3);
+    ra->live_out = (CLive **)zalloc(sizeof(CLive *) * fn->block_count, ARENA_3);
+    in_mark      = (size_t *)zalloc(sizeof(size_t) * fn->block_count, ARENA_3);
+    out_mark     = (size_t *)zalloc(sizeof(size_t) * fn->block_count, ARENA_3);
+    stack        = (size_t *)zalloc(sizeof(size_t) * fn->block_count, ARENA_3);
+    uses         = (CLive **)zalloc(sizeof(CLive *) * (ra->global_count + 1), ARENA_3);
+    defs         = (size_t *)zalloc(sizeof(size_t) * (ra->global_count + 1), ARENA_3);
+
+    memset(ra->live_in, 0, sizeof(CLive *) * fn->block_count);
+    memset(ra->live_out, 0, sizeof(CLive *) * fn->block_count);
+    memset(in_mark, 0, sizeof(size_t) * fn->block_count);
+    memset(out_mark, 0, sizeof(size_t) * fn->block_count);
+    memset(uses, 0, sizeof(CLive *) * ra->global_count);
+
+    for(size_t k = 0; k < ra->global_count; k++)
+        defs[k] = SIZE_MAX;
+
+    // where each global is defined and read: a block it is live into, or twice a predecessor plus one
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand     *op, def;
+            size_t        idx;
+
+            for(size_t n = 0; (op = ins_use(fn, ins, n)); n++) {
+                if(_is_vreg(ra, *op) && (idx = ra->index[OPERAND_INDEX(*op)]) != SIZE_MAX)
+                    _push_live(&uses[idx], ins->kind == INS_PHI ? 2 * blk->preds[n]->id + 1 : 2 * i);
+            }
+
+            if((def = ins_def(ins)) && _is_vreg(ra, def) && (idx = ra->index[OPERAND_INDEX(def)]) != SIZE_MAX)
+                defs[idx] = i;
+        }
+    }
+
+    // marks are the index plus one, so that zero is nobody's
+    for(size_t k = 0; k < ra->global_count; k++) {
+        for(CLive *use = uses[k]; use; use = use->next) {
+            size_t top = 0, b = use->id / 2;
+
+            if(use->id & 1) {
+                if(out_mark[b] == k + 1)
+                    continue;
+
+                out_mark[b] = k + 1;
+                _push_live(&ra->live_out[b], ra->globals[k]);
+
+                if(b == defs[k])
+                    continue;
+            }
+            else if(b == defs[k])
+                continue;
+
+            if(in_mark[b] == k + 1)
+                continue;
+
+            in_mark[b]   = k + 1;
+            stack[top++] = b;
+
+            while(top) {
+                CBasicBlock *blk = fn->blocks[stack[--top]];
+
+                _push_live(&ra->live_in[blk->id], ra->globals[k]);
+
+                for(size_t j = 0; j < blk->pred_count; j++) {
+                    size_t p = blk->preds[j]->id;
+
+                    if(out_mark[p] == k + 1)
+                        continue;
+
+                    out_mark[p] = k + 1;
+                    _push_live(&ra->live_out[p], ra->globals[k]);
+
+                    if(p != defs[k] && in_mark[p] != k + 1) {
+                        in_mark[p]   = k + 1;
+                        stack[top++] = p;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void _build_intervals(CAlloc *ra)
+{
+    CFunction  *fn = ra->fn;
+    CInterval **buckets, **tail = &ra->unhandled;
+
+    for(size_t i = fn->block_count; i-- > 0;)
+        _build_block(ra, fn->blocks[i]);
+
+    buckets = (CInterval **)zalloc(sizeof(CInterval *) * ra->slot_count, ARENA_3);
+    memset(buckets, 0, sizeof(CInterval *) * ra->slot_count);
+
+    // by start, one bucket for the few positions of each slot
+    for(size_t i = 0; i < ra->value_count; i++) {
+        CInterval *it = ra->values[i], **link;
+
+        if(!it || !it->ranges)
+            continue;
+
+        it->start  = it->ranges->from;
+        it->cursor = it->ranges;
+
+        for(CRange *range = it->ranges; range; range = range->next)
+            it->end = range->to;
+
+        for(link = &buckets[it->start / 4]; *link && (*link)->start <= it->start; link = &(*link)->next)
+            ;
+
+        it->next = *link;
+        *link    = it;
+    }
+
+    for(size_t s = 0; s < ra->slot_count; s++) {
+        for(*tail = buckets[s]; *tail; tail = &(*tail)->next)
+            ;
+    }
+}
+
+/*
+ * Walks 'blk' backwards from what is live at its end, the ranges of the
+ * block being prepended to the ones already built after it. A value is
+ * live at a point of the block when its first range, one of this block,
+ * covers it.
+ */
+static void _build_block(CAlloc *ra, CBasicBlock *blk)
+{
+    CFunction *fn    = ra->fn;
+    size_t     first = ra->from[blk->id] / 4 + 1;
+
+    for(CLive *live = ra->live_out[blk->id]; live; live = live->next)
+        _add_range(_value(ra, live->id), ra->from[blk->id], ra->to[blk->id]);
+
+    for(size_t i = blk->count; i-- > 0;) {
+        CInstruction *ins = &blk->ins[i];
+        size_t        pos = 4 * (first + i);
+        COperand      def, *op;
+
+        if(ins->kind == INS_PHI) {
+            CInterval *it  = _value(ra, OPERAND_INDEX(ins->arg1));
+            COperand   arg = LIST_OF(fn, ins->arg2)[0];
+
+            if(_live_at(it, ra->from[blk->id]))
+                it->ranges->from = ra->from[blk->id];
+            else
+                _add_range(it, ra->from[blk->id], ra->from[blk->id] + 1);
+
+            it->type = ins->type;
+            it->sse  = _is_sse(ins);
+
+            if(_is_vreg(ra, arg)) {
+                it->hint     = _value(ra, OPERAND_INDEX(arg));
+                it->hint_pos = ra->to[blk->preds[0]->id] - 1;
+            }
+
+            // the operands are hinted the other way, for loops
+            for(size_t j = 0; j < blk->pred_count; j++) {
+                CInterval *from;
+
+                arg = LIST_OF(fn, ins->arg2)[j];
+
+                if(!_is_vreg(ra, arg) || (from = _value(ra, OPERAND_INDEX(arg)))->hint)
+                    continue;
+
+                from->hint     = it;
+                from->hint_pos = ra->from[blk->id];
+            }
+            continue;
+        }
+
+        _add_fixed(ra, ins, pos);
+
+        if((def = ins_def(ins)) && _is_vreg(ra, def)) {
+            CInterval *it = _value(ra, OPERAND_INDEX(def));
+
+            if(_live_at(it, pos + 2))
+                it->ranges->from = pos + 2;
+            else
+                _add_range(it, pos + 2, pos + 3);
+
+            _add_use(ra, it, pos + 2, &ins->arg1, true);
+
+            it->type = ins->type;
+            it->sse  = _is_sse(ins);
+
+            if(ins->kind == INS_LOAD && _is_vreg(ra, ins->arg2)) {
+                it->hint     = _value(ra, OPERAND_INDEX(ins->arg2));
+                it->hint_pos = pos;
+            }
+        }
+
+        for(size_t n = 0; (op = ins_use(fn, ins, n)); n++) {
+            CInterval *it;
+
+            if(!_is_vreg(ra, *op))
+                continue;
+
+            it = _value(ra, OPERAND_INDEX(*op));
+
+            _add_range(it, ra->from[blk->id], pos + 1);
+            _add_use(ra, it, pos, op, ins->kind != INS_CALL || !n);
+        }
+    }
+}
+
+/*
+ * Records that 'arg' appears in block 'blk', SIZE_MAX for a phi, and
+ * makes it a global when it is not the first block it appears in.
+ */
+static void _note(CAlloc *ra, size_t *home, COperand arg, size_t blk)
+{
+    size_t id;
+
+    if(!_is_vreg(ra, arg))
+        return;
+
+    id = OPERAND_INDEX(arg);
+
+    if(blk != SIZE_MAX && (home[id] == SIZE_MAX || home[id] == blk))
+        home[id] = blk;
+    else if(ra->index[id] == SIZE_MAX) {
+        ra->index[id]                   = ra->global_count;
+        ra->globals[ra->global_count++] = id;
+    }
+}
+
+static void _push_live(CLive **list, size_t id)
+{
+    CLive *live = (CLive *)zalloc(sizeof(CLive), ARENA_3);
+
+    live->id   = id;
+    live->next = *list;
+    *list      = live;
+}
+
+static bool _live_at(CInterval *it, size_t pos)
+{
+    return it->ranges && it->ranges->from <= pos && pos < it->ranges->to;
+}
+
+/*
+ * The registers 'ins' takes for itself, at 'pos'.
+ */
+static void _add_fixed(CAlloc *ra, CInstruction *ins, size_t pos)
+{
+    int    regs[REG_END_MARK];
+    size_t count = 0, from = pos, to = pos + 2;
+
+    switch(ins->kind) {
+        case INS_CALL:
+            for(size_t i = 0; i < sizeof(caller_saved) / sizeof(caller_saved[0]); i++)
+                regs[count++] = caller_saved[i];
+
+            for(size_t i = 0; i < sizeof(sse_order) / sizeof(sse_order[0]); i++)
+                regs[count++] = sse_order[i];
+
+            from = pos + 1;
+            break;
+        case INS_DIV:
+        case INS_MOD:
+        case INS_MULH:
+            if(_is_sse(ins))
+                return;
+
+            regs[count++] = REG_RAX;
+            regs[count++] = REG_RDX;
+            break;
+        case INS_SHL:
+        case INS_SHR:
+            if(!_is_vreg(ra, ins->arg3))
+                return;
+
+            regs[count++] = REG_RCX;
+            to            = pos + 3;
+            break;
+        default:
+            return;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        CInterval *it = ra->fixed[regs[i]];
+
+        if(!it) {
+            it        = _new_interval();
+            it->fixed = true;
+            it->reg   = regs[i];
+            it->sse   = regs[i] >= REG_XMM0;
+
+            ra->fixed[regs[i]] = it;
+        }
+
+        _add_range(it, from, to);
+    }
+}
+
+/*
+ * The scan proper. 'active' holds the intervals covering the current
+ * position, 'inactive' the ones with a register that are in a hole, by
+ * where they resume: an interval resuming after the end of another
+ * cannot be in its way, so only the head of the list is looked at.
+ */
+static void _scan(CAlloc *ra)
+{
+    CInterval *cur;
+
+    for(int r = REG_NONE + 1; r < REG_END_MARK; r++) {
+        CInterval *it = ra->fixed[r];
+
+        if(!it)
+            continue;
+
+        it->start  = it->ranges->from;
+        it->cursor = it->ranges;
+
+        for(CRange *range = it->ranges; range; range = range->next)
+            it->end = range->to;
+
+        _deactivate(ra, it);
+    }
+
+    while((cur = ra->unhandled)) {
+        CInterval **link, *moved = NULL;
+        size_t      pos = cur->start;
+
+        ra->unhandled = cur->next;
+
+        for(link = &ra->active; *link;) {
+            CInterval *it = *link;
+
+            if(it->end <= pos || !_covers(it, pos)) {
+                *link = it->next;
+
+                if(it->end > pos) {
+                    it->next = moved;
+                    moved    = it;
+                }
+                continue;
+            }
+
+            link = &it->next;
+        }
+
+        while(ra->inactive && ra->inactive->resume <= pos) {
+            CInterval *it = ra->inactive;
+
+            ra->inactive = it->next;
+
+            if(it->end <= pos)
+                continue;
+
+            if(_covers(it, pos)) {
+                it->next   = ra->active;
+                ra->active = it;
+            }
+            else {
+                it->next = moved;
+                moved    = it;
+            }
+        }
+
+        while(moved) {
+            CInterval *it = moved;
+
+            moved = it->next;
+            _deactivate(ra, it);
+        }
+
+        if(!_try_free(ra, cur))
+            _allocate_blocked(ra, cur);
+
+        if(cur->reg) {
+            cur->next  = ra->active;
+            ra->active = cur;
+        }
+    }
+}
+
+/*
+ * Gives 'cur' a register free for all of it, preferring its hint and
+ * else the one whose next interval is nearest, so the long free stretches
+ * (the callee saved registers, across calls) go to the intervals needing
+ * them. Failing that, the register free the longest is given to the head
+ * of 'cur' and the rest goes back to the unhandled list.
+ */
+static bool _try_free(CAlloc *ra, CInterval *cur)
+{
+    size_t     free_until[REG_END_MARK];
+    const int *order = cur->sse ? sse_order : gpr_order;
+    size_t     count = cur->sse ? sizeof(sse_order) / sizeof(sse_order[0]) : sizeof(gpr_order) / sizeof(gpr_order[0]);
+    int        reg = REG_NONE, best = REG_NONE, hint;
+
+    for(size_t i = 0; i < count; i++)
+        free_until[order[i]] = SIZE_MAX;
+
+    for(CInterval *it = ra->active; it; it = it->next) {
+        if(it->sse == cur->sse)
+            free_until[it->reg] = 0;
+    }
+
+    for(CInterval *it = ra->inactive; it && it->resume < cur->end; it = it->next) {
+        size_t pos;
+
+        if(it->sse != cur->sse || !free_until[it->reg])
+            continue;
+
+        if((pos = _intersect(it, cur)) < free_until[it->reg])
+            free_until[it->reg] = pos;
+    }
+
+    if((hint = _hint(cur)) && free_until[hint] >= cur->end) {
+        cur->reg = hint;
+        return true;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        int r = order[i];
+
+        if(free_until[r] >= cur->end && (!reg || free_until[r] < free_until[reg]))
+            reg = r;
+
+        if(!best || free_until[r] > free_until[best])
+            best = r;
+    }
+
+    if(reg) {
+        cur->reg = reg;
+        return true;
+    }
+
+    if(!free_until[best])
+        return false;
+
+    {
+        size_t pos = _legal_before(ra, free_until[best]);
+
+        if(pos <= cur->start)
+            return false;
+
+        _insert(&ra->unhandled, _split(ra, cur, pos));
+    }
+
+    cur->reg = best;
+
+    return true;
+}
+
+/*
+ * No register is free for 'cur'. The one whose intervals are next used
+ * the furthest away is taken from them, unless 'cur' is used even later
+ * or is worth less than they are, by use count weighed with the loop
+ * depth: then 'cur' waits in its spill slot until it is needed.
+ */
+static void _allocate_blocked(CAlloc *ra, CInterval *cur)
+{
+    size_t     use_pos[REG_END_MARK], block_pos[REG_END_MARK], first;
+    double     cost[REG_END_MARK];
+    const int *order = cur->sse ? sse_order : gpr_order;
+    size_t     count = cur->sse ? sizeof(sse_order) / sizeof(sse_order[0]) : sizeof(gpr_order) / sizeof(gpr_order[0]);
+    int        reg = REG_NONE;
+
+    for(size_t i = 0; i < count; i++) {
+        use_pos[order[i]]   = SIZE_MAX;
+        block_pos[order[i]] = SIZE_MAX;
+        cost[order[i]]      = 0;
+    }
+
+    for(CInterval *it = ra->active; it; it = it->next) {
+        size_t pos;
+
+        if(it->sse != cur->sse)
+            continue;
+
+        if(it->fixed) {
+            use_pos[it->reg]   = 0;
+            block_pos[it->reg] = 0;
+            continue;
+        }
+
+        if((pos = _next_use(it, cur->start)) < use_pos[it->reg])
+            use_pos[it->reg] = pos;
+
+        cost[it->reg] += _weight(it);
+    }
+
+    for(CInterval *it = ra->inactive; it && it->resume < cur->end; it = it->next) {
+        size_t pos;
+
+        if(it->sse != cur->sse || (pos = _intersect(it, cur)) == SIZE_MAX)
+            continue;
+
+        if(it->fixed) {
+            if(pos < block_pos[it->reg])
+                block_pos[it->reg] = pos;
+            if(pos < use_pos[it->reg])
+                use_pos[it->reg] = pos;
+            continue;
+        }
+
+        if((pos = _next_use(it, cur->start)) < use_pos[it->reg])
+            use_pos[it->reg] = pos;
+
+        cost[it->reg] += _weight(it);
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        int r = order[i];
+
+        if(!reg || use_pos[r] > use_pos[reg] || (use_pos[r] == use_pos[reg] && cost[r] < cost[reg]))
+            reg = r;
+    }
+
+    first = _next_use(cur, cur->start);
+
+    if(first == SIZE_MAX || (first - 1 > cur->start && (use_pos[reg] <= first ||
+       (use_pos[reg] != SIZE_MAX && cost[reg] > _weight(cur))))) {
+        cur->reg = REG_NONE;
+
+        _slot(ra, cur);
+
+        if(first != SIZE_MAX)
+            _insert(&ra->unhandled, _split(ra, cur, _legal_before(ra, first - 1)));
+        return;
+    }
+
+    cur->reg = reg;
+
+    if(block_pos[reg] < cur->end) {
+        size_t pos = _legal_before(ra, block_pos[reg]);
+
+        if(pos > cur->start)
+            _insert(&ra->unhandled, _split(ra, cur, pos));
+    }
+
+    // what is left of them ends here, or is all of it
+    for(CInterval **link = &ra->active; *link;) {
+        CInterval *it = *link;
+
+        if(it->fixed || it->reg != reg) {
+            link = &it->next;
+            continue;
+        }
+
+        *link = it->next;
+        _spill_from(ra, it, cur->start);
+    }
+
+    for(CInterval **link = &ra->inactive; *link && (*link)->resume < cur->end;) {
+        CInterval *it = *link;
+
+        if(it->fixed || it->reg != reg || _intersect(it, cur) == SIZE_MAX) {
+            link = &it->next;
+            continue;
+        }
+
+        *link = it->next;
+        _spill_from(ra, it, cur->start);
+    }
+}
+
+/*
+ * Puts 'it', in a hole at the scan, on the inactive list.
+ */
+static void _deactivate(CAlloc *ra, CInterval *it)
+{
+    CInterval **link = &ra->inactive;
+
+    it->resume = it->cursor->from;
+
+    while(*link && (*link)->resume <= it->resume)
+        link = &(*link)->next;
+
+    it->next = *link;
+    *link    = it;
+}
+
+/*
+ * Moves what is left of 'it' from 'pos' to the spill slot, until just
+ * before its next use.
+ */
+static void _spill_from(CAlloc *ra, CInterval *it, size_t pos)
+{
+    size_t use;
+
+    _slot(ra, it);
+
+    if(pos > it->start && pos < it->end)
+        it = _split(ra, it, pos);
+    else if(pos > it->start)
+        return;
+
+    it->reg = REG_NONE;
+
+    if((use = _next_use(it, it->start)) != SIZE_MAX)
+        _insert(&ra->unhandled, _split(ra, it, _legal_before(ra, use - 1)));
+}
+
+/*
+ * Works out the moves once every piece has its place: the store of each
+ * spilled value after its definition, the moves between the pieces of a
+ * value inside a block and the moves on the edges.
+ */
+static void _resolve(CAlloc *ra)
+{
+    CFunction *fn    = ra->fn;
+    size_t     edges = 0;
+
+    for(size_t i = 0; i < fn->block_count; i++)
+        edges += fn->blocks[i]->succ_count;
+
+    ra->moves = (CMove **)zalloc(sizeof(CMove *) * (fn->block_count + edges), ARENA_3);
+
+    memset(ra->moves, 0, sizeof(CMove *) * (fn->block_count + edges));
+
+    for(size_t i = 0; i < ra->value_count; i++) {
+        CInterval *value = ra->values[i];
+
+        if(!value || !value->ranges)
+            continue;
+
+        for(CInterval *it = value; it; it = it->split) {
+            if(!it->reg)
+                it->misc = _slot(ra, value);
+            else if(it == value)
+                it->misc = value->value;
+            else
+                it->misc = _new_vreg(fn, it->reg);
+
+            if(it->reg)
+                ir_assign(fn, it->misc, it->reg);
+        }
+
+        if(value->slot && value->reg) {
+            CBasicBlock *blk = ra->slots[value->start / 4];
+
+            // after the definition, or after the moves into a phi
+            _add_move(ra, blk, value->start % 4 ? 2 * (value->start + 1) : 2 * value->start + 1,
+                      value->slot, value->misc, value);
+
+            ra->spills++;
+        }
+
+        for(CInterval *it = value; it->split; it = it->split) {
+            CInterval *next = it->split;
+
+            if(!next->reg || next->start % 4 != 3 || !_contains(it, next->start - 1))
+                continue;
+
+            _add_move(ra, ra->slots[next->start / 4], 2 * next->start, next->misc, _location(ra, it), value);
+        }
+    }
+
+    for(size_t i = 0; i < ra->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->succ_count; j++)
+            _resolve_edge(ra, blk, blk->succs[j]);
+    }
+}
+
+/*
+ * The values live into 'to' that are not where they were at the end of
+ * 'from', and the phis of 'to'. A value only needs moving into a
+ * register: its slot always holds it.
+ */
+static void _resolve_edge(CAlloc *ra, CBasicBlock *from, CBasicBlock *to)
+{
+    CFunction    *fn   = ra->fn;
+    CMove        *head;
+    CInstruction *last = from->count ? &from->ins[from->count - 1] : NULL;
+    CBasicBlock  *blk;
+    size_t        end = ra->to[from->id] - 1, start = ra->from[to->id], pred = _pred_index(to, from), key;
+
+    for(CLive *live = ra->live_in[to->id]; live; live = live->next) {
+        CInterval *value = ra->values[live->id];
+        CInterval *src, *dst;
+
+        if(!value || !(dst = _piece_at(value, start)) || !dst->reg)
+            continue;
+
+        if(!(src = _piece_at(value, end)) || _same(fn, _location(ra, src), dst->misc))
+            continue;
+
+        _add_move(ra, NULL, 0, dst->misc, _location(ra, src), value);
+    }
+
+    for(size_t k = 0; k < to->count && to->ins[k].kind == INS_PHI; k++) {
+        CInterval *value = ra->values[OPERAND_INDEX(to->ins[k].arg1)], *dst, *src;
+        COperand   arg   = LIST_OF(fn, to->ins[k].arg2)[pred];
+
+        if(!(dst = _piece_at(value, start)))
+            continue;
+
+        if(_is_vreg(ra, arg)) {
+            if(!ra->values[OPERAND_INDEX(arg)] || !(src = _piece_at(ra->values[OPERAND_INDEX(arg)], end)))
+                continue;
+
+            arg = _location(ra, src);
+        }
+
+        if(!_same(fn, arg, _location(ra, dst)))
+            _add_move(ra, NULL, 0, _location(ra, dst), arg, value);
+    }
+
+    head     = ra->edge;
+    ra->edge = NULL;
+
+    if(!head)
+        return;
+
+    if(from->succ_count == 1 && (!last || (last->kind != INS_JTAB && !is_branch(last->kind)))) {
+        blk = from;
+        key = last && last->kind == INS_JMP ? 2 * (ra->to[from->id] - 4) - 1 : 2 * ra->to[from->id] - 1;
+    } else if(to->pred_count == 1) {
+        blk = to;
+        key = 2 * start;
+    } else {
+        blk = _split_edge(ra, from, to);
+        key = 0;
+    }
+
+    while(head) {
+        CMove *move = head;
+
+        head       = move->next;
+        move->key  = key;
+        move->next = ra->moves[blk->id];
+
+        ra->moves[blk->id] = move;
+    }
+}
+
+/*
+ * Puts a block on the edge: right after 'from' when the edge falls
+ * through, else at the end of the function, jumping to 'to'. The jumps of
+ * 'from' to 'to' are retargeted to it.
+ */
+static CBasicBlock *_split_edge(CAlloc *ra, CBasicBlock *from, CBasicBlock *to)
+{
+    CFunction    *fn   = ra->fn;
+    CInstruction *last = from->count ? &from->ins[from->count - 1] : NULL;
+    CBasicBlock  *blk;
+    COperand      label = 0;
+
+    blk = (CBasicBlock *)zalloc(sizeof(CBasicBlock), ARENA_3);
+
+    memset(blk, 0, sizeof(CBasicBlock));
+
+    blk->id         = fn->block_count++;
+    blk->succs      = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * 2, ARENA_3);
+    blk->preds      = (CBasicBlock **)zalloc(sizeof(CBasicBlock *), ARENA_3);
+    blk->succs[0]   = to;
+    blk->succ_count = 1;
+    blk->preds[0]   = from;
+    blk->pred_count = 1;
+
+    for(size_t i = 0; i < from->succ_count; i++) {
+        if(from->succs[i] == to)
+            from->succs[i] = blk;
+    }
+
+    to->preds[_pred_index(to, from)] = blk;
+
+    if(last && last->kind == INS_JTAB) {
+        for(COperand *op = LIST_OF(fn, last->arg1); *op; op++) {
+            if(TARGET_OF(fn, *op) != to)
+                continue;
+
+            if(!label)
+                label = _new_label(fn, blk);
+
+            *op = label;
+        }
+    } else if(last && is_branch(last->kind) && TARGET_OF(fn, last->arg1) == to)
+        last->arg1 = label = _new_label(fn, blk);
+
+    if(from->next == to) {
+        blk->next  = to;
+        from->next = blk;
+        return blk;
+    }
+
+    if(!label)
+        label = _new_label(fn, blk);
+
+    blk->ins      = (CInstruction *)zalloc(sizeof(CInstruction), ARENA_3);
+    blk->ins[0]   = new_instruction(INS_JMP, to->label, 0, 0, NULL, last ? last->line : 0);
+    blk->count    = 1;
+    blk->capacity = 1;
+
+    for(CBasicBlock *tail = from; ; tail = tail->next) {
+        if(!tail->next) {
+            tail->next = blk;
+            break;
+        }
+    }
+
+    fn->ins_count++;
+
+    return blk;
+}
+
+/*
+ * Points every operand at the piece of its value covering it: the
+ * register of the piece, or the spill slot for a call argument.
+ */
+static void _rewrite(CAlloc *ra)
+{
+    for(size_t i = 0; i < ra->value_count; i++) {
+        for(CInterval *it = ra->values[i]; it; it = it->split) {
+            for(CUse *use = it->uses; use; use = use->next)
+                *use->slot = it->misc;
+        }
+    }
+}
+
+/*
+ * Lays the blocks out again with their moves, dropping the phis: each
+ * group of moves at one position is sequenced before the instruction it
+ * precedes.
+ */
+static void _insert_moves(CAlloc *ra)
+{
+    CFunction *fn = ra->fn;
+    size_t     count = 0;
+
+    for(CBasicBlock *blk = fn->entry; blk; blk = blk->next) {
+        CMove        **sorted, *move;
+        CInstruction  *ins;
+        size_t         moves = 0, n = 0, next = 0, first;
+
+        for(move = ra->moves[blk->id]; move; move = move->next)
+            moves++;
+
+        if(!moves && (!blk->count || blk->ins[0].kind != INS_PHI))
+            continue;
+
+        sorted = (CMove **)zalloc(sizeof(CMove *) * (moves + 1), ARENA_3);
+
+        // the lists were built backwards, so the sequence numbers go down
+        for(move = ra->moves[blk->id]; move; move = move->next)
+            sorted[n++] = move;
+
+        for(size_t i = 1; i < moves; i++) {
+            CMove *m = sorted[i];
+            size_t j = i;
+
+            for(; j && (sorted[j - 1]->key > m->key || (sorted[j - 1]->key == m->key && sorted[j - 1]->seq > m->seq)); j--)
+                sorted[j] = sorted[j - 1];
+
+            sorted[j] = m;
+        }
+
+        ins   = (CInstruction *)zalloc(sizeof(CInstruction) * (blk->count + 3 * moves + 1), ARENA_3);
+        first = blk->id < ra->block_count ? ra->from[blk->id] / 4 + 1 : 0;
+        n     = 0;
+
+        for(size_t i = 0; i <= blk->count; i++) {
+            size_t limit = i < blk->count ? 8 * (first + i) : SIZE_MAX;
+
+            if(blk->id >= ra->block_count)
+                limit = i ? SIZE_MAX : 1;
+
+            while(next < moves && sorted[next]->key < limit) {
+                size_t group = next;
+
+                while(next < moves && sorted[next]->key == sorted[group]->key)
+                    next++;
+
+                n += _sequence(ra, &sorted[group], next - group, &ins[n]);
+            }
+
+            if(i < blk->count && blk->ins[i].kind != INS_PHI)
+                ins[n++] = blk->ins[i];
+        }
+
+        fn->ins_count += n;
+        fn->ins_count -= blk->count;
+
+        blk->ins      = ins;
+        blk->count    = n;
+        blk->capacity = blk->count + 3 * moves + 1;
+    }
+
+    fn->blocks = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * fn->block_count, ARENA_3);
+
+    for(CBasicBlock *blk = fn->entry; blk; blk = blk->next) {
+        blk->id             = count;
+        fn->blocks[count++] = blk;
+    }
+}
+
+/*
+ * Orders a parallel copy: a move goes once no other one still reads its
+ * destination. What is left then are cycles, each broken by saving one
+ * destination in the scratch register of its class. The integer moves
+ * are done first, so a move between two slots, which goes through a
+ * scratch register too, can take the SSE one while the integer one holds
+ * a saved value, and the other way round.
+ */
+static size_t _sequence(CAlloc *ra, CMove **group, size_t count, CInstruction *out)
+{
+    size_t n = 0;
+
+    for(int sse = 0; sse < 2; sse++) {
+        bool busy = false;
+
+        for(;;) {
+            bool progress = false, left = false;
+
+            for(size_t i = 0; i < count; i++) {
+                bool read = false;
+
+                if(!group[i] || group[i]->sse != sse)
+                    continue;
+
+                left = true;
+
+                for(size_t j = 0; j < count && !read; j++)
+                    read = j != i && group[j] && _same(ra->fn, group[j]->src, group[i]->dst);
+
+                if(read)
+                    continue;
+
+                if(group[i]->src == ra->scratch[sse])
+                    busy = false;
+
+                n += _emit(ra, group[i], &out[n], busy);
+
+                group[i] = NULL;
+                progress = true;
+            }
+
+            if(!left)
+                break;
+
+            if(progress)
+                continue;
+
+            for(size_t i = 0; i < count; i++) {
+                COperand saved;
+
+                if(!group[i] || group[i]->sse != sse)
+                    continue;
+
+                if(!ra->scratch[sse])
+                    ra->scratch[sse] = _new_vreg(ra->fn, sse ? REG_XMM15 : REG_R11);
+
+                saved    = group[i]->dst;
+                out[n++] = new_instruction(INS_LOAD, ra->scratch[sse], saved, 0, group[i]->type, 0);
+                busy     = true;
+
+                for(size_t j = 0; j < count; j++) {
+                    if(group[j] && _same(ra->fn, group[j]->src, saved))
+                        group[j]->src = ra->scratch[sse];
+                }
+                break;
+            }
+        }
+    }
+
+    return n;
+}
+
+static size_t _emit(CAlloc *ra, CMove *move, CInstruction *out, bool busy)
+{
+    COperand tmp;
+    int      sse = move->sse != busy;
+
+    if(IS_VREG(move->dst)) {
+        out[0]       = new_instruction(INS_LOAD, move->dst, move->src, 0, move->type, 0);
+        ra->reloads += OPERAND_KIND(move->src) == OPERAND_SYMBOL;
+        return 1;
+    }
+
+    ra->stores++;
+
+    if(OPERAND_KIND(move->src) != OPERAND_SYMBOL) {
+        out[0] = new_instruction(INS_STORE, move->dst, move->src, 0, move->type, 0);
+        return 1;
+    }
+
+    ra->reloads++;
+
+    if(!(tmp = ra->scratch[sse]))
+        tmp = ra->scratch[sse] = _new_vreg(ra->fn, sse ? REG_XMM15 : REG_R11);
+
+    out[0] = new_instruction(INS_LOAD, tmp, move->src, 0, move->type, 0);
+    out[1] = new_instruction(INS_STORE, move->dst, tmp, 0, move->type, 0);
+
+    return 2;
+}
+
+/*
+ * Queues a move of 'value' for 'blk' at 'key': twice the position it goes
+ * at, so a key between two positions orders it after the moves at the
+ * first one. Without a block, the move is kept apart for the edge being
+ * resolved.
+ */
+static void _add_move(CAlloc *ra, CBasicBlock *blk, size_t key, COperand dst, COperand src, CInterval *value)
+{
+    CMove  *move;
+    CMove **list = blk ? &ra->moves[blk->id] : &ra->edge;
+
+    move = (CMove *)zalloc(sizeof(CMove), ARENA_3);
+
+    memset(move, 0, sizeof(CMove));
+
+    move->key  = key;
+    move->seq  = ra->move_count++;
+    move->dst  = dst;
+    move->src  = src;
+    move->type = value->type;
+    move->sse  = value->sse;
+
+    // a spill slot is always stored and reloaded whole, see _slot()
+    if(OPERAND_KIND(dst) == OPERAND_SYMBOL || OPERAND_KIND(src) == OPERAND_SYMBOL)
+        move->type = cmp_primitives[value->sse ? DOUBLE : LONG];
+    move->next = *list;
+
+    *list = move;
+}
+
+static CInterval *_value(CAlloc *ra, size_t id)
+{
+    CInterval *it;
+
+    if((it = ra->values[id]))
+        return it;
+
+    it         = _new_interval();
+    it->value  = OPERAND(OPERAND_VREG, id);
+    it->parent = it;
+
+    ra->values[id] = it;
+
+    return it;
+}
+
+static CInterval *_new_interval(void)
+{
+    CInterval *it;
+
+    it = (CInterval *)zalloc(sizeof(CInterval), ARENA_3);
+
+    memset(it, 0, sizeof(CInterval));
+
+    return it;
+}
+
+/*
+ * Cuts 'it' at 'pos', strictly inside it, and returns the second part.
+ * The part is hinted to the register of the first one.
+ */
+static CInterval *_split(CAlloc *ra, CInterval *it, size_t pos)
+{
+    CInterval *child = _new_interval();
+    CRange   **link  = &it->ranges, *range, *prev = NULL;
+    CUse     **use   = &it->uses;
+
+    while((range = *link) && range->to <= pos) {
+        prev = range;
+        link = &range->next;
+    }
+
+    child->end = it->end;
+
+    if(range->from < pos) {
+        child->ranges = (CRange *)zalloc(sizeof(CRange), ARENA_3);
+
+        child->ranges->from = pos;
+        child->ranges->to   = range->to;
+        child->ranges->next = range->next;
+
+        range->to   = pos;
+        range->next = NULL;
+        it->end     = pos;
+    } else {
+        child->ranges = range;
+        *link         = NULL;
+        it->end       = prev->to;
+    }
+
+    while(*use && (*use)->pos < pos)
+        use = &(*use)->next;
+
+    child->uses = *use;
+    *use        = NULL;
+
+    child->value    = it->value;
+    child->type     = it->type;
+    child->sse      = it->sse;
+    child->parent   = it->parent;
+    child->split    = it->split;
+    child->start    = child->ranges->from;
+    child->cursor   = child->ranges;
+    child->hint     = it->parent;
+    child->hint_pos = pos - 1;
+
+    it->split   = child;
+    it->cursor  = it->ranges;
+    it->weighed = false;
+
+    ra->splits++;
+
+    return child;
+}
+
+/*
+ * Adds [from, to) to the ranges of 'it', merging the ones it touches.
+ * Ranges come mostly in decreasing order, so the search is short.
+ */
+static void _add_range(CInterval *it, size_t from, size_t to)
+{
+    CRange **link = &it->ranges, *range;
+
+    while(*link && (*link)->to < from)
+        link = &(*link)->next;
+
+    if((range = *link) && range->from <= to) {
+        if(from < range->from)
+            range->from = from;
+
+        if(to > range->to)
+            range->to = to;
+
+        while(range->next && range->next->from <= range->to) {
+            if(range->next->to > range->to)
+                range->to = range->next->to;
+
+            range->next = range->next->next;
+        }
+        return;
+    }
+
+    range = (CRange *)zalloc(sizeof(CRange), ARENA_3);
+
+    range->from = from;
+    range->to   = to;
+    range->next = *link;
+
+    *link = range;
+}
+
+/*
+ * Uses are found backwards, so prepending keeps them in order.
+ */
+static void _add_use(CAlloc *ra, CInterval *it, size_t pos, COperand *slot, bool reg)
+{
+    CUse *use;
+
+    use = (CUse *)zalloc(sizeof(CUse), ARENA_3);
+
+    use->pos    = pos;
+    use->slot   = slot;
+    use->reg    = reg;
+    use->weight = ra->weights[ra->slots[pos / 4]->id];
+    use->next   = it->uses;
+
+    it->uses = use;
+}
+
+/*
+ * Whether 'it' covers 'pos', for positions that only grow: the ranges
+ * behind are skipped for good.
+ */
+static bool _covers(CInterval *it, size_t pos)
+{
+    while(it->cursor && it->cursor->to <= pos)
+        it->cursor = it->cursor->next;
+
+    return it->cursor && it->cursor->from <= pos;
+}
+
+static bool _contains(CInterval *it, size_t pos)
+{
+    for(CRange *range = it->ranges; range && range->from <= pos; range = range->next) {
+        if(pos < range->to)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * First position from the scan on that both cover, SIZE_MAX if none.
+ */
+static size_t _intersect(CInterval *a, CInterval *b)
+{
+    CRange *x = a->cursor, *y = b->cursor;
+
+    while(x && y) {
+        if(x->to <= y->from)
+            x = x->next;
+        else if(y->to <= x->from)
+            y = y->next;
+        else
+            return x->from > y->from ? x->from : y->from;
+    }
+
+    return SIZE_MAX;
+}
+
+/*
+ * First use from 'pos' on needing a register.
+ */
+static size_t _next_use(CInterval *it, size_t pos)
+{
+    for(CUse *use = it->uses; use; use = use->next) {
+        if(use->reg && use->pos >= pos)
+            return use->pos;
+    }
+
+    return SIZE_MAX;
+}
+
+/*
+ * Last position up to 'pos' where the piece of a split may start: the
+ * start of a block, whose moves are made on its edges, or a gap before an
+ * instruction of the same block.
+ */
+static size_t _legal_before(CAlloc *ra, size_t pos)
+{
+    size_t       slot = pos / 4;
+    CBasicBlock *blk  = ra->slots[slot];
+    size_t       first = ra->from[blk->id] / 4;
+
+    if(pos % 4 == 3 && (slot == first || slot + 1 < ra->to[blk->id] / 4))
+        return pos;
+
+    if(slot == first)
+        return 4 * slot;
+
+    return 4 * slot - 1;
+}
+
+/*
+ * What keeping 'it' in a register is worth: its uses, weighed by their
+ * loop depth, over its length.
+ */
+static double _weight(CInterval *it)
+{
+    double sum = 0;
+    size_t length = 0;
+
+    if(it->weighed)
+        return it->weight;
+
+    for(CUse *use = it->uses; use; use = use->next)
+        sum += use->weight;
+
+    for(CRange *range = it->ranges; range; range = range->next)
+        length += range->to - range->from;
+
+    it->weight  = sum / (1 + length / 4);
+    it->weighed = true;
+
+    return it->weight;
+}
+
+static int _hint(CInterval *it)
+{
+    CInterval *piece;
+
+    if(!it->hint || !(piece = _piece_at(it->hint, it->hint_pos)) || piece->sse != it->sse)
+        return REG_NONE;
+
+    return piece->reg;
+}
+
+static CInterval *_piece_at(CInterval *it, size_t pos)
+{
+    for(; it; it = it->split) {
+        if(_contains(it, pos))
+            return it;
+    }
+
+    return NULL;
+}
+
+static COperand _location(CAlloc *ra, CInterval *it)
+{
+    return it->reg ? it->misc : _slot(ra, it);
+}
+
+/*
+ * Spill slot of the value 'it' belongs to, a local of the function. It is
+ * as wide as a register of its class, whatever the type of the value: a
+ * phi reloads it with its own type, which may be wider.
+ */
+static COperand _slot(CAlloc *ra, CInterval *it)
+{
+    CInterval *value = it->parent;
+    char       name[32];
+
+    if(value->slot)
+        return value->slot;
+
+    snprintf(name, sizeof(name), "$spill%ld", OPERAND_INDEX(value->value));
+
+    value->slot = ir_temp(ra->fn, name, cmp_primitives[value->sse ? DOUBLE : LONG]);
+
+    return value->slot;
+}
+
+/*
+ * Into a list sorted by start, after the intervals starting at the same
+ * position.
+ */
+static void _insert(CInterval **list, CInterval *it)
+{
+    while(*list && (*list)->start <= it->start)
+        list = &(*list)->next;
+
+    it->next = *list;
+    *list    = it;
+}
+
+/*
+ * Whether two operands are the same location: symbols are interned, so
+ * only registers can be the same under two operands.
+ */
+static bool _same(CFunction *fn, COperand a, COperand b)
+{
+    size_t x = OPERAND_INDEX(a), y = OPERAND_INDEX(b);
+
+    if(a == b)
+        return true;
+
+    if(!IS_VREG(a) || !IS_VREG(b) || x >= fn->reg_count || y >= fn->reg_count)
+        return false;
+
+    return fn->regs[x] && fn->regs[x] == fn->regs[y];
+}
+
+/*
+ * Whether the result of 'ins' goes to an SSE register. A comparison is
+ * typed with its operands but gives an integer.
+ */
+static bool _is_sse(CInstruction *ins)
+{
+    CType *type;
+
+    switch(ins->kind) {
+        case INS_GE:
+        case INS_LE:
+        case INS_GT:
+        case INS_LT:
+        case INS_EQ:
+        case INS_NE:
+            return false;
+        default:
+            break;
+    }
+
+    if(!(type = canonical_type(ins->type)))
+        return false;
+
+    return type->kind == FLOAT || type->kind == DOUBLE || type->kind == LDOUBLE;
+}
+
+static bool _is_vreg(CAlloc *ra, COperand arg)
+{
+    return IS_VREG(arg) && OPERAND_INDEX(arg) < ra->value_count;
+}
+
+static size_t _pred_index(CBasicBlock *blk, CBasicBlock *pred)
+{
+    size_t i;
+
+    for(i = 0; i < blk->pred_count && blk->preds[i] != pred; i++)
+        ;
+
+    return i;
+}
+
+static COperand _new_vreg(CFunction *fn, int reg)
+{
+    COperand vreg = ir_vreg(fn);
+
+    ir_assign(fn, vreg, reg);
+
+    return vreg;
+}
+
+static COperand _new_label(CFunction *fn, CBasicBlock *blk)
+{
+    blk->label = ir_label(fn);
+
+    ir_place(fn, blk->label, blk);
+
+    return blk->label;
+}
@@ -0,0 +1,779 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * Sparse conditional constant propagation (Wegman-Zadeck) over the SSA
+ * registers. Every register starts unknown (TOP) and only moves down the
+ * lattice, to a constant and then to BOTTOM. Blocks are only evaluated
+ * once an edge into them is found executable, so a constant condition
+ * keeps the branch it never takes from polluting the phis it reaches.
+ *
+ * Afterwards every register found constant is defined by a LOAD of the
+ * constant, a conditional jump or a jump table on constants becomes a JMP
+ * or disappears, and blocks never found executable lose their outgoing
+ * edges: they are unreachable and the dead code sweep removes them.
+ */
+
+typedef enum {
+    VALUE_TOP,
+    VALUE_CONST,
+    VALUE_BOTTOM
+} ValueState;
+
+typedef struct CLattice CLattice;
+typedef struct CSite    CSite;
+
+struct CLattice {
+    ValueState state;
+    CType     *type;
+    int64_t    ival;
+    double     fval;
+};
+
+/*
+ * An instruction, or for the flow worklist the 'index'th edge into a block.
+ */
+struct CSite {
+    CBasicBlock *block;
+    size_t       index;
+};
+
+typedef struct CSCCP {
+    CCompiler *cmp;
+    CFunction *fn;
+    CLattice  *values;
+    size_t     value_count;
+    size_t    *use_start;
+    CSite     *uses;
+    bool      *executable;
+    bool     **edges;
+    CSite     *flow;
+    size_t     flow_count;
+    size_t     flow_capacity;
+    CSite     *work;
+    size_t     work_count;
+    size_t     work_capacity;
+} CSCCP;
+
+#define NO_EDGE ((size_t)-1)
+
+static void     _collect_uses(CSCCP *sccp);
+static void     _push(CSite **sites, size_t *count, size_t *capacity, CBasicBlock *blk, size_t index);
+static void     _solve(CSCCP *sccp);
+static void     _visit_block(CSCCP *sccp, CBasicBlock *blk, bool phis_only);
+static void     _visit(CSCCP *sccp, CBasicBlock *blk, size_t index);
+static void     _mark_edge(CSCCP *sccp, CBasicBlock *from, CBasicBlock *to);
+static void     _set(CSCCP *sccp, COperand reg, CLattice value);
+static CLattice _value_of(CSCCP *sccp, COperand arg, CType *type);
+static CLattice _meet(CLattice v1, CLattice v2);
+static CLattice _eval(Instruction kind, CType *type, CLattice v1, CLattice v2);
+static CLattice _convert(CLattice value, CType *type);
+static void     _rewrite(CSCCP *sccp);
+static void     _fold_branch(CSCCP *sccp, CBasicBlock *blk, CInstruction *ins);
+static CLattice _taken(CSCCP *sccp, CInstruction *ins);
+static void     _fold_table(CSCCP *sccp, CBasicBlock *blk, CInstruction *ins);
+static CBasicBlock *_table_target(CFunction *fn, CBasicBlock *blk, CInstruction *ins, int64_t index);
+static void     _sort_phis(CBasicBlock *blk);
+static COperand _constant(CFunction *fn, CLattice value);
+
+static bool     _is_binary(Instruction kind);
+static bool     _is_float(CType *type);
+static bool     _is_integer(CType *type);
+static bool     _is_unsigned(CType *type);
+static int64_t  _truncate(CType *type, int64_t val);
+
+void propagate_constants(CCompiler *cmp, CFunction *fn)
+{
+    CSCCP  sccp;
+    size_t folded, branches, unreachable;
+
+    if(!cmp || !fn || !fn->entry)
+        return;
+
+    memset(&sccp, 0, sizeof(CSCCP));
+
+    sccp.cmp         = cmp;
+    sccp.fn          = fn;
+    sccp.value_count = fn->vreg_count;
+    sccp.values      = (CLattice *)zalloc(sizeof(CLattice) * (fn->vreg_count + 1), ARENA_3);
+    sccp.executable  = (bool *)zalloc(sizeof(bool) * fn->block_count, ARENA_3);
+    sccp.edges       = (bool **)zalloc(sizeof(bool *) * fn->block_count, ARENA_3);
+
+    memset(sccp.values, 0, sizeof(CLattice) * fn->vreg_count);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        sccp.executable[i] = false;
+        sccp.edges[i]      = (bool *)zalloc(sizeof(bool) * (blk->pred_count + 1), ARENA_3);
+
+        memset(sccp.edges[i], 0, sizeof(bool) * blk->pred_count);
+    }
+
+    _collect_uses(&sccp);
+    _solve(&sccp);
+
+    folded      = cmp->opt.folded;
+    branches    = cmp->opt.folded_branches;
+    unreachable = cmp->opt.unreachable;
+
+    _rewrite(&sccp);
+
+    compute_dominators(fn);
+
+    folded      = cmp->opt.folded - folded;
+    branches    = cmp->opt.folded_branches - branches;
+    unreachable = cmp->opt.unreachable - unreachable;
+
+    if((options & COMPILER_OPTION_STATS) && (folded || branches || unreachable))
+        fprintf(cmp->diag, "sccp('%s'): %ld instructions and %ld branches folded, %ld blocks unreachable\n",
+                fn->sym->name, folded, branches, unreachable);
+}
+
+/*
+ * Def-use chains, as one array of instruction sites per register.
+ */
+static void _collect_uses(CSCCP *sccp)
+{
+    CFunction *fn    = sccp->fn;
+    size_t     count = sccp->value_count;
+    size_t    *fill;
+
+    sccp->use_start = (size_t *)zalloc(sizeof(size_t) * (count + 1), ARENA_3);
+    fill            = (size_t *)zalloc(sizeof(size_t) * (count + 1), ARENA_3);
+
+    memset(sccp->use_start, 0, sizeof(size_t) * (count + 1));
+
+    for(int pass = 0; pass < 2; pass++) {
+        for(size_t i = 0; i < fn->block_count; i++) {
+            CBasicBlock *blk = fn->blocks[i];
+
+            for(size_t j = 0; j < blk->count; j++) {
+                COperand *use;
+
+                for(size_t n = 0; (use = ins_use(fn, &blk->ins[j], n)); n++) {
+                    if(!IS_VREG(*use) || OPERAND_INDEX(*use) >= count)
+                        continue;
+                    if(pass)
+                        sccp->uses[fill[OPERAND_INDEX(*use)]++] = (CSite){blk, j};
+                    else
+                        sccp->use_start[OPERAND_INDEX(*use) + 1]++;
+                }
+            }
+        }
+
+        if(pass)
+            break;
+
+        for(size_t i = 0; i < count; i++)
+            sccp->use_start[i + 1] += sccp->use_start[i];
+
+        memcpy(fill, sccp->use_start, sizeof(size_t) * (count + 1));
+
+        sccp->uses = (CSite *)zalloc(sizeof(CSite) * (sccp->use_start[count] + 1), ARENA_3);
+    }
+}
+
+static void _push(CSite **sites, size_t *count, size_t *capacity, CBasicBlock *blk, size_t index)
+{
+    if(*count == *capacity) {
+        CSite *tmp = *sites;
+
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *sites    = (CSite *)zalloc(sizeof(CSite) * *capacity, ARENA_3);
+
+        if(tmp)
+            memcpy(*sites, tmp, sizeof(CSite) * *count);
+    }
+
+    (*sites)[*count].block   = blk;
+    (*sites)[(*count)++].index = index;
+}
+
+static void _solve(CSCCP *sccp)
+{
+    _push(&sccp->flow, &sccp->flow_count, &sccp->flow_capacity, sccp->fn->entry, NO_EDGE);
+
+    while(sccp->flow_count || sccp->work_count) {
+        if(sccp->flow_count) {
+            CSite site = sccp->flow[--sccp->flow_count];
+
+            // a block is evaluated once, a new edge into it only changes its phis
+            if(sccp->executable[site.block->id]) {
+                _visit_block(sccp, site.block, true);
+                continue;
+            }
+
+            sccp->executable[site.block->id] = true;
+
+            _visit_block(sccp, site.block, false);
+            continue;
+        }
+
+        CSite site = sccp->work[--sccp->work_count];
+
+        if(sccp->executable[site.block->id])
+            _visit(sccp, site.block, site.index);
+    }
+}
+
+static void _visit_block(CSCCP *sccp, CBasicBlock *blk, bool phis_only)
+{
+    CInstruction *last;
+
+    for(size_t i = 0; i < blk->count; i++) {
+        if(phis_only && blk->ins[i].kind != INS_PHI)
+            return;
+        _visit(sccp, blk, i);
+    }
+
+    last = blk->count ? &blk->ins[blk->count - 1] : NULL;
+
+    switch(last ? last->kind : INS_END_MARK) {
+        case INS_JMP:
+        case INS_JMPZ:
+        case INS_JLT:
+        case INS_JLE:
+        case INS_JGT:
+        case INS_JGE:
+        case INS_JEQ:
+        case INS_JNE:
+        case INS_JTAB:
+        case INS_RET:
+        case INS_RETVAL:
+        case INS_LEAVE:
+            return; // _visit() followed the edges
+        default:
+            _mark_edge(sccp, blk, blk->next);
+            return;
+    }
+}
+
+static void _visit(CSCCP *sccp, CBasicBlock *blk, size_t index)
+{
+    CInstruction *ins = &blk->ins[index];
+    CLattice      value;
+
+    switch(ins->kind) {
+        case INS_PHI:
+            memset(&value, 0, sizeof(CLattice));
+
+            for(size_t j = 0; LIST_OF(sccp->fn, ins->arg2)[j]; j++)
+                if(sccp->edges[blk->id][j])
+                    value = _meet(value, _value_of(sccp, LIST_OF(sccp->fn, ins->arg2)[j], ins->type));
+
+            _set(sccp, ins->arg1, value);
+            return;
+        case INS_LOAD:
+            _set(sccp, ins->arg1, _value_of(sccp, ins->arg2, ins->type));
+            return;
+        case INS_JMP:
+            _mark_edge(sccp, blk, TARGET_OF(sccp->fn, ins->arg1));
+            return;
+        case INS_JMPZ:
+        case INS_JLT:
+        case INS_JLE:
+        case INS_JGT:
+        case INS_JGE:
+        case INS_JEQ:
+        case INS_JNE:
+            value = _taken(sccp, ins);
+
+            if(value.state == VALUE_TOP)
+                return;
+
+            if(value.state == VALUE_BOTTOM || !value.ival)
+                _mark_edge(sccp, blk, blk->next);
+
+            if(value.state == VALUE_BOTTOM || value.ival)
+                _mark_edge(sccp, blk, TARGET_OF(sccp->fn, ins->arg1));
+            return;
+        case INS_JTAB:
+            value = _value_of(sccp, ins->arg2, ins->type);
+
+            if(value.state == VALUE_CONST)
+                _mark_edge(sccp, blk, _table_target(sccp->fn, blk, ins, value.ival));
+            else if(value.state == VALUE_BOTTOM) {
+                for(size_t i = 0; i < blk->succ_count; i++)
+                    _mark_edge(sccp, blk, blk->succs[i]);
+            }
+            return;
+        case INS_RET:
+        case INS_RETVAL:
+            _mark_edge(sccp, blk, sccp->fn->exit);
+            return;
+        case INS_CALL:
+            // nothing is known about what a call returns
+            memset(&value, 0, sizeof(CLattice));
+            value.state = VALUE_BOTTOM;
+            _set(sccp, ins->arg1, value);
+            return;
+        default:
+            if(_is_binary(ins->kind))
+                _set(sccp, ins->arg1, _eval(ins->kind, ins->type, _value_of(sccp, ins->arg2, ins->type), _value_of(sccp, ins->arg3, ins->type)));
+            return;
+    }
+}
+
+static void _mark_edge(CSCCP *sccp, CBasicBlock *from, CBasicBlock *to)
+{
+    if(!from || !to)
+        return;
+
+    for(size_t j = 0; j < to->pred_count; j++) {
+        if(to->preds[j] != from || sccp->edges[to->id][j])
+            continue;
+
+        sccp->edges[to->id][j] = true;
+
+        _push(&sccp->flow, &sccp->flow_count, &sccp->flow_capacity, to, j);
+    }
+}
+
+static void _set(CSCCP *sccp, COperand reg, CLattice value)
+{
+    CLattice *old;
+    size_t    id;
+
+    if(!IS_VREG(reg) || (id = OPERAND_INDEX(reg)) >= sccp->value_count)
+        return;
+
+    old = &sccp->values[id];
+
+    if(value.state == VALUE_TOP || old->state == VALUE_BOTTOM)
+        return;
+
+    if(old->state == VALUE_CONST) {
+        if(value.state == VALUE_CONST && _meet(*old, value).state == VALUE_CONST)
+            return;
+        value.state = VALUE_BOTTOM;
+    }
+
+    *old = value;
+
+    for(size_t i = sccp->use_start[id]; i < sccp->use_start[id + 1]; i++)
+        _push(&sccp->work, &sccp->work_count, &sccp->work_capacity, sccp->uses[i].block, sccp->uses[i].index);
+}
+
+/*
+ * Lattice value of an operand. A literal takes the type of the instruction
+ * using it, a register the type of the instruction defining it.
+ */
+static CLattice _value_of(CSCCP *sccp, COperand arg, CType *type)
+{
+    CLattice value;
+
+    memset(&value, 0, sizeof(CLattice));
+
+    value.state = VALUE_BOTTOM;
+
+    switch(OPERAND_KIND(arg)) {
+        case OPERAND_VREG:
+            return OPERAND_INDEX(arg) < sccp->value_count ? sccp->values[OPERAND_INDEX(arg)] : value;
+        case OPERAND_INT:
+            value.state = VALUE_CONST;
+            value.type  = type;
+            value.ival  = VALUE_OF(sccp->fn, arg).val;
+            value.fval  = (double)value.ival;
+            return _is_float(type) || _is_integer(type) ? _convert(value, type) : value;
+        case OPERAND_FLOAT:
+            value.state = VALUE_CONST;
+            value.type  = type;
+            value.fval  = type && type->kind == FLOAT ? VALUE_OF(sccp->fn, arg).fval : VALUE_OF(sccp->fn, arg).dval;
+            return _is_float(type) || _is_integer(type) ? _convert(value, type) : value;
+        default:
+            return value;
+    }
+}
+
+static CLattice _meet(CLattice v1, CLattice v2)
+{
+    if(v1.state == VALUE_TOP)
+        return v2;
+
+    if(v2.state == VALUE_TOP || v1.state == VALUE_BOTTOM)
+        return v1;
+
+    if(v2.state == VALUE_BOTTOM || v1.ival != v2.ival || memcmp(&v1.fval, &v2.fval, sizeof(double)))
+        v1.state = VALUE_BOTTOM;
+
+    return v1;
+}
+
+/*
+ * Folds a binary instruction. Both operands are converted to its type,
+ * integers wrap around at its width; anything C leaves undefined (a
+ * division by zero, a shift out of range) stays unknown.
+ */
+static CLattice _eval(Instruction kind, CType *type, CLattice v1, CLattice v2)
+{
+    CLattice result;
+
+    memset(&result, 0, sizeof(CLattice));
+
+    if(v1.state == VALUE_BOTTOM || v2.state == VALUE_BOTTOM || (!_is_integer(type) && !_is_float(type))) {
+        result.state = VALUE_BOTTOM;
+        return result;
+    }
+
+    if(v1.state == VALUE_TOP || v2.state == VALUE_TOP)
+        return result;
+
+    v1 = _convert(v1, type);
+    v2 = _convert(v2, type);
+
+    result.state = VALUE_CONST;
+    result.type  = type;
+
+    if(_is_float(type)) {
+        double a = v1.fval, b = v2.fval;
+
+        switch(kind) {
+            case INS_ADD: result.fval = a + b; break;
+            case INS_SUB: result.fval = a - b; break;
+            case INS_MUL: result.fval = a * b; break;
+            case INS_DIV:
+                if(b == 0)
+                    result.state = VALUE_BOTTOM;
+                else
+                    result.fval = a / b;
+                break;
+            case INS_GE: result.fval = a >= b; break;
+            case INS_LE: result.fval = a <= b; break;
+            case INS_GT: result.fval = a >  b; break;
+            case INS_LT: result.fval = a <  b; break;
+            case INS_EQ: result.fval = a == b; break;
+            case INS_NE: result.fval = a != b; break;
+            default:
+                result.state = VALUE_BOTTOM;
+                break;
+        }
+
+        if(type->kind == FLOAT)
+            result.fval = (float)result.fval;
+
+        return result;
+    }
+
+    int64_t  a  = v1.ival, b = v2.ival;
+    uint64_t ua = (uint64_t)a, ub = (uint64_t)b;
+    size_t   bits = type->size * CHAR_BIT;
+    bool     sign = !_is_unsigned(type);
+
+    switch(kind) {
+        case INS_ADD: result.ival = (int64_t)(ua + ub); break;
+        case INS_SUB: result.ival = (int64_t)(ua - ub); break;
+        case INS_MUL: result.ival = (int64_t)(ua * ub); break;
+        case INS_AND: result.ival = a & b; break;
+        case INS_OR:  result.ival = a | b; break;
+        case INS_XOR: result.ival = a ^ b; break;
+        case INS_DIV:
+        case INS_MOD:
+            if(!b || (sign && a == LLONG_MIN && b == -1))
+                result.state = VALUE_BOTTOM;
+            else if(kind == INS_DIV)
+                result.ival = sign ? a / b : (int64_t)(ua / ub);
+            else
+                result.ival = sign ? a % b : (int64_t)(ua % ub);
+            break;
+        case INS_MULH:
+            if(sign)
+                result.ival = (int64_t)(((__int128)a * b) >> bits);
+            else
+                result.ival = (int64_t)(((unsigned __int128)ua * ub) >> bits);
+            break;
+        case INS_SHL:
+        case INS_SHR:
+            if(b < 0 || (uint64_t)b >= bits)
+                result.state = VALUE_BOTTOM;
+            else if(kind == INS_SHL)
+                result.ival = (int64_t)(ua << b);
+            else
+                result.ival = sign ? a >> b : (int64_t)(ua >> b);
+            break;
+        case INS_GE: result.ival = sign ? a >= b : ua >= ub; break;
+        case INS_LE: result.ival = sign ? a <= b : ua <= ub; break;
+        case INS_GT: result.ival = sign ? a >  b : ua >  ub; break;
+        case INS_LT: result.ival = sign ? a <  b : ua <  ub; break;
+        case INS_EQ: result.ival = a == b; break;
+        case INS_NE: result.ival = a != b; break;
+        default:
+            result.state = VALUE_BOTTOM;
+            break;
+    }
+
+    result.ival = _truncate(type, result.ival);
+    result.fval = 0;
+
+    return result;
+}
+
+static CLattice _convert(CLattice value, CType *type)
+{
+    if(value.state != VALUE_CONST || !type)
+        return value;
+
+    if(_is_float(type)) {
+        if(!_is_float(value.type))
+            value.fval = _is_unsigned(value.type) ? (double)(uint64_t)value.ival : (double)value.ival;
+        if(type->kind == FLOAT)
+            value.fval = (float)value.fval;
+        value.ival = 0;
+    }
+    else {
+        if(_is_float(value.type))
+            value.ival = (int64_t)value.fval;
+        value.ival = _truncate(type, value.ival);
+        value.fval = 0;
+    }
+
+    value.type = type;
+
+    return value;
+}
+
+static void _rewrite(CSCCP *sccp)
+{
+    CFunction *fn = sccp->fn;
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk    = fn->blocks[i];
+        bool         sorted = true;
+
+        if(!sccp->executable[blk->id]) {
+            while(blk->succ_count)
+                remove_edge(fn, blk, blk->succs[0]);
+            sccp->cmp->opt.unreachable++;
+            continue;
+        }
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            CLattice      value;
+
+            if(ins->kind != INS_PHI && ins->kind != INS_LOAD && !_is_binary(ins->kind))
+                continue;
+
+            if(!IS_VREG(ins->arg1) || OPERAND_INDEX(ins->arg1) >= sccp->value_count)
+                continue;
+
+            value = sccp->values[OPERAND_INDEX(ins->arg1)];
+
+            if(value.state != VALUE_CONST || (ins->kind == INS_LOAD && ins->arg2 && OPERAND_KIND(ins->arg2) != OPERAND_SYMBOL))
+                continue;
+
+            sorted   &= ins->kind != INS_PHI;
+            ins->kind = INS_LOAD;
+            ins->arg2 = _constant(fn, _convert(value, ins->type));
+            ins->arg3 = 0;
+
+            sccp->cmp->opt.folded++;
+        }
+
+        if(!sorted)
+            _sort_phis(blk);
+
+        // only now: an edge removed may be into this block, whose phis must be first again
+        if(blk->count && is_branch(blk->ins[blk->count - 1].kind))
+            _fold_branch(sccp, blk, &blk->ins[blk->count - 1]);
+        else if(blk->count && blk->ins[blk->count - 1].kind == INS_JTAB)
+            _fold_table(sccp, blk, &blk->ins[blk->count - 1]);
+
+        // a branch never taken or a table falling through was turned into INS_END_MARK
+        if(blk->count && blk->ins[blk->count - 1].kind == INS_END_MARK) {
+            blk->count--;
+            fn->ins_count--;
+        }
+    }
+}
+
+/*
+ * A conditional jump on constants: if taken it always jumps, otherwise it
+ * never does and the block just falls through.
+ */
+static void _fold_branch(CSCCP *sccp, CBasicBlock *blk, CInstruction *ins)
+{
+    CLattice value = _taken(sccp, ins);
+
+    if(value.state != VALUE_CONST)
+        return;
+
+    if(value.ival) {
+        remove_edge(sccp->fn, blk, blk->next);
+        ins->kind = INS_JMP;
+        ins->arg2 = 0;
+        ins->arg3 = 0;
+    }
+    else {
+        remove_edge(sccp->fn, blk, TARGET_OF(sccp->fn, ins->arg1));
+        ins->kind = INS_END_MARK;
+    }
+
+    sccp->cmp->opt.folded_branches++;
+}
+
+/*
+ * A jump table on a constant index keeps the one edge it takes, a JMP to
+ * the entry or the fall through.
+ */
+static void _fold_table(CSCCP *sccp, CBasicBlock *blk, CInstruction *ins)
+{
+    CLattice     value = _value_of(sccp, ins->arg2, ins->type);
+    CBasicBlock *target;
+
+    if(value.state != VALUE_CONST)
+        return;
+
+    target = _table_target(sccp->fn, blk, ins, value.ival);
+
+    for(size_t i = 0; i < blk->succ_count;) {
+        if(blk->succs[i] != target)
+            remove_edge(sccp->fn, blk, blk->succs[i]);
+        else
+            i++;
+    }
+
+    ins->kind = target == blk->next ? INS_END_MARK : INS_JMP;
+    ins->arg1 = target->label;
+    ins->arg2 = 0;
+
+    sccp->cmp->opt.folded_branches++;
+}
+
+/*
+ * Block a jump table goes to for 'index': the one its entry names, or the
+ * next block when the index is past the table. The index is unsigned, a
+ * negative one is past it too.
+ */
+static CBasicBlock *_table_target(CFunction *fn, CBasicBlock *blk, CInstruction *ins, int64_t index)
+{
+    for(COperand *op = LIST_OF(fn, ins->arg1); *op && index >= 0; op++, index--) {
+        if(!index)
+            return TARGET_OF(fn, *op);
+    }
+
+    return blk->next;
+}
+
+/*
+ * Whether a conditional jump is taken, with an ival of 0 or 1 when known:
+ * JMPZ when its operand is zero, a compare and branch when its operands
+ * are in its relation.
+ */
+static CLattice _taken(CSCCP *sccp, CInstruction *ins)
+{
+    CLattice value;
+    bool   nonzero;
+
+    if(ins->kind == INS_JMPZ)
+        value = _value_of(sccp, ins->arg2, NULL);
+    else
+        value = _eval(branch_compare(ins->kind), ins->type, _value_of(sccp, ins->arg2, ins->type),
+                      _value_of(sccp, ins->arg3, ins->type));
+
+    if(value.state != VALUE_CONST)
+        return value;
+
+    nonzero    = value.ival || value.fval;
+    value.ival = ins->kind == INS_JMPZ ? !nonzero : nonzero;
+    value.fval = 0;
+
+    return value;
+}
+
+/*
+ * Phis folded to a LOAD may now sit between phis, which must stay first.
+ */
+static void _sort_phis(CBasicBlock *blk)
+{
+    size_t phis = 0;
+
+    for(size_t i = 0; i < blk->count; i++) {
+        CInstruction tmp;
+
+        if(blk->ins[i].kind != INS_PHI)
+            continue;
+
+        tmp = blk->ins[i];
+
+        memmove(&blk->ins[phis + 1], &blk->ins[phis], sizeof(CInstruction) * (i - phis));
+
+        blk->ins[phis++] = tmp;
+    }
+}
+
+static COperand _constant(CFunction *fn, CLattice value)
+{
+    CValue bits;
+
+    if(_is_float(value.type)) {
+        bits.val = 0;
+
+        if(value.type->kind == FLOAT)
+            bits.fval = (float)value.fval;
+        else
+            bits.dval = value.fval;
+
+        return ir_constant(fn, OPERAND_FLOAT, bits.val);
+    }
+
+    return ir_constant(fn, OPERAND_INT, value.ival);
+}
+
+static bool _is_binary(Instruction kind)
+{
+    switch(kind) {
+        case INS_ADD:
+        case INS_SUB:
+        case INS_MUL:
+        case INS_DIV:
+        case INS_SHL:
+        case INS_SHR:
+        case INS_GE:
+        case INS_LE:
+        case INS_GT:
+        case INS_LT:
+        case INS_AND:
+        case INS_MOD:
+        case INS_MULH:
+        case INS_EQ:
+        case INS_NE:
+        case INS_OR:
+        case INS_XOR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool _is_float(CType *type)
+{
+    return type && (type->kind == FLOAT || type->kind == DOUBLE || type->kind == LDOUBLE);
+}
+
+static bool _is_integer(CType *type)
+{
+    return type && type->kind >= CHAR && type->kind <= ULONG;
+}
+
+static bool _is_unsigned(CType *type)
+{
+    if(!type)
+        return false;
+
+    return type->kind == UCHAR || type->kind == USHORT || type->kind == UINT || type->kind == ULONG;
+}
+
+static int64_t _truncate(CType *type, int64_t val)
+{
+    switch(type->size) {
+        case 1:
+            return _is_unsigned(type) ? (int64_t)(uint8_t)val  : (int64_t)(int8_t)val;
+        case 2:
+            return _is_unsigned(type) ? (int64_t)(uint16_t)val : (int64_t)(int16_t)val;
+        case 4:
+            return _is_unsigned(type) ? (int64_t)(uint32_t)val : (int64_t)(int32_t)val;
+        default:
+            return val;
+    }
+}
@@ -2,26 +2,42 @@
 #include "misc.h"
 #include <stdio.h>
 
+typedef struct CCaseSet CCaseSet;
+
+struct CCaseSet {
+    CType   *type;
+    int64_t *set;
+    size_t   mask;
+};
+
 static void   _analyse_tree(CCompiler *cmp, CNode *tree);
+static bool   _analyse_step(CCompiler *cmp, CFrame *frame);
+static bool   _visit(CCompiler *cmp, CNode *tree);
 static void   _analyse_fn_proto(CCompiler *cmp, CNode *tree);
 static void   _analyse_fn_decl(CCompiler *cmp, CNode *tree);
-static void   _analyse_blk(CCompiler *cmp, CNode *tree);
-static void   _analyse_vdecl(CCompiler *cmp, CNode *tree);
+static bool   _analyse_blk(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_vdecl(CCompiler *cmp, CFrame *frame);
 static void   _analyse_id(CCompiler *cmp, CNode *tree);
-static void   _analyse_fn_call(CCompiler *cmp, CNode *tree);
-static void   _analyse_dereference(CCompiler *cmp, CNode *tree);
-static void   _analyse_addr(CCompiler *cmp, CNode *tree);
-static void   _analyse_bin(CCompiler *cmp, CNode *tree);
-static void   _analyse_assign(CCompiler *cmp, CNode *tree);
-static void   _analyse_return(CCompiler *cmp, CNode *tree);
-static void   _analyse_if(CCompiler *cmp, CNode *tree);
-static void   _analyse_while(CCompiler *cmp, CNode *tree);
-static void   _analyse_do_while(CCompiler *cmp, CNode *tree);
-static void   _analyse_for(CCompiler *cmp, CNode *tree);
-static void   _analyse_minus(CCompiler *cmp, CNode *tree);
-static void   _analyse_not(CCompiler *cmp, CNode *tree);
-static void   _analyse_prefix_postfix(CCompiler *cmp, CNode *tree);
-static void   _analyse_plus(CCompiler *cmp, CNode *tree);
+static bool   _analyse_fn_call(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_dereference(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_addr(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_bin(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_assign(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_return(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_if(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_while(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_do_while(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_for(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_minus(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_not(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_prefix_postfix(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_plus(CCompiler *cmp, CFrame *frame);
+static void   _analyse_lazy_fns(CCompiler *cmp);
+static bool   _analyse_sizeof(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_switch(CCompiler *cmp, CFrame *frame);
+static bool   _analyse_case(CCompiler *cmp, CFrame *frame);
+static void   _add_case_label(CCompiler *cmp, CNode *tree, CCaseSet *cases);
+static CType *_complete_type(CCompiler *cmp, CType *type, size_t line);
 
 static void   _print_incompatible_types(CCompiler *cmp, CType *t1, CType *t2, size_t line);
 static void   _print_warn_loss_of_info(CCompiler *cmp, CType *t1, CType *t2, size_t line);
@@ -42,104 +58,176 @@ void start_semantic_analyser(CCompiler *cmp)
 
     for(CNode **ptr = &cmp->nodes; *ptr; ptr = &(*ptr)->next_stmt)
         _analyse_tree(cmp, *ptr);
+
+    if(!(options & COMPILER_OPTION_PARALLEL))
+        _analyse_lazy_fns(cmp);
 }
 
+void analyse_unit(CCompiler *cmp, CNode *tree)
+{
+    if(!cmp || !tree)
+        return;
+
+    _analyse_tree(cmp, tree);
+}
+
+/*
+ * Bodies of static functions skipped by the lazy mode are only parsed and
+ * analysed once something references them. Analysing one body can make
+ * another one reachable, so loop until nothing changes.
+ */
+static void _analyse_lazy_fns(CCompiler *cmp)
+{
+    bool progress;
+
+    if(!cmp)
+        return;
+
+    do {
+        progress = false;
+
+        for(CNode **ptr = &cmp->lazy_nodes; *ptr;) {
+            CNode *tree = *ptr;
+
+            if(!tree->decl.symbol->usage) {
+                ptr = &tree->next;
+                continue;
+            }
+
+            *ptr      = tree->next;
+            tree->next = NULL;
+            progress   = true;
+
+            analyse_function(cmp, tree);
+        }
+    }while(progress);
+}
+
+/*
+ * The tree is walked with an explicit stack instead of recursion, so deeply
+ * nested code cannot overflow the C stack. Each node gets a frame and its
+ * _analyse_* function is called once per step: it returns true after
+ * pushing a child with _visit() (it is called again when the child is
+ * done) and false once the node is finished.
+ */
 static void _analyse_tree(CCompiler *cmp, CNode *tree)
 {
+    size_t base;
+
     if(!cmp || !tree)
         return;
 
+    base = cmp->stack->count;
+
+    _visit(cmp, tree);
+
+    while(cmp->stack->count > base)
+        if(!_analyse_step(cmp, top_frame(cmp->stack)))
+            pop_frame(cmp->stack);
+}
+
+static bool _visit(CCompiler *cmp, CNode *tree)
+{
+    if(tree)
+        push_frame(cmp->stack, tree);
+
+    return true;
+}
+
+static bool _analyse_step(CCompiler *cmp, CFrame *frame)
+{
+    CNode *tree = frame->tree;
+
     switch(tree->kind) {
         case FNPROTO:
             _analyse_fn_proto(cmp, tree);
-            return;
+            return false;
         case FNDECL:
             _analyse_fn_decl(cmp, tree);
-            return;
+            return false;
         case BLOCK:
-            _analyse_blk(cmp, tree);
-            return;
+            return _analyse_blk(cmp, frame);
         case VARDECL:
-            _analyse_vdecl(cmp, tree);
-            return;
+            return _analyse_vdecl(cmp, frame);
         case IDENTIFIER:
             _analyse_id(cmp, tree);
-            return;
+            return false;
         case FNCALL:
-            _analyse_fn_call(cmp, tree);
-            return;
+            return _analyse_fn_call(cmp, frame);
         case DEREFERENCE:
-            _analyse_dereference(cmp, tree);
-            return;
+            return _analyse_dereference(cmp, frame);
         case ADDROF:
-            _analyse_addr(cmp, tree);
-            return;
+            return _analyse_addr(cmp, frame);
         case BINARYEXPR:
-            _analyse_bin(cmp, tree);
-            return;
+            return _analyse_bin(cmp, frame);
         case ASSIGN:
-            _analyse_assign(cmp, tree);
-            return;
+            return _analyse_assign(cmp, frame);
         case RETURN:
-            _analyse_return(cmp, tree);
-            return;
+            return _analyse_return(cmp, frame);
         case IF:
-            _analyse_if(cmp, tree);
-            return;
+            return _analyse_if(cmp, frame);
         case WHILE:
-            _analyse_while(cmp, tree);
-            return;
+            return _analyse_while(cmp, frame);
         case DO_WHILE:
-            _analyse_do_while(cmp, tree);
-            return;
+            return _analyse_do_while(cmp, frame);
         case FOR:
-            _analyse_for(cmp, tree);
-            return;
+            return _analyse_for(cmp, frame);
         case MINUS:
-            _analyse_minus(cmp, tree);
-            return;
+            return _analyse_minus(cmp, frame);
         case NOT:
-            _analyse_not(cmp, tree);
-            return;
+            return _analyse_not(cmp, frame);
         case PREFIX:
         case POSTFIX:
-            _analyse_prefix_postfix(cmp, tree);
-            break;
+            return _analyse_prefix_postfix(cmp, frame);
         case PLUS:
-            _analyse_plus(cmp, tree);
-            break;
+        case NEGATION:
+            return _analyse_plus(cmp, frame);
+        case SIZEOF:
+            return _analyse_sizeof(cmp, frame);
+        case SWITCH:
+            return _analyse_switch(cmp, frame);
+        case CASE:
+        case DEFAULT:
+            return _analyse_case(cmp, frame);
+        default:
+            return false;
     }
 }
 
-static void _analyse_prefix_postfix(CCompiler *cmp, CNode *tree)
+static bool _analyse_prefix_postfix(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
+    CNode *tree = frame->tree;
 
-    _analyse_tree(cmp, tree->unary.base);
+    if(!frame->step++)
+        return _visit(cmp, tree->unary.base);
 
     _valid_condition(cmp, tree->unary.base->type, tree->line);
 
     tree->type = tree->unary.base->type;
+
+    return false;
 }
 
-static void _analyse_not(CCompiler *cmp, CNode *tree)
+static bool _analyse_not(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
+    CNode *tree = frame->tree;
 
-    _analyse_tree(cmp, tree->unary.base);
+    if(!frame->step++)
+        return _visit(cmp, tree->unary.base);
 
     _valid_condition(cmp, tree->unary.base->type, tree->line);
 
     tree->type = tree->unary.base->type;
+
+    return false;
 }
 
-static void _analyse_minus(CCompiler *cmp, CNode *tree)
+static bool _analyse_minus(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
-    _analyse_tree(cmp, tree->unary.base);
+    CNode *tree = frame->tree;
+
+    if(!frame->step++)
+        return _visit(cmp, tree->unary.base);
 
     _valid_condition(cmp, tree->unary.base->type, tree->line);
 
@@ -147,96 +235,120 @@ static void _analyse_minus(CCompiler *cmp, CNode *tree)
 
     if(tree->type->kind == UCHAR || tree->type->kind == USHORT || tree->type->kind == UINT || tree->type->kind == ULONG)
         error(cmp, tree->line, "Cannot use '-' in a unsigned expression\n");
+
+    return false;
 }
 
-static void _analyse_for(CCompiler *cmp, CNode *tree)
+static bool _analyse_for(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
-
-    cmp->flags |= COMPILER_FLAG_DONT_PUSH_SCOPE;
-
-    enter_scope(&cmp->tables[SYMBOLS]);
-
-    _analyse_tree(cmp, tree->_for.init);
-    _analyse_tree(cmp, tree->_for.cond);
-
-    _valid_condition(cmp, tree->_for.cond->type, tree->line);
-
-    _analyse_tree(cmp, tree->_for.step);
-    _analyse_tree(cmp, tree->_for.then);
+    CNode *tree = frame->tree;
+
+    switch(frame->step++) {
+        case 0:
+            cmp->flags |= COMPILER_FLAG_DONT_PUSH_SCOPE;
+            enter_scope(&cmp->tables[SYMBOLS]);
+            return _visit(cmp, tree->_for.init);
+        case 1:
+            return _visit(cmp, tree->_for.cond);
+        case 2:
+            _valid_condition(cmp, tree->_for.cond ? tree->_for.cond->type : NULL, tree->line);
+            return _visit(cmp, tree->_for.step);
+        case 3:
+            return _visit(cmp, tree->_for.then);
+    }
 
     if(cmp->flags & COMPILER_FLAG_DONT_PUSH_SCOPE) {
         cmp->flags &= ~COMPILER_FLAG_DONT_PUSH_SCOPE;
         clear_scope(&cmp->tables[SYMBOLS]);
     }
-}
-
-static void _analyse_do_while(CCompiler *cmp, CNode *tree)
-{
-    if(!cmp || !tree)
-        return;
-
-    _analyse_tree(cmp, tree->_while.then);
 
-    _analyse_tree(cmp, tree->_while.cond);
-
-    _valid_condition(cmp, tree->_while.cond->type, tree->line);
+    return false;
 }
 
-static void _analyse_while(CCompiler *cmp, CNode *tree)
+static bool _analyse_do_while(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
+    CNode *tree = frame->tree;
 
-    _analyse_tree(cmp, tree->_while.cond);
+    switch(frame->step++) {
+        case 0:
+            return _visit(cmp, tree->_while.then);
+        case 1:
+            return _visit(cmp, tree->_while.cond);
+    }
 
     _valid_condition(cmp, tree->_while.cond->type, tree->line);
 
-    _analyse_tree(cmp, tree->_while.then);
+    return false;
 }
 
-static void _analyse_if(CCompiler *cmp, CNode *tree)
+static bool _analyse_while(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
+    CNode *tree = frame->tree;
+
+    switch(frame->step++) {
+        case 0:
+            return _visit(cmp, tree->_while.cond);
+        case 1:
+            _valid_condition(cmp, tree->_while.cond->type, tree->line);
+            return _visit(cmp, tree->_while.then);
+    }
 
-    _analyse_tree(cmp, tree->_if.cond);
+    return false;
+}
 
-    _valid_condition(cmp, tree->_if.cond->type, tree->line);
+static bool _analyse_if(CCompiler *cmp, CFrame *frame)
+{
+    CNode *tree = frame->tree;
+
+    switch(frame->step++) {
+        case 0:
+            return _visit(cmp, tree->_if.cond);
+        case 1:
+            _valid_condition(cmp, tree->_if.cond->type, tree->line);
+            return _visit(cmp, tree->_if.then);
+        case 2:
+            return _visit(cmp, tree->_if._else);
+    }
 
-    _analyse_tree(cmp, tree->_if.then);
-    _analyse_tree(cmp, tree->_if._else);
+    return false;
 }
 
-static void _analyse_fn_call(CCompiler *cmp, CNode *tree)
+static bool _analyse_fn_call(CCompiler *cmp, CFrame *frame)
 {
-    CNode      *arg;
+    CNode      *tree = frame->tree;
+    CNode      *arg  = frame->cursor;
     CParameter *params;
 
-    if(!cmp || !tree)
-        return;
+    switch(frame->step++) {
+        case 0:
+            return _visit(cmp, tree->fncall.base);
+        case 1:
+            if(tree->fncall.base->type->kind != FUNCTION)
+                error(cmp, tree->line, "Function expected at function call\n");
 
-    _analyse_tree(cmp, tree->fncall.base);
+            tree->type = tree->fncall.base->type->base;
 
-    if(tree->fncall.base->type->kind != FUNCTION)
-        error(cmp, tree->line, "Function expected at function call\n");
+            if(tree->fncall.count != tree->fncall.base->type->param_count)
+                error(cmp, tree->line, "Argument count mismatch at function call\n");
 
-    tree->type = tree->fncall.base->type->base;
+            frame->data   = tree->fncall.base->type->params;
+            frame->cursor = tree->fncall.args;
+            return _visit(cmp, frame->cursor);
+    }
 
-    if(tree->fncall.count != tree->fncall.base->type->param_count)
-        error(cmp, tree->line, "Argument count mismatch at function call\n");
+    if(!arg)
+        return false;
 
-    params = tree->fncall.base->type->params;
-    
-    for(arg = tree->fncall.args; arg; arg = arg->next_stmt) {
-        _analyse_tree(cmp, arg);
-        if(!params)
-            continue;
+    // 'arg' has just been analysed, check it and go on with the next one
+    if((params = frame->data)) {
         if(!_is_same_type(arg->type, params->type))
            _print_incompatible_types(cmp, arg->type, params->type, tree->line);
-        params = params->next;
+        frame->data = params->next;
     }
+
+    frame->cursor = arg->next_stmt;
+
+    return _visit(cmp, frame->cursor);
 }
 
 static void _analyse_id(CCompiler *cmp, CNode *tree)
@@ -256,67 +368,111 @@ static void _analyse_id(CCompiler *cmp, CNode *tree)
 
     tree->type = sym->type;
 
+    __atomic_fetch_add(&sym->usage, 1, __ATOMIC_RELAXED); // bodies may be analysed concurrently
+
     tree->misc->kind = MISC_SYMBOL;
     tree->misc->sym  = sym;
 }
 
-static void _analyse_vdecl(CCompiler *cmp, CNode *tree)
+static bool _analyse_vdecl(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
+    CNode   *tree = frame->tree;
+    CNode   *decl = frame->cursor;
+    CSymbol *var;
 
-    for(CNode **ptr = &tree; *ptr; ptr = &(*ptr)->next) {
+    // the initializer of 'decl' has just been analysed
+    if(decl) {
+        var = decl->decl.symbol;
 
-        CSymbol *var = (*ptr)->decl.symbol;
+        if(!_can_convert(cmp, var->type, decl->decl.init->type, decl->line))
+            _print_incompatible_types(cmp, var->type, decl->decl.init->type, decl->line);
+        decl->type = var->type;
+
+        decl = decl->next;
+    }
+    else if(!frame->step++)
+        decl = tree;
+
+    for(; decl; decl = decl->next) {
+        var = decl->decl.symbol;
+
+        var->type = _complete_type(cmp, var->type, decl->line);
 
         if(get_local(cmp->tables[SYMBOLS], var->name))
             error(cmp, tree->line, "Variable '%s' already declared in this scope\n", var->name);
         else
             insert(cmp->tables[SYMBOLS], var->name, var);
 
-        if(!(*ptr)->decl.init)
+        if(cmp->tables[SYMBOLS]->prev)
+            var->flags |= SYMBOL_IS_LOCAL;
+
+        if(!decl->decl.init)
             continue;
 
-        _analyse_tree(cmp, (*ptr)->decl.init);
+        frame->cursor = decl;
 
-        if(!_can_convert(cmp, var->type, (*ptr)->decl.init->type, (*ptr)->line))
-            _print_incompatible_types(cmp, var->type, (*ptr)->decl.init->type, (*ptr)->line);
-        (*ptr)->type = var->type;
+        return _visit(cmp, decl->decl.init);
     }
+
+    return false;
 }
 
-static void _analyse_blk(CCompiler *cmp, CNode *tree)
+static bool _analyse_blk(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
+    CNode *tree = frame->tree;
 
-    cmp->flags &= ~COMPILER_FLAG_GLOBAL_SCOPE;
-    cmp->flags |=  COMPILER_FLAG_LOCAL_SCOPE;
+    if(!frame->step++) {
+        cmp->flags &= ~COMPILER_FLAG_GLOBAL_SCOPE;
+        cmp->flags |=  COMPILER_FLAG_LOCAL_SCOPE;
 
-    if(!(cmp->flags & COMPILER_FLAG_DONT_PUSH_SCOPE))
-        enter_scope(&cmp->tables[SYMBOLS]);
+        if(!(cmp->flags & COMPILER_FLAG_DONT_PUSH_SCOPE))
+            enter_scope(&cmp->tables[SYMBOLS]);
 
-    cmp->flags &= ~COMPILER_FLAG_DONT_PUSH_SCOPE;
+        cmp->flags &= ~COMPILER_FLAG_DONT_PUSH_SCOPE;
+
+        frame->cursor = tree->blk.head;
+    }
+    else
+        frame->cursor = frame->cursor->next_stmt;
+
+    if(frame->cursor)
+        return _visit(cmp, frame->cursor);
 
-    for(CNode **ptr = &tree->blk.head; *ptr; ptr = &(*ptr)->next_stmt)
-        _analyse_tree(cmp, *ptr);
     clear_scope(&cmp->tables[SYMBOLS]);
+
+    return false;
 }
 
-static void _analyse_bin(CCompiler *cmp, CNode *tree)
+static bool _analyse_bin(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
+    CNode *tree = frame->tree;
 
-    _analyse_tree(cmp, tree->bin.lhs);
-    _analyse_tree(cmp, tree->bin.rhs);
+    switch(frame->step++) {
+        case 0:
+            return _visit(cmp, tree->bin.lhs);
+        case 1:
+            return _visit(cmp, tree->bin.rhs);
+    }
+
+    // the comma operator takes operands of any type and has its right one's
+    if(tree->bin.op == ',') {
+        tree->type = tree->bin.rhs->type;
+        return false;
+    }
 
     if(!_can_operate(tree->bin.lhs->type, tree->bin.rhs->type))
         error(cmp, tree->line, "Arithmetic or pointer expression expected\n");
 
-    tree->type = _promote(tree->bin.lhs->type, tree->bin.rhs->type);
-    
+    if(tree->bin.op == TK_ANDAND || tree->bin.op == TK_OROR)
+        tree->type = cmp_primitives[INT];
+    else
+        tree->type = _promote(tree->bin.lhs->type, tree->bin.rhs->type);
+
     _verify_bitwise_with_float(cmp, tree);
+
+    fold_in_place(cmp, tree); // operands may have become literals, e.g. sizeof
+
+    return false;
 }
 
 static void _analyse_fn_decl(CCompiler *cmp, CNode *tree)
@@ -340,10 +496,40 @@ static void _analyse_fn_decl(CCompiler *cmp, CNode *tree)
         }
         else
             error(cmp, tree->line, "Function '%s' already have a body\n", fun->name);
+        fun->usage += proto->usage;
+        fun->flags |= proto->flags & SYMBOL_IS_INLINE;
     }
 
     insert(cmp->tables[SYMBOLS], fun->name, fun);
 
+    for(CParameter *param = fun->type->params; param && params_proto; param = param->next) {
+        if(!_is_same_type(param->type, params_proto->type))
+            error(cmp, tree->line, "Parameter '%s' type mismatch in function '%s'\n", param->sym ? param->sym->name : "", fun->name);
+        params_proto = params_proto->next;
+    }
+
+    tree->type = fun->type->base;
+
+    if(!tree->decl.init && tree->decl.body && ((options & COMPILER_OPTION_PARALLEL) || ((fun->flags & SYMBOL_IS_STATIC) && !fun->usage))) {
+        tree->next      = cmp->lazy_nodes;
+        cmp->lazy_nodes = tree;
+        return;
+    }
+
+    analyse_function(cmp, tree);
+}
+
+void analyse_function(CCompiler *cmp, CNode *tree)
+{
+    CSymbol *fun;
+
+    if(!cmp || !tree)
+        return;
+
+    fun = tree->decl.symbol;
+
+    materialize_function(cmp, tree);
+
     enter_scope(&cmp->tables[SYMBOLS]);
 
     cmp->flags |= COMPILER_FLAG_DONT_PUSH_SCOPE;
@@ -352,25 +538,21 @@ static void _analyse_fn_decl(CCompiler *cmp, CNode *tree)
         if(!param->sym)
             error(cmp, tree->line, "Cannot have a unnamed parameter inside a function with a body\n");
         else {
+            param->sym->type = _complete_type(cmp, param->sym->type, tree->line);
             if(get_local(cmp->tables[SYMBOLS], param->sym->name))
                 error(cmp, tree->line, "Parameter '%s' already declared in function '%s'\n", param->sym->name, fun->name);
             else
                 insert(cmp->tables[SYMBOLS], param->sym->name, param->sym);
-        }
-        if(params_proto) {
-            if(!_is_same_type(param->type, params_proto->type))
-                error(cmp, tree->line, "Parameter '%s' type mismatch in function '%s'\n", param->sym->name, fun->name);
-            params_proto = params_proto->next;
+
+            param->sym->flags |= SYMBOL_IS_LOCAL;
         }
     }
 
-    cmp->misc.type = tree->decl.symbol->type->base;
+    cmp->misc.type = fun->type->base;
 
     _analyse_tree(cmp, tree->decl.init);
 
     cmp->misc.type = NULL;
-
-    tree->type = tree->decl.symbol->type->base;
 }
 
 static void _analyse_fn_proto(CCompiler *cmp, CNode *tree)
@@ -388,23 +570,7 @@ static bool _is_same_type(CType *t1, CType *t2)
     if(!t1 || !t2)
         return false;
 
-    if(t1->kind != t2->kind)
-        return false;
-
-    switch(t1->kind) {
-        case PTR:
-        case ARRAY:
-            return _is_same_type(t1->base, t2->base);
-        case FUNCTION:
-            for(CParameter *p1 = t1->params, *p2 = t2->params; p1 && p2; p1 = p1->next, p2 = p2->next)
-                if(!_is_same_type(p1->type, p2->type))
-                    return false;
-            if(t1->param_count != t2->param_count)
-                return false;
-            return _is_same_type(t1->base, t2->base);
-        default:
-            return true;
-    }
+    return canonical_type(t1) == canonical_type(t2); // types are interned
 }
 
 static bool _can_convert(CCompiler *cmp, CType *from, CType *to, size_t line)
@@ -445,13 +611,13 @@ static void _print_incompatible_types(CCompiler *cmp, CType *t1, CType *t2, size
 
     error(cmp, line, "Incompatible types '");
 
-    printf_type(t1, stderr);
+    printf_type(t1, cmp->diag);
 
-    fprintf(stderr, "' and '");
+    fprintf(cmp->diag, "' and '");
 
-    printf_type(t2, stderr);
+    printf_type(t2, cmp->diag);
 
-    fprintf(stderr, "'\n");
+    fprintf(cmp->diag, "'\n");
 }
 
 static void _print_warn_loss_of_info(CCompiler *cmp, CType *t1, CType *t2, size_t line)
@@ -461,13 +627,13 @@ static void _print_warn_loss_of_info(CCompiler *cmp, CType *t1, CType *t2, size_
 
     error(cmp, line, "Converting from '");
 
-    printf_type(t1, stderr);
+    printf_type(t1, cmp->diag);
 
-    fprintf(stderr, "' to '");
+    fprintf(cmp->diag, "' to '");
 
-    printf_type(t2, stderr);
+    printf_type(t2, cmp->diag);
 
-    fprintf(stderr, "' can cause loss of information\n");
+    fprintf(cmp->diag, "' can cause loss of information\n");
 }
 
 static bool _can_operate(CType *t1, CType *t2)
@@ -478,39 +644,50 @@ static bool _can_operate(CType *t1, CType *t2)
     return t1->kind > VOID && t1->kind <= PTR && t2->kind > VOID && t2->kind <= PTR;
 }
 
-static void _analyse_dereference(CCompiler *cmp, CNode *tree)
+static bool _analyse_dereference(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
+    CNode *tree = frame->tree;
 
-    _analyse_tree(cmp, tree->unary.base);
+    if(!frame->step++)
+        return _visit(cmp, tree->unary.base);
 
     if(tree->unary.base->type->kind != PTR) {
         error(cmp, tree->line, "Cannot dereference a non pointer\n");
         tree->type = tree->unary.base->type;
-        return;
+        return false;
     }
 
     tree->type = tree->unary.base->type->base;
+
+    return false;
 }
 
-static void _analyse_addr(CCompiler *cmp, CNode *tree)
+static bool _analyse_addr(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
+    CNode *tree = frame->tree;
 
-    _analyse_tree(cmp, tree->unary.base);
+    if(!frame->step++)
+        return _visit(cmp, tree->unary.base);
 
     tree->type = make_ptr(tree->unary.base->type);
+
+    // a local is only reachable from its own body, no other thread writes its flags
+    if(tree->unary.base->kind == IDENTIFIER && tree->unary.base->misc->kind == MISC_SYMBOL && (tree->unary.base->misc->sym->flags & SYMBOL_IS_LOCAL))
+        tree->unary.base->misc->sym->flags |= SYMBOL_ADDRESS_TAKEN;
+
+    return false;
 }
 
-static void _analyse_assign(CCompiler *cmp, CNode *tree)
+static bool _analyse_assign(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
+    CNode *tree = frame->tree;
 
-    _analyse_tree(cmp, tree->bin.lhs);
-    _analyse_tree(cmp, tree->bin.rhs);
+    switch(frame->step++) {
+        case 0:
+            return _visit(cmp, tree->bin.lhs);
+        case 1:
+            return _visit(cmp, tree->bin.rhs);
+    }
 
     if(!_is_lvalue(tree->bin.lhs))
         error(cmp, tree->line, "Invalid lvalue\n");
@@ -521,6 +698,8 @@ static void _analyse_assign(CCompiler *cmp, CNode *tree)
     tree->type = tree->bin.lhs->type;
 
     _verify_bitwise_with_float(cmp, tree);
+
+    return false;
 }
 
 static bool _is_lvalue(CNode *tree)
@@ -563,22 +742,21 @@ static void _verify_bitwise_with_float(CCompiler *cmp, CNode *bin)
     }
 }
 
-static void _analyse_return(CCompiler *cmp, CNode *tree)
+static bool _analyse_return(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
+    CNode *tree = frame->tree;
 
-    if(!tree->ret.expr)
-        tree->type = cmp_primitives[VOID];
-    else {
-        _analyse_tree(cmp, tree->ret.expr);
-        tree->type = tree->ret.expr->type;
-    }
+    if(!frame->step++ && tree->ret.expr)
+        return _visit(cmp, tree->ret.expr);
+
+    tree->type = tree->ret.expr ? tree->ret.expr->type : cmp_primitives[VOID];
 
     if(!_can_convert(cmp, cmp->misc.type, tree->type, tree->line))
         _print_incompatible_types(cmp, tree->type, cmp->misc.type, tree->line);
 
     tree->type = cmp->misc.type;
+
+    return false;
 }
 
 static void _valid_condition(CCompiler *cmp, CType *cond, size_t line)
@@ -589,14 +767,203 @@ static void _valid_condition(CCompiler *cmp, CType *cond, size_t line)
     error(cmp, line, "Arithmetic or pointer expression expected\n");
 }
 
-static void _analyse_plus(CCompiler *cmp, CNode *tree)
+/*
+ * sizeof is reduced to an 'unsigned long' literal here, so everything
+ * after the semantic analyser only ever sees constants.
+ */
+static bool _analyse_sizeof(CCompiler *cmp, CFrame *frame)
 {
-    if(!cmp || !tree)
-        return;
+    CNode *tree = frame->tree;
+    CType *type;
+
+    if(!frame->step++ && !tree->_sizeof.type)
+        return _visit(cmp, tree->_sizeof.expr);
+
+    if(tree->_sizeof.type)
+        type = _complete_type(cmp, tree->_sizeof.type, tree->line);
+    else
+        type = tree->_sizeof.expr ? tree->_sizeof.expr->type : NULL;
+
+    if(!type || !type->size) {
+        error(cmp, tree->line, "Invalid application of 'sizeof' to an incomplete type\n");
+        tree->type = cmp_primitives[ULONG];
+        return false;
+    }
+
+    tree->kind      = LITERAL;
+    tree->type      = cmp_primitives[ULONG];
+    tree->misc      = new_misc(MISC_CONSTANT_INT);
+    tree->misc->val = (int64_t)type->size;
+
+    return false;
+}
+
+/*
+ * Case labels must be distinct integer constants; they are checked against
+ * an open addressing set sized from the number of cases and replaced by
+ * literals of the controlling expression type.
+ */
+static bool _analyse_switch(CCompiler *cmp, CFrame *frame)
+{
+    CNode    *tree = frame->tree;
+    CCaseSet *cases;
+    CType    *type;
+    size_t    count = 0;
+    size_t    mask  = 1;
+
+    switch(frame->step++) {
+        case 0:
+            return _visit(cmp, tree->_switch.cond);
+        case 1:
+            type = tree->_switch.cond ? tree->_switch.cond->type : NULL;
+
+            if(!type || type->kind < CHAR || type->kind > ULONG) {
+                error(cmp, tree->line, "Switch quantity is not an integer\n");
+                type = cmp_primitives[INT];
+            }
+
+            type = type->kind < INT ? cmp_primitives[INT] : type;
+
+            tree->type = type;
+
+            for(CNode *c = tree->_switch.cases; c; c = c->next_stmt)
+                count++;
+
+            while(mask < count * 2)
+                mask <<= 1;
+
+            // slot 0 of each pair marks it as used, slot 1 holds the value
+            cases       = (CCaseSet *)zalloc(sizeof(CCaseSet), ARENA_2);
+            cases->type = type;
+            cases->mask = mask - 1;
+            cases->set  = (int64_t *)zalloc(sizeof(int64_t) * mask * 2, ARENA_2);
+            memset(cases->set, 0, sizeof(int64_t) * mask * 2);
+
+            frame->data   = cases;
+            frame->cursor = tree->_switch.cases;
+            break;
+        default:
+            frame->cursor = frame->cursor->next_stmt;
+            break;
+    }
+
+    if(!frame->cursor)
+        return false;
+
+    if(frame->cursor->kind == DEFAULT) {
+        if(frame->extra)
+            error(cmp, frame->cursor->line, "Multiple default labels in one switch\n");
+        frame->extra = frame->cursor;
+    }
+
+    push_frame(cmp->stack, frame->cursor)->data = frame->data;
+
+    return true;
+}
+
+static bool _analyse_case(CCompiler *cmp, CFrame *frame)
+{
+    CNode    *tree  = frame->tree;
+    CCaseSet *cases = frame->data;
+
+    if(!cases)
+        return false; // not reached through a switch
+
+    switch(frame->step++) {
+        case 0:
+            return _visit(cmp, tree->kind == CASE ? tree->_case.cond : NULL);
+        case 1:
+            if(tree->kind == CASE)
+                _add_case_label(cmp, tree, cases);
+            frame->cursor = tree->_case.head;
+            break;
+        default:
+            frame->cursor = frame->cursor->next_stmt;
+            break;
+    }
+
+    return frame->cursor ? _visit(cmp, frame->cursor) : false;
+}
+
+static void _add_case_label(CCompiler *cmp, CNode *tree, CCaseSet *cases)
+{
+    int64_t val;
+    size_t  idx;
+
+    if(!eval_constant(cmp, tree->_case.cond, &val)) {
+        error(cmp, tree->line, "Case label is not an integer constant expression\n");
+        val = 0;
+    }
+
+    if(cases->type->size < sizeof(int64_t))
+        val = cases->type->kind == UINT ? (int64_t)(uint32_t)val : (int64_t)(int32_t)val;
+
+    for(idx = ((uint64_t)val * 0x9E3779B97F4A7C15ull >> 32) & cases->mask; cases->set[idx * 2]; idx = (idx + 1) & cases->mask) {
+        if(cases->set[idx * 2 + 1] == val) {
+            error(cmp, tree->line, "Duplicate case value '%ld'\n", val);
+            break;
+        }
+    }
+
+    cases->set[idx * 2]     = 1;
+    cases->set[idx * 2 + 1] = val;
+
+    tree->_case.cond            = new_tree(LITERAL, tree->line);
+    tree->_case.cond->type      = cases->type;
+    tree->_case.cond->misc      = new_misc(MISC_CONSTANT_INT);
+    tree->_case.cond->misc->val = val;
+}
+
+/*
+ * Evaluates the dimensions left as expressions by the parser and returns
+ * the interned, sized type. Types without such dimensions are returned as is.
+ */
+static CType *_complete_type(CCompiler *cmp, CType *type, size_t line)
+{
+    CType  *base;
+    int64_t length;
 
-    _analyse_tree(cmp, tree->unary.base);
+    if(!cmp || !type)
+        return type;
+
+    switch(type->kind) {
+        case PTR:
+            base = _complete_type(cmp, type->base, line);
+            return base == type->base ? type : make_ptr(base);
+        case ARRAY:
+            base = _complete_type(cmp, type->base, line);
+
+            if(!type->array_dimension)
+                return base == type->base ? type : array_of(base, type->length);
+
+            if(!type->array_dimension->type)
+                _analyse_tree(cmp, type->array_dimension);
+
+            if(!eval_constant(cmp, type->array_dimension, &length)) {
+                error(cmp, line, "Array dimension is not an integer constant expression\n");
+                length = -1;
+            }
+            else if(length < 0) {
+                error(cmp, line, "Array dimension is negative\n");
+                length = -1;
+            }
+
+            return array_of(base, length);
+        default:
+            return type;
+    }
+}
+
+static bool _analyse_plus(CCompiler *cmp, CFrame *frame)
+{
+    CNode *tree = frame->tree;
+
+    if(!frame->step++)
+        return _visit(cmp, tree->unary.base);
 
     _valid_condition(cmp, tree->unary.base->type, tree->line);
 
     tree->type = tree->unary.base->type;
+
+    return false;
 }
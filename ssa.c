@@ -0,0 +1,764 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * SSA construction over the per-function IR (Cytron et al.): dominators
+ * with the Cooper-Harvey-Kennedy iteration, dominance frontiers, phi
+ * placement and renaming over the dominator tree.
+ *
+ * Only locals whose address is never taken are promoted, and only when
+ * every access to them is a LOAD from or a STORE of a value to the
+ * symbol itself. Their loads and stores disappear: a use of the register
+ * a load defined is replaced by the value reaching it. Parameters are
+ * loaded once at the entry; a local read before any store reads zero.
+ */
+
+typedef struct CPhiSite CPhiSite;
+typedef struct CDefSite CDefSite;
+typedef struct CRename  CRename;
+
+struct CPhiSite {
+    int       slot;
+    CPhiSite *next;
+};
+
+struct CDefSite {
+    CBasicBlock *block;
+    CDefSite    *next;
+};
+
+struct CRename {
+    CBasicBlock *block;
+    size_t       child;
+    size_t       undo;
+};
+
+/*
+ * State of one build_ssa() call, everything is indexed by slot, block id
+ * or virtual register id.
+ */
+typedef struct CSSA {
+    CCompiler    *cmp;
+    CFunction    *fn;
+    CSymbol     **vars;
+    size_t        var_count;
+    bool         *global;
+    CDefSite    **defs;
+    CPhiSite    **phis;
+    CBasicBlock ***frontier;
+    size_t       *frontier_count;
+    COperand     *cur;
+    COperand     *incoming;
+    bool         *needed;
+    COperand     *repl;
+    size_t        repl_count;
+    int          *undo_slot;
+    COperand     *undo_value;
+    size_t        undo_count;
+    size_t        undo_capacity;
+} CSSA;
+
+static CBasicBlock *_intersect(CBasicBlock *b1, CBasicBlock *b2);
+static void         _number_blocks(CFunction *fn);
+static void         _build_dom_tree(CFunction *fn);
+
+static bool     _is_candidate(CFunction *fn, COperand arg);
+static size_t   _collect_vars(CSSA *ssa);
+static void     _compute_frontiers(CSSA *ssa);
+static void     _scan_defs(CSSA *ssa);
+static void     _place_phis(CSSA *ssa);
+static void     _insert_phis(CSSA *ssa);
+static void     _rename(CSSA *ssa);
+static void     _rename_block(CSSA *ssa, CBasicBlock *blk);
+static void     _fill_phis(CSSA *ssa, CBasicBlock *from, CBasicBlock *to);
+static COperand _use(CSSA *ssa, COperand arg);
+static void     _define(CSSA *ssa, int slot, COperand value);
+static void     _load_params(CSSA *ssa);
+static bool     _is_param(CFunction *fn, CSymbol *sym);
+static void     _compact(CFunction *fn);
+static COperand _zero_of(CFunction *fn, CType *type);
+
+void compute_dominators(CFunction *fn)
+{
+    bool changed = true;
+
+    if(!fn || !fn->entry)
+        return;
+
+    _number_blocks(fn);
+
+    fn->entry->idom = fn->entry;
+
+    while(changed) {
+        changed = false;
+
+        for(size_t i = 1; i < fn->order_count; i++) {
+            CBasicBlock *blk  = fn->order[i];
+            CBasicBlock *idom = NULL;
+
+            for(size_t j = 0; j < blk->pred_count; j++) {
+                CBasicBlock *pred = blk->preds[j];
+
+                if(!pred->idom)
+                    continue; // not processed yet, or unreachable
+
+                idom = idom ? _intersect(pred, idom) : pred;
+            }
+
+            if(idom != blk->idom) {
+                blk->idom = idom;
+                changed   = true;
+            }
+        }
+    }
+
+    _build_dom_tree(fn);
+}
+
+/*
+ * Whether 'b1' dominates 'b2', walking up from 'b2' while the blocks still
+ * come after 'b1' in reverse postorder.
+ */
+bool dominates(CBasicBlock *b1, CBasicBlock *b2)
+{
+    if(!b1 || !b1->idom)
+        return false;
+
+    while(b2 && b2->rpo > b1->rpo)
+        b2 = b2->idom;
+
+    return b2 == b1;
+}
+
+/*
+ * Walks the CFG depth first from the entry, without recursion, and lays
+ * the reachable blocks out in reverse postorder.
+ */
+static void _number_blocks(CFunction *fn)
+{
+    CBasicBlock **stack;
+    size_t       *next;
+    bool         *seen;
+    size_t        top   = 0;
+    size_t        count = fn->block_count;
+
+    stack     = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * fn->block_count, ARENA_3);
+    next      = (size_t *)zalloc(sizeof(size_t) * fn->block_count, ARENA_3);
+    seen      = (bool *)zalloc(sizeof(bool) * fn->block_count, ARENA_3);
+    fn->order = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * fn->block_count, ARENA_3);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        fn->blocks[i]->idom            = NULL;
+        fn->blocks[i]->dom_child_count = 0;
+        seen[i]                        = false;
+    }
+
+    stack[top]           = fn->entry;
+    next[top++]          = 0;
+    seen[fn->entry->id]  = true;
+
+    while(top) {
+        CBasicBlock *blk = stack[top - 1];
+
+        if(next[top - 1] < blk->succ_count) {
+            CBasicBlock *succ = blk->succs[next[top - 1]++];
+
+            if(!seen[succ->id]) {
+                seen[succ->id] = true;
+                stack[top]     = succ;
+                next[top++]    = 0;
+            }
+            continue;
+        }
+
+        fn->order[--count] = blk;
+        top--;
+    }
+
+    // postorder filled the array from the back, slide it to the front
+    fn->order_count = fn->block_count - count;
+
+    memmove(fn->order, fn->order + count, sizeof(CBasicBlock *) * fn->order_count);
+
+    for(size_t i = 0; i < fn->order_count; i++)
+        fn->order[i]->rpo = i;
+}
+
+static CBasicBlock *_intersect(CBasicBlock *b1, CBasicBlock *b2)
+{
+    while(b1 != b2) {
+        while(b1->rpo > b2->rpo)
+            b1 = b1->idom;
+        while(b2->rpo > b1->rpo)
+            b2 = b2->idom;
+    }
+
+    return b1;
+}
+
+static void _build_dom_tree(CFunction *fn)
+{
+    for(size_t i = 1; i < fn->order_count; i++)
+        fn->order[i]->idom->dom_child_count++;
+
+    for(size_t i = 0; i < fn->order_count; i++) {
+        CBasicBlock *blk = fn->order[i];
+
+        blk->dom_children    = blk->dom_child_count ? (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * blk->dom_child_count, ARENA_3) : NULL;
+        blk->dom_child_count = 0;
+    }
+
+    for(size_t i = 1; i < fn->order_count; i++) {
+        CBasicBlock *idom = fn->order[i]->idom;
+
+        idom->dom_children[idom->dom_child_count++] = fn->order[i];
+    }
+}
+
+void build_ssa(CCompiler *cmp, CFunction *fn)
+{
+    CSSA ssa;
+
+    if(!cmp || !fn || !fn->entry)
+        return;
+
+    memset(&ssa, 0, sizeof(CSSA));
+
+    ssa.cmp = cmp;
+    ssa.fn  = fn;
+
+    if(!_collect_vars(&ssa))
+        return;
+
+    compute_dominators(fn);
+
+    _compute_frontiers(&ssa);
+    _scan_defs(&ssa);
+    _place_phis(&ssa);
+    _insert_phis(&ssa);
+    _rename(&ssa);
+    _load_params(&ssa);
+    _compact(fn);
+
+    cmp->opt.promoted += ssa.var_count;
+}
+
+/*
+ * A symbol operand that may be promoted: a scalar local or parameter
+ * whose address is never taken. Static locals keep their storage.
+ */
+static bool _is_candidate(CFunction *fn, COperand arg)
+{
+    CSymbol *sym;
+    CType   *type;
+
+    if(OPERAND_KIND(arg) != OPERAND_SYMBOL || !(sym = SYMBOL_OF(fn, arg)))
+        return false;
+
+    if(!(sym->flags & SYMBOL_IS_LOCAL) || (sym->flags & (SYMBOL_IS_STATIC | SYMBOL_ADDRESS_TAKEN)))
+        return false;
+
+    type = canonical_type(sym->type);
+
+    return type && (type->kind < END_PRIMITIVES || type->kind == PTR || type->kind == ENUM) && type->kind != VOID;
+}
+
+/*
+ * Numbers the candidates in sym->slot and drops the ones accessed in any
+ * other way than a plain load or store. Returns how many are promoted.
+ */
+static size_t _collect_vars(CSSA *ssa)
+{
+    CFunction *fn    = ssa->fn;
+    size_t     count = 0;
+    bool      *bad;
+
+    for(size_t i = 0; i < fn->block_count; i++)
+        for(size_t j = 0; j < fn->blocks[i]->count; j++) {
+            CInstruction *ins = &fn->blocks[i]->ins[j];
+            COperand      args[3] = {ins->arg1, ins->arg2, ins->arg3};
+
+            for(int k = 0; k < 3; k++)
+                if(_is_candidate(fn, args[k]))
+                    SYMBOL_OF(fn, args[k])->slot = -1;
+        }
+
+    for(size_t i = 0; i < fn->block_count; i++)
+        for(size_t j = 0; j < fn->blocks[i]->count; j++) {
+            CInstruction *ins = &fn->blocks[i]->ins[j];
+            COperand      args[3] = {ins->arg1, ins->arg2, ins->arg3};
+
+            for(int k = 0; k < 3; k++)
+                if(_is_candidate(fn, args[k]) && SYMBOL_OF(fn, args[k])->slot < 0)
+                    SYMBOL_OF(fn, args[k])->slot = (int)count++;
+        }
+
+    if(!count)
+        return 0;
+
+    ssa->vars = (CSymbol **)zalloc(sizeof(CSymbol *) * count, ARENA_3);
+    bad       = (bool *)zalloc(sizeof(bool) * count, ARENA_3);
+
+    memset(bad, 0, sizeof(bool) * count);
+
+    for(size_t i = 0; i < fn->block_count; i++)
+        for(size_t j = 0; j < fn->blocks[i]->count; j++) {
+            CInstruction *ins = &fn->blocks[i]->ins[j];
+            COperand      args[3] = {ins->arg1, ins->arg2, ins->arg3};
+
+            for(int k = 0; k < 3; k++) {
+                CSymbol *sym;
+
+                if(!_is_candidate(fn, args[k]))
+                    continue;
+
+                sym = SYMBOL_OF(fn, args[k]);
+
+                ssa->vars[sym->slot] = sym;
+
+                if(ins->kind == INS_LOAD && k == 1)
+                    continue;
+
+                if(ins->kind == INS_STORE && k == 0 && IS_VREG(ins->arg2))
+                    continue;
+
+                bad[sym->slot] = true;
+            }
+        }
+
+    for(size_t i = 0; i < count; i++) {
+        if(bad[i]) {
+            ssa->vars[i]->slot = -1;
+            continue;
+        }
+
+        ssa->vars[i]->slot         = (int)ssa->var_count;
+        ssa->vars[ssa->var_count++] = ssa->vars[i];
+    }
+
+    return ssa->var_count;
+}
+
+/*
+ * Dominance frontiers: a join point is in the frontier of every block on
+ * the dominator tree path from each of its predecessors up to its idom.
+ */
+static void _compute_frontiers(CSSA *ssa)
+{
+    CFunction *fn = ssa->fn;
+
+    ssa->frontier       = (CBasicBlock ***)zalloc(sizeof(CBasicBlock **) * fn->block_count, ARENA_3);
+    ssa->frontier_count = (size_t *)zalloc(sizeof(size_t) * fn->block_count, ARENA_3);
+
+    memset(ssa->frontier_count, 0, sizeof(size_t) * fn->block_count);
+
+    // first count, then fill: a block is in at most pred_count frontiers per path
+    for(int pass = 0; pass < 2; pass++) {
+        for(size_t i = 0; i < fn->order_count; i++) {
+            CBasicBlock *blk = fn->order[i];
+
+            if(blk->pred_count < 2)
+                continue;
+
+            for(size_t j = 0; j < blk->pred_count; j++) {
+                CBasicBlock *runner = blk->preds[j];
+
+                if(!runner->idom)
+                    continue;
+
+                for(; runner != blk->idom; runner = runner->idom) {
+                    size_t n = ssa->frontier_count[runner->id];
+
+                    if(n && pass && ssa->frontier[runner->id][n - 1] == blk)
+                        break;
+
+                    if(pass)
+                        ssa->frontier[runner->id][ssa->frontier_count[runner->id]++] = blk;
+                    else
+                        ssa->frontier_count[runner->id]++;
+                }
+            }
+        }
+
+        if(pass)
+            break;
+
+        for(size_t i = 0; i < fn->block_count; i++) {
+            ssa->frontier[i]       = ssa->frontier_count[i] ? (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * ssa->frontier_count[i], ARENA_3) : NULL;
+            ssa->frontier_count[i] = 0;
+        }
+    }
+}
+
+/*
+ * Records the blocks storing to each variable and which variables are
+ * read in a block before being stored there: only those can need a phi.
+ */
+static void _scan_defs(CSSA *ssa)
+{
+    CFunction *fn = ssa->fn;
+    size_t    *stored;
+
+    ssa->global = (bool *)zalloc(sizeof(bool) * ssa->var_count, ARENA_3);
+    ssa->defs   = (CDefSite **)zalloc(sizeof(CDefSite *) * ssa->var_count, ARENA_3);
+    stored      = (size_t *)zalloc(sizeof(size_t) * ssa->var_count, ARENA_3);
+
+    memset(ssa->global, 0, sizeof(bool) * ssa->var_count);
+    memset(ssa->defs, 0, sizeof(CDefSite *) * ssa->var_count);
+    memset(stored, 0, sizeof(size_t) * ssa->var_count);
+
+    for(size_t i = 0; i < fn->order_count; i++) {
+        CBasicBlock *blk = fn->order[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            int           slot;
+
+            if(ins->kind == INS_LOAD && _is_candidate(fn, ins->arg2) && (slot = SYMBOL_OF(fn, ins->arg2)->slot) >= 0) {
+                if(stored[slot] != blk->id + 1)
+                    ssa->global[slot] = true;
+                continue;
+            }
+
+            if(ins->kind != INS_STORE || !_is_candidate(fn, ins->arg1) || (slot = SYMBOL_OF(fn, ins->arg1)->slot) < 0)
+                continue;
+
+            if(stored[slot] != blk->id + 1) {
+                CDefSite *def = (CDefSite *)zalloc(sizeof(CDefSite), ARENA_3);
+
+                def->block      = blk;
+                def->next       = ssa->defs[slot];
+                ssa->defs[slot] = def;
+                stored[slot]    = blk->id + 1;
+            }
+        }
+    }
+}
+
+/*
+ * Iterated dominance frontier of the stores of every variable live across
+ * blocks. 'placed' and 'queued' hold slot + 1 of the variable being
+ * processed, so they never need to be cleared.
+ */
+static void _place_phis(CSSA *ssa)
+{
+    CFunction    *fn = ssa->fn;
+    CBasicBlock **work;
+    size_t       *placed;
+    size_t       *queued;
+
+    ssa->phis = (CPhiSite **)zalloc(sizeof(CPhiSite *) * fn->block_count, ARENA_3);
+    work      = (CBasicBlock **)zalloc(sizeof(CBasicBlock *) * fn->block_count, ARENA_3);
+    placed    = (size_t *)zalloc(sizeof(size_t) * fn->block_count, ARENA_3);
+    queued    = (size_t *)zalloc(sizeof(size_t) * fn->block_count, ARENA_3);
+
+    memset(ssa->phis, 0, sizeof(CPhiSite *) * fn->block_count);
+    memset(placed, 0, sizeof(size_t) * fn->block_count);
+    memset(queued, 0, sizeof(size_t) * fn->block_count);
+
+    for(size_t slot = 0; slot < ssa->var_count; slot++) {
+        size_t top = 0;
+
+        if(!ssa->global[slot])
+            continue;
+
+        for(CDefSite *def = ssa->defs[slot]; def; def = def->next) {
+            queued[def->block->id] = slot + 1;
+            work[top++]            = def->block;
+        }
+
+        while(top) {
+            CBasicBlock *blk = work[--top];
+
+            for(size_t i = 0; i < ssa->frontier_count[blk->id]; i++) {
+                CBasicBlock *join = ssa->frontier[blk->id][i];
+                CPhiSite    *phi;
+
+                if(placed[join->id] == slot + 1)
+                    continue;
+
+                placed[join->id] = slot + 1;
+
+                phi             = (CPhiSite *)zalloc(sizeof(CPhiSite), ARENA_3);
+                phi->slot       = (int)slot;
+                phi->next       = ssa->phis[join->id];
+                ssa->phis[join->id] = phi;
+
+                if(queued[join->id] != slot + 1) {
+                    queued[join->id] = slot + 1;
+                    work[top++]      = join;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Rebuilds the instruction array of every block receiving phis. An operand
+ * coming from an unreachable predecessor is never read and stays zero.
+ */
+static void _insert_phis(CSSA *ssa)
+{
+    CFunction *fn = ssa->fn;
+
+    for(size_t i = 0; i < fn->order_count; i++) {
+        CBasicBlock  *blk   = fn->order[i];
+        size_t        extra = 0;
+        size_t        pos   = 0;
+        CInstruction *ins;
+
+        for(CPhiSite *phi = ssa->phis[blk->id]; phi; phi = phi->next)
+            extra++;
+
+        if(!extra)
+            continue;
+
+        ins = (CInstruction *)zalloc(sizeof(CInstruction) * (blk->count + extra), ARENA_3);
+
+        for(CPhiSite *phi = ssa->phis[blk->id]; phi; phi = phi->next) {
+            CSymbol  *sym = ssa->vars[phi->slot];
+            COperand  ops = ir_list(fn, OPERAND_PHI, blk->pred_count);
+
+            for(size_t j = 0; j < blk->pred_count; j++)
+                LIST_OF(fn, ops)[j] = _zero_of(fn, sym->type);
+
+            ins[pos++] = new_instruction(INS_PHI, ir_vreg(fn), ops, ir_symbol(fn, sym), sym->type, blk->count ? blk->ins[0].line : 0);
+        }
+
+        ssa->cmp->opt.phis += extra;
+        fn->ins_count      += extra;
+
+        if(blk->count)
+            memcpy(ins + pos, blk->ins, sizeof(CInstruction) * blk->count);
+
+        blk->ins      = ins;
+        blk->count   += extra;
+        blk->capacity = blk->count;
+    }
+}
+
+/*
+ * Walks the dominator tree in preorder without recursion. 'cur' holds the
+ * value reaching the current point for every variable; the values a block
+ * defines are logged and restored when its subtree is done.
+ */
+static void _rename(CSSA *ssa)
+{
+    CFunction *fn  = ssa->fn;
+    CRename   *stack;
+    size_t     top = 0;
+
+    ssa->cur        = (COperand *)zalloc(sizeof(COperand) * ssa->var_count, ARENA_3);
+    ssa->incoming   = (COperand *)zalloc(sizeof(COperand) * ssa->var_count, ARENA_3);
+    ssa->needed     = (bool *)zalloc(sizeof(bool) * ssa->var_count, ARENA_3);
+    ssa->repl_count = fn->vreg_count;
+    ssa->repl       = (COperand *)zalloc(sizeof(COperand) * (ssa->repl_count + 1), ARENA_3);
+    stack           = (CRename *)zalloc(sizeof(CRename) * fn->order_count, ARENA_3);
+
+    memset(ssa->repl, 0, sizeof(COperand) * ssa->repl_count);
+
+    for(size_t slot = 0; slot < ssa->var_count; slot++) {
+        ssa->needed[slot]   = false;
+        ssa->incoming[slot] = _is_param(fn, ssa->vars[slot]) ? ir_vreg(fn) : 0;
+        ssa->cur[slot]      = ssa->incoming[slot] ? ssa->incoming[slot] : _zero_of(fn, ssa->vars[slot]->type);
+    }
+
+    stack[top].block   = fn->entry;
+    stack[top].child   = 0;
+    stack[top++].undo  = 0;
+
+    _rename_block(ssa, fn->entry);
+
+    while(top) {
+        CRename *frame = &stack[top - 1];
+
+        if(frame->child < frame->block->dom_child_count) {
+            CBasicBlock *child = frame->block->dom_children[frame->child++];
+
+            stack[top].block  = child;
+            stack[top].child  = 0;
+            stack[top++].undo = ssa->undo_count;
+
+            _rename_block(ssa, child);
+            continue;
+        }
+
+        while(ssa->undo_count > frame->undo) {
+            ssa->undo_count--;
+            ssa->cur[ssa->undo_slot[ssa->undo_count]] = ssa->undo_value[ssa->undo_count];
+        }
+
+        top--;
+    }
+}
+
+static void _rename_block(CSSA *ssa, CBasicBlock *blk)
+{
+    CFunction *fn = ssa->fn;
+
+    for(size_t i = 0; i < blk->count; i++) {
+        CInstruction *ins = &blk->ins[i];
+        int           slot;
+
+        if(ins->kind == INS_PHI) {
+            _define(ssa, SYMBOL_OF(fn, ins->arg3)->slot, ins->arg1);
+            continue;
+        }
+
+        ins->arg2 = _use(ssa, ins->arg2);
+        ins->arg3 = _use(ssa, ins->arg3);
+
+        if(ins->kind == INS_RETVAL || ins->kind == INS_STORE)
+            ins->arg1 = _use(ssa, ins->arg1);
+
+        if(ins->kind == INS_CALL)
+            for(COperand *op = LIST_OF(fn, ins->arg3); *op; op++)
+                *op = _use(ssa, *op);
+
+        if(ins->kind == INS_LOAD && _is_candidate(fn, ins->arg2) && (slot = SYMBOL_OF(fn, ins->arg2)->slot) >= 0) {
+            ssa->repl[OPERAND_INDEX(ins->arg1)] = ssa->cur[slot];
+            ssa->needed[slot]             |= ssa->cur[slot] == ssa->incoming[slot];
+            ins->kind = INS_END_MARK;
+            ssa->cmp->opt.removed_loads++;
+        }
+        else if(ins->kind == INS_STORE && _is_candidate(fn, ins->arg1) && (slot = SYMBOL_OF(fn, ins->arg1)->slot) >= 0) {
+            _define(ssa, slot, ins->arg2);
+            ins->kind = INS_END_MARK;
+            ssa->cmp->opt.removed_stores++;
+        }
+    }
+
+    for(size_t i = 0; i < blk->succ_count; i++)
+        _fill_phis(ssa, blk, blk->succs[i]);
+}
+
+static void _fill_phis(CSSA *ssa, CBasicBlock *from, CBasicBlock *to)
+{
+    CFunction *fn = ssa->fn;
+
+    for(size_t j = 0; j < to->pred_count; j++) {
+        if(to->preds[j] != from)
+            continue;
+
+        for(size_t i = 0; i < to->count && to->ins[i].kind == INS_PHI; i++) {
+            int slot = SYMBOL_OF(fn, to->ins[i].arg3)->slot;
+
+            LIST_OF(fn, to->ins[i].arg2)[j] = ssa->cur[slot];
+            ssa->needed[slot]       |= ssa->cur[slot] == ssa->incoming[slot];
+        }
+    }
+}
+
+static COperand _use(CSSA *ssa, COperand arg)
+{
+    if(!IS_VREG(arg) || OPERAND_INDEX(arg) >= ssa->repl_count)
+        return arg;
+
+    return ssa->repl[OPERAND_INDEX(arg)] ? ssa->repl[OPERAND_INDEX(arg)] : arg;
+}
+
+static void _define(CSSA *ssa, int slot, COperand value)
+{
+    if(ssa->undo_count == ssa->undo_capacity) {
+        int      *slots  = ssa->undo_slot;
+        COperand *values = ssa->undo_value;
+
+        ssa->undo_capacity = ssa->undo_capacity ? ssa->undo_capacity * 2 : 64;
+        ssa->undo_slot     = (int *)zalloc(sizeof(int) * ssa->undo_capacity, ARENA_3);
+        ssa->undo_value    = (COperand *)zalloc(sizeof(COperand) * ssa->undo_capacity, ARENA_3);
+
+        if(ssa->undo_count) {
+            memcpy(ssa->undo_slot, slots, sizeof(int) * ssa->undo_count);
+            memcpy(ssa->undo_value, values, sizeof(COperand) * ssa->undo_count);
+        }
+    }
+
+    ssa->undo_slot[ssa->undo_count]    = slot;
+    ssa->undo_value[ssa->undo_count++] = ssa->cur[slot];
+
+    ssa->cur[slot] = value;
+}
+
+/*
+ * The incoming value of a promoted parameter is loaded once, right after
+ * ENTER, if anything reads it. Nothing stores to the parameter anymore,
+ * so its memory still holds it.
+ */
+static void _load_params(CSSA *ssa)
+{
+    CFunction    *fn    = ssa->fn;
+    CBasicBlock  *entry = fn->entry;
+    CInstruction *ins;
+    size_t        count = 0;
+    size_t        pos   = 0;
+
+    for(size_t slot = 0; slot < ssa->var_count; slot++)
+        count += ssa->needed[slot];
+
+    if(!count)
+        return;
+
+    ins = (CInstruction *)zalloc(sizeof(CInstruction) * (entry->count + count), ARENA_3);
+
+    if(entry->count && entry->ins[0].kind == INS_ENTER)
+        ins[pos++] = entry->ins[0];
+
+    for(size_t slot = 0; slot < ssa->var_count; slot++) {
+        CSymbol *var = ssa->vars[slot];
+
+        if(!ssa->needed[slot])
+            continue;
+
+        ins[pos++] = new_instruction(INS_LOAD, ssa->incoming[slot], ir_symbol(fn, var), 0, var->type, fn->entry->count ? entry->ins[0].line : 0);
+    }
+
+    memcpy(ins + pos, entry->ins + (pos - count), sizeof(CInstruction) * (entry->count - (pos - count)));
+
+    entry->ins      = ins;
+    entry->count   += count;
+    entry->capacity = entry->count;
+    fn->ins_count  += count;
+
+    ssa->cmp->opt.removed_loads -= count;
+}
+
+static bool _is_param(CFunction *fn, CSymbol *sym)
+{
+    if(!fn->sym)
+        return false;
+
+    for(CParameter *param = fn->sym->type->params; param; param = param->next)
+        if(param->sym == sym)
+            return true;
+
+    return false;
+}
+
+/*
+ * Drops the loads and stores the renaming turned into INS_END_MARK.
+ */
+static void _compact(CFunction *fn)
+{
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk   = fn->blocks[i];
+        size_t       count = 0;
+
+        for(size_t j = 0; j < blk->count; j++)
+            if(blk->ins[j].kind != INS_END_MARK)
+                blk->ins[count++] = blk->ins[j];
+
+        fn->ins_count -= blk->count - count;
+        blk->count     = count;
+    }
+}
+
+static COperand _zero_of(CFunction *fn, CType *type)
+{
+    type = canonical_type(type);
+
+    // 0.0 has all its bits clear as well
+    if(type && (type->kind == FLOAT || type->kind == DOUBLE || type->kind == LDOUBLE))
+        return ir_constant(fn, OPERAND_FLOAT, 0);
+
+    return ir_constant(fn, OPERAND_INT, 0);
+}
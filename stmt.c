@@ -1,106 +1,195 @@
 #include "compiler.h"
 #include "misc.h"
 
-static CNode *_prs_block(CCompiler *cmp);
-static CNode *_prs_if(CCompiler *cmp);
-static CNode *_prs_do(CCompiler *cmp);
-static CNode *_prs_while(CCompiler *cmp);
-static CNode *_prs_for(CCompiler *cmp);
+static bool   _prs_begin(CCompiler *cmp, CNode **tree);
+static bool   _prs_step(CCompiler *cmp, CFrame *frame, CNode *child);
+static void   _push_stmt(CCompiler *cmp, TreeKind kind);
+
+static bool   _prs_block(CCompiler *cmp, CFrame *frame, CNode *child);
+static bool   _prs_if(CCompiler *cmp, CFrame *frame, CNode *child);
+static bool   _prs_do(CCompiler *cmp, CFrame *frame, CNode *child);
+static bool   _prs_while(CCompiler *cmp, CFrame *frame, CNode *child);
+static bool   _prs_for(CCompiler *cmp, CFrame *frame, CNode *child);
+static bool   _prs_case(CCompiler *cmp, CFrame *frame, CNode *child);
+static bool   _prs_switch(CCompiler *cmp, CFrame *frame, CNode *child);
+
 static CNode *_prs_brk(CCompiler *cmp);
 static CNode *_prs_cnt(CCompiler *cmp);
 static CNode *_prs_ret(CCompiler *cmp);
-static CNode *_prs_case(CCompiler *cmp);
-static CNode *_prs_default(CCompiler *cmp);
-static CNode *_prs_switch(CCompiler *cmp);
 static CNode *_prs_goto(CCompiler *cmp);
 
 static CNode *_prs_for_init(CCompiler *cmp);
 static CNode *_prs_id(CCompiler *cmp);
 
 static void   _check_node(CCompiler *cmp, const char *statement_name, CNode *tree);
+
+/*
+ * Statements nest without recursion: a compound statement pushes a frame on
+ * cmp->stack and its _prs_* function is called once per step, with the
+ * statement parsed since the previous step as 'child'. It returns true to
+ * have the next child statement parsed and false once the node is done.
+ */
 CNode *prs_stmt(CCompiler *cmp)
 {
-    CNode *tree;
+    CNode  *tree = NULL;
+    CFrame *frame;
+    size_t  base;
 
-    if(!cmp || cmp->token == ';')
+    if(!cmp)
         return NULL;
 
-    if(is_typename(cmp) || is_typequalifier(cmp) || is_storage_class(cmp))
-        return prs_decl(cmp);
+    base = cmp->stack->count;
+
+    if(!_prs_begin(cmp, &tree))
+        return tree;
+
+    tree = NULL;
+
+    while(cmp->stack->count > base) {
+        frame = top_frame(cmp->stack);
+
+        if(_prs_step(cmp, frame, tree)) {
+            if(_prs_begin(cmp, &tree))
+                tree = NULL; // compound child, its first step runs next
+            continue;
+        }
+
+        tree = frame->tree;
+        pop_frame(cmp->stack);
+    }
+
+    return tree;
+}
+
+/*
+ * Parses a simple statement into 'tree' and returns false, or pushes the
+ * frame of a compound one and returns true.
+ */
+static bool _prs_begin(CCompiler *cmp, CNode **tree)
+{
+    *tree = NULL;
+
+    if(cmp->token == ';')
+        return false;
+
+    if(is_typename(cmp) || is_typequalifier(cmp) || is_storage_class(cmp) || is_function_specifier(cmp)) {
+        *tree = prs_decl(cmp);
+        return false;
+    }
 
     switch(cmp->token) {
         case '{':
-            return _prs_block(cmp);
+            _push_stmt(cmp, BLOCK);
+            return true;
         case KW_IF:
-            return _prs_if(cmp);
+            _push_stmt(cmp, IF);
+            return true;
         case KW_DO:
-            return _prs_do(cmp);
+            _push_stmt(cmp, DO_WHILE);
+            return true;
         case KW_WHILE:
-            return _prs_while(cmp);
+            _push_stmt(cmp, WHILE);
+            return true;
         case KW_FOR:
-            return _prs_for(cmp);
-        case KW_BREAK:
-            return _prs_brk(cmp);
-        case KW_CONTINUE:
-            return _prs_cnt(cmp);
-        case KW_RETURN:
-            return _prs_ret(cmp);
+            _push_stmt(cmp, FOR);
+            return true;
         case KW_CASE:
-            return _prs_case(cmp);
+            _push_stmt(cmp, CASE);
+            return true;
         case KW_DEFAULT:
-            return _prs_default(cmp);
+            _push_stmt(cmp, DEFAULT);
+            return true;
         case KW_SWITCH:
-            return _prs_switch(cmp);
+            _push_stmt(cmp, SWITCH);
+            return true;
+        case KW_BREAK:
+            *tree = _prs_brk(cmp);
+            return false;
+        case KW_CONTINUE:
+            *tree = _prs_cnt(cmp);
+            return false;
+        case KW_RETURN:
+            *tree = _prs_ret(cmp);
+            return false;
         case TK_ID:
-            return _prs_id(cmp);
+            *tree = _prs_id(cmp);
+            return false;
         case KW_GOTO:
-            return _prs_goto(cmp);
+            *tree = _prs_goto(cmp);
+            return false;
     }
 
-    tree = prs_expr(cmp, 0);
+    *tree = prs_expr(cmp, 0);
 
     expect(cmp, ';');
 
-    return tree;
+    return false;
 }
 
-static CNode *_prs_switch(CCompiler *cmp)
+static void _push_stmt(CCompiler *cmp, TreeKind kind)
 {
-    CNode *tree;
-    CNode **ptr;
+    push_frame(cmp->stack, new_tree(kind, cmp->file->line));
+}
 
-    if(!cmp)
-        return NULL;
+static bool _prs_step(CCompiler *cmp, CFrame *frame, CNode *child)
+{
+    switch(frame->tree->kind) {
+        case BLOCK:
+            return _prs_block(cmp, frame, child);
+        case IF:
+            return _prs_if(cmp, frame, child);
+        case DO_WHILE:
+            return _prs_do(cmp, frame, child);
+        case WHILE:
+            return _prs_while(cmp, frame, child);
+        case FOR:
+            return _prs_for(cmp, frame, child);
+        case CASE:
+        case DEFAULT:
+            return _prs_case(cmp, frame, child);
+        case SWITCH:
+            return _prs_switch(cmp, frame, child);
+        default:
+            return false;
+    }
+}
 
-    tree = new_tree(SWITCH, cmp->file->line);
+static bool _prs_switch(CCompiler *cmp, CFrame *frame, CNode *child)
+{
+    CNode *tree = frame->tree;
 
-    lex(cmp);
+    if(!frame->step++) {
+        lex(cmp);
 
-    accept(cmp, '(');
+        accept(cmp, '(');
 
-    tree->_switch.cond = prs_expr(cmp, 0);
+        tree->_switch.cond = prs_expr(cmp, 0);
 
-    accept(cmp, ')');
+        accept(cmp, ')');
 
-    accept(cmp, '{');
+        accept(cmp, '{');
 
-    ptr = &tree->_switch.cases;
+        frame->data = &tree->_switch.cases;
 
-    cmp->switch_count++;
+        cmp->switch_count++;
+    }
+    else if(child) {
+        *(CNode **)frame->data = child;
+        frame->data            = &child->next_stmt;
+    }
 
-    while(*cmp->file->src && cmp->token != '}') {
+    if(*cmp->file->src && cmp->token != '}') {
         if(cmp->token != KW_CASE && cmp->token != KW_DEFAULT)
             error(cmp, 0, "Invalid statement inside switch body\n");
-        *ptr = prs_stmt(cmp);
-        if(*ptr)
-            ptr = &(*ptr)->next_stmt;
+        return true;
     }
 
     cmp->switch_count--;
 
-    return tree;
+    return false;
 }
 
+
 static CNode *_prs_ret(CCompiler *cmp)
 {
     CNode *tree;
@@ -120,40 +209,39 @@ static CNode *_prs_ret(CCompiler *cmp)
     return tree;
 }
 
-static CNode *_prs_for(CCompiler *cmp)
+static bool _prs_for(CCompiler *cmp, CFrame *frame, CNode *child)
 {
-    CNode *tree;
-
-    if(!cmp)
-        return NULL;
+    CNode *tree = frame->tree;
 
-    tree = new_tree(FOR, cmp->file->line);
+    if(!frame->step++) {
+        lex(cmp);
 
-    lex(cmp);
+        accept(cmp, '(');
 
-    accept(cmp, '(');
+        tree->_for.init = _prs_for_init(cmp);
 
-    tree->_for.init = _prs_for_init(cmp);
+        accept(cmp, ';');
 
-    accept(cmp, ';');
+        if(cmp->token != ';')
+            tree->_for.cond = prs_expr(cmp, 0);
 
-    if(cmp->token != ';')
-        tree->_for.cond = prs_expr(cmp, 0);
+        accept(cmp, ';');
 
-    accept(cmp, ';');
+        if(cmp->token != ')')
+            tree->_for.step = prs_expr(cmp, 0);
 
-    if(cmp->token != ')')
-        tree->_for.step = prs_expr(cmp, 0);
+        accept(cmp, ')');
 
-    accept(cmp, ')');
+        cmp->loop_count++;
+        return true;
+    }
 
-    cmp->loop_count++;
-    tree->_for.then = prs_stmt(cmp);
+    tree->_for.then = child;
     cmp->loop_count--;
 
     _check_node(cmp, "for", tree->_for.then);
 
-    return tree;
+    return false;
 }
 
 static CNode *_prs_for_init(CCompiler *cmp)
@@ -167,47 +255,45 @@ static CNode *_prs_for_init(CCompiler *cmp)
     return prs_expr(cmp, 0);
 }
 
-static CNode *_prs_while(CCompiler *cmp)
+static bool _prs_while(CCompiler *cmp, CFrame *frame, CNode *child)
 {
-    CNode *tree;
-
-    if(!cmp)
-        return NULL;
+    CNode *tree = frame->tree;
 
-    tree = new_tree(WHILE, cmp->file->line);
+    if(!frame->step++) {
+        lex(cmp);
 
-    lex(cmp);
+        accept(cmp, '(');
 
-    accept(cmp, '(');
+        tree->_while.cond = prs_expr(cmp, 0);
 
-    tree->_while.cond = prs_expr(cmp, 0);
+        accept(cmp, ')');
 
-    accept(cmp, ')');
+        cmp->loop_count++;
 
-    cmp->loop_count++;
+        return true;
+    }
 
-    tree->_while.then = prs_stmt(cmp);
+    tree->_while.then = child;
 
     cmp->loop_count--;
 
     _check_node(cmp, "while", tree->_while.then);
 
-    return tree;
+    return false;
 }
 
-static CNode *_prs_do(CCompiler *cmp)
+static bool _prs_do(CCompiler *cmp, CFrame *frame, CNode *child)
 {
-    CNode *tree;
+    CNode *tree = frame->tree;
 
-    if(!cmp)
-        return NULL;
-
-    tree = new_tree(DO_WHILE, cmp->file->line);
+    if(!frame->step++) {
+        lex(cmp);
 
-    lex(cmp);
+        cmp->loop_count++;
+        return true;
+    }
 
-    cmp->loop_count++;
-    tree->_while.then = prs_stmt(cmp);
+    tree->_while.then = child;
     cmp->loop_count--;
 
     _check_node(cmp, "do while", tree->_while.then);
@@ -221,66 +307,63 @@ static CNode *_prs_do(CCompiler *cmp)
     accept(cmp, ')');
     expect(cmp, ';');
 
-    return tree;
+    return false;
 }
 
-static CNode *_prs_if(CCompiler *cmp)
+static bool _prs_if(CCompiler *cmp, CFrame *frame, CNode *child)
 {
-    CNode *tree;
+    CNode *tree = frame->tree;
 
-    if(!cmp)
-        return NULL;
+    switch(frame->step++) {
+        case 0:
+            lex(cmp);
 
-    tree = new_tree(IF, cmp->file->line);
+            accept(cmp, '(');
 
-    lex(cmp);
+            tree->_if.cond = prs_expr(cmp, 0);
 
-    accept(cmp, '(');
+            accept(cmp, ')');
 
-    tree->_if.cond = prs_expr(cmp, 0);
+            return true;
+        case 1:
+            tree->_if.then = child;
 
-    accept(cmp, ')');
+            _check_node(cmp, "do while", tree->_if.then);
 
-    tree->_if.then = prs_stmt(cmp);
+            if(lex(cmp) == KW_ELSE) {
+                lex(cmp);
+                return true;
+            }
 
-    _check_node(cmp, "do while", tree->_if.then);
+            cmp->flags |= COMPILER_FLAG_DONT_LEX;
 
-    if(lex(cmp) == KW_ELSE) {
-        lex(cmp);
-        tree->_if._else = prs_stmt(cmp);
-        _check_node(cmp, "else", tree->_if._else);
-        return tree;
+            return false;
     }
 
-    cmp->flags |= COMPILER_FLAG_DONT_LEX;
+    tree->_if._else = child;
+    _check_node(cmp, "else", tree->_if._else);
 
-    return tree;
+    return false;
 }
 
-static CNode *_prs_block(CCompiler *cmp)
+static bool _prs_block(CCompiler *cmp, CFrame *frame, CNode *child)
 {
-    CNode  *blk;
-    CNode **ptr;
-
-    if(!cmp)
-        return NULL;
-
-    blk = new_tree(BLOCK, cmp->file->line);
-
-    ptr = &blk->blk.head;
-
-    while(*cmp->file->src && lex(cmp) != '}') {
-        *ptr = prs_stmt(cmp);
-        if(!*ptr)
-            continue;
-         if((*ptr)->kind == FNPROTO || (*ptr)->kind == FNDECL)
+    if(!frame->step++)
+        frame->data = &frame->tree->blk.head;
+    else if(child) {
+        if(child->kind == FNPROTO || child->kind == FNDECL)
             error(cmp, 0, "Cannot declare a function inside a scope\n");
-         ptr = &(*ptr)->next_stmt;
+
+        *(CNode **)frame->data = child;
+        frame->data            = &child->next_stmt;
     }
 
+    if(*cmp->file->src && lex(cmp) != '}')
+        return true;
+
     expect(cmp, '}');
 
-    return blk;
+    return false;
 }
 
 static CNode *_prs_brk(CCompiler *cmp)
@@ -321,64 +404,32 @@ static CNode *_prs_cnt(CCompiler *cmp)
     return tree;
 }
 
-static CNode *_prs_case(CCompiler *cmp)
+static bool _prs_case(CCompiler *cmp, CFrame *frame, CNode *child)
 {
-    CNode *tree;
-    CNode **ptr;
-
-    if(!cmp)
-        return NULL;
-
-    if(!cmp->switch_count)
-        error(cmp, 0, "Cannot use case statement outside of a switch\n");
+    CNode *tree = frame->tree;
 
-    tree = new_tree(CASE, cmp->file->line);
+    if(!frame->step++) {
+        if(!cmp->switch_count)
+            error(cmp, 0, "Cannot use case statement outside of a switch\n");
 
-    lex(cmp);
-
-    tree->_case.cond = prs_expr(cmp, 0);
-
-    accept(cmp, ':');
-
-    ptr = &tree->_case.head;
-
-    while(*cmp->file->src && cmp->token != KW_CASE && cmp->token != KW_DEFAULT && cmp->token != '}') {
-        *ptr = prs_stmt(cmp);
-        if(*ptr)
-            ptr = &(*ptr)->next_stmt;
         lex(cmp);
-    }
 
-    return tree;
-}
-
-static CNode *_prs_default(CCompiler *cmp)
-{
-    CNode *tree;
-    CNode **ptr;
-
-    if(!cmp)
-        return NULL;
+        if(tree->kind == CASE)
+            tree->_case.cond = prs_expr(cmp, 0);
 
-    if(!cmp->switch_count)
-        error(cmp, 0, "Cannot use case statement outside of a switch\n");
+        accept(cmp, ':');
 
-    tree = new_tree(DEFAULT, cmp->file->line);
-
-    lex(cmp);
-
-    accept(cmp, ':');
-
-    ptr = &tree->_case.head;
-
-    while(*cmp->file->src && cmp->token != KW_CASE && cmp->token != KW_DEFAULT && cmp->token != '}') {
-        *ptr = prs_stmt(cmp);
-        if(*ptr)
-            ptr = &(*ptr)->next_stmt;
+        frame->data = &tree->_case.head;
+    }
+    else {
+        if(child) {
+            *(CNode **)frame->data = child;
+            frame->data            = &child->next_stmt;
+        }
         lex(cmp);
     }
 
-    return tree;
+    return *cmp->file->src && cmp->token != KW_CASE && cmp->token != KW_DEFAULT && cmp->token != '}';
 }
 
 static CNode *_prs_id(CCompiler *cmp)
@@ -97,5 +97,7 @@ static int _get_hash(const char *key)
     if(!key)
         return 0;
 
-    return ((unsigned)key << 1) & 0xFF;
+    // keys are atoms, so the address is the identity; its low bits are
+    // alignment and say little, mix them all into the 256 buckets
+    return (int)(((uintptr_t)key * 0x9E3779B97F4A7C15ull) >> 56);
 }
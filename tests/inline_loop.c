@@ -0,0 +1,27 @@
+// flags: -O -linear-scan
+// expect 1 function 'caller'
+// expect 0 PHI
+// expect 0 Error
+//
+// The loop of 'scale' runs once: constant propagation removes its back
+// edge before 'scale' is inlined, twice, along with its early return. The
+// phis left must still have one operand per predecessor.
+
+int scale(int a, int b)
+{
+    int i, v;
+    if(a < 0)
+        return b;
+    v = b;
+    i = 0;
+    do {
+        v = v * 3 + a;
+        i = i + 1;
+    } while(i < 1);
+    return v;
+}
+
+int caller(int a, int b)
+{
+    return scale(a, b) + scale(b, a);
+}
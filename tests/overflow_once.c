@@ -0,0 +1,14 @@
+// flags:
+// expect 2 Integer overflow in constant expression
+// expect 1 Shift count out of range
+// expect 1 Division by zero
+//
+// The parser folds constant expressions and the analyser folds them again
+// once their operands are typed: each site is reported once.
+
+int big = 2147483647 + 1;
+
+int f(int x)
+{
+    return x + 9223372036854775807 * 2 + (1 << 40) + 5 / 0;
+}
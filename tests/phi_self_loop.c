@@ -0,0 +1,23 @@
+// flags: -O
+// expect 0 PHI
+// expect 0 Error
+//
+// Once inlined into 'caller', the loop of 'count' is a single block that
+// is its own predecessor: the copies of its phis go into the block the
+// phis are in, which may have to grow.
+
+int count(int x, int n)
+{
+    int i;
+    i = 0;
+    do {
+        x = x * 3 + i;
+        i = i + 1;
+    } while(i < n);
+    return x;
+}
+
+int caller(int a)
+{
+    return count(a, 5) + 1;
+}
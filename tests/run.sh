@@ -0,0 +1,29 @@
+#!/bin/sh
+# usage: tests/run.sh path/to/compiler
+#
+# Compiles every tests/*.c with the options of its '// flags:' line and
+# counts the lines of the output, stdout and stderr, holding the text of
+# each '// expect <count> <text>' line.
+
+cc=${1:?usage: tests/run.sh path/to/compiler}
+dir=$(dirname "$0")
+failed=0
+
+for test in "$dir"/*.c; do
+    flags=$(sed -n 's|^// flags:||p' "$test")
+    out=$("$cc" $flags "$test" 2>&1)
+
+    while read -r count text; do
+        found=$(printf '%s\n' "$out" | grep -cF -- "$text")
+
+        if [ "$found" != "$count" ]; then
+            echo "FAIL $test: '$text' $found times, expected $count"
+            failed=1
+        fi
+    done <<LIST
+$(sed -n 's|^// expect ||p' "$test")
+LIST
+done
+
+[ $failed = 0 ] && echo "all tests passed"
+exit $failed
@@ -1,7 +1,8 @@
 #include "compiler.h"
 #include "misc.h"
+#include <pthread.h>
 
-#define TYPE(kind, name, size) &(CType){name, kind, NULL, size, 0, NULL}
+#define TYPE(kind, name, size) &(CType){name, kind, NULL, size, 0, NULL, .length = -1}
 
 CType *cmp_primitives[END_PRIMITIVES] = {
     TYPE(VOID,  "void",         0),  TYPE(CHAR,   "char",           1), TYPE(UCHAR,   "unsigned char", 1),
@@ -9,3 +10,211 @@ CType *cmp_primitives[END_PRIMITIVES] = {
     TYPE(UINT,  "unsigned int", 4),  TYPE(LONG,   "long",           8), TYPE(ULONG,   "unsigned long", 8),
     TYPE(FLOAT, "float",        4),  TYPE(DOUBLE, "double",         8), TYPE(LDOUBLE, "long double",   16)
 };
+
+/*
+ * Derived types are hash-consed: structurally identical types are the same
+ * pointer, so type equality is a pointer compare. 'pointer to T' is cached
+ * on T itself and the arrays of T hang from T->derived. Function signatures
+ * live in a hash table keyed on the return and parameter types.
+ *
+ * A function declarator also carries the parameter names, which differ
+ * between a prototype and its definition. Such a type is not shared; it
+ * points to its interned signature through 'canon'.
+ */
+
+#define FUNCTION_BUCKETS 1024
+
+static CType          *functions[FUNCTION_BUCKETS] = {NULL};
+static pthread_mutex_t lock                        = PTHREAD_MUTEX_INITIALIZER;
+static bool            shared                      = false;
+
+static CType   *_intern_function(CType *base, CParameter *params, size_t param_count);
+static unsigned _hash_function(CType *base, CParameter *params, size_t param_count);
+
+/*
+ * Called before worker threads start building types.
+ */
+void type_share(void)
+{
+    shared = true;
+}
+
+CType *canonical_type(CType *type)
+{
+    if(type && type->kind == FUNCTION && type->canon)
+        return type->canon;
+
+    return type;
+}
+
+CType *make_ptr(CType *base)
+{
+    CType *ptr;
+
+    if(!base)
+        return NULL;
+
+    base = canonical_type(base);
+
+    if((ptr = __atomic_load_n(&base->pointer, __ATOMIC_ACQUIRE)))
+        return ptr;
+
+    if(shared)
+        pthread_mutex_lock(&lock);
+
+    if(!(ptr = base->pointer)) {
+        ptr       = new_type();
+        ptr->kind = PTR;
+        ptr->base = base;
+        ptr->size = sizeof(void *);
+
+        __atomic_store_n(&base->pointer, ptr, __ATOMIC_RELEASE);
+    }
+
+    if(shared)
+        pthread_mutex_unlock(&lock);
+
+    return ptr;
+}
+
+/*
+ * Arrays are only shared when their dimension is known while parsing, i.e.
+ * it is missing or folded to an integer literal.
+ */
+CType *new_array(CType *base, CNode *size_expr)
+{
+    CType *array;
+
+    if(!base)
+        return NULL;
+
+    base = canonical_type(base);
+
+    if(!size_expr)
+        return array_of(base, -1);
+
+    if(size_expr->kind == LITERAL && size_expr->misc->kind == MISC_CONSTANT_INT)
+        return array_of(base, size_expr->misc->val);
+
+    array = new_type();
+
+    array->kind            = ARRAY;
+    array->base            = base;
+    array->length          = -1;
+    array->array_dimension = size_expr;
+
+    return array;
+}
+
+CType *new_function(CType *base, CParameter *params, size_t param_count)
+{
+    CType      *canon;
+    CType      *fun;
+    CParameter *named;
+
+    base  = canonical_type(base);
+    canon = _intern_function(base, params, param_count);
+
+    for(named = params; named && !named->sym; named = named->next);
+
+    if(!named)
+        return canon;
+
+    fun               = new_type();
+    fun->kind         = FUNCTION;
+    fun->base         = base;
+    fun->params       = params;
+    fun->param_count  = param_count;
+    fun->canon        = canon;
+
+    return fun;
+}
+
+/*
+ * Interned 'array of length x base', a negative length is an incomplete array.
+ */
+CType *array_of(CType *base, int64_t length)
+{
+    CType *array;
+
+    if(!base)
+        return NULL;
+
+    base = canonical_type(base);
+
+    if(shared)
+        pthread_mutex_lock(&lock);
+
+    for(array = base->derived; array; array = array->link)
+        if(array->length == length)
+            break;
+
+    if(!array) {
+        array         = new_type();
+        array->kind   = ARRAY;
+        array->base   = base;
+        array->length = length;
+        array->size   = length > 0 ? (size_t)length * base->size : 0;
+        array->link   = base->derived;
+        base->derived = array;
+    }
+
+    if(shared)
+        pthread_mutex_unlock(&lock);
+
+    return array;
+}
+
+static CType *_intern_function(CType *base, CParameter *params, size_t param_count)
+{
+    unsigned     hash = _hash_function(base, params, param_count);
+    CType       *fun;
+    CParameter **ptr;
+
+    if(shared)
+        pthread_mutex_lock(&lock);
+
+    for(fun = functions[hash]; fun; fun = fun->link) {
+        CParameter *p1 = fun->params, *p2 = params;
+
+        if(fun->base != base || fun->param_count != param_count)
+            continue;
+
+        while(p1 && p2 && p1->type == canonical_type(p2->type))
+            p1 = p1->next, p2 = p2->next;
+
+        if(!p1 && !p2)
+            break;
+    }
+
+    if(!fun) {
+        fun              = new_type();
+        fun->kind        = FUNCTION;
+        fun->base        = base;
+        fun->param_count = param_count;
+        fun->link        = functions[hash];
+        functions[hash]  = fun;
+
+        for(ptr = &fun->params; params; params = params->next, ptr = &(*ptr)->next) {
+            *ptr         = new_param();
+            (*ptr)->type = canonical_type(params->type);
+        }
+    }
+
+    if(shared)
+        pthread_mutex_unlock(&lock);
+
+    return fun;
+}
+
+static unsigned _hash_function(CType *base, CParameter *params, size_t param_count)
+{
+    uintptr_t hash = (uintptr_t)base ^ param_count;
+
+    for(; params; params = params->next)
+        hash = (hash * 31) ^ (uintptr_t)canonical_type(params->type);
+
+    hash ^= hash >> 16;
+
+    return (unsigned)(hash >> 4) & (FUNCTION_BUCKETS - 1);
+}
@@ -0,0 +1,1975 @@
+#include "compiler.h"
+#include "misc.h"
+
+/*
+ * x86-64 machine code for the allocated IR ('-x86'), encoded straight to
+ * bytes: instructions are selected and their REX, ModRM, SIB,
+ * displacement and immediate written in one pass over the blocks, with
+ * no assembly text in between. A function is encoded in a buffer of
+ * ARENA_3 growing by doubling, given back with the rest of the function,
+ * and copied to ARENA_5 at its exact size once done.
+ *
+ * The frame is based on rbp. Below it the callee saved registers the
+ * allocators gave out are pushed, then come the locals and spill slots,
+ * 8 bytes each, then the arguments passed on the stack, at rsp, which
+ * stays 16 byte aligned. The parameters passed in registers are stored
+ * to their slots on entry, so a LOAD of a parameter reads memory like a
+ * LOAD of any local.
+ *
+ * In a register, only the low 32 bits of a value of 32 bits or less are
+ * defined, chars and shorts extended to 32 bits after every operation, so
+ * that registers can be compared and tested without looking at the type
+ * of what defined them. Long doubles are handled as doubles.
+ *
+ * r11 and xmm15 are only allocated to the moves the allocators add
+ * through them, so within any other instruction they are free for the
+ * encoder. Jumps go to the blocks in layout order, short when backward
+ * and close enough; the jump tables, the offsets of their targets, and
+ * the constants read from memory follow the code as data, never
+ * executed. A reference to another symbol, a call or the address
+ * of a global, is left to the linker as a relocation. Of the containers
+ * of global initializers, the constants are kept as data.
+ */
+
+#define CODE_INITIAL_SIZE 1024
+#define SLOT_SIZE         8
+#define SSE_ARGS          8
+#define SCRATCH_GPR       REG_R11
+#define SCRATCH_SSE       REG_XMM15
+
+typedef struct CEncoder  CEncoder;
+typedef struct CAddr     CAddr;
+typedef struct CPatch    CPatch;
+typedef struct CTable    CTable;
+typedef struct CConstant CConstant;
+
+/*
+ * Condition codes, as in the low bits of jcc and setcc.
+ */
+enum {
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A  = 0x7,
+    CC_P  = 0xA,
+    CC_NP = 0xB,
+    CC_L  = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G  = 0xF,
+    CC_JMP = -1
+};
+
+/*
+ * A memory operand, registers by hardware number: [base + disp] or
+ * [base + index * 8], rip relative to a symbol or a constant of the pool
+ * when 'base' is -1.
+ */
+struct CAddr {
+    int        base;
+    int        index;
+    int32_t    disp;
+    CSymbol   *sym;
+    CConstant *constant;
+};
+
+/*
+ * A rel32 field to fill once its target is placed, relative to 'end',
+ * the end of its instruction.
+ */
+struct CPatch {
+    size_t       at;
+    size_t       end;
+    int32_t      disp;
+    CBasicBlock *blk;
+    CConstant   *constant;
+    CPatch      *next;
+};
+
+/*
+ * A jump table, data of 8 bytes per entry holding the offset of its
+ * target from the start of the table, and the lea that takes its
+ * address.
+ */
+struct CTable {
+    COperand list;
+    size_t   at;
+    size_t   end;
+    CTable  *next;
+};
+
+struct CConstant {
+    uint64_t   bits;
+    size_t     at;
+    CConstant *next;
+};
+
+struct CEncoder {
+    CCompiler    *cmp;
+    CFunction    *fn;
+    byte         *code;
+    size_t        size;
+    size_t        capacity;
+    size_t       *block_at;   // by block id, SIZE_MAX until encoded
+    size_t        block_ids;
+    CBasicBlock  *next;       // the block after the one encoded
+    CType       **types;      // of each vreg, from its definition
+    int32_t      *slots;      // rbp offset of each symbol of the pool, 0 if it has none
+    CConstant   **pooled;     // by value index
+    CConstant    *constants;
+    CConstant    *last_constant;
+    CTable       *tables;
+    CTable       *last_table;
+    CPatch       *patches;
+    CReloc       *relocs;
+    CReloc       *last_reloc;
+    int           saved[5];   // callee saved registers pushed
+    size_t        saved_count;
+    size_t        frame;      // what rsp goes down after them
+};
+
+static const int gpr_args[] = {
+    REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9
+};
+
+static const int callee_saved[] = {
+    REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15
+};
+
+static CCode     *_encode_data(CCompiler *cmp, CFunction *fn);
+static CCode     *_new_code(CCompiler *cmp, CSymbol *sym, const byte *bytes, size_t size);
+static void       _prepare(CEncoder *e);
+static void       _prepare_params(CEncoder *e, size_t *locals);
+static size_t     _classify(CEncoder *e, CInstruction *ins, int *regs);
+static CParameter *_params_of(CFunction *fn, COperand callee);
+static bool       _is_sse_arg(CEncoder *e, COperand arg, CType *type);
+static void       _prologue(CEncoder *e);
+static void       _epilogue(CEncoder *e);
+static bool       _is_well_formed(CEncoder *e, CInstruction *ins);
+static bool       _is_value(CEncoder *e, COperand op);
+static void       _select(CEncoder *e, CBasicBlock *blk, CInstruction *ins);
+static void       _load(CEncoder *e, CInstruction *ins);
+static void       _store(CEncoder *e, CInstruction *ins);
+static void       _binary(CEncoder *e, CInstruction *ins);
+static void       _sse_binary(CEncoder *e, CInstruction *ins);
+static void       _divide(CEncoder *e, CInstruction *ins);
+static void       _shift(CEncoder *e, CInstruction *ins);
+static int        _compare(CEncoder *e, Instruction kind, COperand x, COperand y, CType *type);
+static void       _set(CEncoder *e, CInstruction *ins);
+static void       _branch(CEncoder *e, CInstruction *ins);
+static void       _jmpz(CEncoder *e, CInstruction *ins);
+static void       _table(CEncoder *e, CInstruction *ins);
+static void       _call(CEncoder *e, CInstruction *ins);
+static void       _parallel_move(CEncoder *e, int *dst, int *src, size_t count);
+static void       _finish(CEncoder *e);
+static void       _move_gpr(CEncoder *e, int dst, COperand src, CType *type);
+static void       _move_sse(CEncoder *e, int dst, COperand src, CType *type);
+static void       _move_imm(CEncoder *e, int dst, int64_t value);
+static void       _load_gpr(CEncoder *e, int dst, CAddr *mem, CType *type);
+static void       _store_gpr(CEncoder *e, CAddr *mem, int src, size_t size);
+static void       _store_imm(CEncoder *e, CAddr *mem, int64_t value, size_t size);
+static void       _extend(CEncoder *e, int dst, int src, CType *type);
+static void       _jump(CEncoder *e, int cc, CBasicBlock *to);
+static size_t     _skip(CEncoder *e, int cc);
+static void       _land(CEncoder *e, size_t at);
+static void       _rr(CEncoder *e, int prefix, int w, uint32_t op, int reg, int rm);
+static void       _rm(CEncoder *e, int prefix, int w, uint32_t op, int reg, CAddr *mem, size_t imm_size);
+static void       _encode(CEncoder *e, int prefix, int w, uint32_t op, int reg, int rm, CAddr *mem, size_t imm_size, bool byte_regs);
+static void       _address(CEncoder *e, COperand op, CAddr *mem);
+static void       _constant(CEncoder *e, COperand op, CAddr *mem);
+static void       _frame_slot(CAddr *mem, int base, int32_t disp);
+static void       _patch(CEncoder *e, size_t at, size_t end, int32_t disp, CBasicBlock *blk, CConstant *constant);
+static void       _reloc(CEncoder *e, CSymbol *sym, size_t at, size_t end, int32_t disp);
+static void       _byte(CEncoder *e, byte value);
+static void       _imm(CEncoder *e, int64_t value, size_t size);
+static void       _put32(CEncoder *e, size_t at, int64_t value);
+static int        _reg(CEncoder *e, COperand op);
+static int        _dst(CEncoder *e, COperand op, bool sse);
+static int        _hw(int reg);
+static bool       _is_sse_reg(int reg);
+static bool       _is_sse_ins(CEncoder *e, CInstruction *ins);
+static size_t     _size(CType *type);
+static size_t     _int_size(CType *type);
+static bool       _is_float(CType *type);
+static bool       _is_single(CType *type);
+static bool       _is_unsigned(CType *type);
+static bool       _is_function(CSymbol *sym);
+static bool       _is_local(CSymbol *sym);
+static bool       _fits8(int64_t value);
+static bool       _fits32(int64_t value);
+static int64_t    _value(CEncoder *e, COperand op, CType *type);
+
+/*
+ * Encodes an allocated function, or the constants a container stores to
+ * globals, appending it to cmp->code. Returns what was appended first,
+ * NULL if nothing was: an instruction without the operands it needs is
+ * an internal error, the function is not encoded.
+ */
+CCode *encode_function(CCompiler *cmp, CFunction *fn)
+{
+    CEncoder e;
+
+    if(!cmp || !fn || !fn->entry)
+        return NULL;
+
+    if(!fn->sym)
+        return _encode_data(cmp, fn);
+
+    memset(&e, 0, sizeof(CEncoder));
+
+    e.cmp = cmp;
+    e.fn  = fn;
+
+    _prepare(&e);
+    _prologue(&e);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock  *blk  = fn->blocks[i];
+        CInstruction *last = blk->count ? &blk->ins[blk->count - 1] : NULL;
+
+        e.block_at[blk->id] = e.size;
+        e.next              = i + 1 < fn->block_count ? fn->blocks[i + 1] : NULL;
+
+        for(size_t j = 0; j < blk->count; j++) {
+            if(!_is_well_formed(&e, &blk->ins[j])) {
+                error(cmp, blk->ins[j].line, "Internal error: malformed instruction in function '%s'\n", fn->sym->name);
+                return NULL;
+            }
+
+            _select(&e, blk, &blk->ins[j]);
+        }
+
+        // a return, or an edge split after the layout, doesn't fall through
+        if(blk->succ_count == 1 && blk->succs[0] != e.next &&
+           (!last || (last->kind != INS_JMP && last->kind != INS_JTAB && !is_branch(last->kind))))
+            _jump(&e, CC_JMP, blk->succs[0]);
+    }
+
+    _finish(&e);
+
+    _new_code(cmp, fn->sym, e.code, e.size)->relocs = e.relocs;
+
+    return cmp->code_tail;
+}
+
+/*
+ * Prints 'code' and whatever was appended after it: a hex dump of the
+ * bytes, and the relocations.
+ */
+void print_code(CCode *code)
+{
+    for(; code; code = code->next) {
+        printf("%s '%s' (%ld bytes)\n", code->data ? "data" : "function", code->sym->name, code->size);
+
+        for(size_t i = 0; i < code->size; i += 16) {
+            printf("\t%04lx ", i);
+
+            for(size_t j = i; j < code->size && j < i + 16; j++)
+                printf(" %02x", code->bytes[j]);
+
+            printf("\n");
+        }
+
+        for(CReloc *reloc = code->relocs; reloc; reloc = reloc->next)
+            printf("\treloc %04lx '%s' %+ld\n", reloc->at, reloc->sym->name, reloc->addend);
+    }
+}
+
+/*
+ * A container only loads constants and stores them: each global stored a
+ * constant gets it as data, at the size of its type. A float constant is
+ * converted when it was loaded as the other width. The vreg count of a
+ * container is not kept (the next function resets it first): the loads
+ * are indexed up to the highest vreg found.
+ */
+static CCode *_encode_data(CCompiler *cmp, CFunction *fn)
+{
+    CInstruction **loads;
+    size_t         count = 0;
+    CCode         *first = NULL;
+
+    for(size_t i = 0; i < fn->block_count; i++)
+        for(size_t j = 0; j < fn->blocks[i]->count; j++)
+            if(IS_VREG(fn->blocks[i]->ins[j].arg1) && OPERAND_INDEX(fn->blocks[i]->ins[j].arg1) >= count)
+                count = OPERAND_INDEX(fn->blocks[i]->ins[j].arg1) + 1;
+
+    loads = (CInstruction **)zalloc(sizeof(CInstruction *) * (count + 1), ARENA_3);
+
+    memset(loads, 0, sizeof(CInstruction *) * (count + 1));
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins  = &blk->ins[j];
+            COperand      src  = ins->arg2;
+            CType        *type = ins->type;
+            CSymbol      *sym;
+            CValue        value;
+            byte          bytes[8];
+            size_t        size;
+
+            if(ins->kind == INS_LOAD && IS_VREG(ins->arg1))
+                loads[OPERAND_INDEX(ins->arg1)] = ins;
+
+            if(ins->kind != INS_STORE || OPERAND_KIND(ins->arg1) != OPERAND_SYMBOL)
+                continue;
+
+            if(IS_VREG(src) && OPERAND_INDEX(src) < count && loads[OPERAND_INDEX(src)]) {
+                type = loads[OPERAND_INDEX(src)]->type;
+                src  = loads[OPERAND_INDEX(src)]->arg2;
+            }
+
+            if(OPERAND_KIND(src) != OPERAND_INT && OPERAND_KIND(src) != OPERAND_FLOAT)
+                continue;
+
+            sym   = SYMBOL_OF(fn, ins->arg1);
+            size  = _size(sym->type);
+            value = VALUE_OF(fn, src);
+
+            if(OPERAND_KIND(src) == OPERAND_FLOAT && _is_float(sym->type) && _is_single(type) != _is_single(sym->type)) {
+                if(_is_single(sym->type))
+                    value.fval = (float)value.dval;
+                else
+                    value.dval = value.fval;
+            }
+
+            for(size_t k = 0; k < size; k++)
+                bytes[k] = (byte)((uint64_t)value.val >> (k * 8));
+
+            if(!first)
+                first = _new_code(cmp, sym, bytes, size);
+            else
+                _new_code(cmp, sym, bytes, size);
+
+            cmp->code_tail->data = true;
+        }
+    }
+
+    return first;
+}
+
+static CCode *_new_code(CCompiler *cmp, CSymbol *sym, const byte *bytes, size_t size)
+{
+    CCode *code = (CCode *)zalloc(sizeof(CCode), ARENA_5);
+
+    memset(code, 0, sizeof(CCode));
+
+    code->sym   = sym;
+    code->size  = size;
+    code->bytes = (byte *)zalloc(size ? size : 1, ARENA_5);
+
+    memcpy(code->bytes, bytes, size);
+
+    if(!cmp->code)
+        cmp->code = code;
+    else
+        cmp->code_tail->next = code;
+
+    cmp->code_tail = code;
+
+    return code;
+}
+
+/*
+ * Everything the encoding looks up: the type each vreg was defined with,
+ * the callee saved registers to push, the slot of each local and the
+ * frame, which keeps rsp aligned to 16 bytes at calls.
+ */
+static void _prepare(CEncoder *e)
+{
+    CFunction *fn     = e->fn;
+    size_t     locals = 0;
+    size_t     out    = 0;
+    bool       used[REG_END_MARK];
+
+    memset(used, 0, sizeof(used));
+
+    for(size_t i = 0; i < fn->block_count; i++)
+        if(fn->blocks[i]->id >= e->block_ids)
+            e->block_ids = fn->blocks[i]->id + 1;
+
+    e->block_at = (size_t *)zalloc(sizeof(size_t) * e->block_ids, ARENA_3);
+    e->types    = (CType **)zalloc(sizeof(CType *) * (fn->vreg_count + 1), ARENA_3);
+
+    memset(e->block_at, 0xFF, sizeof(size_t) * e->block_ids);
+    memset(e->types, 0, sizeof(CType *) * (fn->vreg_count + 1));
+
+    // the parameters may add symbols to the pool: before its size is taken
+    _prepare_params(e, &locals);
+
+    for(size_t i = 0; i < fn->block_count; i++) {
+        CBasicBlock *blk = fn->blocks[i];
+
+        for(size_t j = 0; j < blk->count; j++) {
+            CInstruction *ins = &blk->ins[j];
+            COperand      def = ins_def(ins);
+            COperand     *use;
+
+            if(def && OPERAND_INDEX(def) < fn->vreg_count)
+                e->types[OPERAND_INDEX(def)] = ins->type;
+
+            if(def)
+                used[_reg(e, def)] = true;
+
+            for(size_t n = 0; (use = ins_use(fn, ins, n)); n++)
+                used[_reg(e, *use)] = true;
+
+            if(ins->kind == INS_CALL) {
+                size_t count = 0;
+                size_t stack;
+
+                while(ins->arg3 && LIST_OF(fn, ins->arg3)[count])
+                    count++;
+
+                stack = _classify(e, ins, (int *)zalloc(sizeof(int) * (count + 1), ARENA_3));
+
+                if(stack > out)
+                    out = stack;
+            }
+        }
+    }
+
+    for(size_t i = 0; i < fn->symbol_count; i++) {
+        CSymbol *sym = fn->symbols[i];
+        size_t   size;
+
+        if(!_is_local(sym) || e->slots[i])
+            continue;
+
+        size = sym->type && sym->type->size > SLOT_SIZE ? (sym->type->size + SLOT_SIZE - 1) & ~(size_t)(SLOT_SIZE - 1) : SLOT_SIZE;
+
+        locals      += size;
+        e->slots[i]  = -(int32_t)locals;
+    }
+
+    for(size_t i = 0; i < sizeof(callee_saved) / sizeof(callee_saved[0]); i++)
+        if(used[callee_saved[i]])
+            e->saved[e->saved_count++] = callee_saved[i];
+
+    // the slots are numbered below the pushed registers
+    for(size_t i = 0; i < fn->symbol_count; i++)
+        if(e->slots[i] < 0)
+            e->slots[i] -= (int32_t)(e->saved_count * SLOT_SIZE);
+
+    e->frame = locals + out * SLOT_SIZE;
+
+    if((e->frame + e->saved_count * SLOT_SIZE) % 16)
+        e->frame += SLOT_SIZE;
+}
+
+/*
+ * Parameters take the registers of the SysV ABI in order, gprs and sse
+ * apart, the rest are on the stack above the return address. Those in
+ * registers get a slot like the locals.
+ */
+static void _prepare_params(CEncoder *e, size_t *locals)
+{
+    CFunction *fn    = e->fn;
+    CType     *type  = fn->sym->type;
+    size_t     gpr   = 0;
+    size_t     sse   = 0;
+    size_t     stack = 0;
+    size_t    *index;
+    size_t     count = 0;
+
+    for(CParameter *param = type ? type->params : NULL; param; param = param->next)
+        count++;
+
+    index = (size_t *)zalloc(sizeof(size_t) * (count + 1), ARENA_3);
+    count = 0;
+
+    for(CParameter *param = type ? type->params : NULL; param; param = param->next)
+        index[count++] = param->sym ? OPERAND_INDEX(ir_symbol(fn, param->sym)) : SIZE_MAX;
+
+    e->slots = (int32_t *)zalloc(sizeof(int32_t) * (fn->symbol_count + 1), ARENA_3);
+
+    memset(e->slots, 0, sizeof(int32_t) * (fn->symbol_count + 1));
+
+    count = 0;
+
+    for(CParameter *param = type ? type->params : NULL; param; param = param->next, count++) {
+        bool sse_param = _is_float(param->type);
+
+        if(index[count] == SIZE_MAX)
+            continue;
+
+        if(sse_param ? sse < SSE_ARGS : gpr < sizeof(gpr_args) / sizeof(gpr_args[0])) {
+            *locals              += SLOT_SIZE;
+            e->slots[index[count]] = -(int32_t)*locals;
+
+            if(sse_param)
+                sse++;
+            else
+                gpr++;
+        }
+        else
+            e->slots[index[count]] = (int32_t)(2 * SLOT_SIZE + SLOT_SIZE * stack++);
+    }
+}
+
+/*
+ * The ABI location of each argument of a call: its register, REG_NONE
+ * for the stack. Returns how many go on the stack. The declared type of
+ * the parameter decides, or what the argument is.
+ */
+static size_t _classify(CEncoder *e, CInstruction *ins, int *regs)
+{
+    CFunction  *fn    = e->fn;
+    COperand   *args  = ins->arg3 ? LIST_OF(fn, ins->arg3) : NULL;
+    CParameter *param = _params_of(fn, ins->arg2);
+    size_t      gpr   = 0;
+    size_t      sse   = 0;
+    size_t      stack = 0;
+
+    for(size_t k = 0; args && args[k]; k++) {
+        if(_is_sse_arg(e, args[k], param ? param->type : NULL))
+            regs[k] = sse < SSE_ARGS ? REG_XMM0 + (int)sse++ : REG_NONE;
+        else
+            regs[k] = gpr < sizeof(gpr_args) / sizeof(gpr_args[0]) ? gpr_args[gpr++] : REG_NONE;
+
+        if(!regs[k])
+            stack++;
+
+        if(param)
+            param = param->next;
+    }
+
+    return stack;
+}
+
+static CParameter *_params_of(CFunction *fn, COperand callee)
+{
+    CType *type;
+
+    if(OPERAND_KIND(callee) != OPERAND_SYMBOL || !_is_function(SYMBOL_OF(fn, callee)))
+        return NULL;
+
+    type = canonical_type(SYMBOL_OF(fn, callee)->type);
+
+    return type ? type->params : NULL;
+}
+
+static bool _is_sse_arg(CEncoder *e, COperand arg, CType *type)
+{
+    int reg = _reg(e, arg);
+
+    if(reg)
+        return _is_sse_reg(reg);
+
+    if(type)
+        return _is_float(type);
+
+    switch(OPERAND_KIND(arg)) {
+        case OPERAND_FLOAT:
+            return true;
+        case OPERAND_SYMBOL:
+            return _is_float(SYMBOL_OF(e->fn, arg)->type);
+        default:
+            return false;
+    }
+}
+
+static void _prologue(CEncoder *e)
+{
+    CFunction *fn   = e->fn;
+    CType     *type = fn->sym->type;
+    size_t     gpr  = 0;
+    size_t     sse  = 0;
+    CAddr      mem;
+
+    _byte(e, 0x55);                              // push rbp
+    _rr(e, 0, 1, 0x89, REG_RSP, REG_RBP);        // mov rbp, rsp
+
+    for(size_t i = 0; i < e->saved_count; i++) {
+        if(_hw(e->saved[i]) >= 8)
+            _byte(e, 0x41);
+        _byte(e, 0x50 | (_hw(e->saved[i]) & 7));
+    }
+
+    if(e->frame) {
+        _encode(e, 0, 1, _fits8((int64_t)e->frame) ? 0x83 : 0x81, 5, _hw(REG_RSP), NULL, 0, false);
+        _imm(e, (int64_t)e->frame, _fits8((int64_t)e->frame) ? 1 : 4);
+    }
+
+    for(CParameter *param = type ? type->params : NULL; param; param = param->next) {
+        bool sse_param = _is_float(param->type);
+        int  reg;
+
+        if(sse_param ? sse >= SSE_ARGS : gpr >= sizeof(gpr_args) / sizeof(gpr_args[0]))
+            continue;
+
+        reg = sse_param ? REG_XMM0 + (int)sse++ : gpr_args[gpr++];
+
+        if(!param->sym)
+            continue;
+
+        _address(e, ir_symbol(fn, param->sym), &mem);
+
+        if(sse_param)
+            _rm(e, 0xF2, 0, 0x0F11, reg, &mem, 0); // movsd [slot], xmm
+        else
+            _rm(e, 0, 1, 0x89, reg, &mem, 0);      // mov [slot], reg
+    }
+}
+
+static void _epilogue(CEncoder *e)
+{
+    CAddr mem;
+
+    if(e->saved_count) {
+        _frame_slot(&mem, _hw(REG_RBP), -(int32_t)(e->saved_count * SLOT_SIZE));
+        _rm(e, 0, 1, 0x8D, REG_RSP, &mem, 0);     // lea rsp, [rbp - saved]
+    }
+    else
+        _rr(e, 0, 1, 0x89, REG_RBP, REG_RSP);    // mov rsp, rbp
+
+    for(size_t i = e->saved_count; i-- > 0;) {
+        if(_hw(e->saved[i]) >= 8)
+            _byte(e, 0x41);
+        _byte(e, 0x58 | (_hw(e->saved[i]) & 7));
+    }
+
+    _byte(e, 0x5D);                              // pop rbp
+    _byte(e, 0xC3);                              // ret
+}
+
+/*
+ * Whether 'ins' has every operand its encoding reads, of the right kind.
+ * An instruction missing one, like what an operator the lowering doesn't
+ * handle leaves, would otherwise be encoded as something else.
+ */
+static bool _is_well_formed(CEncoder *e, CInstruction *ins)
+{
+    switch(ins->kind) {
+        case INS_LOAD:
+            return IS_VREG(ins->arg1) && _is_value(e, ins->arg2);
+        case INS_STORE:
+            return OPERAND_KIND(ins->arg1) == OPERAND_SYMBOL && _is_value(e, ins->arg2);
+        case INS_ADD:
+        case INS_SUB:
+        case INS_MUL:
+        case INS_DIV:
+        case INS_MOD:
+        case INS_MULH:
+        case INS_AND:
+        case INS_OR:
+        case INS_XOR:
+        case INS_SHL:
+        case INS_SHR:
+        case INS_GE:
+        case INS_LE:
+        case INS_GT:
+        case INS_LT:
+        case INS_EQ:
+        case INS_NE:
+            return IS_VREG(ins->arg1) && _is_value(e, ins->arg2) && _is_value(e, ins->arg3);
+        case INS_JLT:
+        case INS_JLE:
+        case INS_JGT:
+        case INS_JGE:
+        case INS_JEQ:
+        case INS_JNE:
+            return OPERAND_KIND(ins->arg1) == OPERAND_LABEL && _is_value(e, ins->arg2) && _is_value(e, ins->arg3);
+        case INS_JMPZ:
+            return OPERAND_KIND(ins->arg1) == OPERAND_LABEL && _is_value(e, ins->arg2);
+        case INS_JMP:
+            return OPERAND_KIND(ins->arg1) == OPERAND_LABEL;
+        case INS_JTAB:
+            return ins->arg1 && _is_value(e, ins->arg2);
+        case INS_CALL:
+            if(!_is_value(e, ins->arg2) || (ins->arg1 && !IS_VREG(ins->arg1)))
+                return false;
+
+            for(COperand *arg = ins->arg3 ? LIST_OF(e->fn, ins->arg3) : NULL; arg && *arg; arg++)
+                if(!_is_value(e, *arg))
+                    return false;
+            return true;
+        case INS_RETVAL:
+            return _is_value(e, ins->arg1);
+        case INS_PHI:
+            return false;
+        default:
+            return true;
+    }
+}
+
+/*
+ * A register with a location, a constant or a symbol.
+ */
+static bool _is_value(CEncoder *e, COperand op)
+{
+    switch(OPERAND_KIND(op)) {
+        case OPERAND_VREG:
+            return _reg(e, op) != REG_NONE;
+        case OPERAND_INT:
+        case OPERAND_FLOAT:
+        case OPERAND_SYMBOL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void _select(CEncoder *e, CBasicBlock *blk, CInstruction *ins)
+{
+    switch(ins->kind) {
+        case INS_LOAD:
+            _load(e, ins);
+            break;
+        case INS_STORE:
+            _store(e, ins);
+            break;
+        case INS_ADD:
+        case INS_SUB:
+        case INS_MUL:
+        case INS_AND:
+        case INS_OR:
+        case INS_XOR:
+            if(_is_sse_ins(e, ins))
+                _sse_binary(e, ins);
+            else
+                _binary(e, ins);
+            break;
+        case INS_DIV:
+            if(_is_sse_ins(e, ins)) {
+                _sse_binary(e, ins);
+                break;
+            }
+            // fall through
+        case INS_MOD:
+        case INS_MULH:
+            _divide(e, ins);
+            break;
+        case INS_SHL:
+        case INS_SHR:
+            _shift(e, ins);
+            break;
+        case INS_GE:
+        case INS_LE:
+        case INS_GT:
+        case INS_LT:
+        case INS_EQ:
+        case INS_NE:
+            _set(e, ins);
+            break;
+        case INS_JLT:
+        case INS_JLE:
+        case INS_JGT:
+        case INS_JGE:
+        case INS_JEQ:
+        case INS_JNE:
+            _branch(e, ins);
+            break;
+        case INS_JMPZ:
+            _jmpz(e, ins);
+            break;
+        case INS_JMP:
+            if(TARGET_OF(e->fn, ins->arg1) != e->next)
+                _jump(e, CC_JMP, TARGET_OF(e->fn, ins->arg1));
+            break;
+        case INS_JTAB:
+            _table(e, ins);
+            break;
+        case INS_CALL:
+            _call(e, ins);
+            break;
+        case INS_RETVAL:
+            if(_reg(e, ins->arg1) ? _is_sse_reg(_reg(e, ins->arg1)) : _is_float(ins->type))
+                _move_sse(e, REG_XMM0, ins->arg1, ins->type);
+            else
+                _move_gpr(e, REG_RAX, ins->arg1, ins->type);
+            break;
+        case INS_LEAVE:
+            _epilogue(e);
+            break;
+        default:
+            // ENTER is the prologue, RET its block's edge; no phi is left
+            break;
+    }
+
+    (void)blk;
+}
+
+static void _load(CEncoder *e, CInstruction *ins)
+{
+    int dst = _reg(e, ins->arg1);
+
+    if(!dst)
+        return;
+
+    if(_is_sse_reg(dst))
+        _move_sse(e, dst, ins->arg2, ins->type);
+    else
+        _move_gpr(e, dst, ins->arg2, ins->type);
+}
+
+static void _store(CEncoder *e, CInstruction *ins)
+{
+    COperand src = ins->arg2;
+    int      reg = _reg(e, src);
+    CAddr    mem;
+
+    if(OPERAND_KIND(ins->arg1) != OPERAND_SYMBOL)
+        return;
+
+    _address(e, ins->arg1, &mem);
+
+    if(reg && _is_sse_reg(reg))
+        _rm(e, _is_single(ins->type) ? 0xF3 : 0xF2, 0, 0x0F11, reg, &mem, 0);
+    else if(reg)
+        _store_gpr(e, &mem, reg, _int_size(ins->type));
+    else if(OPERAND_KIND(src) == OPERAND_INT || OPERAND_KIND(src) == OPERAND_FLOAT)
+        _store_imm(e, &mem, VALUE_OF(e->fn, src).val, _size(ins->type));
+    else if(OPERAND_KIND(src) == OPERAND_SYMBOL) {
+        _move_gpr(e, SCRATCH_GPR, src, ins->type);
+        _store_gpr(e, &mem, SCRATCH_GPR, _int_size(ins->type));
+    }
+}
+
+/*
+ * Two address ALU operations, the second operand a register or an
+ * immediate: d = a; d op= b. When b is in d, a commutative operation
+ * swaps its operands, SUB reads b from r11.
+ */
+static void _binary(CEncoder *e, CInstruction *ins)
+{
+    static const int groups[INS_END_MARK] = { [INS_ADD] = 0, [INS_OR] = 1, [INS_AND] = 4, [INS_SUB] = 5, [INS_XOR] = 6 };
+    COperand  x   = ins->arg2;
+    COperand  y   = ins->arg3;
+    size_t    size = _int_size(ins->type);
+    int       w   = size == 8;
+    int       d   = _dst(e, ins->arg1, false);
+    int       a;
+    int       b;
+    int64_t   imm;
+
+    if(ins->kind != INS_SUB && (!_reg(e, x) || (_reg(e, y) == d && _reg(e, x) != d))) {
+        COperand t = x;
+
+        x = y;
+        y = t;
+    }
+
+    a = _reg(e, x);
+    b = _reg(e, y);
+
+    if(!b && (OPERAND_KIND(y) != OPERAND_INT || (w && !_fits32(VALUE_OF(e->fn, y).val)))) {
+        _move_gpr(e, SCRATCH_GPR, y, ins->type);
+        b = SCRATCH_GPR;
+    }
+    else if(b && b == d && a != d) {
+        _rr(e, 0, 1, 0x89, b, SCRATCH_GPR);
+        b = SCRATCH_GPR;
+    }
+
+    if(!b) {
+        imm = _value(e, y, ins->type);
+
+        if(ins->kind == INS_MUL) {
+            // imul d, a, imm
+            if(!a) {
+                _move_gpr(e, d, x, ins->type);
+                a = d;
+            }
+
+            _rr(e, 0, w, _fits8(imm) ? 0x6B : 0x69, d, a);
+            _imm(e, imm, _fits8(imm) ? 1 : 4);
+        }
+        else {
+            _move_gpr(e, d, x, ins->type);
+            _encode(e, 0, w, _fits8(imm) ? 0x83 : 0x81, groups[ins->kind], _hw(d), NULL, 0, false);
+            _imm(e, imm, _fits8(imm) ? 1 : 4);
+        }
+    }
+    else {
+        _move_gpr(e, d, x, ins->type);
+
+        if(ins->kind == INS_MUL)
+            _rr(e, 0, w, 0x0FAF, d, b);
+        else
+            _rr(e, 0, w, groups[ins->kind] << 3 | 3, d, b);
+    }
+
+    _extend(e, d, d, ins->type);
+}
+
+static void _sse_binary(CEncoder *e, CInstruction *ins)
+{
+    static const uint32_t ops[INS_END_MARK] = { [INS_ADD] = 0x0F58, [INS_MUL] = 0x0F59, [INS_SUB] = 0x0F5C, [INS_DIV] = 0x0F5E };
+    COperand x      = ins->arg2;
+    COperand y      = ins->arg3;
+    int      prefix = _is_single(ins->type) ? 0xF3 : 0xF2;
+    int      d      = _dst(e, ins->arg1, true);
+    int      a;
+    int      b;
+    CAddr    mem;
+
+    if(!ops[ins->kind])
+        return;
+
+    if((ins->kind == INS_ADD || ins->kind == INS_MUL) &&
+       ((!_reg(e, x) && _reg(e, y)) || (_reg(e, y) == d && _reg(e, x) != d))) {
+        COperand t = x;
+
+        x = y;
+        y = t;
+    }
+
+    a = _reg(e, x);
+    b = _reg(e, y);
+
+    if(b && b == d && a != d) {
+        _rr(e, 0, 0, 0x0F28, SCRATCH_SSE, b);    // movaps xmm15, b
+        b = SCRATCH_SSE;
+    }
+
+    if(!b) {
+        // a constant or a symbol, read from memory; mem must be taken after a is moved
+        _move_sse(e, d, x, ins->type);
+
+        if(OPERAND_KIND(y) == OPERAND_SYMBOL)
+            _address(e, y, &mem);
+        else
+            _constant(e, y, &mem);
+
+        _rm(e, prefix, 0, ops[ins->kind], d, &mem, 0);
+        return;
+    }
+
+    _move_sse(e, d, x, ins->type);
+    _rr(e, prefix, 0, ops[ins->kind], d, b);
+}
+
+/*
+ * DIV, MOD and MULH through rax and rdx, which the allocators keep free
+ * of their operands. A constant divisor goes to r11.
+ */
+static void _divide(CEncoder *e, CInstruction *ins)
+{
+    size_t size     = _int_size(ins->type);
+    int    w        = size == 8;
+    bool   is_unsigned = _is_unsigned(ins->type);
+    int    d        = _dst(e, ins->arg1, false);
+    int    b        = _reg(e, ins->arg3);
+    int    result   = ins->kind == INS_DIV ? REG_RAX : REG_RDX;
+
+    if(!b) {
+        _move_gpr(e, SCRATCH_GPR, ins->arg3, ins->type);
+        b = SCRATCH_GPR;
+    }
+
+    _move_gpr(e, REG_RAX, ins->arg2, ins->type);
+
+    if(ins->kind == INS_MULH)
+        _encode(e, 0, w, 0xF7, is_unsigned ? 4 : 5, _hw(b), NULL, 0, false);     // mul, imul
+    else {
+        if(is_unsigned)
+            _rr(e, 0, 0, 0x31, REG_RDX, REG_RDX);                              // xor edx, edx
+        else {
+            if(w)
+                _byte(e, 0x48);
+            _byte(e, 0x99);                                                    // cdq, cqo
+        }
+
+        _encode(e, 0, w, 0xF7, is_unsigned ? 6 : 7, _hw(b), NULL, 0, false);     // div, idiv
+    }
+
+    _extend(e, d, result, ins->type);
+}
+
+/*
+ * A shift by a register counts in cl, which the allocators keep for it:
+ * the count is moved there before d is written, in case it is in d.
+ */
+static void _shift(CEncoder *e, CInstruction *ins)
+{
+    size_t size  = _int_size(ins->type);
+    int    w     = size == 8;
+    int    digit = ins->kind == INS_SHL ? 4 : _is_unsigned(ins->type) ? 5 : 7;
+    int    d     = _dst(e, ins->arg1, false);
+    int    b     = _reg(e, ins->arg3);
+
+    if(!b && OPERAND_KIND(ins->arg3) == OPERAND_INT) {
+        _move_gpr(e, d, ins->arg2, ins->type);
+        _encode(e, 0, w, 0xC1, digit, _hw(d), NULL, 0, false);
+        _imm(e, VALUE_OF(e->fn, ins->arg3).val & (w ? 63 : 31), 1);
+    }
+    else {
+        if(b != REG_RCX)
+            _move_gpr(e, REG_RCX, ins->arg3, ins->type);
+
+        _move_gpr(e, d, ins->arg2, ins->type);
+        _encode(e, 0, w, 0xD3, digit, _hw(d), NULL, 0, false);
+    }
+
+    _extend(e, d, d, ins->type);
+}
+
+/*
+ * Compares x with y as 'kind' (a comparison or its branch) does and
+ * returns the condition code true when it holds. Floats compare with
+ * ucomis, the operands ordered so that unordered, NaN, reads as false
+ * for the orderings; EQ and NE still have to look at the parity.
+ */
+static int _compare(CEncoder *e, Instruction kind, COperand x, COperand y, CType *type)
+{
+    static const int signed_cc[]   = { CC_GE, CC_LE, CC_G, CC_L, CC_E, CC_NE };
+    static const int unsigned_cc[] = { CC_AE, CC_BE, CC_A, CC_B, CC_E, CC_NE };
+    static const size_t swapped[]  = { 1, 0, 3, 2, 4, 5 };
+    int    w = _int_size(type) == 8;
+    size_t index;
+    int    a;
+    int    b;
+    CAddr  mem;
+
+    switch(is_branch(kind) ? branch_compare(kind) : kind) {
+        case INS_GE: index = 0; break;
+        case INS_LE: index = 1; break;
+        case INS_GT: index = 2; break;
+        case INS_LT: index = 3; break;
+        case INS_EQ: index = 4; break;
+        default:     index = 5; break;
+    }
+
+    if(_is_float(type)) {
+        int prefix = _is_single(type) ? 0 : 0x66;
+
+        // a < b and a <= b are b > a and b >= a
+        if(index == 1 || index == 3) {
+            COperand t = x;
+
+            x      = y;
+            y      = t;
+            index -= 1;
+        }
+
+        if(!(a = _reg(e, x))) {
+            _move_sse(e, SCRATCH_SSE, x, type);
+            a = SCRATCH_SSE;
+        }
+
+        if((b = _reg(e, y)))
+            _rr(e, prefix, 0, 0x0F2E, a, b);
+        else {
+            if(OPERAND_KIND(y) == OPERAND_SYMBOL)
+                _address(e, y, &mem);
+            else
+                _constant(e, y, &mem);
+
+            _rm(e, prefix, 0, 0x0F2E, a, &mem, 0);
+        }
+
+        return index == 0 ? CC_AE : index == 2 ? CC_A : index == 4 ? CC_E : CC_NE;
+    }
+
+    if(!_reg(e, x) && _reg(e, y)) {
+        COperand t = x;
+
+        x     = y;
+        y     = t;
+        index = swapped[index];
+    }
+
+    if(!(a = _reg(e, x))) {
+        _move_gpr(e, SCRATCH_GPR, x, type);
+        a = SCRATCH_GPR;
+    }
+
+    if((b = _reg(e, y)))
+        _rr(e, 0, w, 0x3B, a, b);
+    else if(OPERAND_KIND(y) == OPERAND_INT && (!w || _fits32(VALUE_OF(e->fn, y).val))) {
+        int64_t imm = _value(e, y, type);
+
+        _encode(e, 0, w, _fits8(imm) ? 0x83 : 0x81, 7, _hw(a), NULL, 0, false);
+        _imm(e, imm, _fits8(imm) ? 1 : 4);
+    }
+    else {
+        if(OPERAND_KIND(y) == OPERAND_SYMBOL)
+            _address(e, y, &mem);
+        else
+            _constant(e, y, &mem);
+
+        _rm(e, 0, w, 0x3B, a, &mem, 0);
+    }
+
+    return _is_unsigned(type) ? unsigned_cc[index] : signed_cc[index];
+}
+
+static void _set(CEncoder *e, CInstruction *ins)
+{
+    int d  = _dst(e, ins->arg1, false);
+    int cc = _compare(e, ins->kind, ins->arg2, ins->arg3, ins->type);
+
+    _encode(e, 0, 0, 0x0F90 | cc, 0, _hw(d), NULL, 0, true);                     // setcc d8
+
+    // unordered is not equal: and with setnp, or with setp
+    if(_is_float(ins->type) && (cc == CC_E || cc == CC_NE)) {
+        _encode(e, 0, 0, 0x0F90 | (cc == CC_E ? CC_NP : CC_P), 0, _hw(SCRATCH_GPR), NULL, 0, true);
+        _encode(e, 0, 0, cc == CC_E ? 0x20 : 0x08, _hw(SCRATCH_GPR), _hw(d), NULL, 0, true);
+    }
+
+    _encode(e, 0, 0, 0x0FB6, _hw(d), _hw(d), NULL, 0, true);                     // movzx d, d8
+}
+
+static void _branch(CEncoder *e, CInstruction *ins)
+{
+    CBasicBlock *to = TARGET_OF(e->fn, ins->arg1);
+    int          cc = _compare(e, ins->kind, ins->arg2, ins->arg3, ins->type);
+    size_t       skip;
+
+    if(!_is_float(ins->type) || (cc != CC_E && cc != CC_NE))
+        _jump(e, cc, to);
+    else if(cc == CC_NE) {
+        _jump(e, CC_P, to);
+        _jump(e, CC_NE, to);
+    }
+    else {
+        skip = _skip(e, CC_P);
+        _jump(e, CC_E, to);
+        _land(e, skip);
+    }
+}
+
+/*
+ * The condition has no type of its own: the one it was defined with
+ * tells a float, which is zero unless NaN, from an integer.
+ */
+static void _jmpz(CEncoder *e, CInstruction *ins)
+{
+    CFunction   *fn   = e->fn;
+    CBasicBlock *to   = TARGET_OF(fn, ins->arg1);
+    COperand     v    = ins->arg2;
+    int          reg  = _reg(e, v);
+    CType       *type = IS_VREG(v) && OPERAND_INDEX(v) < fn->vreg_count ? e->types[OPERAND_INDEX(v)] : NULL;
+    size_t       skip;
+
+    if(!reg && (OPERAND_KIND(v) == OPERAND_INT || OPERAND_KIND(v) == OPERAND_FLOAT)) {
+        if(!VALUE_OF(fn, v).val)
+            _jump(e, CC_JMP, to);
+        return;
+    }
+
+    if(!reg) {
+        _move_gpr(e, SCRATCH_GPR, v, type);
+        reg = SCRATCH_GPR;
+    }
+
+    if(_is_sse_reg(reg)) {
+        _rr(e, 0, 0, 0x0F57, SCRATCH_SSE, SCRATCH_SSE);                           // xorps
+        _rr(e, _is_single(type) ? 0 : 0x66, 0, 0x0F2E, reg, SCRATCH_SSE);         // ucomis
+        skip = _skip(e, CC_P);
+        _jump(e, CC_E, to);
+        _land(e, skip);
+        return;
+    }
+
+    _rr(e, 0, _int_size(type) == 8, 0x85, reg, reg);                               // test
+    _jump(e, CC_E, to);
+}
+
+/*
+ * An index below the size of the table jumps to the table plus the
+ * offset read from it, any other falls through to what follows the JTAB.
+ * The index register may still be live in the targets: it is kept in
+ * xmm15 while it holds the offset.
+ */
+static void _table(CEncoder *e, CInstruction *ins)
+{
+    CFunction *fn    = e->fn;
+    COperand  *list  = LIST_OF(fn, ins->arg1);
+    int        index = _reg(e, ins->arg2);
+    size_t     count = 0;
+    size_t     skip;
+    CTable    *table;
+    CAddr      mem;
+
+    while(list[count])
+        count++;
+
+    if(!index) {
+        uint64_t value = OPERAND_KIND(ins->arg2) == OPERAND_INT ? (uint64_t)_value(e, ins->arg2, ins->type) : count;
+
+        if(value < count)
+            _jump(e, CC_JMP, TARGET_OF(fn, list[value]));
+        return;
+    }
+
+    // the bits above a narrow index are not defined: clear them
+    if(_int_size(ins->type) < 8)
+        _rr(e, 0, 0, 0x89, index, index);
+
+    _encode(e, 0, 1, _fits8((int64_t)count) ? 0x83 : 0x81, 7, _hw(index), NULL, 0, false);
+    _imm(e, (int64_t)count, _fits8((int64_t)count) ? 1 : 4);
+
+    skip = _skip(e, CC_AE);
+
+    table = (CTable *)zalloc(sizeof(CTable), ARENA_3);
+
+    memset(table, 0, sizeof(CTable));
+
+    _rr(e, 0x66, 1, 0x0F6E, SCRATCH_SSE, index);                                   // movq xmm15
+    _frame_slot(&mem, -1, 0);
+    _rm(e, 0, 1, 0x8D, SCRATCH_GPR, &mem, 0);                                      // lea r11, [rip + table]
+
+    table->list = ins->arg1;
+    table->at   = e->size - 4;
+    table->end  = e->size;
+
+    mem.base  = _hw(SCRATCH_GPR);
+    mem.index = _hw(index);
+
+    _rm(e, 0, 1, 0x8B, index, &mem, 0);                                            // mov [r11 + index * 8]
+    _rr(e, 0, 1, 0x01, index, SCRATCH_GPR);                                        // add r11
+    _rr(e, 0x66, 1, 0x0F7E, SCRATCH_SSE, index);                                   // movq from xmm15
+    _encode(e, 0, 0, 0xFF, 4, _hw(SCRATCH_GPR), NULL, 0, false);                 // jmp r11
+    _land(e, skip);
+
+    if(!e->tables)
+        e->tables = table;
+    else
+        e->last_table->next = table;
+
+    e->last_table = table;
+}
+
+/*
+ * The arguments on the stack are stored first, while every register
+ * still holds what it did. A callee that is not a function goes to r11,
+ * then the registers are exchanged into their ABI places and constants
+ * and memory loaded into the rest.
+ */
+static void _call(CEncoder *e, CInstruction *ins)
+{
+    CFunction  *fn     = e->fn;
+    COperand   *args   = ins->arg3 ? LIST_OF(fn, ins->arg3) : NULL;
+    COperand    callee = ins->arg2;
+    bool        direct = OPERAND_KIND(callee) == OPERAND_SYMBOL && _is_function(SYMBOL_OF(fn, callee));
+    size_t      count  = 0;
+    size_t      moves  = 0;
+    size_t      stack  = 0;
+    CParameter *param;
+    int        *regs;
+    int        *dst;
+    int        *src;
+    int         d;
+    CAddr       mem;
+
+    while(args && args[count])
+        count++;
+
+    regs = (int *)zalloc(sizeof(int) * (count + 1) * 3, ARENA_3);
+    dst  = regs + count + 1;
+    src  = dst + count + 1;
+
+    _classify(e, ins, regs);
+
+    param = _params_of(fn, callee);
+
+    for(size_t k = 0; k < count; k++, param = param ? param->next : NULL) {
+        int reg = _reg(e, args[k]);
+
+        if(regs[k])
+            continue;
+
+        _frame_slot(&mem, _hw(REG_RSP), (int32_t)(stack++ * SLOT_SIZE));
+
+        if(reg && _is_sse_reg(reg))
+            _rm(e, 0xF2, 0, 0x0F11, reg, &mem, 0);
+        else if(reg)
+            _rm(e, 0, 1, 0x89, reg, &mem, 0);
+        else if(OPERAND_KIND(args[k]) == OPERAND_SYMBOL) {
+            _move_gpr(e, SCRATCH_GPR, args[k], param ? param->type : SYMBOL_OF(fn, args[k])->type);
+            _rm(e, 0, 1, 0x89, SCRATCH_GPR, &mem, 0);
+        }
+        else
+            _store_imm(e, &mem, VALUE_OF(fn, args[k]).val, SLOT_SIZE);
+    }
+
+    if(!direct)
+        _move_gpr(e, SCRATCH_GPR, callee, NULL);
+
+    for(size_t k = 0; k < count; k++) {
+        int reg = _reg(e, args[k]);
+
+        if(regs[k] && reg && reg != regs[k]) {
+            dst[moves] = regs[k];
+            src[moves] = reg;
+            moves++;
+        }
+    }
+
+    _parallel_move(e, dst, src, moves);
+
+    param = _params_of(fn, callee);
+
+    for(size_t k = 0; k < count; k++, param = param ? param->next : NULL) {
+        CType *type = param ? param->type : OPERAND_KIND(args[k]) == OPERAND_SYMBOL ? SYMBOL_OF(fn, args[k])->type : NULL;
+
+        if(!regs[k] || _reg(e, args[k]))
+            continue;
+
+        if(_is_sse_reg(regs[k]))
+            _move_sse(e, regs[k], args[k], type);
+        else
+            _move_gpr(e, regs[k], args[k], type);
+    }
+
+    if(direct) {
+        _byte(e, 0xE8);                                                              // call rel32
+        _reloc(e, SYMBOL_OF(fn, callee), e->size, e->size + 4, 0);
+        _imm(e, 0, 4);
+    }
+    else
+        _encode(e, 0, 0, 0xFF, 2, _hw(SCRATCH_GPR), NULL, 0, false);                 // call r11
+
+    if(!ins->arg1 || !(d = _reg(e, ins->arg1)))
+        return;
+
+    if(!_is_sse_reg(d))
+        _extend(e, d, REG_RAX, ins->type);
+    else if(d != REG_XMM0)
+        _rr(e, 0, 0, 0x0F28, d, REG_XMM0);
+}
+
+/*
+ * Moves registers to registers at once: each move whose destination no
+ * other one reads is done, until only cycles are left. A gpr cycle is
+ * broken by an xchg, an sse one through xmm15.
+ */
+static void _parallel_move(CEncoder *e, int *dst, int *src, size_t count)
+{
+    while(count) {
+        size_t i;
+        size_t j;
+
+        for(i = 0; i < count; i++) {
+            for(j = 0; j < count && src[j] != dst[i]; j++)
+                ;
+
+            if(j == count)
+                break;
+        }
+
+        if(i == count) {
+            i = 0;
+
+            if(_is_sse_reg(dst[i])) {
+                _rr(e, 0, 0, 0x0F28, SCRATCH_SSE, dst[i]);
+
+                for(j = 0; j < count; j++)
+                    if(src[j] == dst[i])
+                        src[j] = SCRATCH_SSE;
+
+                _rr(e, 0, 0, 0x0F28, dst[i], src[i]);
+            }
+            else {
+                _rr(e, 0, 1, 0x87, src[i], dst[i]);                                  // xchg
+
+                for(j = 0; j < count; j++)
+                    if(j != i && src[j] == dst[i])
+                        src[j] = src[i];
+            }
+        }
+        else if(_is_sse_reg(dst[i]))
+            _rr(e, 0, 0, 0x0F28, dst[i], src[i]);
+        else
+            _rr(e, 0, 1, 0x89, src[i], dst[i]);
+
+        dst[i] = dst[count - 1];
+        src[i] = src[count - 1];
+        count--;
+    }
+}
+
+/*
+ * The jump tables then the constants follow the code, as data aligned to
+ * 8 bytes, and every rel32 whose target was not known when it was
+ * written is filled.
+ */
+static void _finish(CEncoder *e)
+{
+    while((e->tables || e->constants) && e->size % 8)
+        _byte(e, 0xCC);
+
+    for(CTable *table = e->tables; table; table = table->next) {
+        COperand *list  = LIST_OF(e->fn, table->list);
+        size_t    start = e->size;
+
+        _put32(e, table->at, (int64_t)start - (int64_t)table->end);
+
+        for(size_t k = 0; list[k]; k++)
+            _imm(e, (int64_t)e->block_at[TARGET_OF(e->fn, list[k])->id] - (int64_t)start, 8);
+    }
+
+    for(CConstant *constant = e->constants; constant; constant = constant->next) {
+        constant->at = e->size;
+        _imm(e, (int64_t)constant->bits, 8);
+    }
+
+    for(CPatch *patch = e->patches; patch; patch = patch->next) {
+        size_t target = patch->blk ? e->block_at[patch->blk->id] : patch->constant->at;
+
+        _put32(e, patch->at, (int64_t)target + patch->disp - (int64_t)patch->end);
+    }
+}
+
+/*
+ * Moves the value of an operand of 'type' to a gpr. A constant is loaded
+ * whole, whatever its type: it may be stored to something wider.
+ */
+static void _move_gpr(CEncoder *e, int dst, COperand src, CType *type)
+{
+    int   reg = _reg(e, src);
+    CAddr mem;
+
+    switch(OPERAND_KIND(src)) {
+        case OPERAND_VREG:
+            if(reg && reg != dst)
+                _rr(e, 0, 1, 0x89, reg, dst);
+            break;
+        case OPERAND_INT:
+        case OPERAND_FLOAT:
+            _move_imm(e, dst, VALUE_OF(e->fn, src).val);
+            break;
+        case OPERAND_SYMBOL:
+            _address(e, src, &mem);
+
+            if(_is_function(SYMBOL_OF(e->fn, src)))
+                _rm(e, 0, 1, 0x8D, dst, &mem, 0);                                    // lea
+            else
+                _load_gpr(e, dst, &mem, type);
+            break;
+        default:
+            break;
+    }
+}
+
+static void _move_sse(CEncoder *e, int dst, COperand src, CType *type)
+{
+    int      reg    = _reg(e, src);
+    int      prefix = _is_single(type) ? 0xF3 : 0xF2;
+    uint64_t bits;
+    CAddr    mem;
+
+    switch(OPERAND_KIND(src)) {
+        case OPERAND_VREG:
+            if(reg && reg != dst)
+                _rr(e, 0, 0, 0x0F28, dst, reg);                                      // movaps
+            break;
+        case OPERAND_INT:
+        case OPERAND_FLOAT:
+            bits = (uint64_t)VALUE_OF(e->fn, src).val;
+
+            if(!(_is_single(type) ? (uint32_t)bits : bits)) {
+                _rr(e, 0, 0, 0x0F57, dst, dst);                                      // xorps
+                break;
+            }
+
+            _constant(e, src, &mem);
+            _rm(e, prefix, 0, 0x0F10, dst, &mem, 0);                                 // movss, movsd
+            break;
+        case OPERAND_SYMBOL:
+            _address(e, src, &mem);
+            _rm(e, prefix, 0, 0x0F10, dst, &mem, 0);
+            break;
+        default:
+            break;
+    }
+}
+
+static void _move_imm(CEncoder *e, int dst, int64_t value)
+{
+    int hw = _hw(dst);
+
+    if(!value)
+        _rr(e, 0, 0, 0x31, dst, dst);                                                // xor r32, r32
+    else if(value > 0 && value <= UINT32_MAX) {
+        if(hw >= 8)
+            _byte(e, 0x41);
+        _byte(e, 0xB8 | (hw & 7));                                                   // mov r32, imm32
+        _imm(e, value, 4);
+    }
+    else if(_fits32(value)) {
+        _encode(e, 0, 1, 0xC7, 0, hw, NULL, 0, false);                               // mov r64, simm32
+        _imm(e, value, 4);
+    }
+    else {
+        _byte(e, 0x48 | hw >> 3);
+        _byte(e, 0xB8 | (hw & 7));                                                   // movabs
+        _imm(e, value, 8);
+    }
+}
+
+static void _load_gpr(CEncoder *e, int dst, CAddr *mem, CType *type)
+{
+    bool is_unsigned = _is_unsigned(type);
+
+    switch(_size(type)) {
+        case 1:
+            _rm(e, 0, 0, is_unsigned ? 0x0FB6 : 0x0FBE, dst, mem, 0);
+            break;
+        case 2:
+            _rm(e, 0, 0, is_unsigned ? 0x0FB7 : 0x0FBF, dst, mem, 0);
+            break;
+        case 4:
+            _rm(e, 0, 0, 0x8B, dst, mem, 0);
+            break;
+        default:
+            _rm(e, 0, 1, 0x8B, dst, mem, 0);
+            break;
+    }
+}
+
+static void _store_gpr(CEncoder *e, CAddr *mem, int src, size_t size)
+{
+    switch(size) {
+        case 1:
+            _encode(e, 0, 0, 0x88, _hw(src), 0, mem, 0, true);
+            break;
+        case 2:
+            _rm(e, 0x66, 0, 0x89, src, mem, 0);
+            break;
+        case 4:
+            _rm(e, 0, 0, 0x89, src, mem, 0);
+            break;
+        default:
+            _rm(e, 0, 1, 0x89, src, mem, 0);
+            break;
+    }
+}
+
+/*
+ * A 64-bit immediate that does not sign extend from 32 bits is stored
+ * as two halves.
+ */
+static void _store_imm(CEncoder *e, CAddr *mem, int64_t value, size_t size)
+{
+    CAddr high;
+
+    switch(size) {
+        case 1:
+            _encode(e, 0, 0, 0xC6, 0, 0, mem, 1, false);
+            _imm(e, value, 1);
+            break;
+        case 2:
+            _encode(e, 0x66, 0, 0xC7, 0, 0, mem, 2, false);
+            _imm(e, value, 2);
+            break;
+        case 4:
+            _encode(e, 0, 0, 0xC7, 0, 0, mem, 4, false);
+            _imm(e, value, 4);
+            break;
+        default:
+            if(_fits32(value)) {
+                _encode(e, 0, 1, 0xC7, 0, 0, mem, 4, false);
+                _imm(e, value, 4);
+                break;
+            }
+
+            high       = *mem;
+            high.disp += 4;
+
+            _store_imm(e, mem, value, 4);
+            _store_imm(e, &high, value >> 32, 4);
+            break;
+    }
+}
+
+/*
+ * dst = src as a value of 'type' is kept in a register: chars and shorts
+ * extended to 32 bits, the rest copied.
+ */
+static void _extend(CEncoder *e, int dst, int src, CType *type)
+{
+    bool is_unsigned = _is_unsigned(type);
+
+    switch(_int_size(type)) {
+        case 1:
+            _encode(e, 0, 0, is_unsigned ? 0x0FB6 : 0x0FBE, _hw(dst), _hw(src), NULL, 0, true);
+            break;
+        case 2:
+            _rr(e, 0, 0, is_unsigned ? 0x0FB7 : 0x0FBF, dst, src);
+            break;
+        case 4:
+            if(dst != src)
+                _rr(e, 0, 0, 0x89, src, dst);
+            break;
+        default:
+            if(dst != src)
+                _rr(e, 0, 1, 0x89, src, dst);
+            break;
+    }
+}
+
+/*
+ * jmp, or jcc on 'cc', to a block: rel8 back to one close enough, else
+ * rel32, filled by _finish() when it goes forward.
+ */
+static void _jump(CEncoder *e, int cc, CBasicBlock *to)
+{
+    size_t at = e->block_at[to->id];
+
+    if(at != SIZE_MAX && _fits8((int64_t)at - (int64_t)(e->size + 2))) {
+        _byte(e, cc == CC_JMP ? 0xEB : 0x70 | cc);
+        _imm(e, (int64_t)at - (int64_t)(e->size + 1), 1);
+        return;
+    }
+
+    if(cc == CC_JMP)
+        _byte(e, 0xE9);
+    else {
+        _byte(e, 0x0F);
+        _byte(e, 0x80 | cc);
+    }
+
+    _patch(e, e->size, e->size + 4, 0, to, NULL);
+    _imm(e, 0, 4);
+}
+
+/*
+ * A short jcc over the next few instructions, landed by _land().
+ */
+static size_t _skip(CEncoder *e, int cc)
+{
+    _byte(e, 0x70 | cc);
+    _byte(e, 0);
+
+    return e->size - 1;
+}
+
+static void _land(CEncoder *e, size_t at)
+{
+    e->code[at] = (byte)(e->size - (at + 1));
+}
+
+static void _rr(CEncoder *e, int prefix, int w, uint32_t op, int reg, int rm)
+{
+    _encode(e, prefix, w, op, _hw(reg), _hw(rm), NULL, 0, false);
+}
+
+static void _rm(CEncoder *e, int prefix, int w, uint32_t op, int reg, CAddr *mem, size_t imm_size)
+{
+    _encode(e, prefix, w, op, _hw(reg), 0, mem, imm_size, false);
+}
+
+/*
+ * One instruction: a legacy prefix, REX, one or two opcode bytes (0x0F
+ * first) and ModRM, 'reg' over the register 'rm' or over 'mem', with its
+ * SIB and displacement. 'imm_size' bytes of immediate will follow, which
+ * a rip relative displacement has to skip. 'byte_regs' asks for a REX on
+ * registers 4 to 7, to mean spl to dil and not ah to bh.
+ */
+static void _encode(CEncoder *e, int prefix, int w, uint32_t op, int reg, int rm, CAddr *mem, size_t imm_size, bool byte_regs)
+{
+    int rex = 0x40 | w << 3 | (reg & 8) >> 1;
+    int mod;
+
+    if(!mem)
+        rex |= (rm & 8) >> 3;
+    else {
+        if(mem->index >= 0)
+            rex |= (mem->index & 8) >> 2;
+        if(mem->base >= 0)
+            rex |= (mem->base & 8) >> 3;
+    }
+
+    if(prefix)
+        _byte(e, (byte)prefix);
+
+    if(rex != 0x40 || (byte_regs && ((reg >= 4 && reg < 8) || (!mem && rm >= 4 && rm < 8))))
+        _byte(e, (byte)rex);
+
+    if(op > 0xFF)
+        _byte(e, (byte)(op >> 8));
+
+    _byte(e, (byte)op);
+
+    if(!mem) {
+        _byte(e, (byte)(0xC0 | (reg & 7) << 3 | (rm & 7)));
+        return;
+    }
+
+    if(mem->base < 0) {
+        _byte(e, (byte)((reg & 7) << 3 | 5));
+
+        if(mem->sym)
+            _reloc(e, mem->sym, e->size, e->size + 4 + imm_size, mem->disp);
+        else if(mem->constant)
+            _patch(e, e->size, e->size + 4 + imm_size, mem->disp, NULL, mem->constant);
+
+        _imm(e, 0, 4);
+        return;
+    }
+
+    // rbp and r13 have no form without a displacement, rsp and r12 need a SIB
+    mod = !mem->disp && (mem->base & 7) != 5 ? 0 : _fits8(mem->disp) ? 1 : 2;
+
+    if(mem->index >= 0 || (mem->base & 7) == 4) {
+        _byte(e, (byte)(mod << 6 | (reg & 7) << 3 | 4));
+        _byte(e, (byte)((mem->index >= 0 ? 3 << 6 | (mem->index & 7) << 3 : 4 << 3) | (mem->base & 7)));
+    }
+    else
+        _byte(e, (byte)(mod << 6 | (reg & 7) << 3 | (mem->base & 7)));
+
+    if(mod == 1)
+        _imm(e, mem->disp, 1);
+    else if(mod == 2)
+        _imm(e, mem->disp, 4);
+}
+
+static void _address(CEncoder *e, COperand op, CAddr *mem)
+{
+    CSymbol *sym = SYMBOL_OF(e->fn, op);
+
+    if(_is_local(sym))
+        _frame_slot(mem, _hw(REG_RBP), e->slots[OPERAND_INDEX(op)]);
+    else {
+        _frame_slot(mem, -1, 0);
+        mem->sym = sym;
+    }
+}
+
+/*
+ * A constant read from memory, 8 bytes of the pool after the code, one
+ * for each constant of the function.
+ */
+static void _constant(CEncoder *e, COperand op, CAddr *mem)
+{
+    CFunction *fn    = e->fn;
+    size_t     index = OPERAND_INDEX(op);
+    CConstant *constant;
+
+    if(!e->pooled) {
+        e->pooled = (CConstant **)zalloc(sizeof(CConstant *) * (fn->value_count + 1), ARENA_3);
+        memset(e->pooled, 0, sizeof(CConstant *) * (fn->value_count + 1));
+    }
+
+    if(!(constant = e->pooled[index])) {
+        constant = (CConstant *)zalloc(sizeof(CConstant), ARENA_3);
+
+        constant->bits = (uint64_t)fn->values[index].val;
+        constant->at   = 0;
+        constant->next = NULL;
+
+        if(!e->constants)
+            e->constants = constant;
+        else
+            e->last_constant->next = constant;
+
+        e->last_constant = constant;
+        e->pooled[index] = constant;
+    }
+
+    _frame_slot(mem, -1, 0);
+    mem->constant = constant;
+}
+
+static void _frame_slot(CAddr *mem, int base, int32_t disp)
+{
+    mem->base     = base;
+    mem->index    = -1;
+    mem->disp     = disp;
+    mem->sym      = NULL;
+    mem->constant = NULL;
+}
+
+static void _patch(CEncoder *e, size_t at, size_t end, int32_t disp, CBasicBlock *blk, CConstant *constant)
+{
+    CPatch *patch = (CPatch *)zalloc(sizeof(CPatch), ARENA_3);
+
+    patch->at       = at;
+    patch->end      = end;
+    patch->disp     = disp;
+    patch->blk      = blk;
+    patch->constant = constant;
+    patch->next     = e->patches;
+
+    e->patches = patch;
+}
+
+/*
+ * The field at 'at' takes the address of 'sym' plus 'disp' relative to
+ * 'end': S + A - P with the addend relative to the field itself.
+ */
+static void _reloc(CEncoder *e, CSymbol *sym, size_t at, size_t end, int32_t disp)
+{
+    CReloc *reloc = (CReloc *)zalloc(sizeof(CReloc), ARENA_5);
+
+    reloc->sym    = sym;
+    reloc->at     = at;
+    reloc->addend = (int64_t)disp - (int64_t)(end - at);
+    reloc->next   = NULL;
+
+    if(!e->relocs)
+        e->relocs = reloc;
+    else
+        e->last_reloc->next = reloc;
+
+    e->last_reloc = reloc;
+}
+
+static void _byte(CEncoder *e, byte value)
+{
+    if(e->size == e->capacity) {
+        byte *old = e->code;
+
+        e->capacity = e->capacity ? e->capacity * 2 : CODE_INITIAL_SIZE;
+        e->code     = (byte *)zalloc(e->capacity, ARENA_3);
+
+        if(old)
+            memcpy(e->code, old, e->size);
+    }
+
+    e->code[e->size++] = value;
+}
+
+static void _imm(CEncoder *e, int64_t value, size_t size)
+{
+    for(size_t i = 0; i < size; i++)
+        _byte(e, (byte)((uint64_t)value >> (i * 8)));
+}
+
+static void _put32(CEncoder *e, size_t at, int64_t value)
+{
+    for(size_t i = 0; i < 4; i++)
+        e->code[at + i] = (byte)((uint64_t)value >> (i * 8));
+}
+
+static int _reg(CEncoder *e, COperand op)
+{
+    return IS_VREG(op) && OPERAND_INDEX(op) < e->fn->reg_count ? e->fn->regs[OPERAND_INDEX(op)] : REG_NONE;
+}
+
+/*
+ * The register an instruction defines, a scratch one if it has none.
+ */
+static int _dst(CEncoder *e, COperand op, bool sse)
+{
+    int reg = _reg(e, op);
+
+    return reg ? reg : sse ? SCRATCH_SSE : SCRATCH_GPR;
+}
+
+static int _hw(int reg)
+{
+    return reg >= REG_XMM0 ? reg - REG_XMM0 : reg - REG_RAX;
+}
+
+static bool _is_sse_reg(int reg)
+{
+    return reg >= REG_XMM0;
+}
+
+static bool _is_sse_ins(CEncoder *e, CInstruction *ins)
+{
+    int reg = _reg(e, ins->arg1);
+
+    return reg ? _is_sse_reg(reg) : _is_float(ins->type);
+}
+
+static size_t _size(CType *type)
+{
+    if(!type || !(type = canonical_type(type)))
+        return 8;
+
+    switch(type->kind) {
+        case CHAR:
+        case UCHAR:
+            return 1;
+        case SHORT:
+        case USHORT:
+            return 2;
+        case INT:
+        case UINT:
+        case FLOAT:
+        case ENUM:
+            return 4;
+        default:
+            return 8;
+    }
+}
+
+/*
+ * Size of a value of 'type' held in a gpr: the result of comparing floats
+ * is an int.
+ */
+static size_t _int_size(CType *type)
+{
+    return _is_float(type) ? 4 : _size(type);
+}
+
+static bool _is_float(CType *type)
+{
+    if(!type || !(type = canonical_type(type)))
+        return false;
+
+    return type->kind == FLOAT || type->kind == DOUBLE || type->kind == LDOUBLE;
+}
+
+static bool _is_single(CType *type)
+{
+    return type && (type = canonical_type(type)) && type->kind == FLOAT;
+}
+
+static bool _is_unsigned(CType *type)
+{
+    if(!type || !(type = canonical_type(type)))
+        return false;
+
+    switch(type->kind) {
+        case UCHAR:
+        case USHORT:
+        case UINT:
+        case ULONG:
+        case PTR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool _is_function(CSymbol *sym)
+{
+    CType *type = sym && sym->type ? canonical_type(sym->type) : NULL;
+
+    return type && type->kind == FUNCTION;
+}
+
+static bool _is_local(CSymbol *sym)
+{
+    return (sym->flags & SYMBOL_IS_LOCAL) && !(sym->flags & SYMBOL_IS_STATIC);
+}
+
+static bool _fits8(int64_t value)
+{
+    return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+static bool _fits32(int64_t value)
+{
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+/*
+ * A constant as the immediate of an instruction on 'type': narrow types
+ * extended the way their values are in registers.
+ */
+static int64_t _value(CEncoder *e, COperand op, CType *type)
+{
+    int64_t value     = VALUE_OF(e->fn, op).val;
+    bool    is_unsigned = _is_unsigned(type);
+
+    switch(_int_size(type)) {
+        case 1:
+            return is_unsigned ? (int64_t)(uint8_t)value : (int64_t)(int8_t)value;
+        case 2:
+            return is_unsigned ? (int64_t)(uint16_t)value : (int64_t)(int16_t)value;
+        case 4:
+            return (int32_t)value;
+        default:
+            return value;
+    }
+}
@@ -1,4 +1,5 @@
 #include "compiler.h"
+#include <pthread.h>
 
 typedef struct CBlock CBlock;
 
@@ -9,13 +10,32 @@ struct CBlock {
     CBlock *prev;
 };
 
-static CBlock *arena[MAX_ARENAS] = {NULL};
+/*
+ * Every thread allocates from its own arenas, so parser/analyser workers
+ * never contend on the allocator. Blocks of finished workers are parked in
+ * 'retired' by zmerge() and released together with the main thread's ones.
+ */
+static _Thread_local CBlock *arena[MAX_ARENAS] = {NULL};
+static CBlock               *retired[MAX_ARENAS] = {NULL};
+static pthread_mutex_t       retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Blocks given back by zrelease() are kept in 'spare' and handed out again
+ * before asking malloc, so a mark/release cycle per top-level declaration
+ * keeps reusing the same few (cache-warm) blocks. 'reserved' counts the
+ * bytes of the blocks an arena currently owns, 'peak' its high-water mark.
+ */
+static _Thread_local CBlock *spare[MAX_ARENAS]    = {NULL};
+static _Thread_local size_t  reserved[MAX_ARENAS] = {0};
+static _Thread_local size_t  peak[MAX_ARENAS]     = {0};
 
 static void   *_malloc(size_t nbytes);
 static void    _free(void *ptr);
 static CBlock *_new_block(size_t nbytes);
+static CBlock *_get_block(size_t idx, size_t nbytes);
 
 static void    _free_by_id(size_t idx);
+static void    _free_blocks(CBlock **blk);
 
 void *zalloc(size_t nbytes, size_t idx)
 {
@@ -27,17 +47,16 @@ void *zalloc(size_t nbytes, size_t idx)
     blk   = arena[idx];
     align = get_align(nbytes);
 
-    while(blk) {
-        if(blk->avail + align < blk->limit) {
-            blk->avail += align;
-            return blk->avail - align;
-        }
-        blk = blk->prev;
+    // only the newest block is tried, walking all of them made allocation O(blocks)
+    if(blk && blk->avail + align <= blk->limit) {
+        blk->avail += align;
+        return blk->avail - align;
     }
 
-    nbytes = (nbytes > ARENA_DEFAULT_SIZE) ? nbytes : ARENA_DEFAULT_SIZE;
+    // big requests get a block of their own, the rest of the current one is wasted
+    nbytes = (align > ARENA_DEFAULT_SIZE) ? align : ARENA_DEFAULT_SIZE;
 
-    blk = _new_block(nbytes);
+    blk = _get_block(idx, nbytes);
 
     blk->prev = arena[idx];
 
@@ -48,6 +67,46 @@ void *zalloc(size_t nbytes, size_t idx)
     return blk->avail - align;
 }
 
+CMark zmark(size_t idx)
+{
+    CMark mark;
+
+    assert(idx < MAX_ARENAS);
+
+    mark.block = arena[idx];
+    mark.avail = arena[idx] ? arena[idx]->avail : NULL;
+
+    return mark;
+}
+
+/*
+ * Drops everything allocated from arena 'idx' since 'mark' was taken. The
+ * blocks are not freed, they go to the spare list for the next allocations.
+ */
+void zrelease(size_t idx, CMark mark)
+{
+    assert(idx < MAX_ARENAS);
+
+    while(arena[idx] && arena[idx] != mark.block) {
+        CBlock *tmp = arena[idx]->prev;
+
+        reserved[idx]   -= arena[idx]->limit - arena[idx]->base;
+        arena[idx]->prev = spare[idx];
+        spare[idx]       = arena[idx];
+        arena[idx]       = tmp;
+    }
+
+    if(arena[idx])
+        arena[idx]->avail = mark.avail;
+}
+
+size_t zpeak(size_t idx)
+{
+    assert(idx < MAX_ARENAS);
+
+    return peak[idx];
+}
+
 void zfree(void)
 {
     _free_by_id(ARENA_1);
@@ -57,18 +116,46 @@ void zfree(void)
     _free_by_id(ARENA_5);
 }
 
+void zmerge(void)
+{
+    pthread_mutex_lock(&retired_lock);
+
+    for(size_t idx = ARENA_1; idx < MAX_ARENAS; idx++) {
+        _free_blocks(&spare[idx]);
+
+        while(arena[idx]) {
+            CBlock *tmp = arena[idx]->prev;
+            arena[idx]->prev = retired[idx];
+            retired[idx]     = arena[idx];
+            arena[idx]       = tmp;
+        }
+    }
+
+    pthread_mutex_unlock(&retired_lock);
+}
+
 static void _free_by_id(size_t idx)
 {
     assert(idx >= ARENA_1 && idx < MAX_ARENAS);
 
-    while(arena[idx]) {
-        CBlock *tmp = arena[idx]->prev;
-        _free(arena[idx]->base);
-        _free(arena[idx]);
-        arena[idx] = tmp;
-    }
+    _free_blocks(&arena[idx]);
+    _free_blocks(&spare[idx]);
 
-    arena[idx] = NULL;
+    reserved[idx] = 0;
+
+    pthread_mutex_lock(&retired_lock);
+    _free_blocks(&retired[idx]);
+    pthread_mutex_unlock(&retired_lock);
+}
+
+static void _free_blocks(CBlock **blk)
+{
+    while(*blk) {
+        CBlock *tmp = (*blk)->prev;
+        _free((*blk)->base);
+        _free(*blk);
+        *blk = tmp;
+    }
 }
 
 static void *_malloc(size_t nbytes)
@@ -102,3 +189,29 @@ static CBlock *_new_block(size_t nbytes)
 
     return blk;
 }
+
+static CBlock *_get_block(size_t idx, size_t nbytes)
+{
+    CBlock *blk = NULL;
+
+    for(CBlock **ptr = &spare[idx]; *ptr; ptr = &(*ptr)->prev) {
+        if((size_t)((*ptr)->limit - (*ptr)->base) < nbytes)
+            continue;
+
+        blk        = *ptr;
+        *ptr       = blk->prev;
+        blk->avail = blk->base;
+        blk->prev  = NULL;
+        break;
+    }
+
+    if(!blk)
+        blk = _new_block(nbytes);
+
+    reserved[idx] += blk->limit - blk->base;
+
+    if(reserved[idx] > peak[idx])
+        peak[idx] = reserved[idx];
+
+    return blk;
+}